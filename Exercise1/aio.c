@@ -0,0 +1,331 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "aio.h"
+#include "pool.h"
+#include "command.h"
+
+static pthread_mutex_t aio_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t io_thread;
+static bool io_running = false;
+static bool shutting_down = false;
+static Aio_Request_t *queue_head = NULL;
+static Aio_Request_t *queue_tail = NULL;
+static pthread_mutex_t writes_lock = PTHREAD_MUTEX_INITIALIZER;
+static Aio_Request_t *writes = NULL;	/* guarded by writes_lock */
+static size_t in_flight = 0;
+
+/*protected functions*/
+bool submit (Aio_Request_t* req);
+void wait_request (Aio_Request_t* req);
+void show_log (Aio_Request_t* req);
+void* io_main (void* arg);
+
+/*
+ * PURPOSE: Start reading a matrix file in the background.  Only the header
+ *          is read now, the matrix is returned without data and is filled
+ *          in by aio_wait.
+ * INPUTS: filename, where to store the pending matrix
+ * RETURN: True if the read was issued, false if the file can't be read.
+ */
+bool aio_read (const char* filename, Matrix_t** m) {
+	if (!filename || !m || strlen(filename) + 1 > sizeof(((Aio_Request_t*) 0)->filename)) {
+		return false;
+	}
+
+	/* the header must not be peeked at while a write of it is queued */
+	bool queued = false;
+	pthread_mutex_lock(&writes_lock);
+	for (Aio_Request_t *w = writes; w && !queued; w = w->next_write) {
+		queued = !__atomic_load_n(&w->done, __ATOMIC_ACQUIRE) && strcmp(w->filename, filename) == 0;
+	}
+	pthread_mutex_unlock(&writes_lock);
+	if (queued) {
+		aio_drain();
+	}
+
+	char name[MATRIX_NAME_LEN];
+	unsigned int rows = 0;
+	unsigned int cols = 0;
+	if (!read_matrix_info(filename, name, &rows, &cols)) {
+		return false;
+	}
+	Aio_Request_t *req = pool_alloc(sizeof(Aio_Request_t));
+	Matrix_t *pending = pool_alloc(sizeof(Matrix_t));
+	if (!req || !pending) {
+		pool_free(req, sizeof(Aio_Request_t));
+		pool_free(pending, sizeof(Matrix_t));
+		return false;
+	}
+	req->op = AIO_READ;
+	memcpy(req->filename, filename, strlen(filename) + 1);
+	memcpy(pending->name, name, strlen(name) + 1);
+	pending->rows = rows;
+	pending->cols = cols;
+	pending->io = req;
+
+	if (!submit(req)) {
+		pool_free(req, sizeof(Aio_Request_t));
+		pool_free(pending, sizeof(Matrix_t));
+		return false;
+	}
+	destroy_matrix(m);
+	*m = pending;
+	return true;
+}
+
+/*
+ * PURPOSE: Start writing a matrix to the file named after it in the
+ *          background.  The data written is a copy-on-write snapshot, so
+ *          the matrix can be changed or deleted right away.
+ * INPUTS: matrix, Matrix_Write_Flags_t
+ * RETURN: True if the write was issued, false if not.  The result is
+ *         reported by aio_reap.
+ */
+bool aio_write (Matrix_t* m, unsigned int flags) {
+	if (!m || (!m->data && !m->sparse)) {
+		return false;
+	}
+
+	Aio_Request_t *req = pool_alloc(sizeof(Aio_Request_t));
+	if (!req) {
+		return false;
+	}
+	if (!share_matrix(&req->matrix, m->name, m)) {
+		pool_free(req, sizeof(Aio_Request_t));
+		return false;
+	}
+	req->op = AIO_WRITE;
+	req->flags = flags;
+	memcpy(req->filename, m->name, strlen(m->name) + 1);
+
+	if (!submit(req)) {
+		destroy_matrix(&req->matrix);
+		pool_free(req, sizeof(Aio_Request_t));
+		return false;
+	}
+	pthread_mutex_lock(&writes_lock);
+	req->next_write = writes;
+	writes = req;
+	pthread_mutex_unlock(&writes_lock);
+	return true;
+}
+
+/*
+ * PURPOSE: Wait for the background read of a matrix and move the data it
+ *          loaded into the matrix
+ * INPUTS: matrix, may have no read in flight
+ * RETURN: True if the matrix holds its data, false if the read failed
+ *         and the matrix stays without data.
+ */
+bool aio_wait (Matrix_t* m) {
+	if (!m || !m->io) {
+		return m != NULL;
+	}
+
+	Aio_Request_t *req = m->io;
+	wait_request(req);
+	m->io = NULL;
+	show_log(req);
+
+	Matrix_t *loaded = req->matrix;
+	const bool ok = req->ok && loaded && loaded->rows == m->rows && loaded->cols == m->cols;
+	if (ok) {
+		m->data = loaded->data;
+		m->type = loaded->type;
+		m->map_base = loaded->map_base;
+		m->map_len = loaded->map_len;
+		m->read_only = loaded->read_only;
+		m->sparse = loaded->sparse;
+		pool_free(loaded, sizeof(Matrix_t));
+	}
+	else {
+		destroy_matrix(&loaded);
+	}
+	pool_free(req, sizeof(Aio_Request_t));
+	return ok;
+}
+
+/*
+ * PURPOSE: Report background writes that have finished and free them
+ * INPUTS: none
+ * RETURN: none
+ */
+void aio_reap (void) {
+	pthread_mutex_lock(&writes_lock);
+	Aio_Request_t **link = &writes;
+	while (*link) {
+		Aio_Request_t *req = *link;
+		if (!__atomic_load_n(&req->done, __ATOMIC_ACQUIRE)) {
+			link = &req->next_write;
+			continue;
+		}
+		show_log(req);
+		if (req->ok) {
+			fprintf(command_output(), "Matrix (%s) is wrote out to the filesystem\n", req->filename);
+		}
+		else {
+			fprintf(command_output(), "Background write of (%s) failed\n", req->filename);
+		}
+		*link = req->next_write;
+		destroy_matrix(&req->matrix);
+		pool_free(req, sizeof(Aio_Request_t));
+	}
+	pthread_mutex_unlock(&writes_lock);
+}
+
+/*
+ * PURPOSE: Wait until every issued request has finished and report the
+ *          writes.  Reads stay attached to their matrices until aio_wait.
+ * INPUTS: none
+ * RETURN: none
+ */
+void aio_drain (void) {
+	pthread_mutex_lock(&aio_lock);
+	while (in_flight > 0) {
+		pthread_cond_wait(&done_cond, &aio_lock);
+	}
+	pthread_mutex_unlock(&aio_lock);
+	aio_reap();
+}
+
+/*
+ * PURPOSE: Count the requests that have not finished yet
+ * INPUTS: none
+ * RETURN: number of queued or running requests
+ */
+size_t aio_pending (void) {
+	pthread_mutex_lock(&aio_lock);
+	const size_t count = in_flight;
+	pthread_mutex_unlock(&aio_lock);
+	return count;
+}
+
+/*
+ * PURPOSE: Finish every request and stop the I/O thread
+ * INPUTS: none
+ * RETURN: none
+ */
+void aio_shutdown (void) {
+	aio_drain();
+	pthread_mutex_lock(&aio_lock);
+	shutting_down = true;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&aio_lock);
+	if (io_running) {
+		pthread_join(io_thread, NULL);
+		io_running = false;
+	}
+	shutting_down = false;
+}
+
+/*Protected Functions in C*/
+
+/*
+ * PURPOSE: Queue a request for the I/O thread, starting it if needed
+ * INPUTS: request
+ * RETURN: True if queued, false if the thread could not be started.
+ */
+bool submit (Aio_Request_t* req) {
+	pthread_mutex_lock(&aio_lock);
+	if (!io_running) {
+		if (pthread_create(&io_thread, NULL, io_main, NULL)) {
+			pthread_mutex_unlock(&aio_lock);
+			return false;
+		}
+		io_running = true;
+	}
+	req->next = NULL;
+	if (queue_tail) {
+		queue_tail->next = req;
+	}
+	else {
+		queue_head = req;
+	}
+	queue_tail = req;
+	in_flight++;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&aio_lock);
+	return true;
+}
+
+/*
+ * PURPOSE: Block until a request has finished
+ * INPUTS: request
+ * RETURN: none
+ */
+void wait_request (Aio_Request_t* req) {
+	pthread_mutex_lock(&aio_lock);
+	while (!req->done) {
+		pthread_cond_wait(&done_cond, &aio_lock);
+	}
+	pthread_mutex_unlock(&aio_lock);
+}
+
+/*
+ * PURPOSE: Pass on what a finished transfer reported to the output of the
+ *          command that waits for it or reaps it
+ * INPUTS: finished request
+ * RETURN: none.  The log is freed.
+ */
+void show_log (Aio_Request_t* req) {
+	if (req->log) {
+		fwrite(req->log, 1, req->log_len, command_output());
+	}
+	free(req->log);
+	req->log = NULL;
+}
+
+/*
+ * PURPOSE: Body of the I/O thread, runs queued requests in order.  What a
+ *          transfer reports is kept with the request instead of being
+ *          printed from this thread, so it reaches the right client.
+ * INPUTS: unused
+ * RETURN: NULL
+ */
+void* io_main (void* arg) {
+	pthread_mutex_lock(&aio_lock);
+	for (;;) {
+		while (!queue_head && !shutting_down) {
+			pthread_cond_wait(&queue_cond, &aio_lock);
+		}
+		if (!queue_head) {
+			break;
+		}
+		Aio_Request_t *req = queue_head;
+		queue_head = req->next;
+		if (!queue_head) {
+			queue_tail = NULL;
+		}
+		pthread_mutex_unlock(&aio_lock);
+
+		req->log = NULL;
+		req->log_len = 0;
+		FILE *log = open_memstream(&req->log, &req->log_len);
+		command_set_output(log);
+		bool ok = false;
+		if (req->op == AIO_READ) {
+			ok = read_matrix(req->filename, &req->matrix);
+		}
+		else {
+			ok = write_matrix_with_flags(req->filename, req->matrix, req->flags);
+		}
+		command_set_output(NULL);
+		if (log) {
+			fclose(log);
+		}
+
+		pthread_mutex_lock(&aio_lock);
+		req->ok = ok;
+		__atomic_store_n(&req->done, true, __ATOMIC_RELEASE);
+		in_flight--;
+		pthread_cond_broadcast(&done_cond);
+	}
+	pthread_mutex_unlock(&aio_lock);
+	return NULL;
+}
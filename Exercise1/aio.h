@@ -0,0 +1,37 @@
+#ifndef _AIO_H_
+#define _AIO_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "matrix.h"
+
+typedef enum {
+	AIO_READ,
+	AIO_WRITE
+}Aio_Op_t;
+
+/* File transfer run by the background I/O thread.  Requests run one at a
+ * time in the order they were issued, so reads see earlier writes. */
+typedef struct Aio_Request {
+	Aio_Op_t op;
+	char filename[256];
+	unsigned int flags;		/* Matrix_Write_Flags_t of a write */
+	Matrix_t* matrix;		/* matrix read, or snapshot being written */
+	bool done;
+	bool ok;
+	char* log;			/* what the transfer reported, shown by aio_wait or aio_reap */
+	size_t log_len;
+	struct Aio_Request* next;	/* queue of the I/O thread */
+	struct Aio_Request* next_write;	/* writes not reported yet */
+}Aio_Request_t;
+
+bool aio_read (const char* filename, Matrix_t** m);
+bool aio_write (Matrix_t* m, unsigned int flags);
+bool aio_wait (Matrix_t* m);
+void aio_reap (void);
+void aio_drain (void);
+size_t aio_pending (void);
+void aio_shutdown (void);
+
+#endif
@@ -0,0 +1,440 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "matrix.h"
+#include "thread_pool.h"
+#include "kernels.h"
+#include "pool.h"
+#include "types.h"
+
+/* Smallest matrix of the sweep, 4 KB of u32 stays in L1 */
+#define BENCH_MIN_ELEMS 1024
+/* Each size is this many times the one before it */
+#define BENCH_SIZE_STEP 4
+/* Timed runs per point, at least BENCH_MIN_REPS even when the time is up */
+#define BENCH_MIN_REPS 3
+#define BENCH_MAX_REPS 1000
+/* Largest square side mult runs at, and the naive reference, which needs
+ * side^3 multiply adds on one thread */
+#define BENCH_MULT_MAX_SIDE 1024
+#define BENCH_NAIVE_MAX_SIDE 512
+
+typedef enum {
+	BENCH_ADD,
+	BENCH_SHIFT,
+	BENCH_DUPLICATE,
+	BENCH_EQUAL,
+	BENCH_WRITE,
+	BENCH_READ,
+	BENCH_TRANSPOSE,
+	BENCH_MULT,
+	BENCH_MULT_NAIVE,
+	BENCH_NUM_OPS
+}Bench_Op_t;
+
+/* Name of each operation and the bytes per element it reads and writes,
+ * counted as if nothing were shared so copy-on-write shows up as speed */
+static const struct {
+	const char* name;
+	unsigned int reads;
+	unsigned int writes;
+}bench_ops[BENCH_NUM_OPS] = {
+	[BENCH_ADD] = { "add", 2, 1 },
+	[BENCH_SHIFT] = { "shift", 1, 1 },
+	[BENCH_DUPLICATE] = { "duplicate", 1, 1 },
+	[BENCH_EQUAL] = { "equal", 2, 0 },
+	[BENCH_WRITE] = { "write", 1, 0 },
+	[BENCH_READ] = { "read", 0, 1 },
+	[BENCH_TRANSPOSE] = { "transpose", 1, 1 },
+	[BENCH_MULT] = { "mult", 2, 1 },
+	[BENCH_MULT_NAIVE] = { "mult_naive", 2, 1 }
+};
+
+typedef struct {
+	size_t max_bytes;		/* largest matrix of the sweep */
+	unsigned int max_threads;
+	Matrix_Type_t type;
+	double min_seconds;		/* timed per point before stopping */
+	const char* dir;		/* where read and write put their file */
+	bool json;
+	bool ops[BENCH_NUM_OPS];
+}Bench_Config_t;
+
+typedef struct {
+	Matrix_t* a;
+	Matrix_t* b;
+	Matrix_t* c;
+	Matrix_t* sq_a;		/* square u32 operands of mult, NULL when too big */
+	Matrix_t* sq_b;
+	Matrix_t* sq_c;
+	unsigned int side;
+	const char* filename;
+	unsigned int rep;
+}Bench_State_t;
+
+/*protected functions*/
+bool parse_args (int argc, char** argv, Bench_Config_t* config);
+bool parse_ops (const char* list, Bench_Config_t* config);
+bool setup_state (Bench_State_t* state, size_t elems, Matrix_Type_t type);
+void destroy_state (Bench_State_t* state);
+bool run_op (Bench_Op_t op, Bench_State_t* state);
+void naive_multiply (const Matrix_t* a, const Matrix_t* b, Matrix_t* c);
+void bench_point (const Bench_Config_t* config, Bench_Op_t op, Bench_State_t* state, size_t elems,
+	unsigned int threads, bool* first);
+double now_ns (void);
+int compare_doubles (const void* a, const void* b);
+double percentile (const double* sorted, size_t n, unsigned int p);
+
+/*
+ * PURPOSE: Time the matrix operations over a sweep of sizes, from L1
+ *          resident up to the largest one asked for, and thread counts.
+ *          Every point prints ns/element, GB/s and latency percentiles as
+ *          a CSV line or a JSON object.
+ * INPUTS: Argument count, and array of args (see usage below)
+ * RETURN: 0 for normal completion
+ */
+int main (int argc, char** argv) {
+	Bench_Config_t config;
+	if (!parse_args(argc, argv, &config)) {
+		fprintf(stderr, "usage: %s [-m max_megabytes] [-P max_threads] [-t type] [-T seconds]\n"
+			"\t[-d dir] [-b add,shift,duplicate,equal,write,read,transpose,mult,mult_naive] [-j]\n",
+			argv[0]);
+		return -1;
+	}
+
+	const size_t elem_size = type_size(config.type);
+	const size_t len = strlen(config.dir) + strlen("/matbench.tmp") + 1;
+	char *filename = malloc(len);
+	if (!filename) {
+		return -1;
+	}
+	snprintf(filename, len, "%s/matbench.tmp", config.dir);
+
+	if (!config.json) {
+		printf("op,type,kernels,elements,bytes,threads,reps,min_ns,p50_ns,p90_ns,p99_ns,ns_per_elem,gb_per_s,"
+			"gop_per_s\n");
+	}
+	else {
+		printf("[\n");
+	}
+	bool first = true;
+	for (size_t elems = BENCH_MIN_ELEMS; elems * elem_size <= config.max_bytes; elems *= BENCH_SIZE_STEP) {
+		Bench_State_t state = { .filename = filename };
+		if (!setup_state(&state, elems, config.type)) {
+			fprintf(stderr, "Not enough memory for %zu elements, stopping\n", elems);
+			destroy_state(&state);
+			break;
+		}
+		for (unsigned int threads = 1; threads <= config.max_threads; threads *= 2) {
+			if (!thread_pool_set_threads(threads)) {
+				break;
+			}
+			for (unsigned int op = 0; op < BENCH_NUM_OPS; ++op) {
+				if (config.ops[op]) {
+					bench_point(&config, op, &state, elems, threads, &first);
+				}
+			}
+		}
+		destroy_state(&state);
+	}
+	if (config.json) {
+		printf("\n]\n");
+	}
+
+	unlink(filename);
+	free(filename);
+	thread_pool_destroy();
+	pool_release();
+	return 0;
+}
+
+/*Protected Functions in C*/
+
+/*
+ * PURPOSE: Read the command line into a configuration
+ * INPUTS: Argument count, array of args, configuration to fill
+ * RETURN: True if the arguments are valid, false if not.
+ */
+bool parse_args (int argc, char** argv, Bench_Config_t* config) {
+	const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	memset(config, 0, sizeof(*config));
+	config->max_bytes = (size_t) 256 << 20;
+	config->max_threads = (cpus > 0) ? cpus : 1;
+	config->type = MATRIX_U32;
+	config->min_seconds = 0.2;
+	config->dir = ".";
+	for (unsigned int op = 0; op < BENCH_NUM_OPS; ++op) {
+		config->ops[op] = true;
+	}
+
+	int opt;
+	while ((opt = getopt(argc, argv, "m:P:t:T:d:b:j")) != -1) {
+		if (opt == 'm') {
+			config->max_bytes = strtoull(optarg, NULL, 10) << 20;
+		}
+		else if (opt == 'P') {
+			config->max_threads = atoi(optarg);
+		}
+		else if (opt == 't') {
+			if (!type_parse(optarg, &config->type)) {
+				return false;
+			}
+		}
+		else if (opt == 'T') {
+			config->min_seconds = atof(optarg);
+		}
+		else if (opt == 'd') {
+			config->dir = optarg;
+		}
+		else if (opt == 'b') {
+			if (!parse_ops(optarg, config)) {
+				return false;
+			}
+		}
+		else if (opt == 'j') {
+			config->json = true;
+		}
+		else {
+			return false;
+		}
+	}
+	return config->max_threads > 0 && optind == argc;
+}
+
+/*
+ * PURPOSE: Pick the operations to run from a comma separated list
+ * INPUTS: list of operation names, configuration
+ * RETURN: True if every name is an operation, false if not.
+ */
+bool parse_ops (const char* list, Bench_Config_t* config) {
+	for (unsigned int op = 0; op < BENCH_NUM_OPS; ++op) {
+		config->ops[op] = false;
+	}
+	while (*list) {
+		const size_t len = strcspn(list, ",");
+		bool found = false;
+		for (unsigned int op = 0; op < BENCH_NUM_OPS; ++op) {
+			if (strlen(bench_ops[op].name) == len && strncmp(list, bench_ops[op].name, len) == 0) {
+				config->ops[op] = found = true;
+			}
+		}
+		if (!found) {
+			return false;
+		}
+		list += len;
+		list += (*list == ',');
+	}
+	return true;
+}
+
+/*
+ * PURPOSE: Create the operands of one size, filled with random nonzero
+ *          values so they stay dense.  a and b get the same values without
+ *          sharing them, so equal has to compare every element.  mult gets
+ *          square u32 operands of the same element count, the sweep sizes
+ *          are all squares.
+ * INPUTS: state to fill, number of elements, element type
+ * RETURN: True if successful, false if the matrices could not be allocated.
+ */
+bool setup_state (Bench_State_t* state, size_t elems, Matrix_Type_t type) {
+	const unsigned int cols = (elems < BENCH_MIN_ELEMS) ? elems : BENCH_MIN_ELEMS;
+	const unsigned int rows = elems / cols;
+	const Type_Kernels_t *kernels = type_kernels(type);
+	const unsigned int high = (kernels->is_real || kernels->max > 0xFFFFFFFFu) ? 0xFFFFFFFFu : kernels->max;
+	if (!create_typed_matrix(&state->a, "bench_a", rows, cols, type)
+		|| !create_typed_matrix(&state->b, "bench_b", rows, cols, type)
+		|| !create_typed_matrix(&state->c, "bench_c", rows, cols, type)
+		|| !random_matrix_seeded(state->a, 1, high, 1)
+		|| !random_matrix_seeded(state->b, 1, high, 1)
+		|| !random_matrix_seeded(state->c, 1, high, 3)) {
+		return false;
+	}
+
+	unsigned int side = 1;
+	while ((size_t) side * side < elems) {
+		side *= 2;
+	}
+	if (type != MATRIX_U32 || side > BENCH_MULT_MAX_SIDE || (size_t) side * side != elems) {
+		return true;
+	}
+	state->side = side;
+	return create_matrix(&state->sq_a, "bench_sq_a", side, side)
+		&& create_matrix(&state->sq_b, "bench_sq_b", side, side)
+		&& create_matrix(&state->sq_c, "bench_sq_c", side, side)
+		&& random_matrix_seeded(state->sq_a, 1, 0xFFFFFFFFu, 4)
+		&& random_matrix_seeded(state->sq_b, 1, 0xFFFFFFFFu, 5)
+		&& random_matrix_seeded(state->sq_c, 1, 0xFFFFFFFFu, 6);
+}
+
+/*
+ * PURPOSE: Free the operands of one size
+ * INPUTS: state
+ * RETURN: none
+ */
+void destroy_state (Bench_State_t* state) {
+	destroy_matrix(&state->a);
+	destroy_matrix(&state->b);
+	destroy_matrix(&state->c);
+	destroy_matrix(&state->sq_a);
+	destroy_matrix(&state->sq_b);
+	destroy_matrix(&state->sq_c);
+}
+
+/*
+ * PURPOSE: Run an operation once.  shift alternates its direction so the
+ *          values never all reach zero, duplicate alternates its source so
+ *          every run drops and shares data.
+ * INPUTS: operation, state
+ * RETURN: True if the operation succeeded, false if not.
+ */
+bool run_op (Bench_Op_t op, Bench_State_t* state) {
+	Matrix_t *m = NULL;
+	bool ok = false;
+	switch (op) {
+		case BENCH_ADD:
+			return add_matrices(state->a, state->b, state->c);
+		case BENCH_SHIFT:
+			return bitwise_shift_matrix(state->c, (state->rep++ & 1) ? 'r' : 'l', 1);
+		case BENCH_DUPLICATE:
+			return duplicate_matrix((state->rep++ & 1) ? state->b : state->a, state->c);
+		case BENCH_EQUAL:
+			equal_matrices(state->a, state->b);
+			return true;
+		case BENCH_WRITE:
+			return write_matrix(state->filename, state->a);
+		case BENCH_READ:
+			ok = read_matrix(state->filename, &m);
+			destroy_matrix(&m);
+			return ok;
+		case BENCH_TRANSPOSE:
+			return transpose_matrix_in_place(state->c);
+		case BENCH_MULT:
+			return multiply_matrices(state->sq_a, state->sq_b, state->sq_c);
+		case BENCH_MULT_NAIVE:
+			naive_multiply(state->sq_a, state->sq_b, state->sq_c);
+			return true;
+		default:
+			return false;
+	}
+}
+
+/*
+ * PURPOSE: Multiply two square u32 matrices with the textbook i-j-k loop
+ *          on one thread, the reference mult is measured against
+ * INPUTS: matrices a, b and c of the same side
+ * RETURN: none.  Matrix c is modified.
+ */
+void naive_multiply (const Matrix_t* a, const Matrix_t* b, Matrix_t* c) {
+	const size_t n = a->rows;
+	for (size_t i = 0; i < n; ++i) {
+		for (size_t j = 0; j < n; ++j) {
+			unsigned int acc = 0;
+			for (size_t k = 0; k < n; ++k) {
+				acc += a->data[i * n + k] * b->data[k * n + j];
+			}
+			c->data[i * n + j] = acc;
+		}
+	}
+}
+
+/*
+ * PURPOSE: Time one operation at one size and thread count and print the
+ *          result.  After a warm up run it is repeated until min_seconds
+ *          have passed, at least BENCH_MIN_REPS and at most BENCH_MAX_REPS
+ *          times.
+ *         mult and mult_naive also report GOP/s, counting 2 * side^3
+ *         operations per run.
+ * INPUTS: configuration, operation, state, number of elements, threads,
+ *         whether no point has been printed yet
+ * RETURN: none.  A point is printed unless the operation fails.
+ */
+void bench_point (const Bench_Config_t* config, Bench_Op_t op, Bench_State_t* state, size_t elems,
+	unsigned int threads, bool* first) {
+	const bool mult = (op == BENCH_MULT || op == BENCH_MULT_NAIVE);
+	if (op == BENCH_SHIFT && type_kernels(config->type)->is_real) {
+		return;
+	}
+	/* the reference is single threaded, so it runs once per size */
+	if (mult && (!state->sq_c || (op == BENCH_MULT_NAIVE
+		&& (threads != 1 || state->side > BENCH_NAIVE_MAX_SIDE)))) {
+		return;
+	}
+	if (op == BENCH_READ && !write_matrix(state->filename, state->a)) {
+		return;
+	}
+	if (!run_op(op, state)) {
+		fprintf(stderr, "%s of %zu elements failed\n", bench_ops[op].name, elems);
+		return;
+	}
+
+	double samples[BENCH_MAX_REPS];
+	size_t reps = 0;
+	const double start = now_ns();
+	while (reps < BENCH_MAX_REPS
+		&& (reps < BENCH_MIN_REPS || now_ns() - start < config->min_seconds * 1e9)) {
+		const double t0 = now_ns();
+		run_op(op, state);
+		samples[reps++] = now_ns() - t0;
+	}
+	qsort(samples, reps, sizeof(double), compare_doubles);
+
+	const size_t bytes = elems * type_size(config->type);
+	const double p50 = percentile(samples, reps, 50);
+	const double moved = (double) bytes * (bench_ops[op].reads + bench_ops[op].writes);
+	char gops[32] = "";
+	if (mult) {
+		snprintf(gops, sizeof(gops), "%.3f", 2.0 * state->side * state->side * state->side / p50);
+	}
+	if (config->json) {
+		printf("%s  {\"op\": \"%s\", \"type\": \"%s\", \"kernels\": \"%s\", \"elements\": %zu, \"bytes\": %zu, "
+			"\"threads\": %u, \"reps\": %zu, \"min_ns\": %.0f, \"p50_ns\": %.0f, \"p90_ns\": %.0f, "
+			"\"p99_ns\": %.0f, \"ns_per_elem\": %.4f, \"gb_per_s\": %.3f, \"gop_per_s\": %s}",
+			*first ? "" : ",\n", bench_ops[op].name, type_name(config->type), matrix_kernels()->name,
+			elems, bytes, threads, reps, samples[0], p50, percentile(samples, reps, 90),
+			percentile(samples, reps, 99), p50 / elems, moved / p50, mult ? gops : "null");
+	}
+	else {
+		printf("%s,%s,%s,%zu,%zu,%u,%zu,%.0f,%.0f,%.0f,%.0f,%.4f,%.3f,%s\n",
+			bench_ops[op].name, type_name(config->type), matrix_kernels()->name, elems, bytes, threads,
+			reps, samples[0], p50, percentile(samples, reps, 90), percentile(samples, reps, 99),
+			p50 / elems, moved / p50, gops);
+	}
+	fflush(stdout);
+	*first = false;
+}
+
+/*
+ * PURPOSE: Read the monotonic clock
+ * INPUTS: none
+ * RETURN: time in nanoseconds
+ */
+double now_ns (void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * PURPOSE: Order two doubles for qsort
+ * INPUTS: pointers to the doubles
+ * RETURN: negative, zero or positive
+ */
+int compare_doubles (const void* a, const void* b) {
+	const double x = *(const double*) a;
+	const double y = *(const double*) b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * PURPOSE: Nearest rank percentile of sorted samples
+ * INPUTS: sorted samples, their count (at least 1), percentile
+ * RETURN: the sample at that percentile
+ */
+double percentile (const double* sorted, size_t n, unsigned int p) {
+	size_t rank = (p * n + 99) / 100;
+	return sorted[rank ? rank - 1 : 0];
+}
@@ -0,0 +1,336 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "kernels.h"
+#include "matrix.h"
+#include "rng.h"
+
+/* Every length up to this is checked, so each vector width sees every tail */
+#define CHECK_SHORT_LEN 70
+/* Element offsets tried from an aligned buffer, to catch aligned loads */
+#define CHECK_MAX_OFFSET 3
+/* Guard elements past the end that no kernel may touch */
+#define CHECK_GUARD 16
+#define CHECK_GUARD_VALUE 0xDEADBEEFu
+/* Largest shift count checked, counts of 32 give 0 */
+#define CHECK_MAX_SHIFT 32
+
+/* Longer lengths checked on top of the short ones */
+static const size_t check_long_lens[] = { 127, 128, 129, 255, 1000, 4099 };
+/* Inner dimensions given to the gemm micro kernel */
+static const size_t check_gemm_ks[] = { 0, 1, 2, 3, 7, 16, 33, 100 };
+/* Side of the matrix written over its own mapping, several pages of data */
+#define CHECK_MAP_SIDE 512
+
+typedef struct {
+	const Matrix_Kernels_t* ref;
+	const Matrix_Kernels_t* test;
+	unsigned long long seed;
+	unsigned int failures;
+}Check_State_t;
+
+/*protected functions*/
+unsigned int* alloc_check_buffer (size_t n);
+void fill_check_buffer (Check_State_t* state, unsigned int* data, size_t n, unsigned int low,
+	unsigned int high);
+bool guard_intact (const unsigned int* data, size_t n);
+void report (Check_State_t* state, const char* kernel, size_t n, size_t offset, unsigned int extra);
+void check_length (Check_State_t* state, size_t n, size_t offset);
+void check_gemm (Check_State_t* state, size_t k);
+bool check_write_over_map (void);
+bool check_write_over_link (void);
+
+/*
+ * PURPOSE: Compare every kernel table this cpu supports against the scalar
+ *          one over short, odd and unaligned lengths, every shift count and
+ *          the gemm micro kernel, then check that writing a matrix over the
+ *          file it is mapped from leaves it readable and that writing over
+ *          a file keeps its mode and any symlink to it
+ * INPUTS: none
+ * RETURN: 0 when every check passes, 1 if not
+ */
+int main (void) {
+	Check_State_t state = { .ref = matrix_kernels_scalar(), .seed = 1 };
+	unsigned int total = 0;
+
+	const Matrix_Kernels_t *k = NULL;
+	for (unsigned int i = 0; (k = matrix_kernels_available(i)); ++i) {
+		if (k == state.ref) {
+			continue;
+		}
+		state.test = k;
+		state.failures = 0;
+		for (size_t offset = 0; offset <= CHECK_MAX_OFFSET; ++offset) {
+			for (size_t n = 0; n <= CHECK_SHORT_LEN; ++n) {
+				check_length(&state, n, offset);
+			}
+			for (size_t l = 0; l < sizeof(check_long_lens) / sizeof(check_long_lens[0]); ++l) {
+				check_length(&state, check_long_lens[l], offset);
+			}
+		}
+		for (size_t g = 0; g < sizeof(check_gemm_ks) / sizeof(check_gemm_ks[0]); ++g) {
+			check_gemm(&state, check_gemm_ks[g]);
+		}
+		printf("%s: %s\n", k->name, state.failures ? "FAILED" : "ok");
+		total += state.failures;
+	}
+
+	if (total) {
+		printf("%u checks failed\n", total);
+		return 1;
+	}
+	printf("all kernels match %s\n", state.ref->name);
+
+	if (!check_write_over_map()) {
+		printf("write over a mapped matrix: FAILED\n");
+		return 1;
+	}
+	printf("write over a mapped matrix: ok\n");
+
+	if (!check_write_over_link()) {
+		printf("write through a symlink: FAILED\n");
+		return 1;
+	}
+	printf("write through a symlink: ok\n");
+	return 0;
+}
+
+/*Protected Functions in C*/
+
+/*
+ * PURPOSE: Allocate room for n elements, the largest offset and the guard
+ * INPUTS: element count
+ * RETURN: the buffer, exits when out of memory
+ */
+unsigned int* alloc_check_buffer (size_t n) {
+	unsigned int *data = malloc((n + CHECK_MAX_OFFSET + CHECK_GUARD) * sizeof(unsigned int));
+	if (!data) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	return data;
+}
+
+/*
+ * PURPOSE: Fill n elements with random values from [low,high] and put the
+ *          guard after them
+ * INPUTS: state holding the seed, buffer, element count, range
+ * RETURN: none.  The buffer is filled and the seed advanced.
+ */
+void fill_check_buffer (Check_State_t* state, unsigned int* data, size_t n, unsigned int low,
+	unsigned int high) {
+	rng_fill_range(data, 0, n, state->seed++, low, high);
+	for (size_t i = 0; i < CHECK_GUARD; ++i) {
+		data[n + i] = CHECK_GUARD_VALUE;
+	}
+}
+
+/*
+ * PURPOSE: Check that nothing was written past the first n elements
+ * INPUTS: buffer, element count
+ * RETURN: True if the guard is untouched, false if not
+ */
+bool guard_intact (const unsigned int* data, size_t n) {
+	for (size_t i = 0; i < CHECK_GUARD; ++i) {
+		if (data[n + i] != CHECK_GUARD_VALUE) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * PURPOSE: Count and print one mismatch
+ * INPUTS: state, kernel name, length, offset, shift count or position
+ * RETURN: none.  The failure count is updated.
+ */
+void report (Check_State_t* state, const char* kernel, size_t n, size_t offset, unsigned int extra) {
+	if (state->failures++ < 20) {
+		printf("%s %s differs from %s: n=%zu offset=%zu arg=%u\n", state->test->name, kernel,
+			state->ref->name, n, offset, extra);
+	}
+}
+
+/*
+ * PURPOSE: Run add, every shift count, sum and equal on n elements starting
+ *          offset elements into their buffers and compare with the scalar
+ *          kernels
+ * INPUTS: state, element count, element offset
+ * RETURN: none.  Mismatches are reported.
+ */
+void check_length (Check_State_t* state, size_t n, size_t offset) {
+	unsigned int *a_buf = alloc_check_buffer(n);
+	unsigned int *b_buf = alloc_check_buffer(n);
+	unsigned int *ref_buf = alloc_check_buffer(n);
+	unsigned int *test_buf = alloc_check_buffer(n);
+	unsigned int *a = a_buf + offset;
+	unsigned int *b = b_buf + offset;
+	unsigned int *ref = ref_buf + offset;
+	unsigned int *test = test_buf + offset;
+
+	/* values near the top of the range so add wraps and sum passes 2^32 */
+	fill_check_buffer(state, a, n, 0xF0000000u, 0xFFFFFFFFu);
+	fill_check_buffer(state, b, n, 0, 0xFFFFFFFFu);
+	fill_check_buffer(state, ref, n, 0, 0);
+	fill_check_buffer(state, test, n, 0, 0);
+	state->ref->add(a, b, ref, n);
+	state->test->add(a, b, test, n);
+	if (memcmp(ref, test, n * sizeof(unsigned int)) || !guard_intact(test, n)) {
+		report(state, "add", n, offset, 0);
+	}
+
+	if (state->ref->sum(a, n) != state->test->sum(a, n)) {
+		report(state, "sum", n, offset, 0);
+	}
+
+	for (unsigned int shift = 0; shift <= CHECK_MAX_SHIFT; ++shift) {
+		memcpy(ref, b, n * sizeof(unsigned int));
+		memcpy(test, b, n * sizeof(unsigned int));
+		state->ref->shift_left(ref, shift, n);
+		state->test->shift_left(test, shift, n);
+		if (memcmp(ref, test, n * sizeof(unsigned int)) || !guard_intact(test, n)) {
+			report(state, "shift_left", n, offset, shift);
+		}
+		memcpy(ref, b, n * sizeof(unsigned int));
+		memcpy(test, b, n * sizeof(unsigned int));
+		state->ref->shift_right(ref, shift, n);
+		state->test->shift_right(test, shift, n);
+		if (memcmp(ref, test, n * sizeof(unsigned int)) || !guard_intact(test, n)) {
+			report(state, "shift_right", n, offset, shift);
+		}
+	}
+
+	/* equal must see a difference at every position, tails included */
+	memcpy(test, a, n * sizeof(unsigned int));
+	if (!state->test->equal(a, test, n)) {
+		report(state, "equal", n, offset, 0);
+	}
+	for (size_t i = 0; i < n; ++i) {
+		test[i] ^= 1u << (i % 32);
+		if (state->test->equal(a, test, n) != state->ref->equal(a, test, n)) {
+			report(state, "equal", n, offset, i);
+		}
+		test[i] = a[i];
+	}
+
+	free(a_buf);
+	free(b_buf);
+	free(ref_buf);
+	free(test_buf);
+}
+
+/*
+ * PURPOSE: Run the gemm micro kernel over k packed rows and compare the
+ *          tile with the scalar one
+ * INPUTS: state, inner dimension
+ * RETURN: none.  Mismatches are reported.
+ */
+void check_gemm (Check_State_t* state, size_t k) {
+	unsigned int *apack = alloc_check_buffer(k * GEMM_MR);
+	unsigned int *bpack = alloc_check_buffer(k * GEMM_NR);
+	unsigned int ref[GEMM_MR * GEMM_NR];
+	unsigned int test[GEMM_MR * GEMM_NR];
+
+	fill_check_buffer(state, apack, k * GEMM_MR, 0, 0xFFFFFFFFu);
+	fill_check_buffer(state, bpack, k * GEMM_NR, 0, 0xFFFFFFFFu);
+	/* stale values, the kernel has to overwrite the whole tile */
+	memset(ref, 0xAB, sizeof(ref));
+	memset(test, 0xCD, sizeof(test));
+	state->ref->gemm(k, apack, bpack, ref);
+	state->test->gemm(k, apack, bpack, test);
+	if (memcmp(ref, test, sizeof(ref))) {
+		report(state, "gemm", k, 0, 0);
+	}
+
+	free(apack);
+	free(bpack);
+}
+
+/*
+ * PURPOSE: Map a matrix file, write the same matrix and then a different
+ *          one over that file, and read the mapped matrix afterwards.  A
+ *          write that truncated the file in place made the mapped matrix
+ *          fault with SIGBUS.
+ * INPUTS: none
+ * RETURN: True if the mapped matrix kept its data and the file holds the
+ *         last matrix written, false if not
+ */
+bool check_write_over_map (void) {
+	char dir[] = "/tmp/matcheck_XXXXXX";
+	if (!mkdtemp(dir)) {
+		perror("FAILED TO CREATE CHECK DIRECTORY");
+		return false;
+	}
+	char path[sizeof(dir) + sizeof("/mapped")];
+	snprintf(path, sizeof(path), "%s/mapped", dir);
+
+	Matrix_t *orig = NULL;
+	Matrix_t *mapped = NULL;
+	Matrix_t *other = NULL;
+	Matrix_t *back = NULL;
+	unsigned long long before = 0;
+	unsigned long long after = 1;
+	bool ok = create_matrix(&orig, "mapped", CHECK_MAP_SIDE, CHECK_MAP_SIDE)
+		&& random_matrix_seeded(orig, 1, 1000, 1) && write_matrix(path, orig)
+		&& map_matrix(path, &mapped, MATRIX_MAP_COPY_ON_WRITE)
+		&& sum_matrix(mapped, &before)
+		&& write_matrix(path, mapped)
+		&& create_matrix(&other, "other", CHECK_MAP_SIDE / 2, CHECK_MAP_SIDE / 2)
+		&& random_matrix_seeded(other, 1, 1000, 2) && write_matrix(path, other)
+		&& sum_matrix(mapped, &after) && before == after && equal_matrices(mapped, orig)
+		&& read_matrix(path, &back) && equal_matrices(back, other);
+
+	destroy_matrix(&orig);
+	destroy_matrix(&mapped);
+	destroy_matrix(&other);
+	destroy_matrix(&back);
+	unlink(path);
+	rmdir(dir);
+	return ok;
+}
+
+/*
+ * PURPOSE: Write a matrix through a symlink to a file with a mode of its
+ *          own, atomically and then plainly.  Replacing the file through a
+ *          temporary one used to reset its mode and turn the symlink into
+ *          a regular file.
+ * INPUTS: none
+ * RETURN: True if the link still points at the file, the file kept its
+ *         mode and holds the last matrix written, false if not
+ */
+bool check_write_over_link (void) {
+	char dir[] = "/tmp/matcheck_XXXXXX";
+	if (!mkdtemp(dir)) {
+		perror("FAILED TO CREATE CHECK DIRECTORY");
+		return false;
+	}
+	char path[sizeof(dir) + sizeof("/target")];
+	char link[sizeof(dir) + sizeof("/link")];
+	snprintf(path, sizeof(path), "%s/target", dir);
+	snprintf(link, sizeof(link), "%s/link", dir);
+
+	Matrix_t *first = NULL;
+	Matrix_t *second = NULL;
+	Matrix_t *back = NULL;
+	struct stat st;
+	bool ok = create_matrix(&first, "first", 8, 8) && random_matrix_seeded(first, 1, 1000, 3)
+		&& write_matrix(path, first) && chmod(path, 0600) == 0 && symlink("target", link) == 0
+		&& create_matrix(&second, "second", 4, 4) && random_matrix_seeded(second, 1, 1000, 4)
+		&& write_matrix_with_flags(link, second, MATRIX_WRITE_ATOMIC)
+		&& write_matrix(link, first) && write_matrix_with_flags(link, second, MATRIX_WRITE_DEFAULT)
+		&& lstat(link, &st) == 0 && S_ISLNK(st.st_mode)
+		&& stat(path, &st) == 0 && (st.st_mode & 07777) == 0600
+		&& read_matrix(path, &back) && equal_matrices(back, second);
+
+	destroy_matrix(&first);
+	destroy_matrix(&second);
+	destroy_matrix(&back);
+	unlink(link);
+	unlink(path);
+	rmdir(dir);
+	return ok;
+}
@@ -2,15 +2,24 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <errno.h>
 
 #include "command.h"
+#include "pool.h"
 
 #define MAX_CMD_COUNT 50
-#define MAX_CMD_LEN 25
 
+/* Every command is carved out of this arena and released in one go */
+static Arena_t command_arena;
+/* Stream the replies of the commands this thread runs go to, NULL for stdout */
+static __thread FILE *command_out = NULL;
+
+/*protected functions*/
+bool parse_line (Arena_t* arena, const char* input, Commands_t* cmd);
 
 /* 
- * PURPOSE: Parse user input into separate commands
+ * PURPOSE: Parse user input into separate commands.  The commands live in
+ *          a shared arena, so only one parsed line may be alive at a time.
  * INPUTS: user line, command structure to parse line into
  * RETURN: true if successful, false if not. Cmd object may be modified. 
  */
@@ -19,28 +28,30 @@ bool parse_user_input (const char* input, Commands_t** cmd) {
 		return false;
 	}
 
-	char *string = strdup(input);
-	
-	*cmd = calloc (1,sizeof(Commands_t));
-	(*cmd)->cmds = calloc(MAX_CMD_COUNT,sizeof(char*));
-
-	unsigned int i = 0;
-	char *token;
-	token = strtok(string, " \n");
-	for (; token != NULL && i < MAX_CMD_COUNT; ++i) {
-		(*cmd)->cmds[i] = calloc(MAX_CMD_LEN,sizeof(char));
-		if (!(*cmd)->cmds[i]) {
-			perror("Allocation Error\n");
-			return false;
-		}	
-		strncpy((*cmd)->cmds[i],token, strlen(token) + 1);
-		(*cmd)->num_cmds++;
-		token = strtok(NULL, " \n");
+	arena_reset(&command_arena);
+	*cmd = arena_alloc(&command_arena, sizeof(Commands_t));
+	if (!*cmd || !parse_line(&command_arena, input, *cmd)) {
+		command_perror("Allocation Error\n");
+		*cmd = NULL;
+		return false;
 	}
-	free(string);
 	return true;
 }
 
+/* 
+ * PURPOSE: Parse user input into an arena of the caller, so several lines
+ *          can be alive at once, for example on different threads
+ * INPUTS: arena, user line, command structure to parse line into
+ * RETURN: true if successful, false if an allocation failed.
+ */
+bool parse_arena_input (Arena_t* arena, const char* input, Commands_t* cmd) {
+	if( !arena || !input || !cmd ){
+		return false;
+	}
+
+	return parse_line(arena, input, cmd);
+}
+
 /* 
  * PURPOSE: To destroy the commands in the cmd object
  * INPUTS: Object holding commands
@@ -51,11 +62,155 @@ void destroy_commands(Commands_t** cmd) {
 		return;
 	}
 
-	for (int i = 0; i < (*cmd)->num_cmds; ++i) {
-		free((*cmd)->cmds[i]);
-	}
-	free((*cmd)->cmds);
-	free((*cmd));
+	arena_reset(&command_arena);
 	*cmd = NULL;
 }
 
+/* 
+ * PURPOSE: To give the memory kept for parsing back to the system at exit
+ * INPUTS: none
+ * RETURN: none
+ */
+void release_command_memory (void) {
+	arena_release(&command_arena);
+}
+
+/* 
+ * PURPOSE: Parse a whole command file into an op list before anything runs.
+ *          Blank lines and lines starting with # are skipped.
+ * INPUTS: open command file, where to store the script
+ * RETURN: true if successful, false if not.
+ */
+bool parse_script (FILE* input, Script_t** script) {
+	if( !input || !script ){
+		return false;
+	}
+
+	*script = calloc(1, sizeof(Script_t));
+	if (!*script) {
+		return false;
+	}
+
+	unsigned int capacity = 0;
+	unsigned int line_number = 0;
+	char *line = NULL;
+	size_t line_capacity = 0;
+	while (getline(&line, &line_capacity, input) != -1) {
+		line_number++;
+		const char *start = line + strspn(line, " \t\r\n");
+		if (*start == '\0' || *start == '#') {
+			continue;
+		}
+		if ((*script)->num_ops == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			Commands_t *ops = realloc((*script)->ops, capacity * sizeof(Commands_t));
+			unsigned int *lines = realloc((*script)->line_numbers, capacity * sizeof(unsigned int));
+			if (ops) {
+				(*script)->ops = ops;
+			}
+			if (lines) {
+				(*script)->line_numbers = lines;
+			}
+			if (!ops || !lines) {
+				free(line);
+				destroy_script(script);
+				return false;
+			}
+		}
+		Commands_t *op = &(*script)->ops[(*script)->num_ops];
+		if (!parse_line(&(*script)->arena, line, op)) {
+			free(line);
+			destroy_script(script);
+			return false;
+		}
+		if (op->num_cmds > 0) {
+			(*script)->line_numbers[(*script)->num_ops++] = line_number;
+		}
+	}
+	free(line);
+	return true;
+}
+
+/* 
+ * PURPOSE: To destroy a parsed script
+ * INPUTS: script
+ * RETURN: none.  The script pointer is set to NULL.
+ */
+void destroy_script (Script_t** script) {
+	if( !script || !*script ){
+		return;
+	}
+
+	arena_release(&(*script)->arena);
+	free((*script)->ops);
+	free((*script)->line_numbers);
+	free(*script);
+	*script = NULL;
+}
+
+/* 
+ * PURPOSE: Stream a command should write its reply to.  That is stdout
+ *          unless the thread running it redirected it.
+ * INPUTS: none
+ * RETURN: output stream of the calling thread
+ */
+FILE* command_output (void) {
+	return command_out ? command_out : stdout;
+}
+
+/* 
+ * PURPOSE: Send the replies of the commands the calling thread runs to a
+ *          stream, used by the server to collect each reply of a client
+ * INPUTS: output stream, NULL for stdout
+ * RETURN: none
+ */
+void command_set_output (FILE* out) {
+	command_out = out;
+}
+
+/* 
+ * PURPOSE: Report a failed system call like perror does, into the reply of
+ *          the command when the server collects one and on stderr otherwise
+ * INPUTS: message put in front of the error
+ * RETURN: none
+ */
+void command_perror (const char* message) {
+	if (!command_out) {
+		perror(message);
+		return;
+	}
+	fprintf(command_out, "%s: %s\n", message, strerror(errno));
+}
+
+/*Protected Functions in C*/
+
+/* 
+ * PURPOSE: Split a line into tokens stored in an arena
+ * INPUTS: arena, line, command structure to fill in
+ * RETURN: true if successful, false if an allocation failed.
+ */
+bool parse_line (Arena_t* arena, const char* input, Commands_t* cmd) {
+	char *string = arena_strdup(arena, input);
+	if (!string) {
+		return false;
+	}
+
+	/*tokens point into the arena copy of the line*/
+	char *tokens[MAX_CMD_COUNT];
+	unsigned int i = 0;
+	char *token;
+	char *save = NULL;
+	token = strtok_r(string, " \t\r\n", &save);
+	for (; token != NULL && i < MAX_CMD_COUNT; ++i) {
+		tokens[i] = token;
+		token = strtok_r(NULL, " \t\r\n", &save);
+	}
+
+	cmd->num_cmds = i;
+	cmd->cmds = arena_alloc(arena, (i ? i : 1) * sizeof(char*));
+	if (!cmd->cmds) {
+		return false;
+	}
+	memcpy(cmd->cmds, tokens, i * sizeof(char*));
+	return true;
+}
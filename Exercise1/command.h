@@ -1,12 +1,31 @@
 #ifndef _COMMAND_H_
 #define _COMMAND_H_
 
+#include <stdio.h>
+
+#include "pool.h"
+
 typedef struct {
 	unsigned int num_cmds;
 	char** cmds;
 }Commands_t;
 
+/* A whole command file parsed up front, one op per non-empty line */
+typedef struct {
+	unsigned int num_ops;
+	Commands_t* ops;
+	unsigned int* line_numbers;
+	Arena_t arena;
+}Script_t;
+
 bool parse_user_input (const char* input, Commands_t** cmd);
+bool parse_arena_input (Arena_t* arena, const char* input, Commands_t* cmd);
 void destroy_commands(Commands_t** cmd);
+void release_command_memory (void);
+bool parse_script (FILE* input, Script_t** script);
+void destroy_script (Script_t** script);
+FILE* command_output (void);
+void command_set_output (FILE* out);
+void command_perror (const char* message);
 
 #endif
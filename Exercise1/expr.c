@@ -0,0 +1,472 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+
+#include "expr.h"
+#include "thread_pool.h"
+#include "kernels.h"
+#include "pool.h"
+#include "sparse.h"
+#include "command.h"
+
+/* Elements evaluated per step of a fused pass, small enough that every
+ * intermediate of an expression stays in L1 */
+#define EXPR_BLOCK 1024
+
+typedef struct {
+	const Expr_t* e;
+	unsigned int* out;
+}Eval_Task_t;
+
+static bool lazy_enabled = false;
+
+/*protected functions*/
+Expr_t* expr_new (Expr_Op_t op, unsigned int rows, unsigned int cols);
+Expr_t* expr_retain (Expr_t* e);
+Expr_t* expr_of (Matrix_t* m);
+Expr_t* expr_prepare_take (Matrix_t* m);
+void expr_take (Expr_t* leaf, Matrix_t* m);
+Matrix_t* create_pending (const char* name, Expr_t* e);
+const unsigned int* eval_block (const Expr_t* e, size_t begin, size_t n, unsigned int* out);
+void eval_range (void* ctx, size_t begin, size_t end);
+void force_visit (const Registry_Entry_t* entry, void* ctx);
+void discard_visit (const Registry_Entry_t* entry, void* ctx);
+void pending_visit (const Registry_Entry_t* entry, void* ctx);
+
+/*
+ * PURPOSE: Drop one reference to an expression node, freeing it and its
+ *          operands once nothing refers to it
+ * INPUTS: node, may be NULL
+ * RETURN: none
+ */
+void expr_release (Expr_t* e) {
+	while (e && --e->refs == 0) {
+		Expr_t *next = e->left;
+		expr_release(e->right);
+		if (e->op == EXPR_LEAF) {
+			if (e->owned) {
+				destroy_matrix(&e->source);
+			}
+			else {
+				e->source->lazy_refs--;
+			}
+		}
+		pool_free(e, sizeof(Expr_t));
+		e = next;
+	}
+}
+
+/*
+ * PURPOSE: Report whether add, shift and duplicate are being deferred
+ * INPUTS: none
+ * RETURN: True if lazy evaluation is on.
+ */
+bool lazy_is_enabled (void) {
+	return lazy_enabled;
+}
+
+/*
+ * PURPOSE: Turn lazy evaluation on or off.  Turning it off evaluates every
+ *          deferred matrix.
+ * INPUTS: registry, whether to defer
+ * RETURN: none
+ */
+void lazy_set_enabled (Registry_t* reg, bool enabled) {
+	if (!enabled) {
+		lazy_flush(reg);
+	}
+	lazy_enabled = enabled;
+}
+
+/*
+ * PURPOSE: Record dest = a + b without computing it
+ * INPUTS: registry, operands, name of the result
+ * RETURN: True if the result was registered, false if not.
+ */
+bool lazy_add (Registry_t* reg, Matrix_t* a, Matrix_t* b, const char* dest) {
+	if (!reg || !a || !b || !dest || strlen(dest) + 1 > MATRIX_NAME_LEN
+		|| a->rows != b->rows || a->cols != b->cols) {
+		return false;
+	}
+
+	/* The matrix being replaced must not be read by anything deferred.
+	 * A spilled one is not, so it is left on disk until it is replaced. */
+	const Registry_Entry_t *entry = registry_peek(reg, dest);
+	Matrix_t *old = entry ? entry->matrix : NULL;
+	if (old && old->lazy_refs && !lazy_flush(reg)) {
+		return false;
+	}
+	/* A materialized operand that is also replaced hands its data over */
+	const bool take = old && !old->pending && (old == a || old == b);
+
+	Expr_t *node = expr_new(EXPR_ADD, a->rows, a->cols);
+	Expr_t *taken = take ? expr_prepare_take(old) : NULL;
+	Expr_t *left = (take && a == old) ? expr_retain(taken) : expr_of(a);
+	Expr_t *right = (take && b == old) ? expr_retain(taken) : expr_of(b);
+	Matrix_t *c = create_pending(dest, node);
+	if (!node || (take && !taken) || !left || !right || !c) {
+		fprintf(command_output(), "Failure to defer the add into (%s)\n", dest);
+		expr_release(left);
+		expr_release(right);
+		expr_release(taken);
+		if (c) {
+			destroy_matrix(&c);
+		}
+		else {
+			expr_release(node);
+		}
+		return false;
+	}
+	node->left = left;
+	node->right = right;
+	node->depth = 1 + (left->depth > right->depth ? left->depth : right->depth);
+	if (taken) {
+		expr_take(taken, old);
+		expr_release(taken);
+	}
+
+	if (!registry_insert(reg, c)) {
+		destroy_matrix(&c);
+		return false;
+	}
+	return c->pending->depth < EXPR_MAX_DEPTH || lazy_force(c);
+}
+
+/*
+ * PURPOSE: Record a bitwise shift of a matrix without computing it
+ * INPUTS: matrix to shift, direction 'l' or 'r', magnitude of the shift
+ *         below 32
+ * RETURN: True if the shift was recorded, false if not.
+ */
+bool lazy_shift (Registry_t* reg, Matrix_t* m, char direction, unsigned int shift) {
+	if (!reg || !m || m->read_only || (direction != 'l' && direction != 'r')
+		|| shift >= sizeof(unsigned int) * CHAR_BIT) {
+		return false;
+	}
+
+	if (!m->pending && m->lazy_refs && !lazy_flush(reg)) {
+		return false;
+	}
+
+	Expr_t *node = expr_new(EXPR_SHIFT, m->rows, m->cols);
+	if (!node) {
+		return false;
+	}
+	node->direction = direction;
+	node->shift = shift;
+	if (m->pending) {
+		node->left = m->pending;
+	}
+	else {
+		node->left = expr_prepare_take(m);
+		if (!node->left) {
+			expr_release(node);
+			return false;
+		}
+		expr_take(node->left, m);
+	}
+	node->depth = node->left->depth + 1;
+	m->pending = node;
+	return node->depth < EXPR_MAX_DEPTH || lazy_force(m);
+}
+
+/*
+ * PURPOSE: Record dest as a copy of src without copying any data
+ * INPUTS: registry, matrix to copy, name of the copy
+ * RETURN: True if the copy was registered, false if not.
+ */
+bool lazy_duplicate (Registry_t* reg, Matrix_t* src, const char* dest) {
+	if (!reg || !src || !dest || strlen(dest) + 1 > MATRIX_NAME_LEN) {
+		return false;
+	}
+
+	/* only a resident matrix can be src or read by anything deferred */
+	const Registry_Entry_t *entry = registry_peek(reg, dest);
+	Matrix_t *old = entry ? entry->matrix : NULL;
+	if (old == src) {
+		return true;
+	}
+	if (old && old->lazy_refs && !lazy_flush(reg)) {
+		return false;
+	}
+
+	Expr_t *e = expr_of(src);
+	if (!e) {
+		return false;
+	}
+	Matrix_t *c = create_pending(dest, e);
+	if (!c) {
+		expr_release(e);
+		return false;
+	}
+	if (!registry_insert(reg, c)) {
+		destroy_matrix(&c);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * PURPOSE: Evaluate the deferred expression of a matrix in one fused pass
+ *          and store the result as the matrix data
+ * INPUTS: matrix, may be already materialized
+ * RETURN: True if the matrix holds its data, false if it could not be
+ *         allocated and stays deferred.
+ */
+bool lazy_force (Matrix_t* m) {
+	if (!m) {
+		return false;
+	}
+	if (!m->pending) {
+		return true;
+	}
+
+	const size_t count = (size_t) m->rows * m->cols;
+	unsigned int *data = pool_alloc_uninit(count * sizeof(unsigned int));
+	if (!data) {
+		fprintf(command_output(), "Failure to evaluate Matrix (%s)\n", m->name);
+		return false;
+	}
+	Eval_Task_t task = { m->pending, data };
+	parallel_for(count, eval_range, &task);
+
+	m->data = data;
+	expr_release(m->pending);
+	m->pending = NULL;
+	return true;
+}
+
+/*
+ * PURPOSE: Evaluate every deferred matrix of the workspace
+ * INPUTS: registry
+ * RETURN: True if nothing is deferred anymore, false if a matrix could not
+ *         be evaluated.
+ */
+bool lazy_flush (Registry_t* reg) {
+	bool ok = true;
+	registry_for_each(reg, force_visit, &ok);
+	return ok;
+}
+
+/*
+ * PURPOSE: Drop every deferred expression without evaluating it, so the
+ *          workspace can be destroyed in any order
+ * INPUTS: registry
+ * RETURN: none.  Deferred matrices are left without data.
+ */
+void lazy_discard (Registry_t* reg) {
+	registry_for_each(reg, discard_visit, NULL);
+}
+
+/*
+ * PURPOSE: Count the deferred matrices of the workspace
+ * INPUTS: registry
+ * RETURN: number of matrices whose data is not computed yet
+ */
+size_t lazy_pending_count (Registry_t* reg) {
+	size_t count = 0;
+	registry_for_each(reg, pending_visit, &count);
+	return count;
+}
+
+/*Protected Functions in C*/
+
+/*
+ * PURPOSE: Allocate an expression node holding one reference
+ * INPUTS: operation, dimensions of its result
+ * RETURN: the node, NULL if out of memory
+ */
+Expr_t* expr_new (Expr_Op_t op, unsigned int rows, unsigned int cols) {
+	Expr_t *e = pool_alloc(sizeof(Expr_t));
+	if (!e) {
+		return NULL;
+	}
+	e->op = op;
+	e->refs = 1;
+	e->rows = rows;
+	e->cols = cols;
+	return e;
+}
+
+/*
+ * PURPOSE: Add a reference to an expression node
+ * INPUTS: node, may be NULL
+ * RETURN: the node
+ */
+Expr_t* expr_retain (Expr_t* e) {
+	if (e) {
+		e->refs++;
+	}
+	return e;
+}
+
+/*
+ * PURPOSE: Get an expression producing the current value of a matrix
+ * INPUTS: matrix
+ * RETURN: a new reference to its deferred expression, or a leaf borrowing
+ *         the matrix.  NULL if out of memory.
+ */
+Expr_t* expr_of (Matrix_t* m) {
+	if (m->pending) {
+		return expr_retain(m->pending);
+	}
+	Expr_t *leaf = expr_new(EXPR_LEAF, m->rows, m->cols);
+	if (leaf) {
+		leaf->source = m;
+		m->lazy_refs++;
+	}
+	return leaf;
+}
+
+/*
+ * PURPOSE: Allocate a leaf that will own the data of a materialized matrix.
+ *          Nothing is moved yet so the caller can still back out.
+ * INPUTS: matrix whose data will be taken
+ * RETURN: the leaf, NULL if out of memory
+ */
+Expr_t* expr_prepare_take (Matrix_t* m) {
+	Expr_t *leaf = expr_new(EXPR_LEAF, m->rows, m->cols);
+	if (!leaf) {
+		return NULL;
+	}
+	leaf->source = pool_alloc(sizeof(Matrix_t));
+	if (!leaf->source) {
+		pool_free(leaf, sizeof(Expr_t));
+		return NULL;
+	}
+	leaf->owned = true;
+	return leaf;
+}
+
+/*
+ * PURPOSE: Move the data of a materialized matrix into a prepared leaf
+ * INPUTS: leaf from expr_prepare_take, matrix nothing deferred reads
+ * RETURN: none.  The matrix is left without data.
+ */
+void expr_take (Expr_t* leaf, Matrix_t* m) {
+	*leaf->source = *m;
+	m->data = NULL;
+	m->map_base = NULL;
+	m->map_len = 0;
+	m->share = NULL;
+	m->sparse = NULL;
+	m->hash_valid = false;
+}
+
+/*
+ * PURPOSE: Create a matrix whose data is given by a deferred expression
+ * INPUTS: name, expression whose reference is handed to the matrix
+ * RETURN: the matrix, NULL if the name is invalid or out of memory
+ */
+Matrix_t* create_pending (const char* name, Expr_t* e) {
+	if (!e) {
+		return NULL;
+	}
+	Matrix_t *m = pool_alloc(sizeof(Matrix_t));
+	if (!m) {
+		return NULL;
+	}
+	memcpy(m->name, name, strlen(name) + 1);
+	m->rows = e->rows;
+	m->cols = e->cols;
+	m->pending = e;
+	return m;
+}
+
+/*
+ * PURPOSE: Evaluate a block of an expression.  Each operation works in
+ *          place on the output of its left operand, so the only scratch
+ *          needed is one block per right operand on the stack.
+ * INPUTS: expression, first element and length of the block (at most
+ *         EXPR_BLOCK), output buffer of the block
+ * RETURN: pointer to the block values, either out or leaf data
+ */
+const unsigned int* eval_block (const Expr_t* e, size_t begin, size_t n, unsigned int* out) {
+	const Matrix_Kernels_t *k = matrix_kernels();
+	switch (e->op) {
+		case EXPR_LEAF:
+			if (e->source->sparse) {
+				sparse_expand(e->source, begin, n, out);
+				return out;
+			}
+			return &e->source->data[begin];
+		case EXPR_ADD: {
+			unsigned int scratch[EXPR_BLOCK];
+			const unsigned int *a = eval_block(e->left, begin, n, out);
+			const unsigned int *b = eval_block(e->right, begin, n, scratch);
+			k->add(a, b, out, n);
+			return out;
+		}
+		case EXPR_SHIFT: {
+			const unsigned int *a = eval_block(e->left, begin, n, out);
+			if (e->shift >= sizeof(unsigned int) * CHAR_BIT) {
+				memset(out, 0, n * sizeof(unsigned int));
+				return out;
+			}
+			if (a != out) {
+				memcpy(out, a, n * sizeof(unsigned int));
+			}
+			if (e->direction == 'l') {
+				k->shift_left(out, e->shift, n);
+			}
+			else {
+				k->shift_right(out, e->shift, n);
+			}
+			return out;
+		}
+	}
+	return out;
+}
+
+/*
+ * PURPOSE: Evaluate one flat range of an expression block by block, run
+ *          by parallel_for
+ * INPUTS: Eval_Task_t, first and one past the last element of the range
+ * RETURN: none.  The output data is modified.
+ */
+void eval_range (void* ctx, size_t begin, size_t end) {
+	const Eval_Task_t *task = ctx;
+	for (size_t i = begin; i < end; i += EXPR_BLOCK) {
+		const size_t n = (end - i < EXPR_BLOCK) ? end - i : EXPR_BLOCK;
+		const unsigned int *values = eval_block(task->e, i, n, &task->out[i]);
+		if (values != &task->out[i]) {
+			memcpy(&task->out[i], values, n * sizeof(unsigned int));
+		}
+	}
+}
+
+/*
+ * PURPOSE: Evaluate a deferred matrix, used by lazy_flush
+ * INPUTS: registry entry, bool cleared on failure
+ * RETURN: none
+ */
+void force_visit (const Registry_Entry_t* entry, void* ctx) {
+	if (entry->matrix && entry->matrix->pending && !lazy_force(entry->matrix)) {
+		*(bool*) ctx = false;
+	}
+}
+
+/*
+ * PURPOSE: Drop the expression of a deferred matrix, used by lazy_discard
+ * INPUTS: registry entry, unused context
+ * RETURN: none
+ */
+void discard_visit (const Registry_Entry_t* entry, void* ctx) {
+	if (entry->matrix && entry->matrix->pending) {
+		expr_release(entry->matrix->pending);
+		entry->matrix->pending = NULL;
+	}
+}
+
+/*
+ * PURPOSE: Count a deferred matrix, used by lazy_pending_count
+ * INPUTS: registry entry, size_t counter
+ * RETURN: none
+ */
+void pending_visit (const Registry_Entry_t* entry, void* ctx) {
+	if (entry->matrix && entry->matrix->pending) {
+		++*(size_t*) ctx;
+	}
+}
@@ -0,0 +1,49 @@
+#ifndef _EXPR_H_
+#define _EXPR_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "matrix.h"
+#include "registry.h"
+
+/* Deeper expressions are evaluated right away rather than deferred */
+#define EXPR_MAX_DEPTH 64
+
+typedef enum {
+	EXPR_LEAF,
+	EXPR_ADD,
+	EXPR_SHIFT
+}Expr_Op_t;
+
+/* Node of a deferred expression DAG.  Nodes are reference counted and
+ * shared between pending matrices.  A leaf either borrows a materialized
+ * matrix of the workspace (pinned through its lazy_refs count) or owns a
+ * matrix whose data was taken over when the workspace one was rewritten. */
+typedef struct Expr {
+	Expr_Op_t op;
+	unsigned int refs;
+	unsigned int depth;
+	unsigned int rows;
+	unsigned int cols;
+	struct Expr* left;
+	struct Expr* right;
+	char direction;
+	unsigned int shift;
+	Matrix_t* source;
+	bool owned;
+}Expr_t;
+
+void expr_release (Expr_t* e);
+
+bool lazy_is_enabled (void);
+void lazy_set_enabled (Registry_t* reg, bool enabled);
+bool lazy_add (Registry_t* reg, Matrix_t* a, Matrix_t* b, const char* dest);
+bool lazy_shift (Registry_t* reg, Matrix_t* m, char direction, unsigned int shift);
+bool lazy_duplicate (Registry_t* reg, Matrix_t* src, const char* dest);
+bool lazy_force (Matrix_t* m);
+bool lazy_flush (Registry_t* reg);
+void lazy_discard (Registry_t* reg);
+size_t lazy_pending_count (Registry_t* reg);
+
+#endif
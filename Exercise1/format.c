@@ -0,0 +1,919 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define FORMAT_HW_CRC 1
+#endif
+
+#include "format.h"
+#include "thread_pool.h"
+#include "sparse.h"
+#include "types.h"
+#include "command.h"
+
+/* Chunks compressed or decoded per round, their buffers are reused */
+#define FORMAT_GROUP 16
+
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5	/* a block always ends with this many literals */
+#define LZ_MFLIMIT 12		/* no match starts this close to the end */
+
+typedef struct {
+	Matrix_t* m;
+	Format_Chunk_t* table;
+	size_t first;			/* first chunk of the group */
+	unsigned char* buffers;		/* one chunk sized buffer per group slot */
+	unsigned char* scratch;		/* same again for sparse matrices */
+	size_t chunk_bytes;
+	bool compress;
+}Write_Task_t;
+
+typedef struct {
+	Matrix_t* m;
+	const Format_Header_t* header;
+	const Format_Chunk_t* table;
+	size_t first;			/* first chunk of the group */
+	size_t begin;			/* element range of the file being read */
+	size_t end;
+	unsigned char* stored;		/* one chunk sized buffer per group slot */
+	unsigned char* decoded;
+	size_t chunk_bytes;
+	int failed;
+	FILE* out;			/* command_output() of the reading thread */
+}Read_Task_t;
+
+static unsigned int crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static bool crc_hw = false;
+
+/*protected functions*/
+void crc_init (void);
+unsigned int crc32c_sw (unsigned int crc, const unsigned char* p, size_t len);
+unsigned int crc32c_hw (unsigned int crc, const unsigned char* p, size_t len);
+bool write_all (int fd, struct iovec* iov, int iovcnt);
+bool read_all (int fd, void* buf, size_t len, off_t offset);
+bool read_header (int fd, Format_Header_t* header, Format_Chunk_t** table);
+bool check_header (Format_Header_t* header);
+size_t chunk_elems (const Format_Header_t* header, size_t chunk);
+size_t data_start (size_t num_chunks);
+bool check_sparse_chunk (const unsigned int* stored, size_t len, size_t n);
+bool read_sparse (int fd, const Format_Header_t* header, const Format_Chunk_t* table,
+	size_t begin, size_t end, Matrix_t* m);
+void write_range (void* ctx, size_t begin, size_t end);
+void read_range (void* ctx, size_t begin, size_t end);
+size_t lz_compress (const unsigned char* src, size_t n, unsigned char* dst, size_t cap);
+bool lz_emit (unsigned char* dst, size_t cap, size_t* out, const unsigned char* lit,
+	size_t lit_len, size_t offset, size_t match_len);
+size_t lz_decompress (const unsigned char* src, size_t n, unsigned char* dst, size_t cap);
+
+/*
+ * PURPOSE: Update a CRC32C (Castagnoli) checksum, with the SSE4.2 crc32
+ *          instruction when the cpu has it
+ * INPUTS: running crc (0 to start), data, length in bytes
+ * RETURN: updated crc
+ */
+unsigned int format_crc32c (unsigned int crc, const void* data, size_t len) {
+	pthread_once(&crc_once, crc_init);
+	if (crc_hw) {
+		return crc32c_hw(crc, data, len);
+	}
+	return crc32c_sw(crc, data, len);
+}
+
+/*
+ * PURPOSE: Tell the container format from the legacy one by its magic
+ * INPUTS: first bytes of the file, how many there are
+ * RETURN: True if the file is a container file.
+ */
+bool format_is_container (const void* head, size_t len) {
+	return head && len >= sizeof(FORMAT_MAGIC) - 1
+		&& memcmp(head, FORMAT_MAGIC, sizeof(FORMAT_MAGIC) - 1) == 0;
+}
+
+/*
+ * PURPOSE: Write a matrix as a container file: header, chunk table and
+ *          FORMAT_CHUNK_ELEMS sized chunks, each with a CRC32C.  Chunks are
+ *          checksummed and compressed FORMAT_GROUP at a time on the thread
+ *          pool.  A chunk is only kept compressed when that makes it
+ *          smaller, raw chunks go to the file straight from the matrix.
+ *          Chunks of a sparse matrix are stored as their entries while
+ *          that is no bigger than the values.
+ * INPUTS: file descriptor open for writing at offset 0, matrix, whether
+ *         to try compressing the chunks
+ * RETURN: True if successful, false on a write or allocation error.
+ */
+bool format_write (int fd, Matrix_t* m, bool compress) {
+	if (fd < 0 || !m || (!m->data && !m->sparse)) {
+		return false;
+	}
+
+	const size_t count = (size_t) m->rows * m->cols;
+	const size_t num_chunks = (count + FORMAT_CHUNK_ELEMS - 1) / FORMAT_CHUNK_ELEMS;
+	if (num_chunks > UINT_MAX) {
+		return false;
+	}
+	const size_t elem_size = type_size(m->type);
+	const size_t chunk_bytes = FORMAT_CHUNK_ELEMS * elem_size;
+	Format_Chunk_t *table = calloc(num_chunks ? num_chunks : 1, sizeof(Format_Chunk_t));
+	const bool staged = compress || m->sparse;
+	unsigned char *buffers = staged ? malloc((m->sparse ? 2 : 1) * FORMAT_GROUP * chunk_bytes) : NULL;
+	unsigned char *scratch = m->sparse ? &buffers[FORMAT_GROUP * chunk_bytes] : NULL;
+	if (!table || (staged && !buffers)) {
+		free(table);
+		free(buffers);
+		return false;
+	}
+
+	/* chunks go after the header and table, those are written last */
+	size_t offset = data_start(num_chunks);
+	bool ok = lseek(fd, offset, SEEK_SET) == (off_t) offset;
+	for (size_t first = 0; ok && first < num_chunks; first += FORMAT_GROUP) {
+		const size_t group = (num_chunks - first < FORMAT_GROUP) ? num_chunks - first : FORMAT_GROUP;
+		Write_Task_t task = { m, table, first, buffers, scratch, chunk_bytes, compress };
+		parallel_for_weighted(group, FORMAT_CHUNK_ELEMS, write_range, &task);
+
+		struct iovec iov[FORMAT_GROUP];
+		for (size_t i = 0; i < group; ++i) {
+			Format_Chunk_t *chunk = &table[first + i];
+			chunk->offset = offset;
+			if (chunk->codec != FORMAT_CODEC_RAW) {
+				iov[i].iov_base = &buffers[i * chunk_bytes];
+			}
+			else if (m->sparse) {
+				iov[i].iov_base = &scratch[i * chunk_bytes];
+			}
+			else {
+				iov[i].iov_base = (unsigned char*) m->elems + (first + i) * chunk_bytes;
+			}
+			iov[i].iov_len = chunk->stored_len;
+			offset += chunk->stored_len;
+		}
+		ok = write_all(fd, iov, group);
+	}
+
+	Format_Header_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, FORMAT_MAGIC, sizeof(header.magic));
+	header.version = FORMAT_VERSION;
+	header.endian = FORMAT_ENDIAN_MARK;
+	header.rows = m->rows;
+	header.cols = m->cols;
+	header.chunk_elems = FORMAT_CHUNK_ELEMS;
+	header.num_chunks = num_chunks;
+	header.table_crc = format_crc32c(0, table, num_chunks * sizeof(Format_Chunk_t));
+	header.elem_type = m->type;
+	strncpy(header.name, m->name, sizeof(header.name) - 1);
+	header.header_crc = format_crc32c(0, &header, sizeof(header));
+
+	unsigned char pad[FORMAT_DATA_ALIGN] = {0};
+	const size_t table_end = sizeof(header) + num_chunks * sizeof(Format_Chunk_t);
+	struct iovec head[3] = {
+		{ .iov_base = &header, .iov_len = sizeof(header) },
+		{ .iov_base = table, .iov_len = num_chunks * sizeof(Format_Chunk_t) },
+		{ .iov_base = pad, .iov_len = data_start(num_chunks) - table_end }
+	};
+	ok = ok && lseek(fd, 0, SEEK_SET) == 0 && write_all(fd, head, 3);
+
+	free(table);
+	free(buffers);
+	return ok;
+}
+
+/*
+ * PURPOSE: Read and validate only the header of a container file
+ * INPUTS: file descriptor, header to fill
+ * RETURN: True if the header is intact, false if not.
+ */
+bool format_read_info (int fd, Format_Header_t* header) {
+	if (!header || !read_all(fd, header, sizeof(Format_Header_t), 0)) {
+		fprintf(command_output(), "FAILED TO READ MATRIX HEADER\n");
+		return false;
+	}
+	return check_header(header);
+}
+
+/*
+ * PURPOSE: Read rows of a container file into a new matrix.  Only the
+ *          chunks covering those rows are read.  Every chunk is checked
+ *          against its CRC32C and decoded on the thread pool, whole raw
+ *          chunks are read straight into the matrix.  Rows held only in
+ *          sparse chunks give a sparse matrix.
+ * INPUTS: file descriptor, matrix, first row, number of rows (clipped to
+ *         the end of the matrix, UINT_MAX for all of them)
+ * RETURN: True if successful, false if the file is damaged or unreadable.
+ */
+bool format_read (int fd, Matrix_t** m, unsigned int first_row, unsigned int num_rows) {
+	Format_Header_t header;
+	Format_Chunk_t *table = NULL;
+	if (!m || !read_header(fd, &header, &table)) {
+		return false;
+	}
+	if (first_row > header.rows) {
+		fprintf(command_output(), "ROW %u IS PAST THE END OF THE MATRIX\n", first_row);
+		free(table);
+		return false;
+	}
+	if (num_rows > header.rows - first_row) {
+		num_rows = header.rows - first_row;
+	}
+
+	const size_t begin = (size_t) first_row * header.cols;
+	const size_t end = begin + (size_t) num_rows * header.cols;
+	const size_t first_chunk = begin / header.chunk_elems;
+	const size_t last_chunk = (end + header.chunk_elems - 1) / header.chunk_elems;
+	bool sparse = header.elem_type == MATRIX_U32;
+	for (size_t c = first_chunk; c < last_chunk; ++c) {
+		sparse = sparse && table[c].codec == FORMAT_CODEC_SPARSE;
+	}
+
+	Matrix_t *result = NULL;
+	const size_t elem_size = type_size(header.elem_type);
+	const size_t chunk_bytes = (size_t) header.chunk_elems * elem_size;
+	unsigned char *buffers = sparse ? NULL : malloc(2 * FORMAT_GROUP * chunk_bytes);
+	if ((!sparse && !buffers)
+		|| !create_typed_matrix(&result, header.name, num_rows, header.cols, header.elem_type)) {
+		free(buffers);
+		free(table);
+		return false;
+	}
+
+	bool ok = sparse ? read_sparse(fd, &header, table, begin, end, result) : reserve_matrix_storage(result);
+	for (size_t first = first_chunk; !sparse && ok && first < last_chunk; first += FORMAT_GROUP) {
+		const size_t group = (last_chunk - first < FORMAT_GROUP) ? last_chunk - first : FORMAT_GROUP;
+		for (size_t i = 0; ok && i < group; ++i) {
+			const size_t c = first + i;
+			const size_t c_begin = c * header.chunk_elems;
+			const size_t c_end = c_begin + chunk_elems(&header, c);
+			const Format_Chunk_t *chunk = &table[c];
+			/* whole raw chunks need no staging copy */
+			void *dst = (chunk->codec == FORMAT_CODEC_RAW && c_begin >= begin && c_end <= end)
+				? (unsigned char*) result->elems + (c_begin - begin) * elem_size : &buffers[i * chunk_bytes];
+			ok = read_all(fd, dst, chunk->stored_len, chunk->offset);
+		}
+		if (!ok) {
+			fprintf(command_output(), "FAILED TO READ MATRIX DATA\n");
+			break;
+		}
+		Read_Task_t task = { result, &header, table, first, begin, end, buffers,
+			&buffers[FORMAT_GROUP * chunk_bytes], chunk_bytes, 0, command_output() };
+		parallel_for_weighted(group, header.chunk_elems, read_range, &task);
+		ok = !task.failed;
+	}
+
+	free(buffers);
+	free(table);
+	if (!ok) {
+		destroy_matrix(&result);
+		return false;
+	}
+	destroy_matrix(m);
+	*m = result;
+	return true;
+}
+
+/*
+ * PURPOSE: Check whether a mapped container file holds its data raw and
+ *          in one piece, so a matrix can point straight into the mapping
+ * INPUTS: mapped file, its length, header copy, offset of the data
+ * RETURN: True if the data can be used in place, false if the file has to
+ *         be read instead.  Chunk checksums are not verified here.
+ */
+bool format_map_offset (const void* base, size_t len, Format_Header_t* header, size_t* data_offset) {
+	if (!base || !header || !data_offset || len < sizeof(Format_Header_t)) {
+		return false;
+	}
+	memcpy(header, base, sizeof(Format_Header_t));
+	if (!check_header(header)) {
+		return false;
+	}
+
+	const size_t start = data_start(header->num_chunks);
+	const size_t table_len = header->num_chunks * sizeof(Format_Chunk_t);
+	const size_t elem_size = type_size(header->elem_type);
+	const size_t data_len = (size_t) header->rows * header->cols * elem_size;
+	if (len < start || len - start < data_len) {
+		return false;
+	}
+	const Format_Chunk_t *table = (const Format_Chunk_t*) ((const unsigned char*) base + sizeof(Format_Header_t));
+	if (format_crc32c(0, table, table_len) != header->table_crc) {
+		return false;
+	}
+	size_t offset = start;
+	for (size_t c = 0; c < header->num_chunks; ++c) {
+		if (table[c].codec != FORMAT_CODEC_RAW || table[c].offset != offset
+			|| table[c].stored_len != chunk_elems(header, c) * elem_size) {
+			return false;
+		}
+		offset += table[c].stored_len;
+	}
+	*data_offset = start;
+	return true;
+}
+
+/*Protected Functions in C*/
+
+/*
+ * PURPOSE: Build the software CRC32C table and look for the crc32
+ *          instruction, run once
+ * INPUTS: none
+ * RETURN: none
+ */
+void crc_init (void) {
+	for (unsigned int i = 0; i < 256; ++i) {
+		unsigned int crc = i;
+		for (int bit = 0; bit < 8; ++bit) {
+			crc = (crc >> 1) ^ (0x82F63B78u & -(crc & 1));
+		}
+		crc_table[i] = crc;
+	}
+#ifdef FORMAT_HW_CRC
+	__builtin_cpu_init();
+	crc_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+/*
+ * PURPOSE: Table driven CRC32C
+ * INPUTS: running crc, data, length in bytes
+ * RETURN: updated crc
+ */
+unsigned int crc32c_sw (unsigned int crc, const unsigned char* p, size_t len) {
+	crc = ~crc;
+	for (size_t i = 0; i < len; ++i) {
+		crc = crc_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+#ifdef FORMAT_HW_CRC
+/*
+ * PURPOSE: CRC32C with the SSE4.2 crc32 instruction, 8 bytes at a time
+ * INPUTS: running crc, data, length in bytes
+ * RETURN: updated crc
+ */
+__attribute__((target("sse4.2")))
+unsigned int crc32c_hw (unsigned int crc, const unsigned char* p, size_t len) {
+	unsigned long long c = ~crc;
+	size_t i = 0;
+	for (; i + 8 <= len; i += 8) {
+		unsigned long long word;
+		memcpy(&word, &p[i], sizeof(word));
+		c = _mm_crc32_u64(c, word);
+	}
+	for (; i < len; ++i) {
+		c = _mm_crc32_u8((unsigned int) c, p[i]);
+	}
+	return ~(unsigned int) c;
+}
+#else
+unsigned int crc32c_hw (unsigned int crc, const unsigned char* p, size_t len) {
+	return crc32c_sw(crc, p, len);
+}
+#endif
+
+/*
+ * PURPOSE: Write every byte described by an iovec array, resuming after
+ *          short writes and interrupted calls
+ * INPUTS: file descriptor, iovec array (consumed in place), number of iovecs
+ * RETURN: True if everything was written, false on a write error.
+ */
+bool write_all (int fd, struct iovec* iov, int iovcnt) {
+	while (iovcnt > 0) {
+		const ssize_t written = writev(fd, iov, iovcnt);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		size_t remaining = written;
+		while (iovcnt > 0 && remaining >= iov->iov_len) {
+			remaining -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (unsigned char*) iov->iov_base + remaining;
+			iov->iov_len -= remaining;
+		}
+	}
+	return true;
+}
+
+/*
+ * PURPOSE: Read exactly len bytes at offset, resuming after short reads
+ * INPUTS: file descriptor, buffer, length, file offset
+ * RETURN: True if everything was read, false on an error or end of file.
+ */
+bool read_all (int fd, void* buf, size_t len, off_t offset) {
+	unsigned char *p = buf;
+	while (len > 0) {
+		const ssize_t got = pread(fd, p, len, offset);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got <= 0) {
+			return false;
+		}
+		p += got;
+		len -= got;
+		offset += got;
+	}
+	return true;
+}
+
+/*
+ * PURPOSE: Read and validate the header and chunk table of a container
+ * INPUTS: file descriptor, header to fill, where to store the table
+ * RETURN: True if both are intact, false if not.  The caller frees the
+ *         table.
+ */
+bool read_header (int fd, Format_Header_t* header, Format_Chunk_t** table) {
+	if (!read_all(fd, header, sizeof(Format_Header_t), 0)) {
+		fprintf(command_output(), "FAILED TO READ MATRIX HEADER\n");
+		return false;
+	}
+	if (!check_header(header)) {
+		return false;
+	}
+
+	const size_t table_len = header->num_chunks * sizeof(Format_Chunk_t);
+	*table = malloc(table_len ? table_len : 1);
+	if (!*table) {
+		return false;
+	}
+	if (!read_all(fd, *table, table_len, sizeof(Format_Header_t))
+		|| format_crc32c(0, *table, table_len) != header->table_crc) {
+		fprintf(command_output(), "BAD MATRIX CHUNK TABLE\n");
+		free(*table);
+		*table = NULL;
+		return false;
+	}
+	const size_t elem_size = type_size(header->elem_type);
+	const size_t chunk_bytes = (size_t) header->chunk_elems * elem_size;
+	for (size_t c = 0; c < header->num_chunks; ++c) {
+		const Format_Chunk_t *chunk = &(*table)[c];
+		if (chunk->codec > FORMAT_CODEC_SPARSE || chunk->stored_len > chunk_bytes
+			|| (chunk->codec == FORMAT_CODEC_RAW
+			&& chunk->stored_len != chunk_elems(header, c) * elem_size)
+			|| (chunk->codec == FORMAT_CODEC_SPARSE && (header->elem_type != MATRIX_U32
+			|| chunk->stored_len < sizeof(unsigned int) || chunk->stored_len % sizeof(unsigned int)))) {
+			fprintf(command_output(), "BAD MATRIX CHUNK TABLE\n");
+			free(*table);
+			*table = NULL;
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * PURPOSE: Validate the fixed fields of a container header.  A version 1
+ *          header is rewritten in the current layout, as a u32 matrix.
+ * INPUTS: header
+ * RETURN: True if the header is intact and describes a matrix this build
+ *         can read, false if not.
+ */
+bool check_header (Format_Header_t* header) {
+	if (!format_is_container(header->magic, sizeof(header->magic))) {
+		fprintf(command_output(), "BAD MATRIX HEADER\n");
+		return false;
+	}
+	if (header->endian != FORMAT_ENDIAN_MARK) {
+		fprintf(command_output(), "MATRIX FILE HAS THE WRONG BYTE ORDER\n");
+		return false;
+	}
+	if (header->version != FORMAT_VERSION && header->version != 1) {
+		fprintf(command_output(), "UNSUPPORTED MATRIX FILE VERSION %u\n", header->version);
+		return false;
+	}
+	Format_Header_t copy = *header;
+	copy.header_crc = 0;
+	if (format_crc32c(0, &copy, sizeof(copy)) != header->header_crc) {
+		fprintf(command_output(), "BAD MATRIX HEADER\n");
+		return false;
+	}
+	if (header->version == 1) {
+		/* the name started where elem_type is now */
+		char name[sizeof(header->name) + 1];
+		memcpy(name, (const char*) header + offsetof(Format_Header_t, elem_type), sizeof(name));
+		if (!memchr(name, '\0', sizeof(header->name))) {
+			fprintf(command_output(), "BAD MATRIX HEADER\n");
+			return false;
+		}
+		memcpy(header->name, name, sizeof(header->name));
+		header->elem_type = MATRIX_U32;
+	}
+	const size_t count = (size_t) header->rows * header->cols;
+	if (header->chunk_elems == 0 || header->chunk_elems > FORMAT_CHUNK_ELEMS * 16
+		|| header->num_chunks != (count + header->chunk_elems - 1) / header->chunk_elems
+		|| header->elem_type >= MATRIX_NUM_TYPES
+		|| !memchr(header->name, '\0', sizeof(header->name))
+		|| strlen(header->name) + 1 > MATRIX_NAME_LEN) {
+		fprintf(command_output(), "BAD MATRIX HEADER\n");
+		return false;
+	}
+	return true;
+}
+
+/*
+ * PURPOSE: Number of elements in a chunk, the last one may be short
+ * INPUTS: header, chunk index
+ * RETURN: element count
+ */
+size_t chunk_elems (const Format_Header_t* header, size_t chunk) {
+	const size_t count = (size_t) header->rows * header->cols;
+	const size_t first = chunk * header->chunk_elems;
+	return (count - first < header->chunk_elems) ? count - first : header->chunk_elems;
+}
+
+/*
+ * PURPOSE: Offset of the first chunk, past the header and the table
+ * INPUTS: number of chunks
+ * RETURN: offset rounded up to FORMAT_DATA_ALIGN
+ */
+size_t data_start (size_t num_chunks) {
+	const size_t end = sizeof(Format_Header_t) + num_chunks * sizeof(Format_Chunk_t);
+	return (end + FORMAT_DATA_ALIGN - 1) & ~(size_t) (FORMAT_DATA_ALIGN - 1);
+}
+
+/*
+ * PURPOSE: Validate the entries of a sparse chunk: positions ascending and
+ *          inside the chunk, values nonzero
+ * INPUTS: stored chunk, its length in bytes, elements in the chunk
+ * RETURN: True if the entries are valid, false if not.
+ */
+bool check_sparse_chunk (const unsigned int* stored, size_t len, size_t n) {
+	const size_t k = stored[0];
+	if (len != (1 + 2 * k) * sizeof(unsigned int)) {
+		return false;
+	}
+	const unsigned int *pos = &stored[1];
+	const unsigned int *values = &stored[1 + k];
+	for (size_t e = 0; e < k; ++e) {
+		if (pos[e] >= n || (e > 0 && pos[e] <= pos[e - 1]) || !values[e]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * PURPOSE: Read a range of a file whose chunks are all sparse straight
+ *          into CSR storage.  Entries are appended in file order, which is
+ *          row order, so memory and time only grow with the nonzeros.
+ * INPUTS: file descriptor, header, chunk table, element range to read,
+ *         sparse matrix of the size of the range
+ * RETURN: True if successful, false if the file is damaged or unreadable.
+ */
+bool read_sparse (int fd, const Format_Header_t* header, const Format_Chunk_t* table,
+	size_t begin, size_t end, Matrix_t* m) {
+	const size_t first_chunk = begin / header->chunk_elems;
+	const size_t last_chunk = (end + header->chunk_elems - 1) / header->chunk_elems;
+	size_t capacity = 0;
+	for (size_t c = first_chunk; c < last_chunk; ++c) {
+		capacity += (table[c].stored_len / sizeof(unsigned int) - 1) / 2;
+	}
+	if (capacity > UINT_MAX) {
+		return false;
+	}
+	Matrix_Sparse_t *s = sparse_alloc(m->rows, capacity);
+	unsigned int *stored = malloc((size_t) header->chunk_elems * sizeof(unsigned int));
+	bool ok = s && stored;
+
+	size_t nnz = 0;
+	for (size_t c = first_chunk; ok && c < last_chunk; ++c) {
+		const Format_Chunk_t *chunk = &table[c];
+		if (!read_all(fd, stored, chunk->stored_len, chunk->offset)) {
+			fprintf(command_output(), "FAILED TO READ MATRIX DATA\n");
+			ok = false;
+		}
+		else if (format_crc32c(0, stored, chunk->stored_len) != chunk->crc) {
+			fprintf(command_output(), "MATRIX CHUNK %zu FAILED ITS CHECKSUM\n", c);
+			ok = false;
+		}
+		else if (!check_sparse_chunk(stored, chunk->stored_len, chunk_elems(header, c))) {
+			fprintf(command_output(), "MATRIX CHUNK %zu IS CORRUPT\n", c);
+			ok = false;
+		}
+		const size_t k = ok ? stored[0] : 0;
+		for (size_t e = 0; e < k; ++e) {
+			const size_t idx = c * header->chunk_elems + stored[1 + e];
+			if (idx < begin || idx >= end) {
+				continue;
+			}
+			s->row_ptr[(idx - begin) / m->cols + 1]++;
+			s->col_idx[nnz] = (idx - begin) % m->cols;
+			s->values[nnz] = stored[1 + k + e];
+			nnz++;
+		}
+	}
+	free(stored);
+	if (!ok) {
+		sparse_free(&s, m->rows);
+		return false;
+	}
+
+	for (size_t i = 0; i < m->rows; ++i) {
+		s->row_ptr[i + 1] += s->row_ptr[i];
+	}
+	s->nnz = nnz;
+	sparse_free(&m->sparse, m->rows);
+	m->sparse = s;
+	return true;
+}
+
+/*
+ * PURPOSE: Checksum and compress a range of the chunks of a group, run by
+ *          parallel_for_weighted
+ * INPUTS: Write_Task_t, first and one past the last chunk of the range
+ * RETURN: none.  The table entries and the group buffers are filled.
+ */
+void write_range (void* ctx, size_t begin, size_t end) {
+	const Write_Task_t *task = ctx;
+	const size_t count = (size_t) task->m->rows * task->m->cols;
+	const size_t elem_size = type_size(task->m->type);
+	for (size_t i = begin; i < end; ++i) {
+		const size_t c = task->first + i;
+		const size_t first = c * FORMAT_CHUNK_ELEMS;
+		const size_t n = (count - first < FORMAT_CHUNK_ELEMS) ? count - first : FORMAT_CHUNK_ELEMS;
+		const size_t bytes = n * elem_size;
+		const unsigned char *src = task->m->sparse ? NULL : (const unsigned char*) task->m->elems + first * elem_size;
+		Format_Chunk_t *chunk = &task->table[c];
+
+		if (task->m->sparse) {
+			/* count, positions and values take no more room than n values
+			 * while there are at most (n - 1) / 2 entries */
+			unsigned int *stored = (unsigned int*) &task->buffers[i * task->chunk_bytes];
+			unsigned int *values = (unsigned int*) &task->scratch[i * task->chunk_bytes];
+			const size_t cap = (n - 1) / 2;
+			const size_t k = sparse_gather(task->m, first, n, &stored[1], values, cap);
+			if (k != SPARSE_TOO_MANY) {
+				stored[0] = k;
+				memcpy(&stored[1 + k], values, k * sizeof(unsigned int));
+				chunk->codec = FORMAT_CODEC_SPARSE;
+				chunk->stored_len = (1 + 2 * k) * sizeof(unsigned int);
+				chunk->crc = format_crc32c(0, stored, chunk->stored_len);
+				continue;
+			}
+			sparse_expand(task->m, first, n, values);
+			src = (const unsigned char*) values;
+		}
+
+		chunk->crc = format_crc32c(0, src, bytes);
+		chunk->codec = FORMAT_CODEC_RAW;
+		chunk->stored_len = bytes;
+		if (task->compress) {
+			/* only worth keeping if it saves space */
+			const size_t packed = lz_compress(src, bytes, &task->buffers[i * task->chunk_bytes], bytes - 1);
+			if (packed) {
+				chunk->codec = FORMAT_CODEC_LZ;
+				chunk->stored_len = packed;
+			}
+		}
+	}
+}
+
+/*
+ * PURPOSE: Decode and verify a range of the chunks of a group and copy
+ *          the requested part of each into the matrix, run by
+ *          parallel_for_weighted
+ * INPUTS: Read_Task_t, first and one past the last chunk of the range
+ * RETURN: none.  The matrix data is filled or the failed flag is set.
+ */
+void read_range (void* ctx, size_t begin, size_t end) {
+	Read_Task_t *task = ctx;
+	const size_t elem_size = type_size(task->m->type);
+	unsigned char *data = task->m->elems;
+	for (size_t i = begin; i < end; ++i) {
+		const size_t c = task->first + i;
+		const Format_Chunk_t *chunk = &task->table[c];
+		const size_t c_begin = c * task->header->chunk_elems;
+		const size_t n = chunk_elems(task->header, c);
+		const size_t bytes = n * elem_size;
+		const bool whole = c_begin >= task->begin && c_begin + n <= task->end;
+		unsigned char *stored = &task->stored[i * task->chunk_bytes];
+		unsigned char *dst = whole ? &data[(c_begin - task->begin) * elem_size]
+			: &task->decoded[i * task->chunk_bytes];
+
+		if (chunk->codec == FORMAT_CODEC_SPARSE) {
+			const unsigned int *entries = (const unsigned int*) stored;
+			if (format_crc32c(0, stored, chunk->stored_len) != chunk->crc) {
+				fprintf(task->out, "MATRIX CHUNK %zu FAILED ITS CHECKSUM\n", c);
+				__atomic_store_n(&task->failed, 1, __ATOMIC_RELAXED);
+				continue;
+			}
+			if (!check_sparse_chunk(entries, chunk->stored_len, n)) {
+				fprintf(task->out, "MATRIX CHUNK %zu IS CORRUPT\n", c);
+				__atomic_store_n(&task->failed, 1, __ATOMIC_RELAXED);
+				continue;
+			}
+			unsigned int *out = (unsigned int*) dst;
+			memset(out, 0, bytes);
+			for (size_t e = 0; e < entries[0]; ++e) {
+				out[entries[1 + e]] = entries[1 + entries[0] + e];
+			}
+		}
+		else {
+			if (chunk->codec == FORMAT_CODEC_RAW) {
+				if (!whole) {
+					memcpy(dst, stored, bytes);
+				}
+			}
+			else if (lz_decompress(stored, chunk->stored_len, dst, bytes) != bytes) {
+				fprintf(task->out, "MATRIX CHUNK %zu IS CORRUPT\n", c);
+				__atomic_store_n(&task->failed, 1, __ATOMIC_RELAXED);
+				continue;
+			}
+			if (format_crc32c(0, dst, bytes) != chunk->crc) {
+				fprintf(task->out, "MATRIX CHUNK %zu FAILED ITS CHECKSUM\n", c);
+				__atomic_store_n(&task->failed, 1, __ATOMIC_RELAXED);
+				continue;
+			}
+		}
+		if (!whole) {
+			const size_t from = (task->begin > c_begin) ? task->begin : c_begin;
+			const size_t to = (task->end < c_begin + n) ? task->end : c_begin + n;
+			memcpy(&data[(from - task->begin) * elem_size], &dst[(from - c_begin) * elem_size],
+				(to - from) * elem_size);
+		}
+	}
+}
+
+/*
+ * PURPOSE: Compress a buffer into the LZ4 block layout with a greedy
+ *          hash chain free matcher
+ * INPUTS: source, its length, destination, destination capacity
+ * RETURN: compressed length, 0 if it does not fit in cap
+ */
+size_t lz_compress (const unsigned char* src, size_t n, unsigned char* dst, size_t cap) {
+	unsigned int table[1 << LZ_HASH_BITS];
+	memset(table, 0, sizeof(table));
+	size_t anchor = 0;
+	size_t out = 0;
+
+	if (n > LZ_MFLIMIT) {
+		const size_t limit = n - LZ_MFLIMIT;
+		size_t i = 0;
+		while (i < limit) {
+			unsigned int seq;
+			memcpy(&seq, &src[i], sizeof(seq));
+			const unsigned int h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+			const size_t ref = table[h];
+			table[h] = i;
+			unsigned int cand;
+			memcpy(&cand, &src[ref], sizeof(cand));
+			if (ref >= i || i - ref > LZ_MAX_OFFSET || cand != seq) {
+				/* skip faster through data that does not compress */
+				i += 1 + ((i - anchor) >> 6);
+				continue;
+			}
+
+			const size_t max = n - LZ_LAST_LITERALS - i;
+			size_t len = LZ_MIN_MATCH;
+			while (len + 8 <= max) {
+				unsigned long long x, y;
+				memcpy(&x, &src[ref + len], sizeof(x));
+				memcpy(&y, &src[i + len], sizeof(y));
+				if (x != y) {
+					len += __builtin_ctzll(x ^ y) / 8;
+					break;
+				}
+				len += 8;
+			}
+			while (len < max && src[ref + len] == src[i + len]) {
+				++len;
+			}
+			if (!lz_emit(dst, cap, &out, &src[anchor], i - anchor, i - ref, len)) {
+				return 0;
+			}
+			i += len;
+			anchor = i;
+		}
+	}
+	if (!lz_emit(dst, cap, &out, &src[anchor], n - anchor, 0, 0)) {
+		return 0;
+	}
+	return out;
+}
+
+/*
+ * PURPOSE: Append one LZ4 sequence, literals followed by a match
+ * INPUTS: destination, its capacity, write position, literals, literal
+ *         count, match offset and length (0 for the final literals)
+ * RETURN: True if it fit, false if not.  out is advanced.
+ */
+bool lz_emit (unsigned char* dst, size_t cap, size_t* out, const unsigned char* lit,
+	size_t lit_len, size_t offset, size_t match_len) {
+	const size_t need = 1 + lit_len / 255 + 1 + lit_len + (match_len ? 2 + match_len / 255 + 1 : 0);
+	if (*out + need > cap) {
+		return false;
+	}
+
+	unsigned char *p = &dst[*out];
+	unsigned char *token = p++;
+	*token = (lit_len >= 15 ? 15 : lit_len) << 4;
+	if (lit_len >= 15) {
+		size_t rest = lit_len - 15;
+		for (; rest >= 255; rest -= 255) {
+			*p++ = 255;
+		}
+		*p++ = rest;
+	}
+	memcpy(p, lit, lit_len);
+	p += lit_len;
+
+	if (match_len) {
+		*p++ = offset & 0xFF;
+		*p++ = offset >> 8;
+		const size_t ml = match_len - LZ_MIN_MATCH;
+		*token |= (ml >= 15) ? 15 : ml;
+		if (ml >= 15) {
+			size_t rest = ml - 15;
+			for (; rest >= 255; rest -= 255) {
+				*p++ = 255;
+			}
+			*p++ = rest;
+		}
+	}
+	*out = p - dst;
+	return true;
+}
+
+/*
+ * PURPOSE: Decode an LZ4 block, checking every length against both
+ *          buffers so damaged input cannot write out of bounds
+ * INPUTS: compressed data, its length, destination, destination capacity
+ * RETURN: decoded length, (size_t) -1 if the input is malformed
+ */
+size_t lz_decompress (const unsigned char* src, size_t n, unsigned char* dst, size_t cap) {
+	size_t i = 0;
+	size_t o = 0;
+	while (i < n) {
+		const unsigned char token = src[i++];
+		size_t lit = token >> 4;
+		if (lit == 15) {
+			unsigned char b;
+			do {
+				if (i >= n) {
+					return (size_t) -1;
+				}
+				b = src[i++];
+				lit += b;
+			} while (b == 255);
+		}
+		if (lit > n - i || lit > cap - o) {
+			return (size_t) -1;
+		}
+		memcpy(&dst[o], &src[i], lit);
+		i += lit;
+		o += lit;
+		if (i == n) {
+			break;
+		}
+
+		if (n - i < 2) {
+			return (size_t) -1;
+		}
+		const size_t offset = src[i] | (size_t) src[i + 1] << 8;
+		i += 2;
+		size_t ml = token & 15;
+		if (ml == 15) {
+			unsigned char b;
+			do {
+				if (i >= n) {
+					return (size_t) -1;
+				}
+				b = src[i++];
+				ml += b;
+			} while (b == 255);
+		}
+		ml += LZ_MIN_MATCH;
+		if (offset == 0 || offset > o || ml > cap - o) {
+			return (size_t) -1;
+		}
+
+		/* the copied region repeats with period offset, so it can be
+		 * doubled from its start instead of going byte by byte */
+		const size_t from = o - offset;
+		while (ml > 0) {
+			const size_t step = (o - from < ml) ? o - from : ml;
+			memcpy(&dst[o], &dst[from], step);
+			o += step;
+			ml -= step;
+		}
+	}
+	return o;
+}
@@ -0,0 +1,55 @@
+#ifndef _FORMAT_H_
+#define _FORMAT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "matrix.h"
+
+#define FORMAT_MAGIC "MTXC"
+#define FORMAT_VERSION 2		/* 1 had no element type, its files are u32 */
+#define FORMAT_ENDIAN_MARK 0x01020304u
+#define FORMAT_CHUNK_ELEMS (1 << 16)	/* 256 KB of data per chunk */
+#define FORMAT_DATA_ALIGN 64		/* chunk data starts on a cache line */
+
+typedef enum {
+	FORMAT_CODEC_RAW = 0,
+	FORMAT_CODEC_LZ = 1,		/* LZ4 block layout, built in */
+	FORMAT_CODEC_SPARSE = 2		/* entry count, then positions, then values */
+}Format_Codec_t;
+
+/* Fixed size header at the start of a container file.  Fields are stored
+ * in the byte order of the writer, endian tells which one that was.  Chunks
+ * hold chunk_elems elements of elem_type each. */
+typedef struct {
+	char magic[4];
+	unsigned int version;
+	unsigned int endian;
+	unsigned int rows;
+	unsigned int cols;
+	unsigned int chunk_elems;
+	unsigned int num_chunks;
+	unsigned int table_crc;		/* CRC32C of the chunk table */
+	unsigned int header_crc;	/* CRC32C of the header with this field 0 */
+	unsigned char elem_type;	/* Matrix_Type_t */
+	char name[27];
+}Format_Header_t;
+
+/* Chunk table entry, the table follows the header */
+typedef struct {
+	unsigned long long offset;	/* from the start of the file */
+	unsigned int stored_len;	/* bytes on disk */
+	unsigned int codec;
+	unsigned int crc;		/* CRC32C of the decoded chunk, or of the stored
+					 * entries of a sparse chunk */
+	unsigned int reserved;
+}Format_Chunk_t;
+
+unsigned int format_crc32c (unsigned int crc, const void* data, size_t len);
+bool format_is_container (const void* head, size_t len);
+bool format_write (int fd, Matrix_t* m, bool compress);
+bool format_read_info (int fd, Format_Header_t* header);
+bool format_read (int fd, Matrix_t** m, unsigned int first_row, unsigned int num_rows);
+bool format_map_offset (const void* base, size_t len, Format_Header_t* header, size_t* data_offset);
+
+#endif
@@ -0,0 +1,404 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KERNELS_X86 1
+#endif
+
+#include "kernels.h"
+
+/*protected functions*/
+void scalar_add (const unsigned int* a, const unsigned int* b, unsigned int* c, size_t n);
+void scalar_shift_left (unsigned int* data, unsigned int shift, size_t n);
+void scalar_shift_right (unsigned int* data, unsigned int shift, size_t n);
+unsigned long long scalar_sum (const unsigned int* data, size_t n);
+bool scalar_equal (const unsigned int* a, const unsigned int* b, size_t n);
+void scalar_gemm (size_t k, const unsigned int* apack, const unsigned int* bpack, unsigned int* tile);
+void select_best_kernels (void);
+
+static const Matrix_Kernels_t scalar_kernels = {
+	"scalar", scalar_add, scalar_shift_left, scalar_shift_right, scalar_sum, scalar_equal,
+	scalar_gemm
+};
+
+#ifdef KERNELS_X86
+
+/* 
+ * The gemm micro kernel keeps one GEMM_NR wide row of the tile per
+ * accumulator and broadcasts a packed element of A into it.  The body is
+ * written once with vector extensions and compiled for each target.
+ */
+typedef unsigned int Gemm_Row_t __attribute__((vector_size(GEMM_NR * sizeof(unsigned int))));
+
+#define DEFINE_GEMM_KERNEL(fn, isa) \
+__attribute__((target(isa))) \
+void fn (size_t k, const unsigned int* apack, const unsigned int* bpack, unsigned int* tile) { \
+	Gemm_Row_t acc0 = {0}, acc1 = {0}, acc2 = {0}, acc3 = {0}; \
+	for (size_t p = 0; p < k; ++p) { \
+		Gemm_Row_t b; \
+		memcpy(&b, &bpack[p * GEMM_NR], sizeof(b)); \
+		acc0 += apack[p * GEMM_MR + 0] * b; \
+		acc1 += apack[p * GEMM_MR + 1] * b; \
+		acc2 += apack[p * GEMM_MR + 2] * b; \
+		acc3 += apack[p * GEMM_MR + 3] * b; \
+	} \
+	memcpy(&tile[0 * GEMM_NR], &acc0, sizeof(acc0)); \
+	memcpy(&tile[1 * GEMM_NR], &acc1, sizeof(acc1)); \
+	memcpy(&tile[2 * GEMM_NR], &acc2, sizeof(acc2)); \
+	memcpy(&tile[3 * GEMM_NR], &acc3, sizeof(acc3)); \
+}
+
+DEFINE_GEMM_KERNEL(sse4_gemm, "sse4.1")
+DEFINE_GEMM_KERNEL(avx2_gemm, "avx2")
+DEFINE_GEMM_KERNEL(avx512_gemm, "avx512f")
+
+/* 
+ * SSE4.1 kernels, 4 elements per vector.  The tails fall back to the
+ * scalar kernels.
+ */
+__attribute__((target("sse4.1")))
+void sse4_add (const unsigned int* a, const unsigned int* b, unsigned int* c, size_t n) {
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		const __m128i va = _mm_loadu_si128((const __m128i*) &a[i]);
+		const __m128i vb = _mm_loadu_si128((const __m128i*) &b[i]);
+		_mm_storeu_si128((__m128i*) &c[i], _mm_add_epi32(va, vb));
+	}
+	scalar_add(&a[i], &b[i], &c[i], n - i);
+}
+
+__attribute__((target("sse4.1")))
+void sse4_shift_left (unsigned int* data, unsigned int shift, size_t n) {
+	const __m128i count = _mm_cvtsi32_si128(shift);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		const __m128i v = _mm_loadu_si128((const __m128i*) &data[i]);
+		_mm_storeu_si128((__m128i*) &data[i], _mm_sll_epi32(v, count));
+	}
+	scalar_shift_left(&data[i], shift, n - i);
+}
+
+__attribute__((target("sse4.1")))
+void sse4_shift_right (unsigned int* data, unsigned int shift, size_t n) {
+	const __m128i count = _mm_cvtsi32_si128(shift);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		const __m128i v = _mm_loadu_si128((const __m128i*) &data[i]);
+		_mm_storeu_si128((__m128i*) &data[i], _mm_srl_epi32(v, count));
+	}
+	scalar_shift_right(&data[i], shift, n - i);
+}
+
+__attribute__((target("sse4.1")))
+unsigned long long sse4_sum (const unsigned int* data, size_t n) {
+	__m128i acc = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		const __m128i v = _mm_loadu_si128((const __m128i*) &data[i]);
+		acc = _mm_add_epi64(acc, _mm_cvtepu32_epi64(v));
+		acc = _mm_add_epi64(acc, _mm_cvtepu32_epi64(_mm_srli_si128(v, 8)));
+	}
+	unsigned long long lanes[2];
+	_mm_storeu_si128((__m128i*) lanes, acc);
+	return lanes[0] + lanes[1] + scalar_sum(&data[i], n - i);
+}
+
+__attribute__((target("sse4.1")))
+bool sse4_equal (const unsigned int* a, const unsigned int* b, size_t n) {
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		const __m128i va = _mm_loadu_si128((const __m128i*) &a[i]);
+		const __m128i vb = _mm_loadu_si128((const __m128i*) &b[i]);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(va, vb)) != 0xFFFF) {
+			return false;
+		}
+	}
+	return scalar_equal(&a[i], &b[i], n - i);
+}
+
+/* 
+ * AVX2 kernels, 8 elements per vector.
+ */
+__attribute__((target("avx2")))
+void avx2_add (const unsigned int* a, const unsigned int* b, unsigned int* c, size_t n) {
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		const __m256i va = _mm256_loadu_si256((const __m256i*) &a[i]);
+		const __m256i vb = _mm256_loadu_si256((const __m256i*) &b[i]);
+		_mm256_storeu_si256((__m256i*) &c[i], _mm256_add_epi32(va, vb));
+	}
+	scalar_add(&a[i], &b[i], &c[i], n - i);
+}
+
+__attribute__((target("avx2")))
+void avx2_shift_left (unsigned int* data, unsigned int shift, size_t n) {
+	const __m128i count = _mm_cvtsi32_si128(shift);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		const __m256i v = _mm256_loadu_si256((const __m256i*) &data[i]);
+		_mm256_storeu_si256((__m256i*) &data[i], _mm256_sll_epi32(v, count));
+	}
+	scalar_shift_left(&data[i], shift, n - i);
+}
+
+__attribute__((target("avx2")))
+void avx2_shift_right (unsigned int* data, unsigned int shift, size_t n) {
+	const __m128i count = _mm_cvtsi32_si128(shift);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		const __m256i v = _mm256_loadu_si256((const __m256i*) &data[i]);
+		_mm256_storeu_si256((__m256i*) &data[i], _mm256_srl_epi32(v, count));
+	}
+	scalar_shift_right(&data[i], shift, n - i);
+}
+
+__attribute__((target("avx2")))
+unsigned long long avx2_sum (const unsigned int* data, size_t n) {
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc = _mm256_setzero_si256();
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		const __m256i v = _mm256_loadu_si256((const __m256i*) &data[i]);
+		acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(v, zero));
+		acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(v, zero));
+	}
+	unsigned long long lanes[4];
+	_mm256_storeu_si256((__m256i*) lanes, acc);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + scalar_sum(&data[i], n - i);
+}
+
+__attribute__((target("avx2")))
+bool avx2_equal (const unsigned int* a, const unsigned int* b, size_t n) {
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		const __m256i va = _mm256_loadu_si256((const __m256i*) &a[i]);
+		const __m256i vb = _mm256_loadu_si256((const __m256i*) &b[i]);
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(va, vb)) != -1) {
+			return false;
+		}
+	}
+	return scalar_equal(&a[i], &b[i], n - i);
+}
+
+/* 
+ * AVX-512F kernels, 16 elements per vector.
+ */
+__attribute__((target("avx512f")))
+void avx512_add (const unsigned int* a, const unsigned int* b, unsigned int* c, size_t n) {
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		const __m512i va = _mm512_loadu_si512(&a[i]);
+		const __m512i vb = _mm512_loadu_si512(&b[i]);
+		_mm512_storeu_si512(&c[i], _mm512_add_epi32(va, vb));
+	}
+	scalar_add(&a[i], &b[i], &c[i], n - i);
+}
+
+__attribute__((target("avx512f")))
+void avx512_shift_left (unsigned int* data, unsigned int shift, size_t n) {
+	const __m128i count = _mm_cvtsi32_si128(shift);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		const __m512i v = _mm512_loadu_si512(&data[i]);
+		_mm512_storeu_si512(&data[i], _mm512_sll_epi32(v, count));
+	}
+	scalar_shift_left(&data[i], shift, n - i);
+}
+
+__attribute__((target("avx512f")))
+void avx512_shift_right (unsigned int* data, unsigned int shift, size_t n) {
+	const __m128i count = _mm_cvtsi32_si128(shift);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		const __m512i v = _mm512_loadu_si512(&data[i]);
+		_mm512_storeu_si512(&data[i], _mm512_srl_epi32(v, count));
+	}
+	scalar_shift_right(&data[i], shift, n - i);
+}
+
+__attribute__((target("avx512f")))
+unsigned long long avx512_sum (const unsigned int* data, size_t n) {
+	__m512i acc = _mm512_setzero_si512();
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		const __m512i v = _mm512_loadu_si512(&data[i]);
+		acc = _mm512_add_epi64(acc, _mm512_cvtepu32_epi64(_mm512_castsi512_si256(v)));
+		acc = _mm512_add_epi64(acc, _mm512_cvtepu32_epi64(_mm512_extracti64x4_epi64(v, 1)));
+	}
+	return _mm512_reduce_add_epi64(acc) + scalar_sum(&data[i], n - i);
+}
+
+__attribute__((target("avx512f")))
+bool avx512_equal (const unsigned int* a, const unsigned int* b, size_t n) {
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		const __m512i va = _mm512_loadu_si512(&a[i]);
+		const __m512i vb = _mm512_loadu_si512(&b[i]);
+		if (_mm512_cmpneq_epi32_mask(va, vb)) {
+			return false;
+		}
+	}
+	return scalar_equal(&a[i], &b[i], n - i);
+}
+
+static const Matrix_Kernels_t sse4_kernels = {
+	"sse4", sse4_add, sse4_shift_left, sse4_shift_right, sse4_sum, sse4_equal,
+	sse4_gemm
+};
+static const Matrix_Kernels_t avx2_kernels = {
+	"avx2", avx2_add, avx2_shift_left, avx2_shift_right, avx2_sum, avx2_equal,
+	avx2_gemm
+};
+static const Matrix_Kernels_t avx512_kernels = {
+	"avx512", avx512_add, avx512_shift_left, avx512_shift_right, avx512_sum, avx512_equal,
+	avx512_gemm
+};
+
+#endif
+
+/* read and switched with atomics, workers may be loading it while the
+ * command thread selects another table */
+static const Matrix_Kernels_t *active_kernels = &scalar_kernels;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+/* 
+ * PURPOSE: Get the kernels picked for this cpu, the first call runs the
+ *          cpuid based selection
+ * INPUTS: none
+ * RETURN: the active kernel table
+ */
+const Matrix_Kernels_t* matrix_kernels (void) {
+	pthread_once(&kernels_once, select_best_kernels);
+	return __atomic_load_n(&active_kernels, __ATOMIC_ACQUIRE);
+}
+
+/* 
+ * PURPOSE: Get the portable reference kernels
+ * INPUTS: none
+ * RETURN: the scalar kernel table
+ */
+const Matrix_Kernels_t* matrix_kernels_scalar (void) {
+	return &scalar_kernels;
+}
+
+/* 
+ * PURPOSE: Enumerate the kernel tables this cpu can run, scalar first
+ * INPUTS: index of the table
+ * RETURN: kernel table, NULL once index runs past the supported ones
+ */
+const Matrix_Kernels_t* matrix_kernels_available (unsigned int index) {
+	const Matrix_Kernels_t *supported[4];
+	unsigned int count = 0;
+	supported[count++] = &scalar_kernels;
+#ifdef KERNELS_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.1")) {
+		supported[count++] = &sse4_kernels;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		supported[count++] = &avx2_kernels;
+	}
+	if (__builtin_cpu_supports("avx512f")) {
+		supported[count++] = &avx512_kernels;
+	}
+#endif
+	return index < count ? supported[index] : NULL;
+}
+
+/* 
+ * PURPOSE: Force a kernel table by name, e.g. to compare against scalar
+ * INPUTS: kernel table name (scalar, sse4, avx2, avx512)
+ * RETURN: True if the table exists and this cpu supports it, false if not.
+ */
+bool matrix_kernels_select (const char* name) {
+	if (!name) {
+		return false;
+	}
+	pthread_once(&kernels_once, select_best_kernels);
+	const Matrix_Kernels_t *k = NULL;
+	for (unsigned int i = 0; (k = matrix_kernels_available(i)); ++i) {
+		if (strcmp(k->name, name) == 0) {
+			__atomic_store_n(&active_kernels, k, __ATOMIC_RELEASE);
+			return true;
+		}
+	}
+	return false;
+}
+
+/*Protected Functions in C*/
+
+/* 
+ * PURPOSE: Pick the widest kernel table this cpu supports
+ * INPUTS: none
+ * RETURN: none.  active_kernels is set.
+ */
+void select_best_kernels (void) {
+	const Matrix_Kernels_t *k = NULL;
+	const Matrix_Kernels_t *best = &scalar_kernels;
+	for (unsigned int i = 0; (k = matrix_kernels_available(i)); ++i) {
+		best = k;
+	}
+	__atomic_store_n(&active_kernels, best, __ATOMIC_RELEASE);
+}
+
+/* 
+ * Scalar reference kernels, also used for the tails of the vector ones.
+ */
+void scalar_add (const unsigned int* a, const unsigned int* b, unsigned int* c, size_t n) {
+	for (size_t i = 0; i < n; ++i) {
+		c[i] = a[i] + b[i];
+	}
+}
+
+void scalar_shift_left (unsigned int* data, unsigned int shift, size_t n) {
+	if (shift >= 32) {
+		memset(data, 0, n * sizeof(unsigned int));
+		return;
+	}
+	for (size_t i = 0; i < n; ++i) {
+		data[i] <<= shift;
+	}
+}
+
+void scalar_shift_right (unsigned int* data, unsigned int shift, size_t n) {
+	if (shift >= 32) {
+		memset(data, 0, n * sizeof(unsigned int));
+		return;
+	}
+	for (size_t i = 0; i < n; ++i) {
+		data[i] >>= shift;
+	}
+}
+
+unsigned long long scalar_sum (const unsigned int* data, size_t n) {
+	unsigned long long sum = 0;
+	for (size_t i = 0; i < n; ++i) {
+		sum += data[i];
+	}
+	return sum;
+}
+
+bool scalar_equal (const unsigned int* a, const unsigned int* b, size_t n) {
+	for (size_t i = 0; i < n; ++i) {
+		if (a[i] != b[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void scalar_gemm (size_t k, const unsigned int* apack, const unsigned int* bpack, unsigned int* tile) {
+	memset(tile, 0, sizeof(unsigned int) * GEMM_MR * GEMM_NR);
+	for (size_t p = 0; p < k; ++p) {
+		for (size_t r = 0; r < GEMM_MR; ++r) {
+			const unsigned int a = apack[p * GEMM_MR + r];
+			for (size_t j = 0; j < GEMM_NR; ++j) {
+				tile[r * GEMM_NR + j] += a * bpack[p * GEMM_NR + j];
+			}
+		}
+	}
+}
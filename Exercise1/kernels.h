@@ -0,0 +1,30 @@
+#ifndef _KERNELS_H_
+#define _KERNELS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Register block computed by one gemm micro kernel call */
+#define GEMM_MR 4
+#define GEMM_NR 16
+
+/* Flat element kernels over n unsigned ints.  Every implementation gives
+ * bit identical results to the scalar one (checked by make check).  Shifting
+ * by 32 or more gives 0. */
+typedef struct {
+	const char* name;
+	void (*add) (const unsigned int* a, const unsigned int* b, unsigned int* c, size_t n);
+	void (*shift_left) (unsigned int* data, unsigned int shift, size_t n);
+	void (*shift_right) (unsigned int* data, unsigned int shift, size_t n);
+	unsigned long long (*sum) (const unsigned int* data, size_t n);
+	bool (*equal) (const unsigned int* a, const unsigned int* b, size_t n);
+	/* tile[GEMM_MR x GEMM_NR] = apack[k x GEMM_MR]^T * bpack[k x GEMM_NR], wrapping */
+	void (*gemm) (size_t k, const unsigned int* apack, const unsigned int* bpack, unsigned int* tile);
+}Matrix_Kernels_t;
+
+const Matrix_Kernels_t* matrix_kernels (void);
+const Matrix_Kernels_t* matrix_kernels_scalar (void);
+const Matrix_Kernels_t* matrix_kernels_available (unsigned int index);
+bool matrix_kernels_select (const char* name);
+
+#endif
@@ -2,19 +2,35 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <stdint.h>
 #include <math.h>
 #include <stdbool.h>
 #include <time.h>
+#include <unistd.h>
 #include <readline/readline.h>
 
 #include "command.h"
 #include "matrix.h"
+#include "registry.h"
+#include "thread_pool.h"
+#include "kernels.h"
+#include "pool.h"
+#include "expr.h"
+#include "rng.h"
+#include "aio.h"
+#include "types.h"
+#include "stats.h"
+#include "server.h"
 
-void run_commands (Commands_t* cmd, Matrix_t** mats, unsigned int num_mats);
-unsigned int find_matrix_given_name (Matrix_t** mats, unsigned int num_mats, 
-			const char* target);
-
-void destroy_remaining_heap_allocations(Matrix_t **mats, unsigned int num_mats);
+void run_commands (Commands_t* cmd, Registry_t* reg);
+void execute_commands (Commands_t* cmd, Registry_t* reg);
+void run_interactive (Registry_t* reg);
+int run_script (const char* script_filename, Registry_t* reg);
+Matrix_t* find_matrix_given_name (Registry_t* reg, const char* target);
+bool add_matrix_to_registry (Registry_t* reg, Matrix_t* m);
+void print_matrix_summary (const Registry_Entry_t* entry, void* ctx);
+bool needs_evaluation (Commands_t* cmd);
+bool defer_command (Registry_t* reg, Matrix_t* a, Matrix_t* b);
 
 /* 
  * PURPOSE: Begin executuon of program, read and process user input, exit program
@@ -22,43 +38,113 @@ void destroy_remaining_heap_allocations(Matrix_t **mats, unsigned int num_mats);
  * RETURN: 0 for normal completion
  */
 int main (int argc, char **argv) {
-	srand(time(NULL));		
-	char *line = NULL;
-	Commands_t* cmd;
+	rng_set_seed(time(NULL));
+	const char *script_filename = NULL;
+	const char *serve_path = NULL;
+	const char *connect_path = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "f:s:c:")) != -1) {
+		if (opt == 'f') {
+			script_filename = optarg;
+		}
+		else if (opt == 's') {
+			serve_path = optarg;
+		}
+		else if (opt == 'c') {
+			connect_path = optarg;
+		}
+		else {
+			fprintf(stderr, "usage: %s [-f command_file|-] [-s socket | -c socket]\n", argv[0]);
+			return -1;
+		}
+	}
 
-	//Array of matrix pointers
-	Matrix_t *mats[10];
-	memset(&mats,0, sizeof(Matrix_t*) * 10); // IMPORTANT C FUNCTION TO LEARN
+	if (connect_path) {
+		FILE *input = NULL;
+		if (script_filename && strcmp(script_filename, "-") != 0) {
+			input = fopen(script_filename, "r");
+			if (!input) {
+				perror("FAILED TO OPEN SCRIPT");
+				return -1;
+			}
+		}
+		else if (script_filename) {
+			input = stdin;
+		}
+		const int status = server_client(connect_path, input);
+		if (input && input != stdin) {
+			fclose(input);
+		}
+		return status;
+	}
+
+	//Workspace of named matrices
+	Registry_t *reg = NULL;
+	if (!registry_create(&reg)) {
+		perror("PROGRAM FAILED TO INIT\n");
+		return -1;
+	}
 
 	Matrix_t *temp = NULL; 
-	if( !(create_matrix (&temp,"temp_mat", 5, 5)) || add_matrix_to_array(mats,temp, 10) == -1 ){
+	if( !(create_matrix (&temp,"temp_mat", 5, 5)) || !add_matrix_to_registry(reg,temp) ){
 		perror("PROGRAM FAILED TO INIT\n");			
 		return -1;
 	}
 
-	int mat_idx = find_matrix_given_name(mats,10,"temp_mat");
+	Matrix_t *temp_mat = find_matrix_given_name(reg,"temp_mat");
 
-	if (mat_idx < 0) {
+	if (!temp_mat) {
 		perror("PROGRAM FAILED TO INIT\n");
 		return -1;
 	}
 
-	random_matrix(mats[mat_idx], 10, 15);
+	random_matrix(temp_mat, 10, 15);
 
-	if( !write_matrix("temp_mat", mats[mat_idx])){
+	if( !write_matrix("temp_mat", temp_mat)){
 		perror("PROGRAM FAILED TO INIT\n");
 		return -1;
 	}
 
+	int status = 0;
+	if (script_filename) {
+		status = run_script(script_filename, reg);
+	}
+	if (serve_path && status == 0) {
+		status = server_run(serve_path, reg, run_commands) ? 0 : -1;
+	}
+	else if (!script_filename) {
+		run_interactive(reg);
+	}
+
+	aio_drain();
+	stats_trace_close();
+	lazy_discard(reg);
+	registry_destroy(&reg);
+	aio_shutdown();
+	thread_pool_destroy();
+	release_command_memory();
+	pool_release();
+	return status;	
+}
+
+/* 
+ * PURPOSE: Read and run commands from the user until exit
+ * INPUTS: Matrix registry
+ * RETURN: None.  The registry may be modified.
+ */
+void run_interactive (Registry_t* reg) {
+	char *line = NULL;
+	Commands_t* cmd = NULL;
+
 	line = readline("> ");
-	while (strncmp(line,"exit", strlen("exit")  + 1) != 0) {
+	while (line && strncmp(line,"exit", strlen("exit")  + 1) != 0) {
 		
 		if (!parse_user_input(line,&cmd)) {
 			printf("Failed at parsing command\n\n");
 		}
 		
-		if (cmd->num_cmds > 1) {	
-			run_commands(cmd,mats,10);
+		if (cmd && cmd->num_cmds > 0) {	
+			run_commands(cmd,reg);
 		}
 		if (line) {
 			free(line);
@@ -67,8 +153,75 @@ int main (int argc, char **argv) {
 		line = readline("> ");
 	}
 	free(line);
-	destroy_remaining_heap_allocations(mats,10);
-	return 0;	
+}
+
+/* 
+ * PURPOSE: Parse a whole command file, then run it without prompting and
+ *          report how long each command took on stderr
+ * INPUTS: command file name, - for stdin, Matrix registry
+ * RETURN: 0 if the script ran, -1 if it could not be read.
+ */
+int run_script (const char* script_filename, Registry_t* reg) {
+	FILE *input = stdin;
+	if (strcmp(script_filename, "-") != 0) {
+		input = fopen(script_filename, "r");
+		if (!input) {
+			perror("FAILED TO OPEN SCRIPT");
+			return -1;
+		}
+	}
+
+	Script_t *script = NULL;
+	const bool parsed = parse_script(input, &script);
+	if (input != stdin) {
+		fclose(input);
+	}
+	if (!parsed) {
+		printf("Failed at parsing script %s\n", script_filename);
+		return -1;
+	}
+
+	double total_ms = 0;
+	unsigned int i = 0;
+	for (; i < script->num_ops; ++i) {
+		Commands_t *op = &script->ops[i];
+		if (strncmp(op->cmds[0],"exit", strlen("exit") + 1) == 0) {
+			break;
+		}
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		run_commands(op, reg);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		fflush(stdout);
+
+		const double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+		total_ms += ms;
+		fprintf(stderr, "[%u] %s: %.3f ms\n", script->line_numbers[i], op->cmds[0], ms);
+	}
+	fprintf(stderr, "%u commands in %.3f ms\n", i, total_ms);
+	destroy_script(&script);
+	return 0;
+}
+
+/* 
+ * PURPOSE: To run the user-entered commands and record their wall time,
+ *          bytes touched, allocations and system calls (see stats.c)
+ * INPUTS: User inputted commands, Matrix registry
+ * RETURN: None.  Input parameters may be modified.
+ */
+void run_commands (Commands_t* cmd, Registry_t* reg) {
+	if( !cmd || !reg || cmd->num_cmds == 0 ){
+		return;
+	}
+	char line[STATS_LINE_LEN];
+	size_t len = 0;
+	line[0] = '\0';
+	for (unsigned int i = 0; i < cmd->num_cmds && len < sizeof(line); ++i) {
+		len += snprintf(&line[len], sizeof(line) - len, i ? " %s" : "%s", cmd->cmds[i]);
+	}
+	stats_begin(cmd->cmds[0], line);
+	execute_commands(cmd, reg);
+	stats_end();
 }
 
 /* 
@@ -76,195 +229,659 @@ int main (int argc, char **argv) {
  * INPUTS: User inputter commands, array of matrices, and the numebr of matrices
  * RETURN: None.  Input parameters may be modified.
  */
-void run_commands (Commands_t* cmd, Matrix_t** mats, unsigned int num_mats) {
-	if( !cmd || !mats || num_mats < 0){
+void execute_commands (Commands_t* cmd, Registry_t* reg) {
+	if( !cmd || !reg || cmd->num_cmds == 0 ){
+		return;
+	}
+	FILE *out = command_output();
+	registry_begin_command(reg);
+	aio_reap();
+	if (needs_evaluation(cmd) && !lazy_flush(reg)) {
+		fprintf(out, "Failure to evaluate deferred matrices\n");
 		return;
 	}
 
 	/*Parsing and calling of commands*/
 	if (strncmp(cmd->cmds[0],"display",strlen("display") + 1) == 0
-		&& cmd->num_cmds == 2) {
+		&& (cmd->num_cmds == 2 || cmd->num_cmds == 3)) {
 			/*find the requested matrix*/
-			int idx = find_matrix_given_name(mats,num_mats,cmd->cmds[1]);
-			if (idx >= 0) {
-				display_matrix (mats[idx]);
+			Matrix_t* m = find_matrix_given_name(reg,cmd->cmds[1]);
+			if (m && cmd->num_cmds == 3) {
+				display_matrix_corners (m, atoi(cmd->cmds[2]));
+			}
+			else if (m) {
+				display_matrix (m);
 			}
 			else {
-				printf("Matrix (%s) doesn't exist\n", cmd->cmds[1]);
+				fprintf(out, "Matrix (%s) doesn't exist\n", cmd->cmds[1]);
 				return;
 			}
 	}
 	else if (strncmp(cmd->cmds[0],"add",strlen("add") + 1) == 0
 		&& cmd->num_cmds == 4) {
-			int mat1_idx = find_matrix_given_name(mats,num_mats,cmd->cmds[1]);
-			int mat2_idx = find_matrix_given_name(mats,num_mats,cmd->cmds[2]);
-			if (mat1_idx >= 0 && mat2_idx >= 0) {
-				Matrix_t* c = NULL;
-				if( !create_matrix (&c, cmd->cmds[3], mats[mat1_idx]->rows, 
-						mats[mat1_idx]->cols)) {
-					printf("Failure to create the result Matrix (%s)\n", cmd->cmds[3]);
+			Matrix_t* mat1 = find_matrix_given_name(reg,cmd->cmds[1]);
+			Matrix_t* mat2 = find_matrix_given_name(reg,cmd->cmds[2]);
+			if (mat1 && mat2 && defer_command(reg, mat1, mat2)) {
+				if (!lazy_add(reg, mat1, mat2, cmd->cmds[3])) {
+					fprintf(out, "Failure to add %s with %s into %s\n", cmd->cmds[1], cmd->cmds[2], cmd->cmds[3]);
 					return;
 				}
-			
-				if( add_matrix_to_array(mats,c, num_mats) == -1 ){
+				fprintf(out, "Deferred add of %s with %s into %s\n", cmd->cmds[1], cmd->cmds[2], cmd->cmds[3]);
+			}
+			else if (mat1 && mat2) {
+				Matrix_t* c = NULL;
+				if( !create_typed_matrix (&c, cmd->cmds[3], mat1->rows, 
+						mat1->cols, mat1->type)) {
+					fprintf(out, "Failure to create the result Matrix (%s)\n", cmd->cmds[3]);
 					return;
 				}
 
-				if (! add_matrices(mats[mat1_idx], mats[mat2_idx],c) ) {
-					printf("Failure to add %s with %s into %s\n", mats[mat1_idx]->name, mats[mat2_idx]->name,c->name);
+				if (! add_matrices(mat1, mat2,c) ) {
+					fprintf(out, "Failure to add %s with %s into %s\n", mat1->name, mat2->name,c->name);
+					destroy_matrix(&c);
 					return;	
 				}
+
+				if( !add_matrix_to_registry(reg,c) ){
+					return;
+				}
 			}
 	}
+	else if (strncmp(cmd->cmds[0],"mult",strlen("mult") + 1) == 0
+		&& cmd->num_cmds == 4 && strlen(cmd->cmds[3]) + 1 <= MATRIX_NAME_LEN) {
+		Matrix_t* mat1 = find_matrix_given_name(reg,cmd->cmds[1]);
+		Matrix_t* mat2 = find_matrix_given_name(reg,cmd->cmds[2]);
+		if (!mat1 || !mat2) {
+			fprintf(out, "Mult Failed\n");
+			return;
+		}
+		Matrix_t* c = NULL;
+		if( !create_matrix (&c, cmd->cmds[3], mat1->rows, mat2->cols)) {
+			fprintf(out, "Failure to create the result Matrix (%s)\n", cmd->cmds[3]);
+			return;
+		}
+		if (! multiply_matrices(mat1, mat2, c) ) {
+			fprintf(out, "Failure to multiply %s with %s into %s\n", mat1->name, mat2->name, c->name);
+			destroy_matrix(&c);
+			return;
+		}
+		if( !add_matrix_to_registry(reg,c) ){
+			return;
+		}
+		fprintf(out, "Multiplied %s with %s into %s\n", cmd->cmds[1], cmd->cmds[2], cmd->cmds[3]);
+	}
+	else if (strncmp(cmd->cmds[0],"transpose",strlen("transpose") + 1) == 0
+		&& (cmd->num_cmds == 2 || (cmd->num_cmds == 3 && strlen(cmd->cmds[2]) + 1 <= MATRIX_NAME_LEN))) {
+		Matrix_t* mat1 = find_matrix_given_name(reg,cmd->cmds[1]);
+		if (!mat1) {
+			fprintf(out, "Matrix (%s) doesn't exist\n", cmd->cmds[1]);
+			return;
+		}
+		if (cmd->num_cmds == 2) {
+			if (!transpose_matrix_in_place(mat1)) {
+				fprintf(out, "Transpose Failed\n");
+				return;
+			}
+			fprintf(out, "Transposed %s in place\n", mat1->name);
+			return;
+		}
+		Matrix_t* c = NULL;
+		if( !create_typed_matrix (&c, cmd->cmds[2], mat1->cols, mat1->rows, mat1->type)) {
+			fprintf(out, "Failure to create the result Matrix (%s)\n", cmd->cmds[2]);
+			return;
+		}
+		if (! transpose_matrix(mat1, c) ) {
+			fprintf(out, "Failure to transpose %s into %s\n", mat1->name, c->name);
+			destroy_matrix(&c);
+			return;
+		}
+		if( !add_matrix_to_registry(reg,c) ){
+			return;
+		}
+		fprintf(out, "Transposed %s into %s\n", cmd->cmds[1], cmd->cmds[2]);
+	}
+	else if (strncmp(cmd->cmds[0],"sum",strlen("sum") + 1) == 0
+		&& cmd->num_cmds == 2) {
+		Matrix_t* mat1 = find_matrix_given_name(reg,cmd->cmds[1]);
+		if (mat1 && type_kernels(mat1->type)->is_real) {
+			double sum = 0;
+			if (!sum_matrix_real(mat1, &sum)) {
+				fprintf(out, "Sum Failed\n");
+				return;
+			}
+			fprintf(out, "Sum of (%s) = %g\n", mat1->name, sum);
+			return;
+		}
+		unsigned long long sum = 0;
+		if (!mat1 || !sum_matrix(mat1, &sum)) {
+			fprintf(out, "Sum Failed\n");
+			return;
+		}
+		fprintf(out, "Sum of (%s) = %llu\n", mat1->name, sum);
+	}
+	else if (strncmp(cmd->cmds[0],"sum",strlen("sum") + 1) == 0
+		&& cmd->num_cmds == 4 && strlen(cmd->cmds[3]) + 1 <= MATRIX_NAME_LEN) {
+		Matrix_t* mat1 = find_matrix_given_name(reg,cmd->cmds[1]);
+		const bool rows = strncmp(cmd->cmds[2],"rows",strlen("rows") + 1) == 0;
+		const bool cols = strncmp(cmd->cmds[2],"cols",strlen("cols") + 1) == 0;
+		if (!mat1 || (!rows && !cols)) {
+			fprintf(out, "Sum Failed\n");
+			return;
+		}
+		Matrix_t* result = NULL;
+		if( !create_typed_matrix (&result, cmd->cmds[3], rows ? mat1->rows : 1,
+				rows ? 1 : mat1->cols, MATRIX_U64)) {
+			fprintf(out, "Failure to create the result Matrix (%s)\n", cmd->cmds[3]);
+			return;
+		}
+		if (!(rows ? sum_matrix_rows(mat1, result) : sum_matrix_cols(mat1, result))) {
+			fprintf(out, "Sum Failed\n");
+			destroy_matrix(&result);
+			return;
+		}
+		if( !add_matrix_to_registry(reg,result) ){
+			return;
+		}
+		fprintf(out, "Summed the %s of (%s) into (%s)\n", cmd->cmds[2], cmd->cmds[1], cmd->cmds[3]);
+	}
 	else if (strncmp(cmd->cmds[0],"duplicate",strlen("duplicate") + 1) == 0
-		&& cmd->num_cmds == 3 && strlen(cmd->cmds[1]) + 1 <= MATRIX_NAME_LEN) {
-		int mat1_idx = find_matrix_given_name(mats,num_mats,cmd->cmds[1]);
-		if (mat1_idx >= 0 ) {
+		&& cmd->num_cmds == 3 && strlen(cmd->cmds[2]) + 1 <= MATRIX_NAME_LEN) {
+		Matrix_t* mat1 = find_matrix_given_name(reg,cmd->cmds[1]);
+		if (mat1 && defer_command(reg, mat1, NULL)) {
+			if (!lazy_duplicate(reg, mat1, cmd->cmds[2])) {
+				fprintf(out, "Duplication Failed\n");
+				return;
+			}
+			fprintf(out, "Deferred duplication of %s into %s\n", cmd->cmds[1], cmd->cmds[2]);
+		}
+		else if (mat1 ) {
 				Matrix_t* dup_mat = NULL;
-				if( !create_matrix (&dup_mat,cmd->cmds[2], mats[mat1_idx]->rows, 
-						mats[mat1_idx]->cols)) {
+				if( !share_matrix (&dup_mat,cmd->cmds[2], mat1) ){
 					return;
 				}
-				if( !(duplicate_matrix (mats[mat1_idx], dup_mat)) ){
+				if( !add_matrix_to_registry(reg,dup_mat) ){
 					return;
 				}
-				if( add_matrix_to_array(mats,dup_mat,num_mats) == -1 ){
-					return;
-				}
-				printf ("Duplication of %s into %s finished\n", mats[mat1_idx]->name, cmd->cmds[2]);
+				fprintf(out, "Duplication of %s into %s finished\n", cmd->cmds[1], cmd->cmds[2]);
 		}
 		else {
-			printf("Duplication Failed\n");
+			fprintf(out, "Duplication Failed\n");
 			return;
 		}
 	}
 	else if (strncmp(cmd->cmds[0],"equal",strlen("equal") + 1) == 0
-		&& cmd->num_cmds == 2) {
-			int mat1_idx = find_matrix_given_name(mats,num_mats,cmd->cmds[1]);
-			int mat2_idx = find_matrix_given_name(mats,num_mats,cmd->cmds[2]);
-			if (mat1_idx >= 0 && mat2_idx >= 0) {
-				if ( equal_matrices(mats[mat1_idx],mats[mat2_idx]) ) {
-					printf("SAME DATA IN BOTH\n");
+		&& cmd->num_cmds == 3) {
+			Matrix_t* mat1 = find_matrix_given_name(reg,cmd->cmds[1]);
+			Matrix_t* mat2 = find_matrix_given_name(reg,cmd->cmds[2]);
+			if (mat1 && mat2) {
+				if ( equal_matrices(mat1,mat2) ) {
+					fprintf(out, "SAME DATA IN BOTH\n");
 				}
 				else {
-					printf("DIFFERENT DATA IN BOTH\n");
+					fprintf(out, "DIFFERENT DATA IN BOTH\n");
 				}
 			}
 			else {
-				printf("Equal Failed\n");
+				fprintf(out, "Equal Failed\n");
 				return;
 			}
 	}
 	else if (strncmp(cmd->cmds[0],"shift",strlen("shift") + 1) == 0
 		&& cmd->num_cmds == 4) {
-		int mat1_idx = find_matrix_given_name(mats,num_mats,cmd->cmds[1]);
-		const int shift_value = atoi(cmd->cmds[3]);
-		if (mat1_idx >= 0 ) {
-			if( !(bitwise_shift_matrix(mats[mat1_idx],cmd->cmds[2][0], shift_value))){
+		Matrix_t* mat1 = find_matrix_given_name(reg,cmd->cmds[1]);
+		/*the count must be a plain number below the element width*/
+		char *end = NULL;
+		const long shift_value = strtol(cmd->cmds[3], &end, 10);
+		if (!mat1 || end == cmd->cmds[3] || *end != '\0' || shift_value < 0
+			|| shift_value >= (long) (type_size(mat1->type) * CHAR_BIT)) {
+			fprintf(out, "Shift Failed\n");
+			return;
+		}
+		if (defer_command(reg, mat1, NULL)) {
+			if (!lazy_shift(reg, mat1, cmd->cmds[2][0], shift_value)) {
+				fprintf(out, "Shift Failed\n");
 				return;
 			}
-			printf("Matrix (%s) has been shifted by %d\n", mats[mat1_idx]->name, shift_value);
+			fprintf(out, "Deferred shift of (%s) by %ld\n", cmd->cmds[1], shift_value);
 		}
 		else {
-			printf("Matrix shift failed\n");
-			return;
+			if( !(bitwise_shift_matrix(mat1,cmd->cmds[2][0], shift_value))){
+				fprintf(out, "Shift Failed\n");
+				return;
+			}
+			fprintf(out, "Matrix (%s) has been shifted by %ld\n", mat1->name, shift_value);
 		}
 
 	}
-	else if (strncmp(cmd->cmds[0],"read",strlen("read") + 1) == 0
+	else if (strncmp(cmd->cmds[0],"aread",strlen("aread") + 1) == 0
+		&& cmd->num_cmds == 2) {
+		Matrix_t* new_matrix = NULL;
+		if(! aio_read(cmd->cmds[1],&new_matrix)) {
+			fprintf(out, "Read Failed\n");
+			return;
+		}
+		if( !add_matrix_to_registry(reg,new_matrix) ){
+			return;
+		}
+		fprintf(out, "Matrix (%s) is being read from the filesystem\n", new_matrix->name);
+	}
+	else if (strncmp(cmd->cmds[0],"awrite",strlen("awrite") + 1) == 0
 		&& cmd->num_cmds == 2) {
+		Matrix_t* mat1 = find_matrix_given_name(reg,cmd->cmds[1]);
+		if (!mat1) {
+			fprintf(out, "Matrix (%s) doesn't exist\n", cmd->cmds[1]);
+			return;
+		}
+		if (!aio_write(mat1, MATRIX_WRITE_DEFAULT)) {
+			fprintf(out, "Write Failed\n");
+			return;
+		}
+		fprintf(out, "Matrix (%s) is being wrote out to the filesystem\n", mat1->name);
+	}
+	else if (strncmp(cmd->cmds[0],"wait",strlen("wait") + 1) == 0
+		&& cmd->num_cmds == 1) {
+		aio_drain();
+	}
+	else if (strncmp(cmd->cmds[0],"read",strlen("read") + 1) == 0
+		&& (cmd->num_cmds == 2 || cmd->num_cmds == 4)) {
+		aio_drain();
 		Matrix_t* new_matrix = NULL;
-		if(! read_matrix(cmd->cmds[1],&new_matrix)) {
-			printf("Read Failed\n");
+		const bool ok = (cmd->num_cmds == 4) ?
+			read_matrix_rows(cmd->cmds[1],&new_matrix,atoi(cmd->cmds[2]),atoi(cmd->cmds[3])) :
+			read_matrix(cmd->cmds[1],&new_matrix);
+		if(! ok) {
+			fprintf(out, "Read Failed\n");
 			return;
 		}	
 		
-		if( add_matrix_to_array(mats, new_matrix, num_mats) == -1 ){
+		if( !add_matrix_to_registry(reg,new_matrix) ){
 			return;
 		}
-		printf("Matrix (%s) is read from the filesystem\n", cmd->cmds[1]);	
+		fprintf(out, "Matrix (%s) is read from the filesystem\n", cmd->cmds[1]);
+	}
+	else if (strncmp(cmd->cmds[0],"map",strlen("map") + 1) == 0
+		&& (cmd->num_cmds == 2 || (cmd->num_cmds == 3
+		&& strncmp(cmd->cmds[2],"ro",strlen("ro") + 1) == 0))) {
+		aio_drain();
+		Matrix_t* new_matrix = NULL;
+		const Matrix_Map_Mode_t mode = (cmd->num_cmds == 3) ?
+			MATRIX_MAP_READ_ONLY : MATRIX_MAP_COPY_ON_WRITE;
+		if(! map_matrix(cmd->cmds[1],&new_matrix,mode)) {
+			fprintf(out, "Map Failed\n");
+			return;
+		}
+
+		if( !add_matrix_to_registry(reg,new_matrix) ){
+			return;
+		}
+		fprintf(out, "Matrix (%s) is mapped from the filesystem\n", cmd->cmds[1]);
 	}
 	else if (strncmp(cmd->cmds[0],"write",strlen("write") + 1) == 0
-		&& cmd->num_cmds == 2) {
-		int mat1_idx = find_matrix_given_name(mats,num_mats,cmd->cmds[1]);
-		if(! write_matrix(mats[mat1_idx]->name,mats[mat1_idx])) {
-			printf("Write Failed\n");
+		&& (cmd->num_cmds == 2 || cmd->num_cmds == 3)) {
+		Matrix_t* mat1 = find_matrix_given_name(reg,cmd->cmds[1]);
+		if (!mat1) {
+			fprintf(out, "Matrix (%s) doesn't exist\n", cmd->cmds[1]);
+			return;
+		}
+		unsigned int flags = MATRIX_WRITE_DEFAULT;
+		if (cmd->num_cmds == 3) {
+			if (strncmp(cmd->cmds[2],"sync",strlen("sync") + 1) == 0) {
+				flags = MATRIX_WRITE_SYNC;
+			}
+			else if (strncmp(cmd->cmds[2],"atomic",strlen("atomic") + 1) == 0) {
+				flags = MATRIX_WRITE_ATOMIC;
+			}
+			else if (strncmp(cmd->cmds[2],"compress",strlen("compress") + 1) == 0) {
+				flags = MATRIX_WRITE_COMPRESS;
+			}
+			else {
+				fprintf(out, "Unknown write mode (%s)\n", cmd->cmds[2]);
+				return;
+			}
+		}
+		aio_drain();
+		if(! write_matrix_with_flags(mat1->name,mat1,flags)) {
+			fprintf(out, "Write Failed\n");
 			return;
 		}
 		else {
-			printf("Matrix (%s) is wrote out to the filesystem\n", mats[mat1_idx]->name);
+			fprintf(out, "Matrix (%s) is wrote out to the filesystem\n", mat1->name);
 		}
 	}
+	else if (strncmp(cmd->cmds[0],"export",strlen("export") + 1) == 0
+		&& (cmd->num_cmds == 3 || cmd->num_cmds == 4)) {
+		Matrix_t* mat1 = find_matrix_given_name(reg,cmd->cmds[1]);
+		if (!mat1) {
+			fprintf(out, "Matrix (%s) doesn't exist\n", cmd->cmds[1]);
+			return;
+		}
+		char sep = ',';
+		if (cmd->num_cmds == 4) {
+			if (strncmp(cmd->cmds[3],"tsv",strlen("tsv") + 1) == 0) {
+				sep = '\t';
+			}
+			else if (strncmp(cmd->cmds[3],"csv",strlen("csv") + 1) != 0) {
+				fprintf(out, "Unknown export format (%s)\n", cmd->cmds[3]);
+				return;
+			}
+		}
+		if (!export_matrix(cmd->cmds[2], mat1, sep)) {
+			fprintf(out, "Export Failed\n");
+			return;
+		}
+		fprintf(out, "Matrix (%s) is exported to (%s)\n", mat1->name, cmd->cmds[2]);
+	}
+	else if (strncmp(cmd->cmds[0],"import",strlen("import") + 1) == 0
+		&& (cmd->num_cmds == 3 || cmd->num_cmds == 4) && strlen(cmd->cmds[2]) + 1 <= MATRIX_NAME_LEN) {
+		Matrix_Type_t type = MATRIX_U32;
+		if (cmd->num_cmds == 4 && !type_parse(cmd->cmds[3], &type)) {
+			fprintf(out, "Unknown element type (%s)\n", cmd->cmds[3]);
+			return;
+		}
+		Matrix_t* new_matrix = NULL;
+		if (!import_matrix(cmd->cmds[1], cmd->cmds[2], type, &new_matrix)) {
+			fprintf(out, "Import Failed\n");
+			return;
+		}
+		if( !add_matrix_to_registry(reg,new_matrix) ){
+			return;
+		}
+		fprintf(out, "Matrix (%s) is imported from (%s)\n", cmd->cmds[2], cmd->cmds[1]);
+	}
 	else if (strncmp(cmd->cmds[0], "create", strlen("create") + 1) == 0
-		&& strlen(cmd->cmds[1]) + 1 <= MATRIX_NAME_LEN && cmd->num_cmds == 4) {
+		&& (cmd->num_cmds == 4 || cmd->num_cmds == 5) && strlen(cmd->cmds[1]) + 1 <= MATRIX_NAME_LEN) {
 		Matrix_t* new_mat = NULL;
-		const unsigned int rows = atoi(cmd->cmds[2]);
-		const unsigned int cols = atoi(cmd->cmds[3]);
+		/*both sizes must be plain positive numbers that fit a dimension*/
+		char *rows_end = NULL;
+		char *cols_end = NULL;
+		const long long rows = strtoll(cmd->cmds[2], &rows_end, 10);
+		const long long cols = strtoll(cmd->cmds[3], &cols_end, 10);
+		if (rows_end == cmd->cmds[2] || *rows_end != '\0' || rows <= 0 || rows > UINT_MAX
+			|| cols_end == cmd->cmds[3] || *cols_end != '\0' || cols <= 0 || cols > UINT_MAX) {
+			fprintf(out, "Create Failed\n");
+			return;
+		}
+		Matrix_Type_t type = MATRIX_U32;
+		if (cmd->num_cmds == 5 && !type_parse(cmd->cmds[4], &type)) {
+			fprintf(out, "Unknown element type (%s)\n", cmd->cmds[4]);
+			return;
+		}
 
-		if( !(create_matrix(&new_mat,cmd->cmds[1],rows, cols))){
+		if( !(create_typed_matrix(&new_mat,cmd->cmds[1],rows, cols, type))){
+			fprintf(out, "Create Failed\n");
 			return;
 		}
-		if( add_matrix_to_array(mats,new_mat,num_mats) == -1 ){
+		if( !add_matrix_to_registry(reg,new_mat) ){
 			return;
 		}
-		printf("Created Matrix (%s,%u,%u)\n", new_mat->name, new_mat->rows, new_mat->cols);
+		fprintf(out, "Created Matrix (%s,%u,%u)\n", new_mat->name, new_mat->rows, new_mat->cols);
+	}
+	else if (strncmp(cmd->cmds[0], "convert", strlen("convert") + 1) == 0
+		&& cmd->num_cmds == 3) {
+		Matrix_t* mat1 = find_matrix_given_name(reg,cmd->cmds[1]);
+		Matrix_Type_t type = MATRIX_U32;
+		if (!type_parse(cmd->cmds[2], &type)) {
+			fprintf(out, "Unknown element type (%s)\n", cmd->cmds[2]);
+			return;
+		}
+		if (!mat1 || !convert_matrix(mat1, type)) {
+			fprintf(out, "Convert Failed\n");
+			return;
+		}
+		fprintf(out, "Matrix (%s) converted to %s\n", mat1->name, type_name(type));
 	}
 	else if (strncmp(cmd->cmds[0], "random", strlen("random") + 1) == 0
-		&& cmd->num_cmds == 4) {
-		int mat1_idx = find_matrix_given_name(mats,num_mats,cmd->cmds[1]);
-		if(mat1_idx == -1){
+		&& (cmd->num_cmds == 4 || cmd->num_cmds == 5)) {
+		Matrix_t* mat1 = find_matrix_given_name(reg,cmd->cmds[1]);
+		if(!mat1){
 			return;
 		}
 		const unsigned int start_range = atoi(cmd->cmds[2]);
 		const unsigned int end_range = atoi(cmd->cmds[3]);
-		if( !(random_matrix(mats[mat1_idx],start_range, end_range)) ){
+		const unsigned long long seed = (cmd->num_cmds == 5) ?
+			strtoull(cmd->cmds[4], NULL, 0) : rng_next_seed();
+		if( !(random_matrix_seeded(mat1,start_range, end_range, seed)) ){
 			return;
 		}
 
-		printf("Matrix (%s) is randomized between %u %u\n", mats[mat1_idx]->name, start_range, end_range);
+		fprintf(out, "Matrix (%s) is randomized between %u %u\n", mat1->name, start_range, end_range);
+	}
+	else if (strncmp(cmd->cmds[0], "delete", strlen("delete") + 1) == 0
+		&& cmd->num_cmds == 2) {
+		if (!registry_remove(reg, cmd->cmds[1])) {
+			fprintf(out, "Matrix (%s) doesn't exist\n", cmd->cmds[1]);
+			return;
+		}
+		fprintf(out, "Matrix (%s) deleted\n", cmd->cmds[1]);
+	}
+	else if (strncmp(cmd->cmds[0], "list", strlen("list") + 1) == 0
+		&& cmd->num_cmds == 1) {
+		registry_for_each(reg, print_matrix_summary, out);
+		fprintf(out, "%zu matrices\n", registry_count(reg));
+	}
+	else if (strncmp(cmd->cmds[0], "budget", strlen("budget") + 1) == 0
+		&& cmd->num_cmds == 2) {
+		/*a plain non negative number of MB whose byte count fits a size_t*/
+		char *end = NULL;
+		const unsigned long long megabytes = strtoull(cmd->cmds[1], &end, 10);
+		if (end == cmd->cmds[1] || *end != '\0' || cmd->cmds[1][0] == '-'
+			|| megabytes > (SIZE_MAX >> 20)) {
+			fprintf(out, "Budget Failed\n");
+			return;
+		}
+		registry_set_budget(reg, (size_t) megabytes << 20);
+		fprintf(out, "Matrix memory budget set to %llu MB\n", megabytes);
+	}
+	else if (strncmp(cmd->cmds[0], "cache", strlen("cache") + 1) == 0
+		&& cmd->num_cmds == 1) {
+		fprintf(out, "matrices %zu, resident %zu bytes, budget %zu bytes\n",
+			registry_count(reg), reg->resident_bytes, reg->budget);
+		fprintf(out, "hits %lu, misses %lu, spills %lu\n", reg->hits, reg->misses, reg->spills);
+	}
+	else if (strncmp(cmd->cmds[0], "allocs", strlen("allocs") + 1) == 0
+		&& cmd->num_cmds == 1) {
+		const Pool_Stats_t stats = pool_stats();
+		fprintf(out, "system allocs %lu, system frees %lu, pool hits %lu, arena allocs %lu\n",
+			stats.system_allocs, stats.system_frees, stats.pool_hits, stats.arena_allocs);
+		fprintf(out, "mapped allocs %lu, hugetlb allocs %lu, %s pages\n",
+			stats.mapped_allocs, stats.hugetlb_allocs, pool_pages_name(pool_get_pages()));
+	}
+	else if (strncmp(cmd->cmds[0], "pages", strlen("pages") + 1) == 0
+		&& cmd->num_cmds == 2) {
+		if (strncmp(cmd->cmds[1],"small",strlen("small") + 1) == 0) {
+			pool_set_pages(POOL_PAGES_SMALL);
+		}
+		else if (strncmp(cmd->cmds[1],"thp",strlen("thp") + 1) == 0) {
+			pool_set_pages(POOL_PAGES_THP);
+		}
+		else if (strncmp(cmd->cmds[1],"hugetlb",strlen("hugetlb") + 1) == 0) {
+			pool_set_pages(POOL_PAGES_HUGETLB);
+		}
+		else {
+			fprintf(out, "Unknown page policy (%s)\n", cmd->cmds[1]);
+			return;
+		}
+		fprintf(out, "New matrices use %s pages\n", pool_pages_name(pool_get_pages()));
+	}
+	else if (strncmp(cmd->cmds[0], "threads", strlen("threads") + 1) == 0
+		&& (cmd->num_cmds == 2 || cmd->num_cmds == 3)) {
+		const unsigned int threads = atoi(cmd->cmds[1]);
+		if (!thread_pool_set_threads(threads)) {
+			fprintf(out, "Invalid thread count (%s)\n", cmd->cmds[1]);
+			return;
+		}
+		if (cmd->num_cmds == 3) {
+			thread_pool_set_threshold(strtoul(cmd->cmds[2], NULL, 10));
+		}
+		fprintf(out, "Using %u threads for operations of at least %zu elements\n",
+			thread_pool_get_threads(), thread_pool_get_threshold());
+	}
+	else if (strncmp(cmd->cmds[0], "seed", strlen("seed") + 1) == 0
+		&& (cmd->num_cmds == 1 || cmd->num_cmds == 2)) {
+		if (cmd->num_cmds == 2) {
+			rng_set_seed(strtoull(cmd->cmds[1], NULL, 0));
+		}
+		fprintf(out, "Session seed is %llu\n", rng_get_seed());
+	}
+	else if (strncmp(cmd->cmds[0], "lazy", strlen("lazy") + 1) == 0
+		&& cmd->num_cmds == 2) {
+		const bool on = strncmp(cmd->cmds[1],"on",strlen("on") + 1) == 0;
+		if (!on && strncmp(cmd->cmds[1],"off",strlen("off") + 1) != 0) {
+			fprintf(out, "Unknown lazy mode (%s)\n", cmd->cmds[1]);
+			return;
+		}
+		lazy_set_enabled(reg, on);
+		fprintf(out, "Lazy evaluation %s\n", on ? "on" : "off");
+	}
+	else if (strncmp(cmd->cmds[0], "kernels", strlen("kernels") + 1) == 0
+		&& cmd->num_cmds == 2) {
+		if (!matrix_kernels_select(cmd->cmds[1])) {
+			fprintf(out, "Kernels (%s) are not supported, available:", cmd->cmds[1]);
+			const Matrix_Kernels_t *k = NULL;
+			for (unsigned int i = 0; (k = matrix_kernels_available(i)); ++i) {
+				fprintf(out, " %s", k->name);
+			}
+			fprintf(out, "\n");
+			return;
+		}
+		fprintf(out, "Using %s kernels\n", matrix_kernels()->name);
+	}
+	else if (strncmp(cmd->cmds[0], "stats", strlen("stats") + 1) == 0
+		&& (cmd->num_cmds == 1 || (cmd->num_cmds == 2
+		&& strncmp(cmd->cmds[1],"reset",strlen("reset") + 1) == 0))) {
+		if (cmd->num_cmds == 2) {
+			stats_reset();
+			fprintf(out, "Command stats reset\n");
+			return;
+		}
+		stats_print();
+	}
+	else if (strncmp(cmd->cmds[0], "trace", strlen("trace") + 1) == 0
+		&& cmd->num_cmds == 2) {
+		if (strncmp(cmd->cmds[1],"off",strlen("off") + 1) == 0) {
+			stats_trace_close();
+			fprintf(out, "Command trace off\n");
+			return;
+		}
+		if (!stats_trace_open(cmd->cmds[1])) {
+			fprintf(out, "Trace Failed\n");
+			return;
+		}
+		fprintf(out, "Tracing commands into (%s)\n", cmd->cmds[1]);
 	}
 	else {
-		printf("Not a command in this application\n");
+		fprintf(out, "Not a command in this application\n");
 	}
 
 }
 
 /* 
- * PURPOSE: To find a matrix with the given name in the matrix array
- * INPUTS: Matrix array, numbe rof matrices, name to search for
- * RETURN: Index of matrix if found.  -1 if not successful.
+ * PURPOSE: To find a matrix with the given name in the workspace
+ * INPUTS: Matrix registry, name to search for
+ * RETURN: The matrix if found.  NULL if not successful.
  */
-unsigned int find_matrix_given_name (Matrix_t** mats, unsigned int num_mats, const char* target) {
-	if( !mats || num_mats < 0 || !target ){
-		return -1;
+Matrix_t* find_matrix_given_name (Registry_t* reg, const char* target) {
+	if( !reg || !target ){
+		return NULL;
 	}
 
-	for (int i = 0; i < num_mats && mats[i] ; ++i) {
-		if (strncmp(mats[i]->name,target,strlen(mats[i]->name)) == 0) {
-			return i;
-		}
+	Matrix_t *m = registry_find(reg, target);
+	if (m && m->io && !aio_wait(m)) {
+		fprintf(command_output(), "Background read of (%s) failed\n", target);
+		registry_remove(reg, target);
+		return NULL;
 	}
-	return -1;
+	stats_touch_matrix(m);
+	return m;
 }
 
 /* 
- * PURPOSE: to destroy all matrices in matrix array
- * INPUTS: matrix array, size of matrix array
- * RETURN: none.  Matrix array should be freed.
+ * PURPOSE: To add a matrix to the workspace, replacing any matrix of the same name
+ * INPUTS: Matrix registry, matrix to add
+ * RETURN: True if successful.  False if not, the matrix is destroyed.
  */
-void destroy_remaining_heap_allocations(Matrix_t **mats, unsigned int num_mats) {
-	if(!mats || num_mats < 1){
-		return;
+bool add_matrix_to_registry (Registry_t* reg, Matrix_t* m) {
+	stats_touch_matrix(m);
+	if( !registry_insert(reg, m) ){
+		fprintf(command_output(), "Failure to store Matrix (%s)\n", m ? m->name : "");
+		destroy_matrix(&m);
+		return false;
 	}
+	return true;
+}
 
-	int i = 0;
-	Matrix_t *clr_ptr = NULL;
-	while( i < num_mats ){
-		clr_ptr = mats[i];
-		if( clr_ptr != NULL){
-			destroy_matrix(&clr_ptr);	
-		}
-		i ++;
+/* 
+ * PURPOSE: To print the name and dimensions of a matrix, used by list
+ * INPUTS: registry entry, output stream
+ * RETURN: none
+ */
+void print_matrix_summary (const Registry_Entry_t* entry, void* ctx) {
+	FILE *out = ctx;
+	if (entry->matrix && entry->matrix->io) {
+		fprintf(out, "%s (%u,%u) loading\n", entry->name, entry->matrix->rows, entry->matrix->cols);
+	}
+	else if (entry->matrix && entry->matrix->pending) {
+		fprintf(out, "%s (%u,%u) deferred\n", entry->name, entry->matrix->rows, entry->matrix->cols);
+	}
+	else if (entry->matrix && entry->matrix->sparse) {
+		fprintf(out, "%s (%u,%u) sparse, %u nonzero\n", entry->name, entry->matrix->rows, entry->matrix->cols,
+			entry->matrix->sparse->nnz);
+	}
+	else if (entry->matrix && entry->matrix->type != MATRIX_U32) {
+		fprintf(out, "%s (%u,%u) %s\n", entry->name, entry->matrix->rows, entry->matrix->cols,
+			type_name(entry->matrix->type));
+	}
+	else if (entry->matrix) {
+		fprintf(out, "%s (%u,%u)\n", entry->name, entry->matrix->rows, entry->matrix->cols);
+	}
+	else {
+		fprintf(out, "%s (%u,%u) spilled\n", entry->name, entry->rows, entry->cols);
+	}
+}
+
+/* 
+ * PURPOSE: Decide whether deferred matrices must be evaluated before a
+ *          command runs.  Only the commands lazy evaluation records and
+ *          the ones that do not look at matrix data can run without it.
+ * INPUTS: User inputted command
+ * RETURN: True if the workspace has to be flushed first.
+ */
+bool needs_evaluation (Commands_t* cmd) {
+	const char *name = cmd->cmds[0];
+	if (lazy_is_enabled()
+		&& ((strncmp(name,"add",strlen("add") + 1) == 0 && cmd->num_cmds == 4)
+		|| (strncmp(name,"shift",strlen("shift") + 1) == 0 && cmd->num_cmds == 4)
+		|| (strncmp(name,"duplicate",strlen("duplicate") + 1) == 0 && cmd->num_cmds == 3))) {
+		return false;
+	}
+	return strncmp(name,"list",strlen("list") + 1) != 0
+		&& strncmp(name,"cache",strlen("cache") + 1) != 0
+		&& strncmp(name,"allocs",strlen("allocs") + 1) != 0
+		&& strncmp(name,"pages",strlen("pages") + 1) != 0
+		&& strncmp(name,"threads",strlen("threads") + 1) != 0
+		&& strncmp(name,"kernels",strlen("kernels") + 1) != 0
+		&& strncmp(name,"seed",strlen("seed") + 1) != 0
+		&& strncmp(name,"stats",strlen("stats") + 1) != 0
+		&& strncmp(name,"trace",strlen("trace") + 1) != 0
+		&& strncmp(name,"wait",strlen("wait") + 1) != 0;
+}
+
+/* 
+ * PURPOSE: Decide whether a command lazy evaluation records is deferred.
+ *          Only commands on u32 matrices are, before any other runs the
+ *          deferred matrices are evaluated.
+ * INPUTS: Matrix registry, operands (b may be NULL)
+ * RETURN: True if the command should be deferred.
+ */
+bool defer_command (Registry_t* reg, Matrix_t* a, Matrix_t* b) {
+	if (!lazy_is_enabled()) {
+		return false;
+	}
+	if (a->type == MATRIX_U32 && (!b || b->type == MATRIX_U32)) {
+		return true;
+	}
+	if (!lazy_flush(reg)) {
+		fprintf(command_output(), "Failure to evaluate deferred matrices\n");
 	}
-	return;
+	return false;
 }
@@ -2,24 +2,162 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <limits.h>
 
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <errno.h>
 
 
 #include "matrix.h"
+#include "thread_pool.h"
+#include "kernels.h"
+#include "pool.h"
+#include "expr.h"
+#include "rng.h"
+#include "format.h"
+#include "aio.h"
+#include "sparse.h"
+#include "types.h"
+#include "text.h"
+#include "command.h"
 
 
 #define MAX_CMD_COUNT 50
 
+typedef struct {
+	const unsigned int* a;
+	const unsigned int* b;
+	unsigned int* c;
+}Add_Task_t;
+
+typedef struct {
+	unsigned int* data;
+	char direction;
+	unsigned int shift;
+}Shift_Task_t;
+
+typedef struct {
+	const Matrix_t* m;
+	unsigned long long* out;
+	unsigned long long total;
+}Sum_Task_t;
+
+typedef struct {
+	unsigned int* data;
+	unsigned long long seed;
+	unsigned int low;
+	unsigned int high;
+}Random_Task_t;
+
+/* Flat range of a matrix of any element type, for the operations that
+ * are not specialised for MATRIX_U32 */
+typedef struct {
+	const Type_Kernels_t* kernels;
+	const void* a;
+	const void* b;
+	void* c;
+	Matrix_Type_t src_type;		/* of a, for convert */
+	char direction;
+	unsigned int shift;
+	unsigned long long seed;
+	unsigned int low;
+	unsigned int high;
+	unsigned long long total;
+	size_t count;			/* elements, for the ranges of EQUAL_CHUNK chunks */
+	double* partials;		/* one per chunk, for real sums */
+	int differ;
+	int overflow;			/* set when an integer sum passes 64 bits */
+}Typed_Task_t;
+
+/* Elements compared and hashed per step of equal_matrices.  Fixed so the
+ * content hash does not depend on the thread count. */
+#define EQUAL_CHUNK (1 << 16)
+
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+
+typedef struct {
+	const unsigned int* a;
+	const unsigned int* b;
+	size_t count;
+	unsigned long long* chunk_hashes;
+	int differ;
+}Equal_Task_t;
+
+/* Transposes recurse on the longer side of a block until both sides fit
+ * TRANSPOSE_LEAF, whatever the cache sizes.  The parallel split is into
+ * TRANSPOSE_TILE row bands, and square in place transposes swap
+ * TRANSPOSE_TILE x TRANSPOSE_TILE tiles with their mirror tile. */
+#define TRANSPOSE_LEAF 32
+#define TRANSPOSE_TILE 64
+
+typedef struct {
+	const void* src;
+	void* dst;
+	size_t size;		/* bytes per element */
+	size_t rows;		/* of src */
+	size_t cols;
+}Transpose_Task_t;
+
+/* Pages of a new payload are first written at this stride (see alloc_payload) */
+#define TOUCH_STRIDE 4096
+
+typedef struct {
+	unsigned char* base;
+	size_t size;		/* bytes per element */
+}Touch_Task_t;
+
+/* Block of B packed for the gemm micro kernel, sized to stay in L2 */
+#define GEMM_KC 256
+#define GEMM_NC 512
+
+typedef struct {
+	const Matrix_t* a;
+	Matrix_t* c;
+	const unsigned int* bpack;
+	size_t pc;
+	size_t kc;
+	size_t jc;
+	size_t nc;
+}Gemm_Task_t;
+
 /*protected functions*/
-void load_matrix (Matrix_t* m, unsigned int* data);
+bool has_data (const Matrix_t* m);
+bool share_data (Matrix_t* src, Matrix_t* dest);
+void release_data (Matrix_t* m);
+bool unshare_matrix (Matrix_t* m);
+void add_range (void* ctx, size_t begin, size_t end);
+void shift_range (void* ctx, size_t begin, size_t end);
+void random_range (void* ctx, size_t begin, size_t end);
+void sum_range (void* ctx, size_t begin, size_t end);
+void sum_rows_range (void* ctx, size_t begin, size_t end);
+void sum_cols_range (void* ctx, size_t begin, size_t end);
+void pack_gemm_b (const Matrix_t* b, unsigned int* bpack, size_t pc, size_t kc, size_t jc, size_t nc);
+void gemm_range (void* ctx, size_t begin, size_t end);
+void equal_range (void* ctx, size_t begin, size_t end);
+unsigned long long hash_words (const unsigned int* data, size_t n, unsigned long long seed);
+void typed_add_range (void* ctx, size_t begin, size_t end);
+void typed_shift_range (void* ctx, size_t begin, size_t end);
+void typed_random_range (void* ctx, size_t begin, size_t end);
+void typed_sum_range (void* ctx, size_t begin, size_t end);
+void typed_sum_real_range (void* ctx, size_t begin, size_t end);
+void typed_equal_range (void* ctx, size_t begin, size_t end);
+void typed_convert_range (void* ctx, size_t begin, size_t end);
+void transpose_block (const Transpose_Task_t* task, size_t r0, size_t r1, size_t c0, size_t c1);
+void transpose_range (void* ctx, size_t begin, size_t end);
+void swap_tiles (const Transpose_Task_t* task, size_t i0, size_t i1, size_t j0, size_t j1);
+void transpose_square_range (void* ctx, size_t begin, size_t end);
+void* alloc_payload (size_t count, size_t size, bool zero);
+void touch_range (void* ctx, size_t begin, size_t end);
 
 /* 
- * PURPOSE: instantiates a new matrix with the passed name, rows, cols 
+ * PURPOSE: instantiates a new matrix with the passed name, rows, cols.
+ *          The matrix starts out as empty sparse storage, so nothing of
+ *          size rows * cols is allocated until dense data is written.
  * INPUTS: 
  *	name the name of the matrix limited to 50 characters 
  *  rows the number of rows the matrix
@@ -32,33 +170,87 @@ void load_matrix (Matrix_t* m, unsigned int* data);
 
 bool create_matrix (Matrix_t** new_matrix, const char* name, const unsigned int rows,
 						const unsigned int cols) {
+	return create_typed_matrix(new_matrix, name, rows, cols, MATRIX_U32);
+}
+
+/* 
+ * PURPOSE: instantiates a new zero filled matrix of an element type.  Only
+ *          MATRIX_U32 matrices start out sparse, the others are allocated
+ *          dense right away.
+ * INPUTS: new matrix, name, rows, cols, element type
+ * RETURN: True if successful, false if not.
+ */
+bool create_typed_matrix (Matrix_t** new_matrix, const char* name, const unsigned int rows,
+	const unsigned int cols, Matrix_Type_t type) {
 
-	if (!new_matrix || !name || rows < 0 || cols < 0) {
+	if (!new_matrix || !name || !type_kernels(type)) {
+		return false;
+	}
+	unsigned int len = strlen(name) + 1; 
+	if (len > MATRIX_NAME_LEN) {
+		return false;
+	}
+	/* the payload a dense matrix of this size needs must fit a size_t */
+	size_t bytes = 0;
+	if (__builtin_mul_overflow((size_t) rows, (size_t) cols, &bytes)
+		|| __builtin_mul_overflow(bytes, type_size(type), &bytes)) {
+		return false;
+	}
+	pool_free(*new_matrix, sizeof(Matrix_t));
+	*new_matrix = pool_alloc(sizeof(Matrix_t));
+	if (!*new_matrix) {
 		return false;
 	}
-	free(*new_matrix);
-	*new_matrix = calloc( 1, sizeof(Matrix_t) );
 
-	(*new_matrix)->data = calloc(rows * cols, sizeof(unsigned int));
-	if (!(*new_matrix)->data) {
-		free( (*new_matrix)->data);
-		free( (*new_matrix) );
+	if (type == MATRIX_U32) {
+		(*new_matrix)->sparse = sparse_alloc(rows, 0);
+	}
+	else {
+		(*new_matrix)->elems = alloc_payload((size_t) rows * cols, type_size(type), true);
+	}
+	if (!has_data(*new_matrix)) {
+		pool_free(*new_matrix, sizeof(Matrix_t));
+		*new_matrix = NULL;
 		return false;
 	}
+	(*new_matrix)->type = type;
 	(*new_matrix)->rows = rows;
 	(*new_matrix)->cols = cols;
-	unsigned int len = strlen(name) + 1; 
-	if (len > MATRIX_NAME_LEN) {
-		free( (*new_matrix)->data);
-		free( (*new_matrix) );
+	memcpy((*new_matrix)->name,name,len);
+	return true;
+}
+
+/* 
+ * PURPOSE: instantiates a new matrix with the passed name that shares the
+ *          data of src.  Nothing is copied until one of them is modified,
+ *          except sparse storage which is copied right away.
+ * INPUTS: new matrix, name of the new matrix, matrix to share
+ * RETURN: True if successful, false if not.
+ */
+bool share_matrix (Matrix_t** new_matrix, const char* name, Matrix_t* src) {
+	if (!new_matrix || !name || !has_data(src) || strlen(name) + 1 > MATRIX_NAME_LEN) {
+		return false;
+	}
+
+	Matrix_t *shared = pool_alloc(sizeof(Matrix_t));
+	if (!shared) {
+		return false;
+	}
+	memcpy(shared->name, name, strlen(name) + 1);
+	shared->rows = src->rows;
+	shared->cols = src->cols;
+	if (!share_data(src, shared)) {
+		pool_free(shared, sizeof(Matrix_t));
 		return false;
 	}
-	strncpy((*new_matrix)->name,name,len);
+
+	pool_free(*new_matrix, sizeof(Matrix_t));
+	*new_matrix = shared;
 	return true;
 }
 
 /* 
- * PURPOSE: Free data in a matrix
+ * PURPOSE: Free data in a matrix, or drop its deferred expression
  * INPUTS: Matrix array pointer
  * RETURN: Matrix may be modified.
  */
@@ -67,94 +259,414 @@ void destroy_matrix (Matrix_t** m) {
 		return;
 	}
 
-	free((*m)->data);
-	free(*m);
+	if ((*m)->io) {
+		aio_wait(*m);
+	}
+	expr_release((*m)->pending);
+	release_data(*m);
+	pool_free(*m, sizeof(Matrix_t));
 	*m = NULL;
 }
 
 
 /* 
- * PURPOSE: Check if two matrices are equal
+ * PURPOSE: Check if two matrices are equal.  Dimensions, shared data and
+ *          cached content hashes are checked first.  Otherwise the data is
+ *          compared in chunks across the thread pool, stopping once any
+ *          chunk differs, and a full match caches the hash on both.
+ *          Sparse matrices are compared by their entries, matrices of other
+ *          element types than u32 bit for bit without a hash.
  * INPUTS: two matrices
  * RETURN: True if matrices are equal, False if they are not equal.
  */
 bool equal_matrices (Matrix_t* a, Matrix_t* b) {	
-	if (!a || !b || !a->data || !b->data) {
+	if (!has_data(a) || !has_data(b)) {
 		return false;
 	}
-
-	int result = memcmp(a->data, b->data, sizeof(unsigned int) * a->rows * a->cols);
-	if (result == 0) {
+	if (a->rows != b->rows || a->cols != b->cols || a->type != b->type) {
+		return false;
+	}
+	if (a == b || (a->data && a->data == b->data)) {
 		return true;
 	}
-	return false;
+	if (a->hash_valid && b->hash_valid && a->hash != b->hash) {
+		return false;
+	}
+	if (a->sparse || b->sparse) {
+		return sparse_equal(a, b);
+	}
+
+	const size_t count = (size_t) a->rows * a->cols;
+	const size_t chunks = (count + EQUAL_CHUNK - 1) / EQUAL_CHUNK;
+	if (a->type != MATRIX_U32) {
+		Typed_Task_t task = { .kernels = type_kernels(a->type), .a = a->elems, .b = b->elems, .count = count };
+		parallel_for_weighted(chunks, EQUAL_CHUNK, typed_equal_range, &task);
+		return !task.differ;
+	}
+	unsigned long long *chunk_hashes = malloc((chunks ? chunks : 1) * sizeof(unsigned long long));
+	if (!chunk_hashes) {
+		return matrix_kernels()->equal(a->data, b->data, count);
+	}
+	Equal_Task_t task = { a->data, b->data, count, chunk_hashes, 0 };
+	parallel_for_weighted(chunks, EQUAL_CHUNK, equal_range, &task);
+
+	if (!task.differ) {
+		const unsigned long long hash = hash_words((const unsigned int*) chunk_hashes,
+			chunks * 2, count);
+		a->hash = b->hash = hash;
+		a->hash_valid = b->hash_valid = true;
+	}
+	free(chunk_hashes);
+	return !task.differ;
 }
 
 /* 
- * PURPOSE: To duplicate a matrix's contents
- * INPUTS: original (src) matrix and new (dest) matrix
+ * PURPOSE: To duplicate a matrix's contents.  The old data of dest is
+ *          dropped and both matrices share the data of src until one of
+ *          them is modified.
+ * INPUTS: original (src) matrix and new (dest) matrix of the same size
  * RETURN: True if duplication successful, False if not.
  */
 bool duplicate_matrix (Matrix_t* src, Matrix_t* dest) {
-	if (!src || !dest || !src->data ) {
+	if (!has_data(src) || !dest || dest->read_only
+		|| src->rows != dest->rows || src->cols != dest->cols) {
 		return false;
 	}
-	/*
-	 * copy over data
-	 */
-	unsigned int bytesToCopy = sizeof(unsigned int) * src->rows * src->cols;
-	memcpy(dest->data,src->data, bytesToCopy);	
-	return equal_matrices (src,dest);
+	if (src == dest || (src->data && src->data == dest->data)) {
+		return true;
+	}
+
+	return share_data(src, dest);
 }
 
 /* 
- * PURPOSE: To shift each value in matrix with a user defined bitwise operation
- * INPUTS: matrix, direction of bitwise shift, and magnitude of shift
+ * PURPOSE: To shift each value in matrix with a user defined bitwise operation.
+ *          Sparse matrices only shift their stored values, real matrices
+ *          can't be shifted.
+ * INPUTS: matrix, direction of bitwise shift, and magnitude of shift,
+ *         which must be below the element width
  * RETURN: True if shift successful, False if unsucessful.  
  *		   Matrix may be modified.
  */
 bool bitwise_shift_matrix (Matrix_t* a, char direction, unsigned int shift) {
-	if (!a || ( direction != 'l' && direction != 'r' ) || shift < 0) {
+	if (!has_data(a) || a->read_only || ( direction != 'l' && direction != 'r' )
+		|| type_kernels(a->type)->is_real || shift >= type_size(a->type) * CHAR_BIT) {
+		return false;
+	}
+	if (a->sparse) {
+		sparse_shift(a, direction, shift);
+		a->hash_valid = false;
+		return fit_matrix_storage(a);
+	}
+	if (!unshare_matrix(a)) {
 		return false;
 	}
+	if (a->type != MATRIX_U32) {
+		Typed_Task_t task = { .kernels = type_kernels(a->type), .c = a->elems,
+			.direction = direction, .shift = shift };
+		parallel_for((size_t) a->rows * a->cols, typed_shift_range, &task);
+		return true;
+	}
 
-	if (direction == 'l') {
-		unsigned int i = 0;
-		for (; i < a->rows; ++i) {
-			unsigned int j = 0;
-			for (; j < a->cols; ++j) {
-				a->data[i * a->cols + j] = a->data[i * a->cols + j] << shift;
-			}
+	Shift_Task_t task = { a->data, direction, shift };
+	parallel_for((size_t) a->rows * a->cols, shift_range, &task);
+	return fit_matrix_storage(a);
+}
+
+/* 
+ * PURPOSE: Add contents of matrices a and b into matrix c.  Two sparse
+ *          matrices give a sparse sum, a sparse and a dense one only add
+ *          the stored entries onto the dense values.
+ * INPUTS: matrices a, b, and c, all of the same element type
+ * RETURN: False if unsucessful, True if sucessful.  Matrix c may be modified.
+ */
+bool add_matrices (Matrix_t* a, Matrix_t* b, Matrix_t* c) {
+	if ( !has_data(a) || !has_data(b) || !has_data(c) || c->read_only
+		|| a->rows != b->rows || a->cols != b->cols
+		|| a->rows != c->rows || a->cols != c->cols
+		|| a->type != b->type || a->type != c->type ) {
+		return false;
+	}
+	if (a->type != MATRIX_U32) {
+		if (!unshare_matrix(c)) {
+			return false;
+		}
+		Typed_Task_t task = { .kernels = type_kernels(a->type), .a = a->elems, .b = b->elems, .c = c->elems };
+		parallel_for((size_t) a->rows * a->cols, typed_add_range, &task);
+		return true;
+	}
+
+	if (a->sparse && b->sparse) {
+		Matrix_Sparse_t *sum = sparse_add(a, b);
+		if (!sum) {
+			return false;
 		}
+		release_data(c);
+		c->sparse = sum;
+		c->hash_valid = false;
+		return fit_matrix_storage(c);
 	}
-	else {
-		unsigned int i = 0;
-		for (; i < a->rows; ++i) {
-			unsigned int j = 0;
-			for (; j < a->cols; ++j) {
-				a->data[i * a->cols + j] = a->data[i * a->cols + j] >> shift;
-			}
+	/* c may be the sparse operand, it is dense from here on */
+	if (!unshare_matrix(c)) {
+		return false;
+	}
+	if (a->sparse || b->sparse) {
+		const Matrix_t *s = a->sparse ? a : b;
+		const Matrix_t *d = a->sparse ? b : a;
+		if (c->data != d->data) {
+			memcpy(c->data, d->data, (size_t) c->rows * c->cols * sizeof(unsigned int));
 		}
+		sparse_add_dense(s, c->data);
+		return fit_matrix_storage(c);
 	}
-	
+
+	Add_Task_t task = { a->data, b->data, c->data };
+	parallel_for((size_t) a->rows * a->cols, add_range, &task);
+	return fit_matrix_storage(c);
+}
+
+/* 
+ * PURPOSE: Sum every element of a matrix.  Each thread sums its range into
+ *          a 64 bit partial and the partials are combined at the end, so the
+ *          result is exact for matrices of fewer than 2^32 elements.  A u64
+ *          sum that passes 64 bits is reported instead of wrapping.  Only
+ *          integer matrices have an integer sum (see sum_matrix_real).
+ * INPUTS: matrix, where to store the sum
+ * RETURN: False if unsucessful, True if sucessful.
+ */
+bool sum_matrix (Matrix_t* m, unsigned long long* sum) {
+	if (!has_data(m) || !sum || type_kernels(m->type)->is_real) {
+		return false;
+	}
+	if (m->sparse) {
+		*sum = sparse_sum(m);
+		return true;
+	}
+	if (m->type != MATRIX_U32) {
+		Typed_Task_t task = { .kernels = type_kernels(m->type), .a = m->elems };
+		parallel_for((size_t) m->rows * m->cols, typed_sum_range, &task);
+		if (task.overflow) {
+			fprintf(command_output(), "SUM DOES NOT FIT 64 BITS\n");
+			return false;
+		}
+		*sum = task.total;
+		return true;
+	}
+
+	Sum_Task_t task = { m, NULL, 0 };
+	parallel_for((size_t) m->rows * m->cols, sum_range, &task);
+	*sum = task.total;
 	return true;
 }
 
 /* 
- * PURPOSE: Add contents of matrices a and b into matrix c
- * INPUTS: matrices a, b, and c
- * RETURN: False if unsucessful, True if sucessful.  Matrix c may be modified.
+ * PURPOSE: Sum every element of a matrix of any element type as a double.
+ *          Real matrices are summed in EQUAL_CHUNK sized partials added up
+ *          in order, so the result does not depend on the thread count.
+ * INPUTS: matrix, where to store the sum
+ * RETURN: False if unsucessful, True if sucessful.
  */
-bool add_matrices (Matrix_t* a, Matrix_t* b, Matrix_t* c) {
-	if ( !a || ( a->rows != b->rows && a->cols != b->cols )) {
+bool sum_matrix_real (Matrix_t* m, double* sum) {
+	if (!has_data(m) || !sum) {
+		return false;
+	}
+	if (!type_kernels(m->type)->is_real) {
+		unsigned long long total = 0;
+		if (!sum_matrix(m, &total)) {
+			return false;
+		}
+		*sum = (double) total;
+		return true;
+	}
+
+	const size_t count = (size_t) m->rows * m->cols;
+	const size_t chunks = (count + EQUAL_CHUNK - 1) / EQUAL_CHUNK;
+	double *partials = malloc((chunks ? chunks : 1) * sizeof(double));
+	if (!partials) {
+		return false;
+	}
+	Typed_Task_t task = { .kernels = type_kernels(m->type), .a = m->elems, .count = count,
+		.partials = partials };
+	parallel_for_weighted(chunks, EQUAL_CHUNK, typed_sum_real_range, &task);
+	*sum = 0;
+	for (size_t i = 0; i < chunks; ++i) {
+		*sum += partials[i];
+	}
+	free(partials);
+	return true;
+}
+
+/* 
+ * PURPOSE: Sum each row of a matrix into a column vector.  The sums are kept
+ *          in 64 bits so they can't wrap around.
+ * INPUTS: u32 matrix, u64 result matrix of m->rows x 1
+ * RETURN: False if unsucessful, True if sucessful.  Matrix result is modified.
+ */
+bool sum_matrix_rows (Matrix_t* m, Matrix_t* result) {
+	if (!has_data(m) || !has_data(result) || result->read_only
+		|| m->type != MATRIX_U32 || result->type != MATRIX_U64
+		|| result->rows != m->rows || result->cols != 1 || !unshare_matrix(result)) {
+		return false;
+	}
+	if (m->sparse) {
+		sparse_sum_rows(m, result->elems);
+		return true;
+	}
+
+	Sum_Task_t task = { m, result->elems, 0 };
+	parallel_for_weighted(m->rows, m->cols, sum_rows_range, &task);
+	return true;
+}
+
+/* 
+ * PURPOSE: Sum each column of a matrix into a row vector.  The sums are kept
+ *          in 64 bits so they can't wrap around.
+ * INPUTS: u32 matrix, u64 result matrix of 1 x m->cols
+ * RETURN: False if unsucessful, True if sucessful.  Matrix result is modified.
+ */
+bool sum_matrix_cols (Matrix_t* m, Matrix_t* result) {
+	if (!has_data(m) || !has_data(result) || result->read_only
+		|| m->type != MATRIX_U32 || result->type != MATRIX_U64
+		|| result->rows != 1 || result->cols != m->cols || !unshare_matrix(result)) {
+		return false;
+	}
+	if (m->sparse) {
+		sparse_sum_cols(m, result->elems);
+		return true;
+	}
+
+	Sum_Task_t task = { m, result->elems, 0 };
+	parallel_for_weighted(m->cols, m->rows, sum_cols_range, &task);
+	return true;
+}
+
+/* 
+ * PURPOSE: Multiply matrices a and b into matrix c.  B is packed one
+ *          GEMM_KC x GEMM_NC block at a time, row blocks of A are spread
+ *          over the thread pool and each GEMM_MR x GEMM_NR tile of c is
+ *          computed by the register blocked micro kernel.  Products and sums
+ *          wrap around like add_matrices does.  When a or b is sparse only
+ *          its nonzeros are multiplied (see sparse_multiply).
+ * INPUTS: u32 matrices a (n x k), b (k x m) and c (n x m), c must not be a or b
+ * RETURN: False if unsucessful, True if sucessful.  Matrix c is modified.
+ */
+bool multiply_matrices (Matrix_t* a, Matrix_t* b, Matrix_t* c) {
+	if ( !has_data(a) || !has_data(b) || !has_data(c) || c->read_only
+		|| a->type != MATRIX_U32 || b->type != MATRIX_U32 || c->type != MATRIX_U32
+		|| c == a || c == b || a->cols != b->rows || c->rows != a->rows || c->cols != b->cols
+		|| !unshare_matrix(c) || c->data == a->data || c->data == b->data ) {
+		return false;
+	}
+
+	memset(c->data, 0, (size_t) c->rows * c->cols * sizeof(unsigned int));
+	if (a->cols == 0 || c->rows == 0 || c->cols == 0) {
+		return fit_matrix_storage(c);
+	}
+	if (a->sparse || b->sparse) {
+		sparse_multiply(a, b, c);
+		return fit_matrix_storage(c);
+	}
+
+	unsigned int *bpack = NULL;
+	if (posix_memalign((void**) &bpack, 64, GEMM_KC * GEMM_NC * sizeof(unsigned int))) {
+		return false;
+	}
+
+	const size_t row_blocks = (a->rows + GEMM_MR - 1) / GEMM_MR;
+	for (size_t jc = 0; jc < b->cols; jc += GEMM_NC) {
+		const size_t nc = (b->cols - jc < GEMM_NC) ? b->cols - jc : GEMM_NC;
+		for (size_t pc = 0; pc < a->cols; pc += GEMM_KC) {
+			const size_t kc = (a->cols - pc < GEMM_KC) ? a->cols - pc : GEMM_KC;
+			pack_gemm_b(b, bpack, pc, kc, jc, nc);
+			Gemm_Task_t task = { a, c, bpack, pc, kc, jc, nc };
+			parallel_for_weighted(row_blocks, GEMM_MR * kc * nc, gemm_range, &task);
+		}
+	}
+
+	free(bpack);
+	return fit_matrix_storage(c);
+}
+
+/* 
+ * PURPOSE: Transpose matrix a into matrix b.  Row bands of a are spread
+ *          over the thread pool and each band is split in half recursively
+ *          (see transpose_block), so reads and writes both stay within
+ *          cache at every level without tuning for its size.  A sparse
+ *          matrix gives a sparse transpose (see sparse_transpose).
+ * INPUTS: matrices a (n x m) and b (m x n) of the same element type, b
+ *         must not be a
+ * RETURN: False if unsucessful, True if sucessful.  Matrix b is modified.
+ */
+bool transpose_matrix (Matrix_t* a, Matrix_t* b) {
+	if ( !has_data(a) || !has_data(b) || b->read_only || a == b || a->type != b->type
+		|| b->rows != a->cols || b->cols != a->rows ) {
+		return false;
+	}
+	if (a->sparse) {
+		Matrix_Sparse_t *t = sparse_transpose(a);
+		if (!t) {
+			return false;
+		}
+		release_data(b);
+		b->sparse = t;
+		b->hash_valid = false;
+		return fit_matrix_storage(b);
+	}
+	if (!reserve_matrix_storage(b) || b->elems == a->elems) {
 		return false;
 	}
 
-	for (int i = 0; i < a->rows; ++i) {
-		for (int j = 0; j < b->cols; ++j) {
-			c->data[i * a->cols +j] = a->data[i * a->cols + j] + b->data[i * a->cols + j];
+	Transpose_Task_t task = { a->elems, b->elems, type_size(a->type), a->rows, a->cols };
+	parallel_for_weighted((a->rows + TRANSPOSE_TILE - 1) / TRANSPOSE_TILE,
+		(size_t) TRANSPOSE_TILE * a->cols, transpose_range, &task);
+	return fit_matrix_storage(b);
+}
+
+/* 
+ * PURPOSE: Transpose a matrix in place.  Square matrices swap each tile
+ *          above the diagonal with its mirror tile below it, rows of tiles
+ *          spread over the thread pool.  Other shapes are transposed into a
+ *          new buffer that then replaces the data.
+ * INPUTS: matrix
+ * RETURN: False if unsucessful, True if sucessful.  Matrix m is modified.
+ */
+bool transpose_matrix_in_place (Matrix_t* m) {
+	if (!has_data(m) || m->read_only) {
+		return false;
+	}
+	const unsigned int rows = m->rows;
+	if (m->sparse) {
+		Matrix_Sparse_t *t = sparse_transpose(m);
+		if (!t) {
+			return false;
+		}
+		sparse_free(&m->sparse, rows);
+		m->sparse = t;
+	}
+	else if (m->rows == m->cols) {
+		if (!unshare_matrix(m)) {
+			return false;
+		}
+		Transpose_Task_t task = { m->elems, m->elems, type_size(m->type), m->rows, m->cols };
+		const size_t tiles = (m->rows + TRANSPOSE_TILE - 1) / TRANSPOSE_TILE;
+		/*tile row i is paired with tiles - 1 - i, so every item swaps as many tiles*/
+		parallel_for_weighted((tiles + 1) / 2, (size_t) TRANSPOSE_TILE * (tiles + 1) * TRANSPOSE_TILE,
+			transpose_square_range, &task);
+	}
+	else {
+		void *transposed = alloc_payload((size_t) m->rows * m->cols, type_size(m->type), false);
+		if (!transposed) {
+			return false;
 		}
+		Transpose_Task_t task = { m->elems, transposed, type_size(m->type), m->rows, m->cols };
+		parallel_for_weighted((m->rows + TRANSPOSE_TILE - 1) / TRANSPOSE_TILE,
+			(size_t) TRANSPOSE_TILE * m->cols, transpose_range, &task);
+		release_data(m);
+		m->elems = transposed;
 	}
+	m->rows = m->cols;
+	m->cols = rows;
+	m->hash_valid = false;
 	return true;
 }
 
@@ -164,24 +676,99 @@ bool add_matrices (Matrix_t* a, Matrix_t* b, Matrix_t* c) {
  * RETURN: none.  Matrix will be displayed to user.  Matrix will not be modified.
  */
 void display_matrix (Matrix_t* m) {
-	if (!m || !m->name || m->rows < 0 || m->cols < 0 || !m->data ) {
+	display_matrix_corners(m, 0);
+}
+
+/* 
+ * PURPOSE: Display a large matrix as a preview of its corners
+ * INPUTS: matrix, rows and columns shown at each edge (0 shows all)
+ * RETURN: none
+ */
+void display_matrix_corners (Matrix_t* m, unsigned int corner) {
+	if (!m || !has_data(m) ) {
 		return;
 	}
 
-	printf("\nMatrix Contents (%s):\n", m->name);
-	printf("DIM = (%u,%u)\n", m->rows, m->cols);
-	for (int i = 0; i < m->rows; ++i) {
-		for (int j = 0; j < m->cols; ++j) {
-			printf("%u ", m->data[i * m->cols + j]);
-		}
-		printf("\n");
+	FILE *out = command_output();
+	fprintf(out, "\nMatrix Contents (%s):\n", m->name);
+	fprintf(out, "DIM = (%u,%u)\n", m->rows, m->cols);
+	if (m->type != MATRIX_U32) {
+		fprintf(out, "TYPE = %s\n", type_name(m->type));
+	}
+	text_write_matrix(out, m, ' ', true, corner);
+	fprintf(out, "\n");
+}
+
+/* 
+ * PURPOSE: Export a matrix as delimited text, one row per line
+ * INPUTS: filename, matrix, separator (',' for CSV, '\t' for TSV)
+ * RETURN: False if the export is unsucessful.  True if it is successful.
+ */
+bool export_matrix (const char* filename, Matrix_t* m, char sep) {
+	if (!filename || !m || !has_data(m)) {
+		return false;
+	}
+	FILE *out = fopen(filename, "w");
+	if (!out) {
+		command_perror("FAILED TO OPEN FOR EXPORT");
+		return false;
+	}
+	bool ok = text_write_matrix(out, m, sep, false, 0);
+	if (fclose(out) != 0) {
+		ok = false;
 	}
-	printf("\n");
+	if (!ok) {
+		command_perror("EXPORT FAILED");
+		unlink(filename);
+	}
+	return ok;
+}
 
+/* 
+ * PURPOSE: Import a matrix from delimited text (see text_read_matrix).
+ *          The file is mapped rather than read, so the values are parsed
+ *          straight from the page cache into the matrix.
+ * INPUTS: filename, name of the new matrix, element type, matrix
+ * RETURN: False if the import is unsucessful.  True if it is successful.
+ */
+bool import_matrix (const char* filename, const char* name, Matrix_Type_t type, Matrix_t** m) {
+	if (!filename || !name || !m) {
+		return false;
+	}
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(command_output(), "FAILED TO OPEN FOR IMPORT\n");
+		command_perror("IMPORT OPEN");
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size == 0) {
+		fprintf(command_output(), "FAILED TO STAT TEXT FILE\n");
+		close(fd);
+		return false;
+	}
+	const size_t len = st.st_size;
+	char *text = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (text == MAP_FAILED) {
+		command_perror("FAILED TO MAP TEXT FILE");
+		return false;
+	}
+	madvise(text, len, MADV_SEQUENTIAL);
+	bool ok = text_read_matrix(text, len, name, type, m);
+	munmap(text, len);
+	if (ok && !fit_matrix_storage(*m)) {
+		destroy_matrix(m);
+		ok = false;
+	}
+	return ok;
 }
 
 /* 
  * PURPOSE: Read a matrix from binary file.  Load it into the matrix array.
+ *          Container files are read chunk by chunk with their checksums
+ *          verified, anything else is read as the legacy layout.  The
+ *          storage is then picked by density.
  * INPUTS: filename, matrix
  * RETURN: False if read is unsucessful.  True if read is successful.
  *			
@@ -193,253 +780,1183 @@ bool read_matrix (const char* matrix_input_filename, Matrix_t** m) {
 
 	int fd = open(matrix_input_filename,O_RDONLY);
 	if (fd < 0) {
-		printf("FAILED TO OPEN FOR READING\n");
+		fprintf(command_output(), "FAILED TO OPEN FOR READING\n");
 		if (errno == EACCES ) {
-			perror("DO NOT HAVE ACCESS TO FILE\n");
+			command_perror("DO NOT HAVE ACCESS TO FILE\n");
 		}
 		else if (errno == EADDRINUSE ){
-			perror("FILE ALREADY IN USE\n");
+			command_perror("FILE ALREADY IN USE\n");
 		}
 		else if (errno == EBADF) {
-			perror("BAD FILE DESCRIPTOR\n");	
+			command_perror("BAD FILE DESCRIPTOR\n");	
 		}
 		else if (errno == EEXIST) {
-			perror("FILE EXIST\n");
+			command_perror("FILE EXIST\n");
 		}
 		return false;
 	}
 
+	char magic[sizeof(FORMAT_MAGIC) - 1];
+	if (pread(fd, magic, sizeof(magic), 0) == sizeof(magic) && format_is_container(magic, sizeof(magic))) {
+		const bool ok = format_read(fd, m, 0, UINT_MAX);
+		close(fd);
+		return ok && fit_matrix_storage(*m);
+	}
+
 	/*read the wrote dimensions and name length*/
 	unsigned int name_len = 0;
 	unsigned int rows = 0;
 	unsigned int cols = 0;
 	
 	if (read(fd,&name_len,sizeof(unsigned int)) != sizeof(unsigned int)) {
-		printf("FAILED TO READ FILE\n");
+		fprintf(command_output(), "FAILED TO READ FILE\n");
 		if (errno == EACCES ) {
-			perror("DO NOT HAVE ACCESS TO FILE\n");
+			command_perror("DO NOT HAVE ACCESS TO FILE\n");
 		}
 		else if (errno == EADDRINUSE ){
-			perror("FILE ALREADY IN USE\n");
+			command_perror("FILE ALREADY IN USE\n");
 		}
 		else if (errno == EBADF) {
-			perror("BAD FILE DESCRIPTOR\n");	
+			command_perror("BAD FILE DESCRIPTOR\n");	
 		}
 		else if (errno == EEXIST) {
-			perror("FILE EXIST\n");
+			command_perror("FILE EXIST\n");
 		}
 		return false;
 	}
 	char name_buffer[50];
+	if (name_len == 0 || name_len > sizeof(name_buffer)) {
+		fprintf(command_output(), "BAD MATRIX HEADER\n");
+		close(fd);
+		return false;
+	}
 	if (read (fd,name_buffer,sizeof(char) * name_len) != sizeof(char) * name_len) {
-		printf("FAILED TO READ MATRIX NAME\n");
+		fprintf(command_output(), "FAILED TO READ MATRIX NAME\n");
 		if (errno == EACCES ) {
-			perror("DO NOT HAVE ACCESS TO FILE\n");
+			command_perror("DO NOT HAVE ACCESS TO FILE\n");
 		}
 		else if (errno == EADDRINUSE ){
-			perror("FILE ALREADY IN USE\n");
+			command_perror("FILE ALREADY IN USE\n");
 		}
 		else if (errno == EBADF) {
-			perror("BAD FILE DESCRIPTOR\n");	
+			command_perror("BAD FILE DESCRIPTOR\n");	
 		}
 		else if (errno == EEXIST) {
-			perror("FILE EXIST\n");
+			command_perror("FILE EXIST\n");
 		}
 
 		return false;	
 	}
+	if (!memchr(name_buffer, '\0', name_len) || strlen(name_buffer) + 1 > MATRIX_NAME_LEN) {
+		fprintf(command_output(), "BAD MATRIX HEADER\n");
+		close(fd);
+		return false;
+	}
 
 	if (read (fd,&rows, sizeof(unsigned int)) != sizeof(unsigned int)) {
-		printf("FAILED TO READ MATRIX ROW SIZE\n");
+		fprintf(command_output(), "FAILED TO READ MATRIX ROW SIZE\n");
 		if (errno == EACCES ) {
-			perror("DO NOT HAVE ACCESS TO FILE\n");
+			command_perror("DO NOT HAVE ACCESS TO FILE\n");
 		}
 		else if (errno == EADDRINUSE ){
-			perror("FILE ALREADY IN USE\n");
+			command_perror("FILE ALREADY IN USE\n");
 		}
 		else if (errno == EBADF) {
-			perror("BAD FILE DESCRIPTOR\n");	
+			command_perror("BAD FILE DESCRIPTOR\n");	
 		}
 		else if (errno == EEXIST) {
-			perror("FILE EXIST\n");
+			command_perror("FILE EXIST\n");
 		}
 
 		return false;
 	}
 
 	if (read(fd,&cols,sizeof(unsigned int)) != sizeof(unsigned int)) {
-		printf("FAILED TO READ MATRIX COLUMN SIZE\n");
+		fprintf(command_output(), "FAILED TO READ MATRIX COLUMN SIZE\n");
 		if (errno == EACCES ) {
-			perror("DO NOT HAVE ACCESS TO FILE\n");
+			command_perror("DO NOT HAVE ACCESS TO FILE\n");
 		}
 		else if (errno == EADDRINUSE ){
-			perror("FILE ALREADY IN USE\n");
+			command_perror("FILE ALREADY IN USE\n");
 		}
 		else if (errno == EBADF) {
-			perror("BAD FILE DESCRIPTOR\n");	
+			command_perror("BAD FILE DESCRIPTOR\n");	
 		}
 		else if (errno == EEXIST) {
-			perror("FILE EXIST\n");
+			command_perror("FILE EXIST\n");
 		}
 
 		return false;
 	}
 
-	unsigned int numberOfDataBytes = rows * cols * sizeof(unsigned int);
-	unsigned int *data = calloc(rows * cols, sizeof(unsigned int));
-	if (read(fd,data,numberOfDataBytes) != numberOfDataBytes) {
-		printf("FAILED TO READ MATRIX DATA\n");
+	/*read straight into the storage of the matrix*/
+	const ssize_t numberOfDataBytes = (size_t) rows * cols * sizeof(unsigned int);
+	if (!create_matrix(m,name_buffer,rows,cols) || !reserve_matrix_storage(*m)) {
+		close(fd);
+		return false;
+	}
+	if (read(fd,(*m)->data,numberOfDataBytes) != numberOfDataBytes) {
+		fprintf(command_output(), "FAILED TO READ MATRIX DATA\n");
 		if (errno == EACCES ) {
-			perror("DO NOT HAVE ACCESS TO FILE\n");
+			command_perror("DO NOT HAVE ACCESS TO FILE\n");
 		}
 		else if (errno == EADDRINUSE ){
-			perror("FILE ALREADY IN USE\n");
+			command_perror("FILE ALREADY IN USE\n");
 		}
 		else if (errno == EBADF) {
-			perror("BAD FILE DESCRIPTOR\n");	
+			command_perror("BAD FILE DESCRIPTOR\n");	
 		}
 		else if (errno == EEXIST) {
-			perror("FILE EXIST\n");
+			command_perror("FILE EXIST\n");
 		}
 
+		destroy_matrix(m);
+		close(fd);
 		return false;	
 	}
 
-	if (!create_matrix(m,name_buffer,rows,cols)) {
-		return false;
-	}
-
-	load_matrix(*m,data);
-	free(data);
 	if (close(fd)) {
 		return false;
 
 	}
-	return true;
+	return fit_matrix_storage(*m);
 }
 
 /* 
- * PURPOSE: Write a matrix into a binary file
- * INPUTS: filename, matrix to load
- * RETURN: True if write is sucessful, false if unsucessful.
+ * PURPOSE: Read the name and dimensions of a matrix file without reading
+ *          its data, in either format
+ * INPUTS: filename, name buffer of MATRIX_NAME_LEN, rows, cols
+ * RETURN: True if the header is valid, false if not.
  */
-bool write_matrix (const char* matrix_output_filename, Matrix_t* m) {
-	if ( !m || !matrix_output_filename ) {
+bool read_matrix_info (const char* matrix_input_filename, char* name, unsigned int* rows, unsigned int* cols) {
+	if ( !matrix_input_filename || !name || !rows || !cols) {
 		return false;
 	}
 
-	int fd = open (matrix_output_filename, O_CREAT | O_RDWR | O_TRUNC, 0644);
-	/* ERROR HANDLING USING errorno*/
+	int fd = open(matrix_input_filename,O_RDONLY);
 	if (fd < 0) {
-		printf("FAILED TO CREATE/OPEN FILE FOR WRITING\n");
-		if (errno == EACCES ) {
-			perror("DO NOT HAVE ACCESS TO FILE\n");
-		}
-		else if (errno == EADDRINUSE ){
-			perror("FILE ALREADY IN USE\n");
-		}
-		else if (errno == EBADF) {
-			perror("BAD FILE DESCRIPTOR\n");	
-		}
-		else if (errno == EEXIST) {
-			perror("FILE EXISTS\n");
-		}
+		fprintf(command_output(), "FAILED TO OPEN FOR READING\n");
+		command_perror("READ OPEN");
 		return false;
 	}
-	/* Calculate the needed buffer for our matrix */
-	unsigned int name_len = strlen(m->name) + 1;
-	unsigned int numberOfBytes = sizeof(unsigned int) + (sizeof(unsigned int)  * 2) + name_len + sizeof(unsigned int) * m->rows * m->cols + 1;
-	/* Allocate the output_buffer in bytes
-	 * IMPORTANT TO UNDERSTAND THIS WAY OF MOVING MEMORY
-	 */
-	unsigned char* output_buffer = calloc(numberOfBytes,sizeof(unsigned char));
-	unsigned int offset = 0;
-	memcpy(&output_buffer[offset], &name_len, sizeof(unsigned int)); // IMPORTANT C FUNCTION TO KNOW
-	offset += sizeof(unsigned int);	
-	memcpy(&output_buffer[offset], m->name,name_len);
-	offset += name_len;
-	memcpy(&output_buffer[offset],&m->rows,sizeof(unsigned int));
-	offset += sizeof(unsigned int);
-	memcpy(&output_buffer[offset],&m->cols,sizeof(unsigned int));
-	offset += sizeof(unsigned int);
-	memcpy (&output_buffer[offset],m->data,m->rows * m->cols * sizeof(unsigned int));
-	offset += (m->rows * m->cols * sizeof(unsigned int));
-	output_buffer[numberOfBytes - 1] = EOF;
 
-	if (write(fd,output_buffer,numberOfBytes) != numberOfBytes) {
-		printf("FAILED TO WRITE MATRIX TO FILE\n");
-		if (errno == EACCES ) {
-			perror("DO NOT HAVE ACCESS TO FILE\n");
-		}
-		else if (errno == EADDRINUSE ){
-			perror("FILE ALREADY IN USE\n");
+	bool ok = false;
+	char magic[sizeof(FORMAT_MAGIC) - 1];
+	if (pread(fd, magic, sizeof(magic), 0) == sizeof(magic) && format_is_container(magic, sizeof(magic))) {
+		Format_Header_t header;
+		ok = format_read_info(fd, &header);
+		if (ok) {
+			memcpy(name, header.name, strlen(header.name) + 1);
+			*rows = header.rows;
+			*cols = header.cols;
 		}
-		else if (errno == EBADF) {
-			perror("BAD FILE DESCRIPTOR\n");	
+	}
+	else {
+		/*legacy layout: name length, name, rows, cols*/
+		unsigned int name_len = 0;
+		char name_buffer[50];
+		ok = pread(fd, &name_len, sizeof(name_len), 0) == sizeof(name_len)
+			&& name_len > 0 && name_len <= sizeof(name_buffer)
+			&& pread(fd, name_buffer, name_len, sizeof(name_len)) == name_len
+			&& memchr(name_buffer, '\0', name_len) && strlen(name_buffer) + 1 <= MATRIX_NAME_LEN
+			&& pread(fd, rows, sizeof(*rows), sizeof(name_len) + name_len) == sizeof(*rows)
+			&& pread(fd, cols, sizeof(*cols), sizeof(name_len) + name_len + sizeof(*rows)) == sizeof(*cols);
+		if (ok) {
+			memcpy(name, name_buffer, strlen(name_buffer) + 1);
 		}
-		else if (errno == EEXIST) {
-			perror("FILE EXIST\n");
+		else {
+			fprintf(command_output(), "BAD MATRIX HEADER\n");
 		}
-		return false;
-	}
-	
-	if (close(fd)) {
-		return false;
 	}
-	free(output_buffer);
-
-	return true;
+	close(fd);
+	return ok;
 }
 
 /* 
- * PURPOSE: Insert random data into matrix
- * INPUTS: matrix, beginngin range of random data, end rang of random data
- * RETURN: True if sucessful, false is unsucessful.  Matrix data may be modified.
+ * PURPOSE: Read a range of rows of a container file without reading the
+ *          chunks outside of it
+ * INPUTS: filename, matrix, first row, number of rows (clipped to the end
+ *         of the matrix)
+ * RETURN: False if read is unsucessful.  True if read is successful.
  */
-bool random_matrix(Matrix_t* m, unsigned int start_range, unsigned int end_range) {
-		if ( !m || start_range > end_range ) {
+bool read_matrix_rows (const char* matrix_input_filename, Matrix_t** m, unsigned int first_row, unsigned int num_rows) {
+	if ( !m || !matrix_input_filename || !(*matrix_input_filename)) {
 		return false;
 	}
 
-	for (unsigned int i = 0; i < m->rows; ++i) {
-		for (unsigned int j = 0; j < m->cols; ++j) {
-			m->data[i * m->cols + j] = rand() % (end_range + 1 - start_range) + start_range;
-		}
+	int fd = open(matrix_input_filename,O_RDONLY);
+	if (fd < 0) {
+		fprintf(command_output(), "FAILED TO OPEN FOR READING\n");
+		command_perror("READ OPEN");
+		return false;
 	}
-	return true;
+	const bool ok = format_read(fd, m, first_row, num_rows);
+	close(fd);
+	return ok && fit_matrix_storage(*m);
 }
 
-/*Protected Functions in C*/
-
 /* 
- * PURPOSE: load data into a matrix
- * INPUTS: matrix, data to load
- * RETURN: nothing. matrix data may be modified.
+ * PURPOSE: Map a matrix binary file into memory so the matrix data points
+ *          straight into the file.  Pages are only faulted in when touched.
+ *          Legacy files whose data is not word aligned are copied out of the
+ *          mapping, compressed container files are read instead.
+ * INPUTS: filename, matrix, mapping mode (copy-on-write or read only)
+ * RETURN: False if map is unsucessful.  True if map is successful.
  */
-void load_matrix (Matrix_t* m, unsigned int* data) {
-	if ( !m || !data ) {
-		return;
+bool map_matrix (const char* matrix_input_filename, Matrix_t** m, Matrix_Map_Mode_t mode) {
+	if ( !m || !matrix_input_filename || !(*matrix_input_filename)) {
+		return false;
 	}
 
-	memcpy(m->data,data,m->rows * m->cols * sizeof(unsigned int));
-}
+	int fd = open(matrix_input_filename,O_RDONLY);
+	if (fd < 0) {
+		fprintf(command_output(), "FAILED TO OPEN FOR MAPPING\n");
+		command_perror("MAP OPEN");
+		return false;
+	}
 
-/* 
- * PURPOSE: To add a matrix to the array of matrices
- * INPUTS: matrix array, matrix ot add to array, total number of matrices
- * RETURN: -1 if insert is unsucessful.  Position of inserted matrix if sucessful.
- */
-unsigned int add_matrix_to_array (Matrix_t** mats, Matrix_t* new_matrix, unsigned int num_mats) {
-	if (!mats || !new_matrix || num_mats < 0) {
-		return -1;
+	struct stat st;
+	if (fstat(fd,&st) || st.st_size < (off_t) (sizeof(unsigned int) * 3)) {
+		fprintf(command_output(), "FAILED TO STAT MATRIX FILE\n");
+		close(fd);
+		return false;
 	}
 
-	static long int current_position = 0;
-	const long int pos = current_position % num_mats;
-	if ( mats[pos] ) {
-		destroy_matrix(&mats[pos]);
-	} 
-	mats[pos] = new_matrix;
-	current_position++;
-	return pos;
+	const size_t map_len = st.st_size;
+	const int prot = (mode == MATRIX_MAP_READ_ONLY) ? PROT_READ : PROT_READ | PROT_WRITE;
+	unsigned char *base = mmap(NULL, map_len, prot, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		command_perror("FAILED TO MAP MATRIX FILE");
+		return false;
+	}
+
+	if (format_is_container(base, map_len)) {
+		Format_Header_t header;
+		size_t data_offset = 0;
+		if (!format_map_offset(base, map_len, &header, &data_offset)) {
+			/*compressed or damaged, read it the normal way*/
+			munmap(base, map_len);
+			return read_matrix(matrix_input_filename, m);
+		}
+		Matrix_t *mapped = pool_alloc(sizeof(Matrix_t));
+		if (!mapped) {
+			munmap(base, map_len);
+			return false;
+		}
+		memcpy(mapped->name, header.name, strlen(header.name) + 1);
+		mapped->rows = header.rows;
+		mapped->cols = header.cols;
+		mapped->type = header.elem_type;
+		mapped->elems = &base[data_offset];
+		mapped->map_base = base;
+		mapped->map_len = map_len;
+		mapped->read_only = (mode == MATRIX_MAP_READ_ONLY);
+
+		pool_free(*m, sizeof(Matrix_t));
+		*m = mapped;
+		return true;
+	}
+
+	/*validate the header against the mapped size*/
+	unsigned int name_len = 0;
+	unsigned int rows = 0;
+	unsigned int cols = 0;
+	size_t offset = 0;
+	memcpy(&name_len, &base[offset], sizeof(unsigned int));
+	offset += sizeof(unsigned int);
+	if (name_len == 0 || name_len > 50 || offset + name_len + sizeof(unsigned int) * 2 > map_len
+		|| !memchr(&base[offset], '\0', name_len)
+		|| strlen((const char*) &base[offset]) + 1 > MATRIX_NAME_LEN) {
+		fprintf(command_output(), "BAD MATRIX HEADER\n");
+		munmap(base, map_len);
+		return false;
+	}
+	const char *name = (const char*) &base[offset];
+	offset += name_len;
+	memcpy(&rows, &base[offset], sizeof(unsigned int));
+	offset += sizeof(unsigned int);
+	memcpy(&cols, &base[offset], sizeof(unsigned int));
+	offset += sizeof(unsigned int);
+
+	const size_t numberOfDataBytes = (size_t) rows * cols * sizeof(unsigned int);
+	if (cols && numberOfDataBytes / cols / sizeof(unsigned int) != rows) {
+		fprintf(command_output(), "BAD MATRIX HEADER\n");
+		munmap(base, map_len);
+		return false;
+	}
+	if (map_len - offset < numberOfDataBytes) {
+		fprintf(command_output(), "MATRIX FILE IS TRUNCATED\n");
+		munmap(base, map_len);
+		return false;
+	}
+
+	if (offset % sizeof(unsigned int)) {
+		/*legacy unpadded file, the data can't be used in place*/
+		bool ok = create_matrix(m,name,rows,cols) && densify_matrix(*m);
+		if (ok) {
+			memcpy((*m)->data, &base[offset], numberOfDataBytes);
+		}
+		munmap(base, map_len);
+		return ok;
+	}
+
+	Matrix_t *mapped = pool_alloc(sizeof(Matrix_t));
+	if (!mapped) {
+		munmap(base, map_len);
+		return false;
+	}
+	strncpy(mapped->name, name, MATRIX_NAME_LEN - 1);
+	mapped->rows = rows;
+	mapped->cols = cols;
+	mapped->data = (unsigned int*) &base[offset];
+	mapped->map_base = base;
+	mapped->map_len = map_len;
+	mapped->read_only = (mode == MATRIX_MAP_READ_ONLY);
+
+	pool_free(*m, sizeof(Matrix_t));
+	*m = mapped;
+	return true;
+}
+
+/* 
+ * PURPOSE: Write a matrix into a binary file
+ * INPUTS: filename, matrix to load
+ * RETURN: True if write is sucessful, false if unsucessful.
+ */
+bool write_matrix (const char* matrix_output_filename, Matrix_t* m) {
+	return write_matrix_with_flags(matrix_output_filename, m, MATRIX_WRITE_DEFAULT);
+}
+
+/* 
+ * PURPOSE: Stream a matrix into a chunked container file (see format.c).
+ *          Raw chunks go out through writev straight from the matrix, so no
+ *          staging copy of the data is made.
+ *          An existing file is never rewritten in place: a matrix mapped
+ *          from it (map_matrix) would fault on the truncated pages, so a
+ *          temporary file with the same mode is written and renamed over
+ *          it instead, over the file a symlink points at for a symlink.
+ * INPUTS: filename, matrix to write, MATRIX_WRITE_SYNC to fsync before
+ *         returning, MATRIX_WRITE_ATOMIC to always go through a temporary
+ *         file, synced before it replaces the target, MATRIX_WRITE_COMPRESS
+ *         to store the chunks that shrink compressed
+ * RETURN: True if write is sucessful, false if unsucessful.
+ */
+bool write_matrix_with_flags (const char* matrix_output_filename, Matrix_t* m, unsigned int flags) {
+	if ( !has_data(m) || !matrix_output_filename ) {
+		return false;
+	}
+
+	struct stat st;
+	const bool exists = stat(matrix_output_filename, &st) == 0 && S_ISREG(st.st_mode);
+	const bool replace = (flags & MATRIX_WRITE_ATOMIC) || exists;
+	char *target = NULL;
+	char *tmp_filename = NULL;
+	int fd = -1;
+	if (replace) {
+		/* through a symlink the file it points at is replaced, not the link */
+		target = exists ? realpath(matrix_output_filename, NULL) : NULL;
+		const char *path = target ? target : matrix_output_filename;
+		const size_t len = strlen(path) + strlen(".XXXXXX") + 1;
+		tmp_filename = malloc(len);
+		if (!tmp_filename) {
+			free(target);
+			return false;
+		}
+		snprintf(tmp_filename, len, "%s.XXXXXX", path);
+		fd = mkstemp(tmp_filename);
+		/* the replacement keeps the permissions of the file it replaces */
+		if (fd >= 0 && fchmod(fd, exists ? (st.st_mode & 07777) : 0644)) {
+			command_perror("FAILED TO SET FILE MODE");
+		}
+	}
+	else {
+		fd = open (matrix_output_filename, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+	}
+	/* ERROR HANDLING USING errorno*/
+	if (fd < 0) {
+		fprintf(command_output(), "FAILED TO CREATE/OPEN FILE FOR WRITING\n");
+		if (errno == EACCES ) {
+			command_perror("DO NOT HAVE ACCESS TO FILE\n");
+		}
+		else if (errno == EADDRINUSE ){
+			command_perror("FILE ALREADY IN USE\n");
+		}
+		else if (errno == EBADF) {
+			command_perror("BAD FILE DESCRIPTOR\n");	
+		}
+		else if (errno == EEXIST) {
+			command_perror("FILE EXISTS\n");
+		}
+		free(target);
+		free(tmp_filename);
+		return false;
+	}
+
+	bool ok = format_write(fd, m, flags & MATRIX_WRITE_COMPRESS);
+	if (!ok) {
+		fprintf(command_output(), "FAILED TO WRITE MATRIX TO FILE\n");
+		command_perror("WRITE");
+	}
+	if (ok && (flags & (MATRIX_WRITE_SYNC | MATRIX_WRITE_ATOMIC)) && fsync(fd)) {
+		command_perror("FAILED TO SYNC MATRIX FILE");
+		ok = false;
+	}
+	if (close(fd)) {
+		ok = false;
+	}
+
+	if (replace) {
+		if (ok && rename(tmp_filename, target ? target : matrix_output_filename)) {
+			command_perror("FAILED TO RENAME MATRIX FILE");
+			ok = false;
+		}
+		if (!ok) {
+			unlink(tmp_filename);
+		}
+		free(target);
+		free(tmp_filename);
+	}
+	return ok;
+}
+
+/* 
+ * PURPOSE: Insert random data into matrix, seeded from the session seed
+ * INPUTS: matrix, beginngin range of random data, end rang of random data
+ * RETURN: True if sucessful, false is unsucessful.  Matrix data may be modified.
+ */
+bool random_matrix(Matrix_t* m, unsigned int start_range, unsigned int end_range) {
+	return random_matrix_seeded(m, start_range, end_range, rng_next_seed());
+}
+
+/* 
+ * PURPOSE: Insert uniformly distributed random data into matrix.  The
+ *          values only depend on the seed and the matrix size, never on
+ *          the number of threads filling it.  The matrix becomes dense
+ *          unless the range makes most values zero.  Integer matrices take
+ *          values of the range, which has to fit the element type, real
+ *          matrices are spread over it.
+ * INPUTS: matrix, beginning and end (inclusive) of the range, seed
+ * RETURN: True if sucessful, false is unsucessful.  Matrix data may be modified.
+ */
+bool random_matrix_seeded(Matrix_t* m, unsigned int start_range, unsigned int end_range, unsigned long long seed) {
+	if ( !has_data(m) || m->read_only || start_range > end_range ) {
+		return false;
+	}
+	const Type_Kernels_t *kernels = type_kernels(m->type);
+	if ((!kernels->is_real && end_range > kernels->max) || !reserve_matrix_storage(m)) {
+		return false;
+	}
+	if (m->type != MATRIX_U32) {
+		Typed_Task_t task = { .kernels = kernels, .c = m->elems, .seed = seed,
+			.low = start_range, .high = end_range };
+		parallel_for((size_t) m->rows * m->cols, typed_random_range, &task);
+		return true;
+	}
+
+	Random_Task_t task = { m->data, seed, start_range, end_range };
+	parallel_for((size_t) m->rows * m->cols, random_range, &task);
+	return fit_matrix_storage(m);
+}
+
+/* 
+ * PURPOSE: Convert a matrix to another element type in place.  Integers
+ *          are cast and wrap around, reals are truncated and saturate at
+ *          the range of an integer type.
+ * INPUTS: matrix, new element type
+ * RETURN: True if successful, false if not.  The matrix keeps its old
+ *         type on failure.
+ */
+bool convert_matrix (Matrix_t* m, Matrix_Type_t type) {
+	const Type_Kernels_t *kernels = type_kernels(type);
+	if (!has_data(m) || m->read_only || !kernels) {
+		return false;
+	}
+	if (m->type == type) {
+		return true;
+	}
+	if (!densify_matrix(m)) {
+		return false;
+	}
+
+	const size_t count = (size_t) m->rows * m->cols;
+	void *elems = alloc_payload(count, kernels->size, false);
+	if (!elems) {
+		return false;
+	}
+	Typed_Task_t task = { .kernels = kernels, .a = m->elems, .c = elems, .src_type = m->type };
+	parallel_for(count, typed_convert_range, &task);
+	release_data(m);
+	m->elems = elems;
+	m->type = type;
+	m->hash_valid = false;
+	return fit_matrix_storage(m);
+}
+
+/* 
+ * PURPOSE: Give a sparse matrix dense storage
+ * INPUTS: matrix
+ * RETURN: True if the matrix is dense, false if the memory could not be
+ *         allocated and it stays sparse.
+ */
+bool densify_matrix (Matrix_t* m) {
+	if (!m || !m->sparse) {
+		return m != NULL;
+	}
+
+	const size_t count = (size_t) m->rows * m->cols;
+	unsigned int *data = alloc_payload(count, sizeof(unsigned int), false);
+	if (!data) {
+		return false;
+	}
+	sparse_expand(m, 0, count, data);
+	sparse_free(&m->sparse, m->rows);
+	m->data = data;
+	return true;
+}
+
+/* 
+ * PURPOSE: Give a matrix private dense storage that is about to be
+ *          overwritten completely.  Unlike unshare_matrix nothing is kept:
+ *          sparse entries are not expanded and shared data is not copied,
+ *          fresh storage is simply allocated without zeroing it.
+ * INPUTS: matrix about to be filled
+ * RETURN: True if the data may be written, false if it could not be
+ *         allocated.  The contents are undefined.
+ */
+bool reserve_matrix_storage (Matrix_t* m) {
+	if (!m) {
+		return false;
+	}
+	if (!m->sparse && (!m->share || (m->share->refs == 1 && !m->share->read_only))) {
+		return unshare_matrix(m);
+	}
+	void *elems = alloc_payload((size_t) m->rows * m->cols, type_size(m->type), false);
+	if (!elems) {
+		return false;
+	}
+	release_data(m);
+	m->elems = elems;
+	m->hash_valid = false;
+	return true;
+}
+
+/* 
+ * PURPOSE: Pick dense or sparse storage by the density of a matrix (see
+ *          SPARSE_ENTER_RATIO).  Counting the nonzeros of a dense matrix
+ *          stops as soon as it is clearly too dense, and mapped, read only
+ *          or shared data is left where it is.  Only u32 matrices can be
+ *          sparse.
+ * INPUTS: matrix
+ * RETURN: True unless a sparse matrix had to become dense and could not be
+ *         allocated.
+ */
+bool fit_matrix_storage (Matrix_t* m) {
+	if (!m) {
+		return false;
+	}
+	if (m->type != MATRIX_U32) {
+		return true;
+	}
+
+	const size_t count = (size_t) m->rows * m->cols;
+	if (m->sparse) {
+		if ((size_t) m->sparse->nnz * SPARSE_LEAVE_RATIO > count) {
+			return densify_matrix(m);
+		}
+		return true;
+	}
+	if (!m->data || m->map_base || m->share || m->read_only) {
+		return true;
+	}
+
+	const size_t limit = count / SPARSE_ENTER_RATIO;
+	const size_t nnz = sparse_count_nonzero(m->data, count, limit);
+	if (nnz > limit) {
+		return true;
+	}
+	Matrix_Sparse_t *s = sparse_from_dense(m->data, m->rows, m->cols, nnz);
+	if (s) {
+		release_data(m);
+		m->sparse = s;
+	}
+	return true;
+}
+
+/*Protected Functions in C*/
+
+/* 
+ * PURPOSE: Check that a matrix holds its values, dense or sparse
+ * INPUTS: matrix, may be NULL
+ * RETURN: True if it has data, false if not.
+ */
+bool has_data (const Matrix_t* m) {
+	return m && (m->data || m->sparse);
+}
+
+/* 
+ * PURPOSE: Add one flat range of two matrices, run by parallel_for
+ * INPUTS: Add_Task_t, first and one past the last element of the range
+ * RETURN: none.  The result matrix data is modified.
+ */
+void add_range (void* ctx, size_t begin, size_t end) {
+	const Add_Task_t *task = ctx;
+	matrix_kernels()->add(&task->a[begin], &task->b[begin], &task->c[begin], end - begin);
+}
+
+/* 
+ * PURPOSE: Shift one flat range of a matrix, run by parallel_for.
+ *          Shifting by the width of an unsigned int or more gives 0.
+ * INPUTS: Shift_Task_t, first and one past the last element of the range
+ * RETURN: none.  The matrix data is modified.
+ */
+void shift_range (void* ctx, size_t begin, size_t end) {
+	const Shift_Task_t *task = ctx;
+	if (task->shift >= sizeof(unsigned int) * CHAR_BIT) {
+		memset(&task->data[begin], 0, (end - begin) * sizeof(unsigned int));
+	}
+	else if (task->direction == 'l') {
+		matrix_kernels()->shift_left(&task->data[begin], task->shift, end - begin);
+	}
+	else {
+		matrix_kernels()->shift_right(&task->data[begin], task->shift, end - begin);
+	}
+}
+
+/* 
+ * PURPOSE: Fill one flat range of a matrix with random values, run by
+ *          parallel_for
+ * INPUTS: Random_Task_t, first and one past the last element of the range
+ * RETURN: none.  The matrix data is modified.
+ */
+void random_range (void* ctx, size_t begin, size_t end) {
+	const Random_Task_t *task = ctx;
+	rng_fill_range(task->data, begin, end, task->seed, task->low, task->high);
+}
+
+/* 
+ * PURPOSE: Sum one flat range of a matrix into the task total, run by
+ *          parallel_for
+ * INPUTS: Sum_Task_t, first and one past the last element of the range
+ * RETURN: none.  The task total is updated.
+ */
+void sum_range (void* ctx, size_t begin, size_t end) {
+	Sum_Task_t *task = ctx;
+	const unsigned long long partial = matrix_kernels()->sum(&task->m->data[begin], end - begin);
+	__atomic_fetch_add(&task->total, partial, __ATOMIC_RELAXED);
+}
+
+/* 
+ * PURPOSE: Sum a range of rows, run by parallel_for_weighted
+ * INPUTS: Sum_Task_t, first and one past the last row of the range
+ * RETURN: none.  The task output is modified.
+ */
+void sum_rows_range (void* ctx, size_t begin, size_t end) {
+	Sum_Task_t *task = ctx;
+	const Matrix_t *m = task->m;
+	for (size_t i = begin; i < end; ++i) {
+		task->out[i] = matrix_kernels()->sum(&m->data[i * m->cols], m->cols);
+	}
+}
+
+/* 
+ * PURPOSE: Sum a range of columns, run by parallel_for_weighted.  Walks the
+ *          matrix row by row so every read stays sequential.
+ * INPUTS: Sum_Task_t, first and one past the last column of the range
+ * RETURN: none.  The task output is modified.
+ */
+void sum_cols_range (void* ctx, size_t begin, size_t end) {
+	Sum_Task_t *task = ctx;
+	const Matrix_t *m = task->m;
+	unsigned long long * restrict out = task->out;
+	memset(&out[begin], 0, (end - begin) * sizeof(unsigned long long));
+	for (size_t i = 0; i < m->rows; ++i) {
+		const unsigned int * restrict row = &m->data[i * m->cols];
+		for (size_t j = begin; j < end; ++j) {
+			out[j] += row[j];
+		}
+	}
+}
+
+/* 
+ * PURPOSE: Copy a kc x nc block of b into GEMM_NR wide column panels, each
+ *          stored row after row and zero padded past the last column
+ * INPUTS: matrix b, destination buffer, first row and row count, first
+ *         column and column count of the block
+ * RETURN: none.  The buffer is filled.
+ */
+void pack_gemm_b (const Matrix_t* b, unsigned int* bpack, size_t pc, size_t kc, size_t jc, size_t nc) {
+	const size_t panels = (nc + GEMM_NR - 1) / GEMM_NR;
+	for (size_t q = 0; q < panels; ++q) {
+		const size_t col = jc + q * GEMM_NR;
+		const size_t width = (nc - q * GEMM_NR < GEMM_NR) ? nc - q * GEMM_NR : GEMM_NR;
+		unsigned int *panel = &bpack[q * kc * GEMM_NR];
+		for (size_t p = 0; p < kc; ++p) {
+			memcpy(&panel[p * GEMM_NR], &b->data[(pc + p) * b->cols + col], width * sizeof(unsigned int));
+			memset(&panel[p * GEMM_NR + width], 0, (GEMM_NR - width) * sizeof(unsigned int));
+		}
+	}
+}
+
+/* 
+ * PURPOSE: Multiply a range of GEMM_MR row blocks of a by the packed block
+ *          of b and accumulate into c, run by parallel_for_weighted
+ * INPUTS: Gemm_Task_t, first and one past the last row block of the range
+ * RETURN: none.  Matrix c is modified.
+ */
+void gemm_range (void* ctx, size_t begin, size_t end) {
+	const Gemm_Task_t *task = ctx;
+	const Matrix_t *a = task->a;
+	Matrix_t *c = task->c;
+	const Matrix_Kernels_t *kernels = matrix_kernels();
+	unsigned int apack[GEMM_KC * GEMM_MR] __attribute__((aligned(64)));
+	unsigned int tile[GEMM_MR * GEMM_NR] __attribute__((aligned(64)));
+	const size_t panels = (task->nc + GEMM_NR - 1) / GEMM_NR;
+
+	for (size_t blk = begin; blk < end; ++blk) {
+		const size_t i0 = blk * GEMM_MR;
+		const size_t mr = (a->rows - i0 < GEMM_MR) ? a->rows - i0 : GEMM_MR;
+		for (size_t p = 0; p < task->kc; ++p) {
+			for (size_t r = 0; r < GEMM_MR; ++r) {
+				apack[p * GEMM_MR + r] = (r < mr) ? a->data[(i0 + r) * a->cols + task->pc + p] : 0;
+			}
+		}
+
+		for (size_t q = 0; q < panels; ++q) {
+			kernels->gemm(task->kc, apack, &task->bpack[q * task->kc * GEMM_NR], tile);
+			const size_t col = task->jc + q * GEMM_NR;
+			const size_t nr = (task->nc - q * GEMM_NR < GEMM_NR) ? task->nc - q * GEMM_NR : GEMM_NR;
+			for (size_t r = 0; r < mr; ++r) {
+				unsigned int *crow = &c->data[(i0 + r) * c->cols + col];
+				for (size_t j = 0; j < nr; ++j) {
+					crow[j] += tile[r * GEMM_NR + j];
+				}
+			}
+		}
+	}
+}
+
+/* 
+ * PURPOSE: Drop the data of dest and make it use the data of src.  Sparse
+ *          storage is small and copied instead.
+ * INPUTS: matrix whose data is shared, matrix of the same size
+ * RETURN: True if successful, false if the share count could not be
+ *         allocated.  dest is left unchanged on failure.
+ */
+bool share_data (Matrix_t* src, Matrix_t* dest) {
+	if (src->sparse) {
+		Matrix_Sparse_t *copy = sparse_copy(src->sparse, src->rows);
+		if (!copy) {
+			return false;
+		}
+		release_data(dest);
+		dest->sparse = copy;
+		dest->type = src->type;
+		dest->hash = src->hash;
+		dest->hash_valid = src->hash_valid;
+		return true;
+	}
+	if (!src->share) {
+		src->share = pool_alloc(sizeof(Matrix_Share_t));
+		if (!src->share) {
+			return false;
+		}
+		src->share->refs = 1;
+		src->share->read_only = src->map_base && src->read_only;
+	}
+	release_data(dest);
+	src->share->refs++;
+	dest->data = src->data;
+	dest->type = src->type;
+	dest->map_base = src->map_base;
+	dest->map_len = src->map_len;
+	dest->share = src->share;
+	dest->hash = src->hash;
+	dest->hash_valid = src->hash_valid;
+	return true;
+}
+
+/* 
+ * PURPOSE: Drop the data of a matrix, dense or sparse.  Shared data is
+ *          only freed or unmapped by the last matrix using it.
+ * INPUTS: matrix
+ * RETURN: none.  The matrix is left without data.
+ */
+void release_data (Matrix_t* m) {
+	if (m->share && --m->share->refs > 0) {
+		/* another duplicate still uses the data */
+	}
+	else if (m->map_base) {
+		munmap(m->map_base, m->map_len);
+	}
+	else {
+		pool_free(m->elems, (size_t) m->rows * m->cols * type_size(m->type));
+	}
+	if (m->share && m->share->refs == 0) {
+		pool_free(m->share, sizeof(Matrix_Share_t));
+	}
+	sparse_free(&m->sparse, m->rows);
+	m->data = NULL;
+	m->map_base = NULL;
+	m->map_len = 0;
+	m->share = NULL;
+}
+
+/* 
+ * PURPOSE: Give a matrix its own copy of shared data before it is written
+ *          to and forget its content hash.  The last user of shared data
+ *          keeps it unless it is a read only mapping, sparse matrices are
+ *          made dense.
+ * INPUTS: matrix about to be modified
+ * RETURN: True if the data may be written, false if the copy could not be
+ *         allocated.
+ */
+bool unshare_matrix (Matrix_t* m) {
+	m->hash_valid = false;
+	if (m->sparse) {
+		return densify_matrix(m);
+	}
+	if (!m->share) {
+		return true;
+	}
+	if (m->share->refs == 1 && !m->share->read_only) {
+		pool_free(m->share, sizeof(Matrix_Share_t));
+		m->share = NULL;
+		return true;
+	}
+
+	const size_t count = (size_t) m->rows * m->cols;
+	void *copy = alloc_payload(count, type_size(m->type), false);
+	if (!copy) {
+		return false;
+	}
+	memcpy(copy, m->elems, count * type_size(m->type));
+	release_data(m);
+	m->elems = copy;
+	return true;
+}
+
+/* 
+ * PURPOSE: Compare a range of EQUAL_CHUNK sized chunks and hash each one
+ *          while it is still in cache, run by parallel_for_weighted.
+ *          Chunks are skipped once any thread has found a difference.
+ * INPUTS: Equal_Task_t, first and one past the last chunk of the range
+ * RETURN: none.  The chunk hashes or the differ flag are set.
+ */
+void equal_range (void* ctx, size_t begin, size_t end) {
+	Equal_Task_t *task = ctx;
+	const Matrix_Kernels_t *kernels = matrix_kernels();
+	for (size_t i = begin; i < end; ++i) {
+		if (__atomic_load_n(&task->differ, __ATOMIC_RELAXED)) {
+			return;
+		}
+		const size_t first = i * EQUAL_CHUNK;
+		const size_t n = (task->count - first < EQUAL_CHUNK) ? task->count - first : EQUAL_CHUNK;
+		if (!kernels->equal(&task->a[first], &task->b[first], n)) {
+			__atomic_store_n(&task->differ, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		task->chunk_hashes[i] = hash_words(&task->a[first], n, i);
+	}
+}
+
+/* 
+ * PURPOSE: Hash an array of unsigned ints, four 64 bit lanes at a time in
+ *          the style of xxHash64
+ * INPUTS: data, number of elements, seed
+ * RETURN: 64 bit hash
+ */
+unsigned long long hash_words (const unsigned int* data, size_t n, unsigned long long seed) {
+	unsigned long long lane[4] = { seed + HASH_PRIME1 + HASH_PRIME2, seed + HASH_PRIME2, seed, seed - HASH_PRIME1 };
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		for (int l = 0; l < 4; ++l) {
+			unsigned long long word;
+			memcpy(&word, &data[i + 2 * l], sizeof(word));
+			lane[l] += word * HASH_PRIME2;
+			lane[l] = (lane[l] << 31 | lane[l] >> 33) * HASH_PRIME1;
+		}
+	}
+	unsigned long long h = (lane[0] << 1 | lane[0] >> 63) + (lane[1] << 7 | lane[1] >> 57)
+		+ (lane[2] << 12 | lane[2] >> 52) + (lane[3] << 18 | lane[3] >> 46);
+	h += n;
+	for (; i < n; ++i) {
+		h ^= data[i] * HASH_PRIME1;
+		h = (h << 23 | h >> 41) * HASH_PRIME2;
+	}
+	h ^= h >> 33;
+	h *= HASH_PRIME2;
+	h ^= h >> 29;
+	h *= HASH_PRIME1;
+	h ^= h >> 32;
+	return h;
+}
+
+/* 
+ * PURPOSE: Add one flat range of two matrices of any element type, run by
+ *          parallel_for
+ * INPUTS: Typed_Task_t, first and one past the last element of the range
+ * RETURN: none.  The result matrix data is modified.
+ */
+void typed_add_range (void* ctx, size_t begin, size_t end) {
+	const Typed_Task_t *task = ctx;
+	const size_t size = task->kernels->size;
+	task->kernels->add((const char*) task->a + begin * size, (const char*) task->b + begin * size,
+		(char*) task->c + begin * size, end - begin);
+}
+
+/* 
+ * PURPOSE: Shift one flat range of an integer matrix, run by parallel_for.
+ *          Shifting by the element width or more gives 0.
+ * INPUTS: Typed_Task_t, first and one past the last element of the range
+ * RETURN: none.  The matrix data is modified.
+ */
+void typed_shift_range (void* ctx, size_t begin, size_t end) {
+	const Typed_Task_t *task = ctx;
+	const size_t size = task->kernels->size;
+	char *data = (char*) task->c + begin * size;
+	if (task->shift >= size * CHAR_BIT) {
+		memset(data, 0, (end - begin) * size);
+	}
+	else if (task->direction == 'l') {
+		task->kernels->shift_left(data, task->shift, end - begin);
+	}
+	else {
+		task->kernels->shift_right(data, task->shift, end - begin);
+	}
+}
+
+/* 
+ * PURPOSE: Fill one flat range of a matrix of any element type with random
+ *          values, run by parallel_for
+ * INPUTS: Typed_Task_t, first and one past the last element of the range
+ * RETURN: none.  The matrix data is modified.
+ */
+void typed_random_range (void* ctx, size_t begin, size_t end) {
+	const Typed_Task_t *task = ctx;
+	task->kernels->random((char*) task->c + begin * task->kernels->size, begin, end,
+		task->seed, task->low, task->high);
+}
+
+/* 
+ * PURPOSE: Sum one flat range of an integer matrix into the task total,
+ *          run by parallel_for
+ * INPUTS: Typed_Task_t, first and one past the last element of the range
+ * RETURN: none.  The task total is updated, and the overflow flag set if
+ *         it passed 64 bits.
+ */
+void typed_sum_range (void* ctx, size_t begin, size_t end) {
+	Typed_Task_t *task = ctx;
+	const void *x = (const char*) task->a + begin * task->kernels->size;
+	unsigned long long partial = 0;
+	bool wrapped = false;
+	if (task->kernels->size == sizeof(unsigned long long)) {
+		/* only u64 elements can pass 64 bits within one range */
+		const unsigned long long *v = x;
+		for (size_t i = 0; i < end - begin; ++i) {
+			wrapped |= __builtin_add_overflow(partial, v[i], &partial);
+		}
+	}
+	else {
+		partial = task->kernels->sum(x, end - begin);
+	}
+	/* the total wraps exactly when one of the partials carries it past 2^64 */
+	const unsigned long long before = __atomic_fetch_add(&task->total, partial, __ATOMIC_RELAXED);
+	if (wrapped || before + partial < before) {
+		__atomic_store_n(&task->overflow, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/* 
+ * PURPOSE: Sum a range of EQUAL_CHUNK sized chunks of a matrix into their
+ *          partials, run by parallel_for_weighted
+ * INPUTS: Typed_Task_t, first and one past the last chunk of the range
+ * RETURN: none.  The task partials are set.
+ */
+void typed_sum_real_range (void* ctx, size_t begin, size_t end) {
+	Typed_Task_t *task = ctx;
+	for (size_t i = begin; i < end; ++i) {
+		const size_t first = i * EQUAL_CHUNK;
+		const size_t n = (task->count - first < EQUAL_CHUNK) ? task->count - first : EQUAL_CHUNK;
+		task->partials[i] = task->kernels->sum_real((const char*) task->a + first * task->kernels->size, n);
+	}
+}
+
+/* 
+ * PURPOSE: Compare a range of EQUAL_CHUNK sized chunks of two matrices of
+ *          any element type bit for bit, run by parallel_for_weighted
+ * INPUTS: Typed_Task_t, first and one past the last chunk of the range
+ * RETURN: none.  The differ flag is set on a difference.
+ */
+void typed_equal_range (void* ctx, size_t begin, size_t end) {
+	Typed_Task_t *task = ctx;
+	const size_t size = task->kernels->size;
+	for (size_t i = begin; i < end; ++i) {
+		if (__atomic_load_n(&task->differ, __ATOMIC_RELAXED)) {
+			return;
+		}
+		const size_t first = i * EQUAL_CHUNK;
+		const size_t n = (task->count - first < EQUAL_CHUNK) ? task->count - first : EQUAL_CHUNK;
+		if (memcmp((const char*) task->a + first * size, (const char*) task->b + first * size, n * size)) {
+			__atomic_store_n(&task->differ, 1, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+}
+
+/* 
+ * PURPOSE: Convert one flat range of a matrix to another element type, run
+ *          by parallel_for
+ * INPUTS: Typed_Task_t, first and one past the last element of the range
+ * RETURN: none.  The task output is filled.
+ */
+void typed_convert_range (void* ctx, size_t begin, size_t end) {
+	const Typed_Task_t *task = ctx;
+	task->kernels->convert((char*) task->c + begin * task->kernels->size,
+		(const char*) task->a + begin * type_size(task->src_type), task->src_type, end - begin);
+}
+
+/* 
+ * PURPOSE: Transpose rows r0 to r1 and columns c0 to c1 of the source into
+ *          the destination.  The longer side is halved until both fit
+ *          TRANSPOSE_LEAF, then the block is copied element by element.
+ * INPUTS: Transpose_Task_t, row range, column range
+ * RETURN: none.  The destination block is filled.
+ */
+void transpose_block (const Transpose_Task_t* task, size_t r0, size_t r1, size_t c0, size_t c1) {
+	if (r1 - r0 > TRANSPOSE_LEAF || c1 - c0 > TRANSPOSE_LEAF) {
+		if (r1 - r0 >= c1 - c0) {
+			const size_t mid = r0 + (r1 - r0) / 2;
+			transpose_block(task, r0, mid, c0, c1);
+			transpose_block(task, mid, r1, c0, c1);
+		}
+		else {
+			const size_t mid = c0 + (c1 - c0) / 2;
+			transpose_block(task, r0, r1, c0, mid);
+			transpose_block(task, r0, r1, mid, c1);
+		}
+		return;
+	}
+	const size_t rows = task->rows;
+	const size_t cols = task->cols;
+#define TRANSPOSE_COPY(T) { \
+	const T *s = task->src; \
+	T *d = task->dst; \
+	for (size_t i = r0; i < r1; ++i) { \
+		for (size_t j = c0; j < c1; ++j) { \
+			d[j * rows + i] = s[i * cols + j]; \
+		} \
+	} \
+}
+	switch (task->size) {
+		case 1: TRANSPOSE_COPY(unsigned char) break;
+		case 2: TRANSPOSE_COPY(unsigned short) break;
+		case 8: TRANSPOSE_COPY(unsigned long long) break;
+		default: TRANSPOSE_COPY(unsigned int) break;
+	}
+#undef TRANSPOSE_COPY
+}
+
+/* 
+ * PURPOSE: Transpose a range of TRANSPOSE_TILE row bands, run by
+ *          parallel_for_weighted
+ * INPUTS: Transpose_Task_t, first and one past the last band of the range
+ * RETURN: none.  The columns of the destination for those rows are filled.
+ */
+void transpose_range (void* ctx, size_t begin, size_t end) {
+	const Transpose_Task_t *task = ctx;
+	const size_t r1 = (end * TRANSPOSE_TILE < task->rows) ? end * TRANSPOSE_TILE : task->rows;
+	transpose_block(task, begin * TRANSPOSE_TILE, r1, 0, task->cols);
+}
+
+/* 
+ * PURPOSE: Swap the tile of rows i0 to i1 and columns j0 to j1 of a square
+ *          matrix with its mirror tile.  A tile on the diagonal is its own
+ *          mirror and only swaps the elements above the diagonal.
+ * INPUTS: Transpose_Task_t (dst is the matrix), row range, column range
+ * RETURN: none.  The matrix is modified.
+ */
+void swap_tiles (const Transpose_Task_t* task, size_t i0, size_t i1, size_t j0, size_t j1) {
+	const size_t n = task->cols;
+#define TRANSPOSE_SWAP(T) { \
+	T *d = task->dst; \
+	for (size_t i = i0; i < i1; ++i) { \
+		for (size_t j = (i0 == j0) ? i + 1 : j0; j < j1; ++j) { \
+			const T t = d[i * n + j]; \
+			d[i * n + j] = d[j * n + i]; \
+			d[j * n + i] = t; \
+		} \
+	} \
+}
+	switch (task->size) {
+		case 1: TRANSPOSE_SWAP(unsigned char) break;
+		case 2: TRANSPOSE_SWAP(unsigned short) break;
+		case 8: TRANSPOSE_SWAP(unsigned long long) break;
+		default: TRANSPOSE_SWAP(unsigned int) break;
+	}
+#undef TRANSPOSE_SWAP
+}
+
+/* 
+ * PURPOSE: Transpose a range of paired tile rows of a square matrix in
+ *          place, run by parallel_for_weighted.  Item i swaps the tiles on
+ *          and right of the diagonal in tile rows i and tiles - 1 - i.
+ * INPUTS: Transpose_Task_t, first and one past the last pair of the range
+ * RETURN: none.  The matrix is modified.
+ */
+void transpose_square_range (void* ctx, size_t begin, size_t end) {
+	const Transpose_Task_t *task = ctx;
+	const size_t n = task->rows;
+	const size_t tiles = (n + TRANSPOSE_TILE - 1) / TRANSPOSE_TILE;
+	for (size_t p = begin; p < end; ++p) {
+		const size_t pair[2] = { p, tiles - 1 - p };
+		for (size_t k = 0; k < ((pair[0] == pair[1]) ? 1 : 2); ++k) {
+			const size_t i0 = pair[k] * TRANSPOSE_TILE;
+			const size_t i1 = (i0 + TRANSPOSE_TILE < n) ? i0 + TRANSPOSE_TILE : n;
+			for (size_t j0 = i0; j0 < n; j0 += TRANSPOSE_TILE) {
+				swap_tiles(task, i0, i1, j0, (j0 + TRANSPOSE_TILE < n) ? j0 + TRANSPOSE_TILE : n);
+			}
+		}
+	}
+}
+
+/* 
+ * PURPOSE: Allocate the elements of a matrix 64 byte aligned.  Payloads big
+ *          enough to be mapped (see POOL_MAP_MIN) that are about to be
+ *          overwritten get their pages first written by the worker threads
+ *          over the same ranges parallel_for hands them later, so each page
+ *          lands on the NUMA node of the thread that works on it and the
+ *          page faults are taken in parallel.  Zeroed payloads are left
+ *          untouched, they cost nothing until they are written.
+ * INPUTS: number of elements, bytes per element, whether the elements must
+ *         be zero or are about to be overwritten
+ * RETURN: the elements, NULL if they could not be allocated or their size
+ *         does not fit a size_t
+ */
+void* alloc_payload (size_t count, size_t size, bool zero) {
+	size_t bytes = 0;
+	if (__builtin_mul_overflow(count, size, &bytes)) {
+		return NULL;
+	}
+	void *elems = zero ? pool_alloc(bytes) : pool_alloc_uninit(bytes);
+	if (elems && !zero && bytes >= POOL_MAP_MIN) {
+		Touch_Task_t task = { elems, size };
+		parallel_for(count, touch_range, &task);
+	}
+	return elems;
+}
+
+/* 
+ * PURPOSE: Write the first byte of every page that starts in a range of a
+ *          new payload, run by parallel_for.  Mapped payloads are zero and
+ *          page aligned, so writing zero leaves them unchanged.
+ * INPUTS: Touch_Task_t, first and one past the last element of the range
+ * RETURN: none
+ */
+void touch_range (void* ctx, size_t begin, size_t end) {
+	const Touch_Task_t *task = ctx;
+	const size_t first = (begin * task->size + TOUCH_STRIDE - 1) / TOUCH_STRIDE * TOUCH_STRIDE;
+	for (size_t offset = first; offset < end * task->size; offset += TOUCH_STRIDE) {
+		task->base[offset] = 0;
+	}
 }
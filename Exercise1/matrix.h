@@ -1,27 +1,107 @@
 #ifndef _MATRIX_H_
 #define _MATRIX_H_
 
+#include <stddef.h>
+
 #define MATRIX_NAME_LEN 25
 
+typedef enum {
+	MATRIX_MAP_COPY_ON_WRITE,
+	MATRIX_MAP_READ_ONLY
+}Matrix_Map_Mode_t;
+
+typedef enum {
+	MATRIX_WRITE_DEFAULT = 0,
+	MATRIX_WRITE_SYNC = 1,		/* fsync the file before returning */
+	MATRIX_WRITE_ATOMIC = 2,	/* write and sync a temporary file, then rename it over the target */
+	MATRIX_WRITE_COMPRESS = 4	/* store chunks compressed when that makes them smaller */
+}Matrix_Write_Flags_t;
+
+/* Element type of a matrix, also its code in matrix files.  Only MATRIX_U32
+ * matrices have sparse storage, lazy evaluation, mult and row/col sums. */
+typedef enum {
+	MATRIX_U32 = 0,
+	MATRIX_U8,
+	MATRIX_U16,
+	MATRIX_U64,
+	MATRIX_F32,
+	MATRIX_F64,
+	MATRIX_NUM_TYPES
+}Matrix_Type_t;
+
+struct Expr;
+struct Aio_Request;
+
+/* Data buffer shared by duplicates until one of them is written to */
+typedef struct {
+	unsigned int refs;
+	bool read_only;		/* the buffer is a read only mapping */
+}Matrix_Share_t;
+
+/* Compressed sparse row storage of a mostly zero matrix (see sparse.c).
+ * Row i holds the entries row_ptr[i] up to row_ptr[i + 1], their columns
+ * ascending and no stored zeros. */
+typedef struct Matrix_Sparse {
+	unsigned int nnz;
+	size_t capacity;		/* entries allocated in col_idx and values */
+	unsigned int *row_ptr;		/* rows + 1 entries */
+	unsigned int *col_idx;
+	unsigned int *values;
+}Matrix_Sparse_t;
+
 typedef struct {
 	char name[MATRIX_NAME_LEN];
 	unsigned int rows;
 	unsigned int cols;
-	unsigned int *data;
+	union {
+		unsigned int *data;	/* elements of a MATRIX_U32 matrix */
+		void *elems;		/* elements of any type */
+	};
+	Matrix_Type_t type;
+	void *map_base;		/* non-NULL when data lives inside an mmap'd file */
+	size_t map_len;
+	bool read_only;
+	Matrix_Share_t *share;	/* NULL while no other matrix uses data */
+	unsigned long long hash;	/* content hash, only meaningful when hash_valid */
+	bool hash_valid;
+	struct Expr *pending;	/* deferred expression, data is NULL until forced */
+	unsigned int lazy_refs;	/* expression leaves reading this matrix */
+	struct Aio_Request *io;	/* background read in flight, data is NULL until waited on */
+	Matrix_Sparse_t *sparse;	/* CSR storage, data is NULL while it is set */
 }Matrix_t;
 
 bool create_matrix (Matrix_t** new_matrix, const char* name, const unsigned int rows, const unsigned int cols);
+bool create_typed_matrix (Matrix_t** new_matrix, const char* name, const unsigned int rows,
+	const unsigned int cols, Matrix_Type_t type);
 void destroy_matrix (Matrix_t** m); 
 bool write_matrix (const char* matrix_output_filename, Matrix_t* m);
+bool write_matrix_with_flags (const char* matrix_output_filename, Matrix_t* m, unsigned int flags);
 bool read_matrix (const char* matrix_input_filename, Matrix_t** m);
-int sum_matrix (Matrix_t* m);
+bool read_matrix_info (const char* matrix_input_filename, char* name, unsigned int* rows, unsigned int* cols);
+bool read_matrix_rows (const char* matrix_input_filename, Matrix_t** m, unsigned int first_row, unsigned int num_rows);
+bool map_matrix (const char* matrix_input_filename, Matrix_t** m, Matrix_Map_Mode_t mode);
+bool sum_matrix (Matrix_t* m, unsigned long long* sum);
+bool sum_matrix_real (Matrix_t* m, double* sum);
+bool sum_matrix_rows (Matrix_t* m, Matrix_t* result);
+bool sum_matrix_cols (Matrix_t* m, Matrix_t* result);
 bool add_matrices (Matrix_t* a, Matrix_t* b, Matrix_t* c); 
+bool multiply_matrices (Matrix_t* a, Matrix_t* b, Matrix_t* c);
+bool transpose_matrix (Matrix_t* a, Matrix_t* b);
+bool transpose_matrix_in_place (Matrix_t* m);
 bool bitwise_shift_matrix (Matrix_t* a, char direction, unsigned int shift);
 bool duplicate_matrix (Matrix_t* src, Matrix_t* dest);
+bool share_matrix (Matrix_t** new_matrix, const char* name, Matrix_t* src);
 bool equal_matrices (Matrix_t* a, Matrix_t* b); 
 void display_matrix (Matrix_t* m); 
+void display_matrix_corners (Matrix_t* m, unsigned int corner);
+bool export_matrix (const char* filename, Matrix_t* m, char sep);
+bool import_matrix (const char* filename, const char* name, Matrix_Type_t type, Matrix_t** m);
 bool random_matrix(Matrix_t* m, unsigned int start_range, unsigned int end_range);
-unsigned int add_matrix_to_array (Matrix_t** mats, Matrix_t* new_matrix, unsigned int num_mats);
+bool convert_matrix (Matrix_t* m, Matrix_Type_t type);
+bool densify_matrix (Matrix_t* m);
+bool reserve_matrix_storage (Matrix_t* m);
+bool fit_matrix_storage (Matrix_t* m);
+bool random_matrix_seeded(Matrix_t* m, unsigned int start_range, unsigned int end_range, unsigned long long seed);
 
 
 #endif
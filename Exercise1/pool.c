@@ -0,0 +1,366 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+
+#include "pool.h"
+
+#define ARENA_BLOCK_SIZE 4096
+#define ARENA_ALIGN 16
+#define POOL_MIN_SHIFT 6	/* 64 byte smallest class */
+#define POOL_NUM_CLASSES 7	/* 64 .. 4096 bytes */
+#define POOL_MAX_CACHED 256	/* free blocks kept per class */
+#define POOL_ALIGN 64
+
+typedef struct Pool_Block {
+	struct Pool_Block* next;
+}Pool_Block_t;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static Pool_Block_t *free_lists[POOL_NUM_CLASSES];
+static unsigned int free_counts[POOL_NUM_CLASSES];
+static Pool_Stats_t stats;
+/* allocations of the calling thread, counted like pool_stats counts them */
+static __thread unsigned long thread_allocs = 0;
+static Pool_Pages_t page_policy = POOL_PAGES_THP;
+
+/*protected functions*/
+int size_class (size_t bytes);
+void* alloc_block (size_t bytes, bool zero);
+void* map_block (size_t bytes);
+
+/* 
+ * PURPOSE: Carve memory out of an arena, adding a block when the current
+ *          one is full
+ * INPUTS: arena, number of bytes
+ * RETURN: 16 byte aligned memory, NULL if the allocation failed
+ */
+void* arena_alloc (Arena_t* arena, size_t bytes) {
+	if (!arena) {
+		return NULL;
+	}
+
+	bytes = (bytes + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+	Arena_Block_t *block = arena->head;
+	if (!block || block->size - block->used < bytes) {
+		const size_t size = bytes > ARENA_BLOCK_SIZE ? bytes : ARENA_BLOCK_SIZE;
+		block = malloc(sizeof(Arena_Block_t) + size);
+		if (!block) {
+			return NULL;
+		}
+		__atomic_fetch_add(&stats.system_allocs, 1, __ATOMIC_RELAXED);
+		thread_allocs++;
+		block->size = size;
+		block->used = 0;
+		block->next = arena->head;
+		arena->head = block;
+	}
+	void *ptr = &block->data[block->used];
+	block->used += bytes;
+	__atomic_fetch_add(&stats.arena_allocs, 1, __ATOMIC_RELAXED);
+	thread_allocs++;
+	return ptr;
+}
+
+/* 
+ * PURPOSE: Copy a string into an arena
+ * INPUTS: arena, string
+ * RETURN: the copy, NULL if the allocation failed
+ */
+char* arena_strdup (Arena_t* arena, const char* str) {
+	if (!str) {
+		return NULL;
+	}
+	const size_t len = strlen(str) + 1;
+	char *copy = arena_alloc(arena, len);
+	if (copy) {
+		memcpy(copy, str, len);
+	}
+	return copy;
+}
+
+/* 
+ * PURPOSE: Release everything handed out by an arena.  The newest block is
+ *          kept so the next round of allocations needs no system call.
+ * INPUTS: arena
+ * RETURN: none
+ */
+void arena_reset (Arena_t* arena) {
+	if (!arena || !arena->head) {
+		return;
+	}
+
+	Arena_Block_t *block = arena->head->next;
+	while (block) {
+		Arena_Block_t *next = block->next;
+		free(block);
+		__atomic_fetch_add(&stats.system_frees, 1, __ATOMIC_RELAXED);
+		block = next;
+	}
+	arena->head->next = NULL;
+	arena->head->used = 0;
+}
+
+/* 
+ * PURPOSE: Free every block of an arena
+ * INPUTS: arena
+ * RETURN: none
+ */
+void arena_release (Arena_t* arena) {
+	if (!arena) {
+		return;
+	}
+	arena_reset(arena);
+	if (arena->head) {
+		free(arena->head);
+		__atomic_fetch_add(&stats.system_frees, 1, __ATOMIC_RELAXED);
+		arena->head = NULL;
+	}
+}
+
+/* 
+ * PURPOSE: Allocate zeroed memory.  Requests up to POOL_MAX_BLOCK bytes are
+ *          rounded to a power of two size class and reuse freed blocks of
+ *          that class, bigger ones go to the system (see alloc_block).
+ * INPUTS: number of bytes
+ * RETURN: zeroed 64 byte aligned memory, NULL if the allocation failed
+ */
+void* pool_alloc (size_t bytes) {
+	return alloc_block(bytes, true);
+}
+
+/* 
+ * PURPOSE: Allocate memory the caller is about to overwrite completely, so
+ *          it is not zeroed first.  Freed with pool_free like pool_alloc.
+ * INPUTS: number of bytes
+ * RETURN: 64 byte aligned memory of undefined contents, NULL if the
+ *         allocation failed
+ */
+void* pool_alloc_uninit (size_t bytes) {
+	return alloc_block(bytes, false);
+}
+
+/* 
+ * PURPOSE: Return memory from pool_alloc or pool_alloc_uninit
+ * INPUTS: pointer, the size it was allocated with
+ * RETURN: none
+ */
+void pool_free (void* ptr, size_t bytes) {
+	if (!ptr) {
+		return;
+	}
+
+	const int cls = size_class(bytes);
+	if (cls >= 0) {
+		pthread_mutex_lock(&pool_lock);
+		if (free_counts[cls] < POOL_MAX_CACHED) {
+			Pool_Block_t *block = ptr;
+			block->next = free_lists[cls];
+			free_lists[cls] = block;
+			free_counts[cls]++;
+			ptr = NULL;
+		}
+		pthread_mutex_unlock(&pool_lock);
+	}
+	if (ptr && bytes >= POOL_MAP_MIN) {
+		munmap(ptr, (bytes + POOL_HUGE_PAGE - 1) & ~(size_t) (POOL_HUGE_PAGE - 1));
+		__atomic_fetch_add(&stats.system_frees, 1, __ATOMIC_RELAXED);
+	}
+	else if (ptr) {
+		free(ptr);
+		__atomic_fetch_add(&stats.system_frees, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/* 
+ * PURPOSE: Give every cached free block back to the system
+ * INPUTS: none
+ * RETURN: none
+ */
+void pool_release (void) {
+	pthread_mutex_lock(&pool_lock);
+	for (int cls = 0; cls < POOL_NUM_CLASSES; ++cls) {
+		Pool_Block_t *block = free_lists[cls];
+		while (block) {
+			Pool_Block_t *next = block->next;
+			free(block);
+			__atomic_fetch_add(&stats.system_frees, 1, __ATOMIC_RELAXED);
+			block = next;
+		}
+		free_lists[cls] = NULL;
+		free_counts[cls] = 0;
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/* 
+ * PURPOSE: Snapshot the allocator counters
+ * INPUTS: none
+ * RETURN: counters
+ */
+Pool_Stats_t pool_stats (void) {
+	Pool_Stats_t snapshot;
+	snapshot.system_allocs = __atomic_load_n(&stats.system_allocs, __ATOMIC_RELAXED);
+	snapshot.system_frees = __atomic_load_n(&stats.system_frees, __ATOMIC_RELAXED);
+	snapshot.pool_hits = __atomic_load_n(&stats.pool_hits, __ATOMIC_RELAXED);
+	snapshot.arena_allocs = __atomic_load_n(&stats.arena_allocs, __ATOMIC_RELAXED);
+	snapshot.mapped_allocs = __atomic_load_n(&stats.mapped_allocs, __ATOMIC_RELAXED);
+	snapshot.hugetlb_allocs = __atomic_load_n(&stats.hugetlb_allocs, __ATOMIC_RELAXED);
+	return snapshot;
+}
+
+/* 
+ * PURPOSE: Count the allocations the calling thread has made, pooled or not
+ * INPUTS: none
+ * RETURN: system allocations, pool hits and arena allocations of this thread
+ */
+unsigned long pool_thread_allocs (void) {
+	return thread_allocs;
+}
+
+/* 
+ * PURPOSE: Pick how requests of POOL_MAP_MIN bytes or more are backed from
+ *          now on.  Memory already handed out keeps its pages.
+ * INPUTS: page policy
+ * RETURN: none
+ */
+void pool_set_pages (Pool_Pages_t pages) {
+	__atomic_store_n(&page_policy, pages, __ATOMIC_RELAXED);
+}
+
+/* 
+ * PURPOSE: Get the page policy of mapped requests
+ * INPUTS: none
+ * RETURN: page policy
+ */
+Pool_Pages_t pool_get_pages (void) {
+	return __atomic_load_n(&page_policy, __ATOMIC_RELAXED);
+}
+
+/* 
+ * PURPOSE: Name a page policy
+ * INPUTS: page policy
+ * RETURN: "small", "thp" or "hugetlb"
+ */
+const char* pool_pages_name (Pool_Pages_t pages) {
+	switch (pages) {
+		case POOL_PAGES_SMALL: return "small";
+		case POOL_PAGES_HUGETLB: return "hugetlb";
+		default: return "thp";
+	}
+}
+
+/*Protected Functions in C*/
+
+/* 
+ * PURPOSE: Allocate from a size class free list or the system.  Mapped
+ *          requests are always zero, the others are zeroed on request.
+ * INPUTS: number of bytes, whether the memory must be zeroed
+ * RETURN: 64 byte aligned memory, NULL if the allocation failed
+ */
+void* alloc_block (size_t bytes, bool zero) {
+	const int cls = size_class(bytes);
+	if (cls < 0 && bytes >= POOL_MAP_MIN) {
+		return map_block(bytes);
+	}
+	if (cls < 0) {
+		void *ptr = NULL;
+		if (posix_memalign(&ptr, POOL_ALIGN, bytes)) {
+			return NULL;
+		}
+		__atomic_fetch_add(&stats.system_allocs, 1, __ATOMIC_RELAXED);
+		thread_allocs++;
+		if (zero) {
+			memset(ptr, 0, bytes);
+		}
+		return ptr;
+	}
+
+	const size_t class_size = (size_t) 1 << (cls + POOL_MIN_SHIFT);
+	pthread_mutex_lock(&pool_lock);
+	Pool_Block_t *block = free_lists[cls];
+	if (block) {
+		free_lists[cls] = block->next;
+		free_counts[cls]--;
+		__atomic_fetch_add(&stats.pool_hits, 1, __ATOMIC_RELAXED);
+		thread_allocs++;
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	if (!block) {
+		if (posix_memalign((void**) &block, POOL_ALIGN, class_size)) {
+			return NULL;
+		}
+		__atomic_fetch_add(&stats.system_allocs, 1, __ATOMIC_RELAXED);
+		thread_allocs++;
+	}
+	if (zero) {
+		memset(block, 0, bytes ? bytes : 1);
+	}
+	return block;
+}
+
+/* 
+ * PURPOSE: Map a large request from the kernel in whole huge pages, backed
+ *          as the page policy says.  Pages are zero and only get memory
+ *          when first written, so the thread that first writes a page
+ *          places it on its own NUMA node.
+ * INPUTS: number of bytes, at least POOL_MAP_MIN
+ * RETURN: memory aligned to POOL_HUGE_PAGE, NULL if the mapping failed
+ */
+void* map_block (size_t bytes) {
+	const size_t len = (bytes + POOL_HUGE_PAGE - 1) & ~(size_t) (POOL_HUGE_PAGE - 1);
+	const Pool_Pages_t pages = pool_get_pages();
+#ifdef MAP_HUGETLB
+	if (pages == POOL_PAGES_HUGETLB) {
+		void *huge = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (huge != MAP_FAILED) {
+			__atomic_fetch_add(&stats.system_allocs, 1, __ATOMIC_RELAXED);
+			thread_allocs++;
+			__atomic_fetch_add(&stats.mapped_allocs, 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&stats.hugetlb_allocs, 1, __ATOMIC_RELAXED);
+			return huge;
+		}
+	}
+#endif
+
+	/*map a huge page more than needed and trim it to an aligned start*/
+	unsigned char *raw = mmap(NULL, len + POOL_HUGE_PAGE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (raw == MAP_FAILED) {
+		return NULL;
+	}
+	unsigned char *block = (unsigned char*) (((uintptr_t) raw + POOL_HUGE_PAGE - 1)
+		& ~(uintptr_t) (POOL_HUGE_PAGE - 1));
+	if (block > raw) {
+		munmap(raw, block - raw);
+	}
+	munmap(block + len, raw + POOL_HUGE_PAGE - block);
+#if defined(MADV_HUGEPAGE) && defined(MADV_NOHUGEPAGE)
+	madvise(block, len, (pages == POOL_PAGES_SMALL) ? MADV_NOHUGEPAGE : MADV_HUGEPAGE);
+#endif
+	__atomic_fetch_add(&stats.system_allocs, 1, __ATOMIC_RELAXED);
+	thread_allocs++;
+	__atomic_fetch_add(&stats.mapped_allocs, 1, __ATOMIC_RELAXED);
+	return block;
+}
+
+/* 
+ * PURPOSE: Map a request size to its size class
+ * INPUTS: number of bytes
+ * RETURN: class index, -1 for requests too big for the pool
+ */
+int size_class (size_t bytes) {
+	if (bytes > POOL_MAX_BLOCK) {
+		return -1;
+	}
+	int cls = 0;
+	while (((size_t) 1 << (cls + POOL_MIN_SHIFT)) < bytes) {
+		cls++;
+	}
+	return cls;
+}
@@ -0,0 +1,63 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Largest request served from the size classed free lists, bigger ones go
+ * straight to the system allocator */
+#define POOL_MAX_BLOCK 4096
+
+/* Requests of at least POOL_MAP_MIN bytes, in practice matrix payloads, are
+ * mapped straight from the kernel in whole POOL_HUGE_PAGE units aligned to
+ * a huge page, so they can be backed by huge pages (see Pool_Pages_t) and
+ * their zeroing is left to the first write of each page.  Everything else
+ * bigger than POOL_MAX_BLOCK is 64 byte aligned. */
+#define POOL_HUGE_PAGE (2 << 20)
+#define POOL_MAP_MIN POOL_HUGE_PAGE
+
+/* How mapped requests are backed */
+typedef enum {
+	POOL_PAGES_SMALL,	/* base pages only, even if the system defaults to huge ones */
+	POOL_PAGES_THP,		/* transparent huge pages advised with madvise */
+	POOL_PAGES_HUGETLB	/* reserved huge pages, falling back to POOL_PAGES_THP */
+}Pool_Pages_t;
+
+typedef struct Arena_Block {
+	struct Arena_Block* next;
+	size_t size;
+	size_t used;
+	unsigned char data[];
+}Arena_Block_t;
+
+/* Bump allocator, everything it handed out is released at once by
+ * arena_reset */
+typedef struct {
+	Arena_Block_t* head;
+}Arena_t;
+
+typedef struct {
+	unsigned long system_allocs;	/* calls into malloc and friends */
+	unsigned long system_frees;
+	unsigned long pool_hits;	/* requests served from a free list */
+	unsigned long arena_allocs;
+	unsigned long mapped_allocs;	/* requests mapped from the kernel, also system allocs */
+	unsigned long hugetlb_allocs;	/* mapped requests backed by reserved huge pages */
+}Pool_Stats_t;
+
+void* arena_alloc (Arena_t* arena, size_t bytes);
+char* arena_strdup (Arena_t* arena, const char* str);
+void arena_reset (Arena_t* arena);
+void arena_release (Arena_t* arena);
+
+void* pool_alloc (size_t bytes);
+void* pool_alloc_uninit (size_t bytes);
+void pool_free (void* ptr, size_t bytes);
+void pool_release (void);
+Pool_Stats_t pool_stats (void);
+unsigned long pool_thread_allocs (void);
+void pool_set_pages (Pool_Pages_t pages);
+Pool_Pages_t pool_get_pages (void);
+const char* pool_pages_name (Pool_Pages_t pages);
+
+#endif
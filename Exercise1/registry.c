@@ -0,0 +1,522 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "registry.h"
+#include "sparse.h"
+#include "types.h"
+#include "command.h"
+
+#define REGISTRY_INITIAL_BUCKETS 64
+#define SPILL_PATH_LEN 4096
+
+/*protected functions*/
+unsigned long hash_name (const char* name);
+Registry_Entry_t** find_link (Registry_t* reg, const char* name, unsigned long hash);
+bool grow_registry (Registry_t* reg);
+size_t matrix_bytes (const Matrix_t* m);
+void lru_unlink (Registry_t* reg, Registry_Entry_t* entry);
+void lru_push_front (Registry_t* reg, Registry_Entry_t* entry);
+void touch_entry (Registry_t* reg, Registry_Entry_t* entry);
+void spill_path (Registry_t* reg, unsigned long spill_id, char* path);
+bool spill_entry (Registry_t* reg, Registry_Entry_t* entry);
+bool reload_entry (Registry_t* reg, Registry_Entry_t* entry);
+void drop_entry (Registry_t* reg, Registry_Entry_t* entry);
+void enforce_budget (Registry_t* reg);
+
+/* 
+ * PURPOSE: Create an empty matrix registry
+ * INPUTS: where to store the new registry
+ * RETURN: True if successful, false if not.
+ */
+bool registry_create (Registry_t** reg) {
+	if (!reg) {
+		return false;
+	}
+
+	*reg = calloc(1, sizeof(Registry_t));
+	if (!*reg) {
+		return false;
+	}
+	(*reg)->buckets = calloc(REGISTRY_INITIAL_BUCKETS, sizeof(Registry_Entry_t*));
+	if (!(*reg)->buckets) {
+		free(*reg);
+		*reg = NULL;
+		return false;
+	}
+	(*reg)->num_buckets = REGISTRY_INITIAL_BUCKETS;
+	pthread_mutex_init(&(*reg)->lock, NULL);
+	return true;
+}
+
+/* 
+ * PURPOSE: Destroy a registry, every matrix still in it and any spill files
+ * INPUTS: registry to destroy
+ * RETURN: none.  The registry pointer is set to NULL.
+ */
+void registry_destroy (Registry_t** reg) {
+	if (!reg || !*reg) {
+		return;
+	}
+
+	for (size_t i = 0; i < (*reg)->num_buckets; ++i) {
+		Registry_Entry_t *entry = (*reg)->buckets[i];
+		while (entry) {
+			Registry_Entry_t *next = entry->next;
+			drop_entry(*reg, entry);
+			entry = next;
+		}
+	}
+	if ((*reg)->spill_dir) {
+		rmdir((*reg)->spill_dir);
+		free((*reg)->spill_dir);
+	}
+	free((*reg)->buckets);
+	pthread_mutex_destroy(&(*reg)->lock);
+	free(*reg);
+	*reg = NULL;
+}
+
+/* 
+ * PURPOSE: Look up a matrix by its exact name.  A spilled matrix is read
+ *          back from disk, and the matrix is marked as used by the current
+ *          command so it stays in memory until the command is done.
+ * INPUTS: registry, name to search for
+ * RETURN: The matrix if found, NULL if not or if it could not be reloaded.
+ */
+Matrix_t* registry_find (Registry_t* reg, const char* name) {
+	if (!reg || !name) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&reg->lock);
+	Registry_Entry_t *entry = *find_link(reg, name, hash_name(name));
+	Matrix_t *m = NULL;
+	if (entry && entry->matrix) {
+		reg->hits++;
+	}
+	else if (entry) {
+		reg->misses++;
+		if (!reload_entry(reg, entry)) {
+			entry = NULL;
+		}
+	}
+	if (entry) {
+		touch_entry(reg, entry);
+		enforce_budget(reg);
+		m = entry->matrix;
+	}
+	pthread_mutex_unlock(&reg->lock);
+	return m;
+}
+
+/* 
+ * PURPOSE: Look up the entry of a name without reading a spilled matrix
+ *          back or marking it used
+ * INPUTS: registry, name to search for
+ * RETURN: The entry if the name is registered, NULL if not.  It stays
+ *         valid until the entry is next inserted or removed.
+ */
+const Registry_Entry_t* registry_peek (Registry_t* reg, const char* name) {
+	if (!reg || !name) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&reg->lock);
+	const Registry_Entry_t *entry = *find_link(reg, name, hash_name(name));
+	pthread_mutex_unlock(&reg->lock);
+	return entry;
+}
+
+/* 
+ * PURPOSE: Add a matrix under its own name.  A different matrix already
+ *          registered under that name is destroyed and replaced, unless a
+ *          deferred expression still reads it.
+ * INPUTS: registry, matrix to take ownership of
+ * RETURN: True if successful, false if not.  On failure the caller keeps
+ *         ownership of the matrix.
+ */
+bool registry_insert (Registry_t* reg, Matrix_t* m) {
+	if (!reg || !m) {
+		return false;
+	}
+
+	pthread_mutex_lock(&reg->lock);
+	const unsigned long hash = hash_name(m->name);
+	Registry_Entry_t **link = find_link(reg, m->name, hash);
+	Registry_Entry_t *entry = *link;
+	/* like a spill, replacing a borrowed leaf would free it under its reader */
+	if (entry && entry->matrix && entry->matrix != m && entry->matrix->lazy_refs) {
+		pthread_mutex_unlock(&reg->lock);
+		return false;
+	}
+	if (entry) {
+		if (entry->matrix != m) {
+			if (entry->matrix) {
+				reg->resident_bytes -= entry->bytes;
+				destroy_matrix(&entry->matrix);
+			}
+			else {
+				char path[SPILL_PATH_LEN];
+				spill_path(reg, entry->spill_id, path);
+				unlink(path);
+				entry->spill_id = 0;
+			}
+			entry->matrix = m;
+			entry->bytes = matrix_bytes(m);
+			reg->resident_bytes += entry->bytes;
+		}
+	}
+	else {
+		if (reg->count >= reg->num_buckets && grow_registry(reg)) {
+			link = find_link(reg, m->name, hash);
+		}
+		entry = calloc(1, sizeof(Registry_Entry_t));
+		if (!entry) {
+			pthread_mutex_unlock(&reg->lock);
+			return false;
+		}
+		memcpy(entry->name, m->name, MATRIX_NAME_LEN);
+		entry->hash = hash;
+		entry->matrix = m;
+		entry->bytes = matrix_bytes(m);
+		*link = entry;
+		reg->count++;
+		reg->resident_bytes += entry->bytes;
+		lru_push_front(reg, entry);
+	}
+	touch_entry(reg, entry);
+	enforce_budget(reg);
+	pthread_mutex_unlock(&reg->lock);
+	return true;
+}
+
+/* 
+ * PURPOSE: Remove and destroy the matrix with the given name
+ * INPUTS: registry, name of the matrix
+ * RETURN: True if a matrix was removed, false if there was none.
+ */
+bool registry_remove (Registry_t* reg, const char* name) {
+	if (!reg || !name) {
+		return false;
+	}
+
+	pthread_mutex_lock(&reg->lock);
+	Registry_Entry_t **link = find_link(reg, name, hash_name(name));
+	Registry_Entry_t *entry = *link;
+	if (entry) {
+		*link = entry->next;
+		reg->count--;
+		drop_entry(reg, entry);
+	}
+	pthread_mutex_unlock(&reg->lock);
+	return entry != NULL;
+}
+
+/* 
+ * PURPOSE: Report how many matrices are registered
+ * INPUTS: registry
+ * RETURN: number of matrices, spilled ones included
+ */
+size_t registry_count (Registry_t* reg) {
+	return reg ? reg->count : 0;
+}
+
+/* 
+ * PURPOSE: Call visit on every registry entry, most recently used first.
+ *          Spilled entries are visited too, with a NULL matrix.
+ * INPUTS: registry, visitor, context passed to the visitor
+ * RETURN: none
+ */
+void registry_for_each (Registry_t* reg, Registry_Visit_t visit, void* ctx) {
+	if (!reg || !visit) {
+		return;
+	}
+
+	pthread_mutex_lock(&reg->lock);
+	for (Registry_Entry_t *entry = reg->lru_head; entry; entry = entry->lru_next) {
+		visit(entry, ctx);
+	}
+	pthread_mutex_unlock(&reg->lock);
+}
+
+/* 
+ * PURPOSE: Start a new command.  Matrices touched by earlier commands
+ *          are charged for their current size and become candidates for
+ *          spilling again.
+ * INPUTS: registry
+ * RETURN: none
+ */
+void registry_begin_command (Registry_t* reg) {
+	if (!reg) {
+		return;
+	}
+	pthread_mutex_lock(&reg->lock);
+	/* the storage of what the last command touched may have changed size */
+	for (Registry_Entry_t *entry = reg->lru_head; entry && entry->last_used == reg->command;
+		entry = entry->lru_next) {
+		if (entry->matrix) {
+			reg->resident_bytes -= entry->bytes;
+			entry->bytes = matrix_bytes(entry->matrix);
+			reg->resident_bytes += entry->bytes;
+		}
+	}
+	reg->command++;
+	pthread_mutex_unlock(&reg->lock);
+}
+
+/* 
+ * PURPOSE: Set the memory budget for resident matrices and spill down to it
+ * INPUTS: registry, budget in bytes, 0 for no limit
+ * RETURN: none
+ */
+void registry_set_budget (Registry_t* reg, size_t budget) {
+	if (!reg) {
+		return;
+	}
+	pthread_mutex_lock(&reg->lock);
+	reg->budget = budget;
+	enforce_budget(reg);
+	pthread_mutex_unlock(&reg->lock);
+}
+
+/*Protected Functions in C*/
+
+/* 
+ * PURPOSE: FNV-1a hash of a matrix name
+ * INPUTS: name
+ * RETURN: hash value
+ */
+unsigned long hash_name (const char* name) {
+	unsigned long long hash = 14695981039346656037ULL;
+	for (const unsigned char *c = (const unsigned char*) name; *c; ++c) {
+		hash ^= *c;
+		hash *= 1099511628211ULL;
+	}
+	return (unsigned long) hash;
+}
+
+/* 
+ * PURPOSE: Find the link that points at the entry for a name, or the empty
+ *          link at the end of its bucket where it would be inserted
+ * INPUTS: registry, name, hash of the name
+ * RETURN: link to the entry
+ */
+Registry_Entry_t** find_link (Registry_t* reg, const char* name, unsigned long hash) {
+	Registry_Entry_t **link = &reg->buckets[hash & (reg->num_buckets - 1)];
+	while (*link && ((*link)->hash != hash || strncmp((*link)->name, name, MATRIX_NAME_LEN) != 0)) {
+		link = &(*link)->next;
+	}
+	return link;
+}
+
+/* 
+ * PURPOSE: Double the bucket count and rehash every entry
+ * INPUTS: registry
+ * RETURN: True if the table grew, false if the allocation failed and the
+ *         table was left as it was.
+ */
+bool grow_registry (Registry_t* reg) {
+	const size_t num_buckets = reg->num_buckets * 2;
+	Registry_Entry_t **buckets = calloc(num_buckets, sizeof(Registry_Entry_t*));
+	if (!buckets) {
+		return false;
+	}
+
+	for (size_t i = 0; i < reg->num_buckets; ++i) {
+		Registry_Entry_t *entry = reg->buckets[i];
+		while (entry) {
+			Registry_Entry_t *next = entry->next;
+			Registry_Entry_t **head = &buckets[entry->hash & (num_buckets - 1)];
+			entry->next = *head;
+			*head = entry;
+			entry = next;
+		}
+	}
+	free(reg->buckets);
+	reg->buckets = buckets;
+	reg->num_buckets = num_buckets;
+	return true;
+}
+
+/* 
+ * PURPOSE: Memory a matrix is charged for
+ * INPUTS: matrix
+ * RETURN: header plus data size in bytes, dense or sparse
+ */
+size_t matrix_bytes (const Matrix_t* m) {
+	if (m->sparse) {
+		return sizeof(Matrix_t) + sparse_bytes(m->sparse, m->rows);
+	}
+	return sizeof(Matrix_t) + (size_t) m->rows * m->cols * type_size(m->type);
+}
+
+/* 
+ * PURPOSE: Take an entry out of the LRU list
+ * INPUTS: registry, entry
+ * RETURN: none
+ */
+void lru_unlink (Registry_t* reg, Registry_Entry_t* entry) {
+	if (entry->lru_prev) {
+		entry->lru_prev->lru_next = entry->lru_next;
+	}
+	else {
+		reg->lru_head = entry->lru_next;
+	}
+	if (entry->lru_next) {
+		entry->lru_next->lru_prev = entry->lru_prev;
+	}
+	else {
+		reg->lru_tail = entry->lru_prev;
+	}
+	entry->lru_prev = entry->lru_next = NULL;
+}
+
+/* 
+ * PURPOSE: Put an entry at the most recently used end of the LRU list
+ * INPUTS: registry, entry that is not in the list
+ * RETURN: none
+ */
+void lru_push_front (Registry_t* reg, Registry_Entry_t* entry) {
+	entry->lru_prev = NULL;
+	entry->lru_next = reg->lru_head;
+	if (reg->lru_head) {
+		reg->lru_head->lru_prev = entry;
+	}
+	reg->lru_head = entry;
+	if (!reg->lru_tail) {
+		reg->lru_tail = entry;
+	}
+}
+
+/* 
+ * PURPOSE: Mark an entry as used by the current command
+ * INPUTS: registry, entry
+ * RETURN: none.  The entry moves to the front of the LRU list.
+ */
+void touch_entry (Registry_t* reg, Registry_Entry_t* entry) {
+	entry->last_used = reg->command;
+	if (reg->lru_head != entry) {
+		lru_unlink(reg, entry);
+		lru_push_front(reg, entry);
+	}
+}
+
+/* 
+ * PURPOSE: Build the file name a spilled matrix is kept under
+ * INPUTS: registry, spill id, buffer of SPILL_PATH_LEN bytes
+ * RETURN: none.  The buffer holds the path.
+ */
+void spill_path (Registry_t* reg, unsigned long spill_id, char* path) {
+	snprintf(path, SPILL_PATH_LEN, "%s/%lu.mat", reg->spill_dir ? reg->spill_dir : ".", spill_id);
+}
+
+/* 
+ * PURPOSE: Write a matrix out to the spill directory and free its memory
+ * INPUTS: registry, resident entry
+ * RETURN: True if the matrix was spilled, false if it stays resident.
+ */
+bool spill_entry (Registry_t* reg, Registry_Entry_t* entry) {
+	if (!reg->spill_dir) {
+		const char *tmp = getenv("TMPDIR");
+		const size_t len = strlen(tmp ? tmp : "/tmp") + strlen("/matlab_spill_XXXXXX") + 1;
+		char *dir = malloc(len);
+		if (!dir) {
+			return false;
+		}
+		snprintf(dir, len, "%s/matlab_spill_XXXXXX", tmp ? tmp : "/tmp");
+		if (!mkdtemp(dir)) {
+			command_perror("FAILED TO CREATE SPILL DIRECTORY");
+			free(dir);
+			return false;
+		}
+		reg->spill_dir = dir;
+	}
+
+	char path[SPILL_PATH_LEN];
+	const unsigned long spill_id = ++reg->next_spill_id;
+	spill_path(reg, spill_id, path);
+	if (!write_matrix(path, entry->matrix)) {
+		unlink(path);
+		return false;
+	}
+
+	entry->rows = entry->matrix->rows;
+	entry->cols = entry->matrix->cols;
+	entry->read_only = entry->matrix->read_only;
+	entry->spill_id = spill_id;
+	destroy_matrix(&entry->matrix);
+	reg->resident_bytes -= entry->bytes;
+	reg->spills++;
+	return true;
+}
+
+/* 
+ * PURPOSE: Read a spilled matrix back into memory and remove its file.  A
+ *          matrix that was read only stays read only.
+ * INPUTS: registry, spilled entry
+ * RETURN: True if the matrix is resident again, false if not.
+ */
+bool reload_entry (Registry_t* reg, Registry_Entry_t* entry) {
+	char path[SPILL_PATH_LEN];
+	spill_path(reg, entry->spill_id, path);
+	if (!read_matrix(path, &entry->matrix)) {
+		fprintf(command_output(), "FAILED TO RELOAD SPILLED MATRIX (%s)\n", entry->name);
+		entry->matrix = NULL;
+		return false;
+	}
+	unlink(path);
+	entry->matrix->read_only = entry->read_only;
+	entry->spill_id = 0;
+	entry->bytes = matrix_bytes(entry->matrix);
+	reg->resident_bytes += entry->bytes;
+	return true;
+}
+
+/* 
+ * PURPOSE: Free an entry that is already unlinked from its bucket, with its
+ *          matrix or spill file
+ * INPUTS: registry, entry
+ * RETURN: none
+ */
+void drop_entry (Registry_t* reg, Registry_Entry_t* entry) {
+	lru_unlink(reg, entry);
+	if (entry->matrix) {
+		reg->resident_bytes -= entry->bytes;
+		destroy_matrix(&entry->matrix);
+	}
+	else if (entry->spill_id) {
+		char path[SPILL_PATH_LEN];
+		spill_path(reg, entry->spill_id, path);
+		unlink(path);
+	}
+	free(entry);
+}
+
+/* 
+ * PURPOSE: Spill least recently used matrices until the resident ones fit
+ *          the budget.  Matrices used by the current command are never
+ *          spilled since the command may still hold pointers to them, and
+ *          neither are deferred results, matrices a deferred expression
+ *          still reads or matrices still being read in the background.
+ * INPUTS: registry
+ * RETURN: none
+ */
+void enforce_budget (Registry_t* reg) {
+	if (!reg->budget) {
+		return;
+	}
+
+	Registry_Entry_t *entry = reg->lru_tail;
+	while (entry && reg->resident_bytes > reg->budget) {
+		Registry_Entry_t *prev = entry->lru_prev;
+		if (entry->matrix && entry->last_used != reg->command
+			&& !entry->matrix->pending && !entry->matrix->lazy_refs && !entry->matrix->io
+			&& !spill_entry(reg, entry)) {
+			return;
+		}
+		entry = prev;
+	}
+}
@@ -0,0 +1,60 @@
+#ifndef _REGISTRY_H_
+#define _REGISTRY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "matrix.h"
+
+typedef struct Registry_Entry {
+	char name[MATRIX_NAME_LEN];
+	unsigned long hash;
+	Matrix_t* matrix;		/* NULL while spilled to disk */
+	struct Registry_Entry* next;
+	struct Registry_Entry* lru_prev;
+	struct Registry_Entry* lru_next;
+	size_t bytes;			/* memory charged against the budget */
+	unsigned long last_used;	/* command that last touched the entry */
+	unsigned long spill_id;		/* 0 when resident */
+	unsigned int rows;
+	unsigned int cols;
+	bool read_only;			/* restored on the matrix when it is reloaded */
+}Registry_Entry_t;
+
+/* Workspace of named matrices, a chained hash table keyed by exact name.
+ * Under a memory budget the least recently used matrices are written to a
+ * spill directory and read back when they are looked up again.  Lookups
+ * are serialized by lock, so the server can run commands that only read
+ * matrices on several threads. */
+typedef struct {
+	Registry_Entry_t** buckets;
+	size_t num_buckets;
+	size_t count;
+	Registry_Entry_t* lru_head;	/* most recently used */
+	Registry_Entry_t* lru_tail;
+	size_t budget;			/* 0 for no limit */
+	size_t resident_bytes;
+	unsigned long command;
+	unsigned long next_spill_id;
+	char* spill_dir;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long spills;
+	pthread_mutex_t lock;
+}Registry_t;
+
+typedef void (*Registry_Visit_t)(const Registry_Entry_t* entry, void* ctx);
+
+bool registry_create (Registry_t** reg);
+void registry_destroy (Registry_t** reg);
+Matrix_t* registry_find (Registry_t* reg, const char* name);
+const Registry_Entry_t* registry_peek (Registry_t* reg, const char* name);
+bool registry_insert (Registry_t* reg, Matrix_t* m);
+bool registry_remove (Registry_t* reg, const char* name);
+size_t registry_count (Registry_t* reg);
+void registry_for_each (Registry_t* reg, Registry_Visit_t visit, void* ctx);
+void registry_begin_command (Registry_t* reg);
+void registry_set_budget (Registry_t* reg, size_t budget);
+
+#endif
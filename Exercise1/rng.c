@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "rng.h"
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+
+/* Values drawn per Philox block */
+#define RNG_LANES 4
+
+/* Philox blocks computed side by side so the rounds vectorize across them */
+#define RNG_BATCH 16
+
+/* Seed of the next fill that does not give its own */
+static unsigned long long session_seed = 0;
+
+/*protected functions*/
+void philox (const unsigned int ctr[RNG_LANES], unsigned long long seed, unsigned int out[RNG_LANES]);
+void philox_batch (unsigned long long first, unsigned long long seed, unsigned int out[RNG_BATCH * RNG_LANES]);
+unsigned int reduce (unsigned int x, size_t index, unsigned long long seed, unsigned int range, unsigned int threshold);
+unsigned int redraw (size_t index, unsigned long long seed, unsigned int range, unsigned int threshold);
+
+/*
+ * PURPOSE: Set the seed that later fills without their own seed derive
+ *          theirs from
+ * INPUTS: seed
+ * RETURN: none
+ */
+void rng_set_seed (unsigned long long seed) {
+	session_seed = seed;
+}
+
+/*
+ * PURPOSE: Report the current session seed
+ * INPUTS: none
+ * RETURN: seed the next rng_next_seed call starts from
+ */
+unsigned long long rng_get_seed (void) {
+	return session_seed;
+}
+
+/*
+ * PURPOSE: Derive the seed of one fill from the session seed (splitmix64),
+ *          so a run started from the same seed repeats every fill
+ * INPUTS: none
+ * RETURN: seed for one fill
+ */
+unsigned long long rng_next_seed (void) {
+	unsigned long long z = (session_seed += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+/*
+ * PURPOSE: Fill out[begin,end) with values uniformly drawn from
+ *          [low,high]
+ * INPUTS: output array, first and one past the last element, seed, range
+ * RETURN: none.  out is modified.
+ */
+void rng_fill_range (unsigned int* out, size_t begin, size_t end, unsigned long long seed,
+	unsigned int low, unsigned int high) {
+	rng_fill_block(&out[begin], begin, end, seed, low, high);
+}
+
+/*
+ * PURPOSE: Fill a buffer with the values elements begin to end of a fill
+ *          would get, uniformly drawn from [low,high].  Ranges are reduced
+ *          with Lemire's multiply and shift, the rare draws that would bias
+ *          the result are redrawn from a counter only that element uses.
+ * INPUTS: output of end - begin values, first and one past the last
+ *         element, seed, range
+ * RETURN: none.  out is modified.
+ */
+void rng_fill_block (unsigned int* out, size_t begin, size_t end, unsigned long long seed,
+	unsigned int low, unsigned int high) {
+	const unsigned int range = high - low + 1;	/* 0 means all 2^32 values */
+	const unsigned int threshold = range ? -range % range : 0;
+	const size_t span = RNG_BATCH * RNG_LANES;
+	unsigned int values[RNG_BATCH * RNG_LANES];
+
+	size_t i = begin;
+	while (i < end) {
+		const size_t base = i / span * span;
+		const size_t stop = (end - base < span) ? end : base + span;
+		philox_batch(base / RNG_LANES, seed, values);
+		if (!range) {
+			memcpy(&out[i - begin], &values[i - base], (stop - i) * sizeof(unsigned int));
+			i = stop;
+			continue;
+		}
+		for (; i < stop; ++i) {
+			out[i - begin] = low + reduce(values[i - base], i, seed, range, threshold);
+		}
+	}
+}
+
+/*Protected Functions in C*/
+
+/*
+ * PURPOSE: Run the Philox4x32-10 bijection on one counter
+ * INPUTS: counter, 64 bit key, output block
+ * RETURN: none.  out holds four random 32 bit values.
+ */
+void philox (const unsigned int ctr[RNG_LANES], unsigned long long seed, unsigned int out[RNG_LANES]) {
+	unsigned int c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+	unsigned int k0 = (unsigned int) seed, k1 = (unsigned int) (seed >> 32);
+	for (int r = 0; r < PHILOX_ROUNDS; ++r) {
+		const unsigned long long p0 = (unsigned long long) PHILOX_M0 * c0;
+		const unsigned long long p1 = (unsigned long long) PHILOX_M1 * c2;
+		const unsigned int n0 = (unsigned int) (p1 >> 32) ^ c1 ^ k0;
+		const unsigned int n2 = (unsigned int) (p0 >> 32) ^ c3 ^ k1;
+		c1 = (unsigned int) p1;
+		c3 = (unsigned int) p0;
+		c0 = n0;
+		c2 = n2;
+		k0 += PHILOX_W0;
+		k1 += PHILOX_W1;
+	}
+	out[0] = c0;
+	out[1] = c1;
+	out[2] = c2;
+	out[3] = c3;
+}
+
+/*
+ * PURPOSE: Run Philox on RNG_BATCH consecutive counters at once
+ * INPUTS: first counter, 64 bit key, output of RNG_BATCH blocks
+ * RETURN: none.  out holds the blocks one after the other.
+ */
+void philox_batch (unsigned long long first, unsigned long long seed, unsigned int out[RNG_BATCH * RNG_LANES]) {
+	unsigned int c0[RNG_BATCH], c1[RNG_BATCH], c2[RNG_BATCH], c3[RNG_BATCH];
+	for (int b = 0; b < RNG_BATCH; ++b) {
+		c0[b] = (unsigned int) (first + b);
+		c1[b] = (unsigned int) ((first + b) >> 32);
+		c2[b] = 0;
+		c3[b] = 0;
+	}
+	unsigned int k0 = (unsigned int) seed, k1 = (unsigned int) (seed >> 32);
+	for (int r = 0; r < PHILOX_ROUNDS; ++r) {
+		for (int b = 0; b < RNG_BATCH; ++b) {
+			const unsigned long long p0 = (unsigned long long) PHILOX_M0 * c0[b];
+			const unsigned long long p1 = (unsigned long long) PHILOX_M1 * c2[b];
+			const unsigned int n0 = (unsigned int) (p1 >> 32) ^ c1[b] ^ k0;
+			const unsigned int n2 = (unsigned int) (p0 >> 32) ^ c3[b] ^ k1;
+			c1[b] = (unsigned int) p1;
+			c3[b] = (unsigned int) p0;
+			c0[b] = n0;
+			c2[b] = n2;
+		}
+		k0 += PHILOX_W0;
+		k1 += PHILOX_W1;
+	}
+	for (int b = 0; b < RNG_BATCH; ++b) {
+		out[b * RNG_LANES] = c0[b];
+		out[b * RNG_LANES + 1] = c1[b];
+		out[b * RNG_LANES + 2] = c2[b];
+		out[b * RNG_LANES + 3] = c3[b];
+	}
+}
+
+/*
+ * PURPOSE: Map a random value onto [0,range) with Lemire's multiply and
+ *          shift, redrawing the rare values that would bias the result
+ * INPUTS: random value, element index, seed, range size, rejection threshold
+ * RETURN: offset into the range
+ */
+unsigned int reduce (unsigned int x, size_t index, unsigned long long seed, unsigned int range, unsigned int threshold) {
+	const unsigned long long m = (unsigned long long) x * range;
+	if ((unsigned int) m < threshold) {
+		return redraw(index, seed, range, threshold);
+	}
+	return (unsigned int) (m >> 32);
+}
+
+/*
+ * PURPOSE: Draw again for an element whose first draw was rejected, using
+ *          counters tagged with the element index and the attempt number
+ * INPUTS: element index, seed, range size, rejection threshold
+ * RETURN: offset into the range
+ */
+unsigned int redraw (size_t index, unsigned long long seed, unsigned int range, unsigned int threshold) {
+	unsigned int block[RNG_LANES];
+	for (unsigned int attempt = 1; ; ++attempt) {
+		const unsigned int ctr[RNG_LANES] = { (unsigned int) index,
+			(unsigned int) ((unsigned long long) index >> 32), attempt, 1 };
+		philox(ctr, seed, block);
+		for (int l = 0; l < RNG_LANES; ++l) {
+			const unsigned long long m = (unsigned long long) block[l] * range;
+			if ((unsigned int) m >= threshold) {
+				return (unsigned int) (m >> 32);
+			}
+		}
+	}
+}
@@ -0,0 +1,18 @@
+#ifndef _RNG_H_
+#define _RNG_H_
+
+#include <stddef.h>
+
+/* Counter based Philox4x32-10 generator.  Element i of a fill only depends
+ * on the seed and on i, so a fill can be split across any number of threads
+ * and still gives the same values. */
+
+void rng_set_seed (unsigned long long seed);
+unsigned long long rng_get_seed (void);
+unsigned long long rng_next_seed (void);
+void rng_fill_range (unsigned int* out, size_t begin, size_t end, unsigned long long seed,
+	unsigned int low, unsigned int high);
+void rng_fill_block (unsigned int* out, size_t begin, size_t end, unsigned long long seed,
+	unsigned int low, unsigned int high);
+
+#endif
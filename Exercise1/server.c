@@ -0,0 +1,951 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <readline/readline.h>
+
+#include "server.h"
+#include "expr.h"
+#include "pool.h"
+
+/* Seals of a reply handed out as shared memory, it can't change anymore */
+#define SERVER_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+/* Bytes of inline reply text the client copies to stdout at a time */
+#define SERVER_CLIENT_CHUNK (64 << 10)
+
+/* Connection of a client.  A client has at most one command running, the
+ * lines it sends meanwhile wait in its input buffer. */
+typedef struct Server_Client {
+	int fd;				/* -1 once closed */
+	unsigned int events;		/* epoll events asked for */
+	char input[SERVER_LINE_MAX];
+	size_t input_len;
+	bool busy;			/* a command of the client is running */
+	bool closing;			/* hung up or sent exit, closed once idle */
+	char* output;			/* reply header and text being sent */
+	size_t output_len;
+	size_t output_sent;
+	int shared_fd;			/* memory file to pass with the header, -1 if none */
+	struct Server_Client* prev;
+	struct Server_Client* next;
+}Server_Client_t;
+
+/* Command line of a client handed to a worker, and its reply */
+typedef struct Server_Job {
+	Server_Client_t* client;
+	char line[SERVER_LINE_MAX];
+	char* output;			/* Server_Reply_t and the inline text, NULL on failure */
+	size_t output_len;
+	int shared_fd;
+	struct Server_Job* next;
+}Server_Job_t;
+
+typedef struct {
+	Registry_t* reg;
+	Server_Execute_t execute;
+	pthread_rwlock_t workspace;	/* shared by readers, held alone by every other command */
+	pthread_mutex_t lock;		/* guards the job queues and stopping */
+	pthread_cond_t queued;
+	Server_Job_t* todo_head;
+	Server_Job_t* todo_tail;
+	Server_Job_t* done;
+	bool stopping;
+	int done_fd;			/* eventfd bumped by the workers for finished jobs */
+	Server_Client_t* clients;	/* touched by the event loop only */
+	Server_Client_t* closed;	/* freed once the events at hand are handled */
+}Server_t;
+
+typedef struct {
+	Server_t* server;
+	pthread_t thread;
+	Arena_t arena;			/* parsed command line of the job being run */
+	int reply_fd;			/* memory file collecting the reply */
+	FILE* reply;
+}Server_Worker_t;
+
+/* Commands that only read the workspace and may run at the same time as
+ * each other, with the argument counts they do that with */
+static const struct {
+	const char* name;
+	unsigned int min_cmds;
+	unsigned int max_cmds;
+}readers[] = {
+	{"display", 2, 3},
+	{"sum", 2, 2},
+	{"export", 3, 4},
+	{"list", 1, 1},
+	{"allocs", 1, 1},
+	{"stats", 1, 1}
+};
+
+static int stop_fd = -1;	/* eventfd written by SIGINT and SIGTERM */
+
+/*protected functions*/
+void on_stop_signal (int sig);
+int listen_on (const char* path);
+bool watch (int epfd, int op, int fd, unsigned int events, void* ptr);
+void accept_clients (Server_t* s, int epfd, int listen_fd);
+bool read_client (Server_Client_t* c);
+bool write_client (Server_Client_t* c);
+void service_client (Server_t* s, int epfd, Server_Client_t* c);
+void close_client (Server_t* s, int epfd, Server_Client_t* c);
+void free_closed (Server_t* s);
+void finish_jobs (Server_t* s, int epfd);
+void free_job (Server_Job_t* job);
+void* serve_jobs (void* arg);
+bool open_reply (Server_Worker_t* w);
+void run_job (Server_Worker_t* w, Server_Job_t* job);
+bool is_reader (const Commands_t* cmd);
+bool can_share (Registry_t* reg, const Commands_t* cmd);
+bool is_exit (const char* line);
+bool send_all (int fd, const char* buffer, size_t len);
+bool receive_reply (int fd);
+bool receive_header (int fd, Server_Reply_t* header, int* shared_fd);
+
+/*
+ * PURPOSE: Serve the workspace to local clients on a Unix domain socket
+ *          until SIGINT or SIGTERM.  An epoll loop does all socket I/O
+ *          and hands each command line to SERVER_WORKERS threads.  The
+ *          commands of readers (see readers) run at the same time under a
+ *          shared lock of the workspace, any other command runs alone.
+ * INPUTS: socket path, workspace, function running a parsed command
+ * RETURN: True once the server stopped, false if it could not start.
+ */
+bool server_run (const char* path, Registry_t* reg, Server_Execute_t execute) {
+	if (!path || !reg || !execute) {
+		return false;
+	}
+
+	Server_t server;
+	memset(&server, 0, sizeof(server));
+	server.reg = reg;
+	server.execute = execute;
+	pthread_rwlock_init(&server.workspace, NULL);
+	pthread_mutex_init(&server.lock, NULL);
+	pthread_cond_init(&server.queued, NULL);
+
+	int listen_fd = listen_on(path);
+	stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	server.done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	const int epfd = epoll_create1(EPOLL_CLOEXEC);
+	bool ok = listen_fd >= 0 && stop_fd >= 0 && server.done_fd >= 0 && epfd >= 0
+		&& watch(epfd, EPOLL_CTL_ADD, listen_fd, EPOLLIN, &listen_fd)
+		&& watch(epfd, EPOLL_CTL_ADD, stop_fd, EPOLLIN, &stop_fd)
+		&& watch(epfd, EPOLL_CTL_ADD, server.done_fd, EPOLLIN, &server.done_fd);
+
+	Server_Worker_t workers[SERVER_WORKERS];
+	memset(workers, 0, sizeof(workers));
+	unsigned int num_workers = 0;
+	for (; ok && num_workers < SERVER_WORKERS; ++num_workers) {
+		Server_Worker_t *w = &workers[num_workers];
+		w->server = &server;
+		if (!open_reply(w) || pthread_create(&w->thread, NULL, serve_jobs, w)) {
+			if (w->reply) {
+				fclose(w->reply);
+				close(w->reply_fd);
+			}
+			ok = false;
+			break;
+		}
+	}
+
+	struct sigaction stop, old_int, old_term;
+	memset(&stop, 0, sizeof(stop));
+	stop.sa_handler = on_stop_signal;
+	sigemptyset(&stop.sa_mask);
+	sigaction(SIGINT, &stop, &old_int);
+	sigaction(SIGTERM, &stop, &old_term);
+
+	if (ok) {
+		printf("Serving the workspace on (%s)\n", path);
+		fflush(stdout);
+	}
+	else if (listen_fd >= 0) {
+		perror("FAILED TO START SERVER");
+	}
+
+	bool running = ok;
+	while (running) {
+		struct epoll_event events[SERVER_MAX_EVENTS];
+		const int n = epoll_wait(epfd, events, SERVER_MAX_EVENTS, -1);
+		if (n < 0 && errno != EINTR) {
+			perror("SERVER WAIT FAILED");
+			break;
+		}
+		for (int i = 0; i < n; ++i) {
+			void *ptr = events[i].data.ptr;
+			if (ptr == &stop_fd) {
+				running = false;
+				continue;
+			}
+			if (ptr == &listen_fd) {
+				accept_clients(&server, epfd, listen_fd);
+				continue;
+			}
+			if (ptr == &server.done_fd) {
+				finish_jobs(&server, epfd);
+				continue;
+			}
+			Server_Client_t *c = ptr;
+			if (c->fd < 0) {
+				continue;
+			}
+			if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+				close_client(&server, epfd, c);
+				continue;
+			}
+			if ((events[i].events & EPOLLIN) && !read_client(c)) {
+				c->closing = true;
+			}
+			if ((events[i].events & EPOLLOUT) && !write_client(c)) {
+				close_client(&server, epfd, c);
+				continue;
+			}
+			service_client(&server, epfd, c);
+		}
+		free_closed(&server);
+	}
+
+	sigaction(SIGINT, &old_int, NULL);
+	sigaction(SIGTERM, &old_term, NULL);
+
+	pthread_mutex_lock(&server.lock);
+	server.stopping = true;
+	pthread_cond_broadcast(&server.queued);
+	pthread_mutex_unlock(&server.lock);
+	for (unsigned int i = 0; i < num_workers; ++i) {
+		pthread_join(workers[i].thread, NULL);
+		if (workers[i].reply) {
+			fclose(workers[i].reply);
+			close(workers[i].reply_fd);
+		}
+		arena_release(&workers[i].arena);
+	}
+	while (server.todo_head) {
+		Server_Job_t *job = server.todo_head;
+		server.todo_head = job->next;
+		free_job(job);
+	}
+	while (server.done) {
+		Server_Job_t *job = server.done;
+		server.done = job->next;
+		free_job(job);
+	}
+	while (server.clients) {
+		server.clients->busy = false;
+		close_client(&server, epfd, server.clients);
+	}
+	free_closed(&server);
+
+	if (epfd >= 0) {
+		close(epfd);
+	}
+	if (server.done_fd >= 0) {
+		close(server.done_fd);
+	}
+	if (stop_fd >= 0) {
+		close(stop_fd);
+		stop_fd = -1;
+	}
+	if (listen_fd >= 0) {
+		close(listen_fd);
+		unlink(path);
+	}
+	pthread_cond_destroy(&server.queued);
+	pthread_mutex_destroy(&server.lock);
+	pthread_rwlock_destroy(&server.workspace);
+	if (ok) {
+		printf("Server on (%s) stopped\n", path);
+	}
+	return ok;
+}
+
+/*
+ * PURPOSE: Send command lines to a server and print its replies.  Lines
+ *          are read with a prompt, or from a command file, in which case
+ *          the time of each round trip is reported on stderr as run_script
+ *          does.
+ * INPUTS: socket path, open command file (NULL to prompt)
+ * RETURN: 0 if every command got its reply, -1 if not.
+ */
+int server_client (const char* path, FILE* input) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (!path || strlen(path) >= sizeof(addr.sun_path)) {
+		printf("Invalid socket path (%s)\n", path ? path : "");
+		return -1;
+	}
+	memcpy(addr.sun_path, path, strlen(path) + 1);
+
+	const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+		perror("FAILED TO CONNECT TO SERVER");
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+
+	int status = 0;
+	char *line = NULL;
+	size_t capacity = 0;
+	unsigned int line_number = 0;
+	unsigned int count = 0;
+	double total_ms = 0;
+	while (true) {
+		if (input) {
+			if (getline(&line, &capacity, input) == -1) {
+				break;
+			}
+			line_number++;
+		}
+		else {
+			free(line);
+			line = readline("> ");
+			if (!line) {
+				break;
+			}
+		}
+
+		const char *start = line + strspn(line, " \t\r\n");
+		const size_t len = strcspn(start, "\r\n");
+		if (len == 0 || (input && *start == '#')) {
+			continue;
+		}
+		if (is_exit(start)) {
+			break;
+		}
+		if (len + 1 > SERVER_LINE_MAX) {
+			printf("Command line is longer than %d characters\n", SERVER_LINE_MAX - 1);
+			continue;
+		}
+
+		struct timespec begin, end;
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		if (!send_all(fd, start, len) || !send_all(fd, "\n", 1) || !receive_reply(fd)) {
+			printf("Lost the connection to the server\n");
+			status = -1;
+			break;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		const double ms = (end.tv_sec - begin.tv_sec) * 1e3 + (end.tv_nsec - begin.tv_nsec) / 1e6;
+		count++;
+		total_ms += ms;
+		if (input) {
+			fprintf(stderr, "[%u] %.*s: %.3f ms\n", line_number, (int) strcspn(start, " \t\r\n"), start, ms);
+		}
+	}
+	if (input) {
+		fprintf(stderr, "%u commands in %.3f ms\n", count, total_ms);
+	}
+	free(line);
+	close(fd);
+	return status;
+}
+
+/*Protected Functions in C*/
+
+/*
+ * PURPOSE: Signal handler asking the event loop to stop
+ * INPUTS: signal number
+ * RETURN: none
+ */
+void on_stop_signal (int sig) {
+	if (stop_fd >= 0) {
+		eventfd_write(stop_fd, 1);
+	}
+}
+
+/*
+ * PURPOSE: Create the listening socket.  A socket file left behind by a
+ *          server that is gone is replaced, one still answering is not.
+ * INPUTS: socket path
+ * RETURN: non blocking socket, -1 if it could not be created
+ */
+int listen_on (const char* path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		printf("Invalid socket path (%s)\n", path);
+		return -1;
+	}
+	memcpy(addr.sun_path, path, strlen(path) + 1);
+
+	struct stat st;
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		const int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		const bool live = probe >= 0 && connect(probe, (struct sockaddr*) &addr, sizeof(addr)) == 0;
+		if (probe >= 0) {
+			close(probe);
+		}
+		if (live) {
+			printf("A server is already running on (%s)\n", path);
+			return -1;
+		}
+		unlink(path);
+	}
+
+	const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("FAILED TO CREATE SOCKET");
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) || listen(fd, SOMAXCONN)) {
+		perror("FAILED TO LISTEN ON SOCKET");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * PURPOSE: Add or change the events epoll reports for a descriptor
+ * INPUTS: epoll instance, EPOLL_CTL_ADD or EPOLL_CTL_MOD, descriptor,
+ *         events, pointer the events come back with
+ * RETURN: True if successful, false if not.
+ */
+bool watch (int epfd, int op, int fd, unsigned int events, void* ptr) {
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = events;
+	event.data.ptr = ptr;
+	return epoll_ctl(epfd, op, fd, &event) == 0;
+}
+
+/*
+ * PURPOSE: Take every pending connection
+ * INPUTS: server, epoll instance, listening socket
+ * RETURN: none
+ */
+void accept_clients (Server_t* s, int epfd, int listen_fd) {
+	while (true) {
+		const int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0 && (errno == EINTR || errno == ECONNABORTED)) {
+			continue;
+		}
+		if (fd < 0) {
+			return;
+		}
+		Server_Client_t *c = calloc(1, sizeof(Server_Client_t));
+		if (!c || !watch(epfd, EPOLL_CTL_ADD, fd, EPOLLIN, c)) {
+			free(c);
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		c->events = EPOLLIN;
+		c->shared_fd = -1;
+		c->next = s->clients;
+		if (s->clients) {
+			s->clients->prev = c;
+		}
+		s->clients = c;
+	}
+}
+
+/*
+ * PURPOSE: Read what a client sent into its input buffer
+ * INPUTS: client
+ * RETURN: True while the client is connected, false once it hung up.
+ */
+bool read_client (Server_Client_t* c) {
+	while (c->input_len < SERVER_LINE_MAX) {
+		const ssize_t n = recv(c->fd, c->input + c->input_len, SERVER_LINE_MAX - c->input_len, 0);
+		if (n > 0) {
+			c->input_len += n;
+		}
+		else if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		else {
+			return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+		}
+	}
+	return true;
+}
+
+/*
+ * PURPOSE: Send as much of the reply of a client as its socket takes.  A
+ *          memory file goes along with the first byte of the header.
+ * INPUTS: client
+ * RETURN: True unless the connection failed.  The reply is freed once sent.
+ */
+bool write_client (Server_Client_t* c) {
+	while (c->output && c->output_sent < c->output_len) {
+		struct iovec iov = { c->output + c->output_sent, c->output_len - c->output_sent };
+		struct msghdr msg;
+		char control[CMSG_SPACE(sizeof(int))];
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		if (c->shared_fd >= 0) {
+			memset(control, 0, sizeof(control));
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(cmsg), &c->shared_fd, sizeof(int));
+		}
+		const ssize_t n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+		if (c->shared_fd >= 0) {
+			close(c->shared_fd);
+			c->shared_fd = -1;
+		}
+		c->output_sent += n;
+	}
+	free(c->output);
+	c->output = NULL;
+	c->output_len = c->output_sent = 0;
+	return true;
+}
+
+/*
+ * PURPOSE: Move a client along once it is idle: start its next buffered
+ *          line, or close it if it is done, then ask epoll for the events
+ *          it waits on.  Lines a client sent before hanging up still run.
+ * INPUTS: server, epoll instance, client
+ * RETURN: none
+ */
+void service_client (Server_t* s, int epfd, Server_Client_t* c) {
+	while (!c->busy && !c->output) {
+		char *end = memchr(c->input, '\n', c->input_len);
+		if (!end) {
+			if (c->input_len == SERVER_LINE_MAX) {
+				printf("Client sent a line of more than %d characters\n", SERVER_LINE_MAX - 1);
+				c->closing = true;
+			}
+			break;
+		}
+		const size_t len = end - c->input + 1;
+		*end = '\0';
+		Server_Job_t *job = NULL;
+		if (is_exit(c->input + strspn(c->input, " \t\r"))
+			|| !(job = calloc(1, sizeof(Server_Job_t)))) {
+			c->closing = true;
+			c->input_len = 0;
+			break;
+		}
+		memcpy(job->line, c->input, len);
+		job->client = c;
+		job->shared_fd = -1;
+		c->input_len -= len;
+		memmove(c->input, c->input + len, c->input_len);
+		c->busy = true;
+
+		pthread_mutex_lock(&s->lock);
+		if (s->todo_tail) {
+			s->todo_tail->next = job;
+		}
+		else {
+			s->todo_head = job;
+		}
+		s->todo_tail = job;
+		pthread_cond_signal(&s->queued);
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	if (c->closing && !c->busy && !c->output) {
+		close_client(s, epfd, c);
+		return;
+	}
+	unsigned int events = 0;
+	if (c->output) {
+		events = EPOLLOUT;
+	}
+	else if (!c->busy && !c->closing) {
+		events = EPOLLIN;
+	}
+	if (events != c->events && watch(epfd, EPOLL_CTL_MOD, c->fd, events, c)) {
+		c->events = events;
+	}
+}
+
+/*
+ * PURPOSE: Close the connection of a client.  The client is moved to the
+ *          closed list once no command of it is running, so events already
+ *          taken from epoll can still look at it.
+ * INPUTS: server, epoll instance, client
+ * RETURN: none
+ */
+void close_client (Server_t* s, int epfd, Server_Client_t* c) {
+	c->closing = true;
+	if (c->fd >= 0) {
+		epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+		close(c->fd);
+		c->fd = -1;
+	}
+	if (c->busy) {
+		return;
+	}
+	if (c->prev) {
+		c->prev->next = c->next;
+	}
+	else {
+		s->clients = c->next;
+	}
+	if (c->next) {
+		c->next->prev = c->prev;
+	}
+	c->prev = NULL;
+	c->next = s->closed;
+	s->closed = c;
+}
+
+/*
+ * PURPOSE: Free the clients closed since the last call
+ * INPUTS: server
+ * RETURN: none
+ */
+void free_closed (Server_t* s) {
+	while (s->closed) {
+		Server_Client_t *c = s->closed;
+		s->closed = c->next;
+		if (c->shared_fd >= 0) {
+			close(c->shared_fd);
+		}
+		free(c->output);
+		free(c);
+	}
+}
+
+/*
+ * PURPOSE: Start sending the replies of the jobs the workers finished
+ * INPUTS: server, epoll instance
+ * RETURN: none
+ */
+void finish_jobs (Server_t* s, int epfd) {
+	eventfd_t count;
+	eventfd_read(s->done_fd, &count);
+	pthread_mutex_lock(&s->lock);
+	Server_Job_t *job = s->done;
+	s->done = NULL;
+	pthread_mutex_unlock(&s->lock);
+
+	while (job) {
+		Server_Job_t *next = job->next;
+		Server_Client_t *c = job->client;
+		c->busy = false;
+		if (c->fd < 0 || !job->output) {
+			close_client(s, epfd, c);
+			free_job(job);
+		}
+		else {
+			c->output = job->output;
+			c->output_len = job->output_len;
+			c->output_sent = 0;
+			c->shared_fd = job->shared_fd;
+			free(job);
+			if (!write_client(c)) {
+				close_client(s, epfd, c);
+			}
+			else {
+				service_client(s, epfd, c);
+			}
+		}
+		job = next;
+	}
+}
+
+/*
+ * PURPOSE: Free a job with the reply it holds
+ * INPUTS: job
+ * RETURN: none
+ */
+void free_job (Server_Job_t* job) {
+	if (job->shared_fd >= 0) {
+		close(job->shared_fd);
+	}
+	free(job->output);
+	free(job);
+}
+
+/*
+ * PURPOSE: Run queued jobs until the server stops
+ * INPUTS: Server_Worker_t
+ * RETURN: NULL
+ */
+void* serve_jobs (void* arg) {
+	Server_Worker_t *w = arg;
+	Server_t *s = w->server;
+	pthread_mutex_lock(&s->lock);
+	while (true) {
+		while (!s->stopping && !s->todo_head) {
+			pthread_cond_wait(&s->queued, &s->lock);
+		}
+		if (s->stopping) {
+			break;
+		}
+		Server_Job_t *job = s->todo_head;
+		s->todo_head = job->next;
+		if (!s->todo_head) {
+			s->todo_tail = NULL;
+		}
+		pthread_mutex_unlock(&s->lock);
+
+		run_job(w, job);
+
+		pthread_mutex_lock(&s->lock);
+		job->next = s->done;
+		s->done = job;
+		eventfd_write(s->done_fd, 1);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+/*
+ * PURPOSE: Give a worker a new memory file to collect replies in
+ * INPUTS: worker
+ * RETURN: True if successful, false if not.
+ */
+bool open_reply (Server_Worker_t* w) {
+	w->reply = NULL;
+	w->reply_fd = memfd_create("matlab-reply", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (w->reply_fd < 0) {
+		return false;
+	}
+	const int dup_fd = dup(w->reply_fd);
+	w->reply = (dup_fd >= 0) ? fdopen(dup_fd, "w") : NULL;
+	if (!w->reply) {
+		if (dup_fd >= 0) {
+			close(dup_fd);
+		}
+		close(w->reply_fd);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * PURPOSE: Run the command line of a job and build its reply.  Short
+ *          replies are copied after the header, longer ones are sealed and
+ *          the memory file they were written to goes to the client.
+ * INPUTS: worker, job
+ * RETURN: none.  The reply is stored in the job, its output is NULL if it
+ *         could not be built.
+ */
+void run_job (Server_Worker_t* w, Server_Job_t* job) {
+	Server_t *s = w->server;
+	if (!w->reply && !open_reply(w)) {
+		return;
+	}
+	rewind(w->reply);
+	if (ftruncate(w->reply_fd, 0)) {
+		return;
+	}
+
+	Commands_t cmd;
+	arena_reset(&w->arena);
+	if (!parse_arena_input(&w->arena, job->line, &cmd)) {
+		fprintf(w->reply, "Failed at parsing command\n\n");
+	}
+	else if (cmd.num_cmds > 0) {
+		bool shared = is_reader(&cmd);
+		if (shared) {
+			pthread_rwlock_rdlock(&s->workspace);
+			if (!can_share(s->reg, &cmd)) {
+				pthread_rwlock_unlock(&s->workspace);
+				shared = false;
+			}
+		}
+		if (!shared) {
+			pthread_rwlock_wrlock(&s->workspace);
+		}
+		command_set_output(w->reply);
+		s->execute(&cmd, s->reg);
+		command_set_output(NULL);
+		pthread_rwlock_unlock(&s->workspace);
+	}
+	fflush(w->reply);
+	const long len = ftell(w->reply);
+	if (len < 0) {
+		return;
+	}
+
+	Server_Reply_t header = { (unsigned long long) len, 0 };
+	if (len >= SERVER_SHARED_MIN && fcntl(w->reply_fd, F_ADD_SEALS, SERVER_SEALS) == 0) {
+		header.text_len = 0;
+		header.shared_len = len;
+		job->shared_fd = w->reply_fd;
+		fclose(w->reply);
+		open_reply(w);
+	}
+	job->output_len = sizeof(header) + header.text_len;
+	job->output = malloc(job->output_len);
+	if (!job->output) {
+		return;
+	}
+	memcpy(job->output, &header, sizeof(header));
+	if (header.text_len && pread(w->reply_fd, job->output + sizeof(header), header.text_len, 0) != len) {
+		free(job->output);
+		job->output = NULL;
+	}
+}
+
+/*
+ * PURPOSE: Decide whether a command only reads the workspace
+ * INPUTS: parsed command
+ * RETURN: True if it is one of readers.
+ */
+bool is_reader (const Commands_t* cmd) {
+	for (size_t i = 0; i < sizeof(readers) / sizeof(readers[0]); ++i) {
+		if (strncmp(cmd->cmds[0], readers[i].name, strlen(readers[i].name) + 1) == 0) {
+			return cmd->num_cmds >= readers[i].min_cmds && cmd->num_cmds <= readers[i].max_cmds;
+		}
+	}
+	return false;
+}
+
+/*
+ * PURPOSE: Decide whether a reader can run next to other readers.  It can
+ *          not when running it would change the workspace after all:
+ *          deferred matrices would be evaluated, a spilled or background
+ *          read matrix brought in, or other matrices spilled for it.
+ * INPUTS: registry, read locked by the caller, parsed reader command
+ * RETURN: True if it can run under the shared lock.
+ */
+bool can_share (Registry_t* reg, const Commands_t* cmd) {
+	if (lazy_is_enabled() || reg->budget || lazy_pending_count(reg)) {
+		return false;
+	}
+	if (strncmp(cmd->cmds[0],"display",strlen("display") + 1) != 0
+		&& strncmp(cmd->cmds[0],"sum",strlen("sum") + 1) != 0
+		&& strncmp(cmd->cmds[0],"export",strlen("export") + 1) != 0) {
+		return true;
+	}
+	const Registry_Entry_t *entry = registry_peek(reg, cmd->cmds[1]);
+	return !entry || (entry->matrix && !entry->matrix->io && !entry->matrix->pending);
+}
+
+/*
+ * PURPOSE: Check for the exit command
+ * INPUTS: line without leading blanks
+ * RETURN: True if the line is exit.
+ */
+bool is_exit (const char* line) {
+	return strncmp(line, "exit", strlen("exit")) == 0
+		&& line[strlen("exit") + strspn(line + strlen("exit"), " \t\r\n")] == '\0';
+}
+
+/*
+ * PURPOSE: Write a whole buffer to a blocking socket
+ * INPUTS: socket, buffer, length
+ * RETURN: True if everything was sent, false if the connection failed.
+ */
+bool send_all (int fd, const char* buffer, size_t len) {
+	while (len > 0) {
+		const ssize_t n = send(fd, buffer, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		buffer += n;
+		len -= n;
+	}
+	return true;
+}
+
+/*
+ * PURPOSE: Receive a reply and print it.  Shared replies are mapped and
+ *          written straight from the mapping.
+ * INPUTS: socket
+ * RETURN: True if the whole reply arrived, false if not.
+ */
+bool receive_reply (int fd) {
+	Server_Reply_t header;
+	int shared_fd = -1;
+	if (!receive_header(fd, &header, &shared_fd)) {
+		if (shared_fd >= 0) {
+			close(shared_fd);
+		}
+		return false;
+	}
+
+	bool ok = true;
+	char buffer[SERVER_CLIENT_CHUNK];
+	unsigned long long remaining = header.text_len;
+	while (ok && remaining > 0) {
+		const ssize_t n = recv(fd, buffer, remaining < sizeof(buffer) ? remaining : sizeof(buffer), 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		ok = n > 0 && fwrite(buffer, 1, n, stdout) == (size_t) n;
+		remaining -= (n > 0) ? n : 0;
+	}
+	if (ok && header.shared_len) {
+		void *text = (shared_fd >= 0) ?
+			mmap(NULL, header.shared_len, PROT_READ, MAP_SHARED, shared_fd, 0) : MAP_FAILED;
+		ok = text != MAP_FAILED;
+		if (ok) {
+			madvise(text, header.shared_len, MADV_SEQUENTIAL);
+			fwrite(text, 1, header.shared_len, stdout);
+			munmap(text, header.shared_len);
+		}
+	}
+	if (shared_fd >= 0) {
+		close(shared_fd);
+	}
+	fflush(stdout);
+	return ok;
+}
+
+/*
+ * PURPOSE: Receive a reply header and the memory file passed with it
+ * INPUTS: socket, where to store the header and the memory file (-1 if
+ *         there is none)
+ * RETURN: True if the header arrived, false if the connection failed.
+ */
+bool receive_header (int fd, Server_Reply_t* header, int* shared_fd) {
+	size_t got = 0;
+	while (got < sizeof(*header)) {
+		struct iovec iov = { (char*) header + got, sizeof(*header) - got };
+		struct msghdr msg;
+		char control[CMSG_SPACE(sizeof(int))];
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		const ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+				memcpy(shared_fd, CMSG_DATA(cmsg), sizeof(int));
+			}
+		}
+		got += n;
+	}
+	return true;
+}
@@ -0,0 +1,35 @@
+#ifndef _SERVER_H_
+#define _SERVER_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "command.h"
+#include "registry.h"
+
+/* Longest command line a client may send, newline included */
+#define SERVER_LINE_MAX 4096
+/* Threads running commands, each owns a reply buffer */
+#define SERVER_WORKERS 4
+/* Events taken from epoll per wakeup */
+#define SERVER_MAX_EVENTS 64
+/* Replies of at least this many bytes, in practice displayed matrices, are
+ * handed to the client as shared memory instead of being sent as text */
+#define SERVER_SHARED_MIN (64 << 10)
+
+/* Sent ahead of every reply.  A reply is either text_len bytes of text
+ * following the header, or a sealed memory file of shared_len bytes passed
+ * along with the header (SCM_RIGHTS), which the client maps. */
+typedef struct {
+	unsigned long long text_len;
+	unsigned long long shared_len;
+}Server_Reply_t;
+
+/* Runs one parsed command against the workspace, writing its reply to
+ * command_output() */
+typedef void (*Server_Execute_t)(Commands_t* cmd, Registry_t* reg);
+
+bool server_run (const char* path, Registry_t* reg, Server_Execute_t execute);
+int server_client (const char* path, FILE* input);
+
+#endif
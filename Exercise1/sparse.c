@@ -0,0 +1,581 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+
+#include "sparse.h"
+#include "thread_pool.h"
+#include "kernels.h"
+#include "pool.h"
+
+/* Elements counted between checks of the early exit in sparse_count_nonzero */
+#define SPARSE_SCAN_BLOCK 4096
+
+typedef struct {
+	const Matrix_Sparse_t* a;
+	const Matrix_Sparse_t* b;
+	unsigned int* row_ptr;
+	Matrix_Sparse_t* c;
+}Sparse_Add_Task_t;
+
+typedef struct {
+	const Matrix_t* s;		/* sparse operand */
+	const Matrix_t* d;		/* dense operand */
+	int differ;
+}Sparse_Equal_Task_t;
+
+typedef struct {
+	const Matrix_t* a;
+	const Matrix_t* b;
+	Matrix_t* c;
+}Sparse_Mult_Task_t;
+
+/*protected functions*/
+size_t row_entry (const Matrix_Sparse_t* s, size_t row, unsigned int col);
+unsigned int merge_row (const Matrix_Sparse_t* a, const Matrix_Sparse_t* b, size_t row,
+	unsigned int* cols, unsigned int* values);
+void add_count_range (void* ctx, size_t begin, size_t end);
+void add_fill_range (void* ctx, size_t begin, size_t end);
+void equal_dense_range (void* ctx, size_t begin, size_t end);
+void axpy_row (const Matrix_t* b, size_t k, unsigned int scale, unsigned int* crow);
+void multiply_range (void* ctx, size_t begin, size_t end);
+
+/*
+ * PURPOSE: Allocate empty CSR storage.  Every row starts out empty.
+ * INPUTS: number of rows, number of entries to make room for
+ * RETURN: the storage, NULL if it could not be allocated
+ */
+Matrix_Sparse_t* sparse_alloc (unsigned int rows, size_t capacity) {
+	Matrix_Sparse_t *s = pool_alloc(sizeof(Matrix_Sparse_t));
+	if (!s) {
+		return NULL;
+	}
+	s->capacity = capacity;
+	s->row_ptr = pool_alloc(((size_t) rows + 1) * sizeof(unsigned int));
+	s->col_idx = pool_alloc(capacity * sizeof(unsigned int));
+	s->values = pool_alloc(capacity * sizeof(unsigned int));
+	if (!s->row_ptr || !s->col_idx || !s->values) {
+		sparse_free(&s, rows);
+		return NULL;
+	}
+	return s;
+}
+
+/*
+ * PURPOSE: Free CSR storage
+ * INPUTS: storage, may be NULL, number of rows it was allocated for
+ * RETURN: none.  The pointer is set to NULL.
+ */
+void sparse_free (Matrix_Sparse_t** s, unsigned int rows) {
+	if (!s || !*s) {
+		return;
+	}
+	pool_free((*s)->row_ptr, ((size_t) rows + 1) * sizeof(unsigned int));
+	pool_free((*s)->col_idx, (*s)->capacity * sizeof(unsigned int));
+	pool_free((*s)->values, (*s)->capacity * sizeof(unsigned int));
+	pool_free(*s, sizeof(Matrix_Sparse_t));
+	*s = NULL;
+}
+
+/*
+ * PURPOSE: Copy CSR storage, trimmed to the entries in use
+ * INPUTS: storage, number of rows
+ * RETURN: the copy, NULL if it could not be allocated
+ */
+Matrix_Sparse_t* sparse_copy (const Matrix_Sparse_t* s, unsigned int rows) {
+	Matrix_Sparse_t *copy = sparse_alloc(rows, s->nnz);
+	if (!copy) {
+		return NULL;
+	}
+	copy->nnz = s->nnz;
+	memcpy(copy->row_ptr, s->row_ptr, ((size_t) rows + 1) * sizeof(unsigned int));
+	memcpy(copy->col_idx, s->col_idx, (size_t) s->nnz * sizeof(unsigned int));
+	memcpy(copy->values, s->values, (size_t) s->nnz * sizeof(unsigned int));
+	return copy;
+}
+
+/*
+ * PURPOSE: Memory held by CSR storage
+ * INPUTS: storage, number of rows
+ * RETURN: size in bytes
+ */
+size_t sparse_bytes (const Matrix_Sparse_t* s, unsigned int rows) {
+	return sizeof(Matrix_Sparse_t) + ((size_t) rows + 1) * sizeof(unsigned int)
+		+ s->capacity * 2 * sizeof(unsigned int);
+}
+
+/*
+ * PURPOSE: Count the nonzero elements of dense data, giving up once there
+ *          are more than limit so dense matrices are rejected early
+ * INPUTS: data, number of elements, most nonzeros of interest
+ * RETURN: the count, or some number above limit
+ */
+size_t sparse_count_nonzero (const unsigned int* data, size_t count, size_t limit) {
+	size_t nnz = 0;
+	for (size_t i = 0; i < count && nnz <= limit; i += SPARSE_SCAN_BLOCK) {
+		const size_t n = (count - i < SPARSE_SCAN_BLOCK) ? count - i : SPARSE_SCAN_BLOCK;
+		for (size_t j = 0; j < n; ++j) {
+			nnz += data[i + j] != 0;
+		}
+	}
+	return nnz;
+}
+
+/*
+ * PURPOSE: Build CSR storage from dense data
+ * INPUTS: data, rows, cols, exact number of nonzeros in it
+ * RETURN: the storage, NULL if it could not be allocated or nnz is wrong
+ */
+Matrix_Sparse_t* sparse_from_dense (const unsigned int* data, unsigned int rows, unsigned int cols, size_t nnz) {
+	if (nnz > UINT_MAX) {
+		return NULL;
+	}
+	Matrix_Sparse_t *s = sparse_alloc(rows, nnz);
+	if (!s) {
+		return NULL;
+	}
+
+	size_t e = 0;
+	for (size_t i = 0; i < rows; ++i) {
+		const unsigned int *row = &data[i * cols];
+		for (size_t j = 0; j < cols; ++j) {
+			if (!row[j]) {
+				continue;
+			}
+			if (e == nnz) {
+				sparse_free(&s, rows);
+				return NULL;
+			}
+			s->col_idx[e] = j;
+			s->values[e] = row[j];
+			++e;
+		}
+		s->row_ptr[i + 1] = e;
+	}
+	s->nnz = e;
+	return s;
+}
+
+/*
+ * PURPOSE: Write out a flat range of a sparse matrix as dense values
+ * INPUTS: sparse matrix, first element and length of the range, output of
+ *         n elements
+ * RETURN: none.  out is filled, zeros included.
+ */
+void sparse_expand (const Matrix_t* m, size_t begin, size_t n, unsigned int* out) {
+	memset(out, 0, n * sizeof(unsigned int));
+	if (n == 0 || m->cols == 0) {
+		return;
+	}
+
+	const Matrix_Sparse_t *s = m->sparse;
+	const size_t end = begin + n;
+	size_t row = begin / m->cols;
+	size_t e = row_entry(s, row, begin % m->cols);
+	for (; row < m->rows && row * m->cols < end; ++row) {
+		for (; e < s->row_ptr[row + 1]; ++e) {
+			const size_t idx = row * m->cols + s->col_idx[e];
+			if (idx >= end) {
+				return;
+			}
+			out[idx - begin] = s->values[e];
+		}
+	}
+}
+
+/*
+ * PURPOSE: Collect the entries of a flat range of a sparse matrix
+ * INPUTS: sparse matrix, first element and length of the range, where to
+ *         store each entry's position within the range and its value, most
+ *         entries to collect
+ * RETURN: number of entries, SPARSE_TOO_MANY if there are more than cap
+ */
+size_t sparse_gather (const Matrix_t* m, size_t begin, size_t n, unsigned int* pos,
+	unsigned int* values, size_t cap) {
+	if (n == 0 || m->cols == 0) {
+		return 0;
+	}
+
+	const Matrix_Sparse_t *s = m->sparse;
+	const size_t end = begin + n;
+	size_t row = begin / m->cols;
+	size_t e = row_entry(s, row, begin % m->cols);
+	size_t found = 0;
+	for (; row < m->rows && row * m->cols < end; ++row) {
+		for (; e < s->row_ptr[row + 1]; ++e) {
+			const size_t idx = row * m->cols + s->col_idx[e];
+			if (idx >= end) {
+				return found;
+			}
+			if (found == cap) {
+				return SPARSE_TOO_MANY;
+			}
+			pos[found] = idx - begin;
+			values[found] = s->values[e];
+			++found;
+		}
+	}
+	return found;
+}
+
+/*
+ * PURPOSE: Add two sparse matrices of the same size.  The entries of each
+ *          result row are counted on the thread pool, then filled in.
+ *          Sums that wrap around to zero are not stored.
+ * INPUTS: sparse matrices a and b
+ * RETURN: storage of a + b, NULL if it could not be allocated
+ */
+Matrix_Sparse_t* sparse_add (const Matrix_t* a, const Matrix_t* b) {
+	const size_t rows = a->rows;
+	unsigned int *row_ptr = pool_alloc((rows + 1) * sizeof(unsigned int));
+	if (!row_ptr) {
+		return NULL;
+	}
+	const size_t weight = ((size_t) a->sparse->nnz + b->sparse->nnz) / (rows ? rows : 1) + 1;
+	Sparse_Add_Task_t task = { a->sparse, b->sparse, row_ptr, NULL };
+	parallel_for_weighted(rows, weight, add_count_range, &task);
+
+	size_t total = 0;
+	for (size_t i = 0; i < rows; ++i) {
+		total += row_ptr[i + 1];
+		row_ptr[i + 1] = total;
+	}
+	Matrix_Sparse_t *c = (total <= UINT_MAX) ? sparse_alloc(rows, total) : NULL;
+	if (c) {
+		memcpy(c->row_ptr, row_ptr, (rows + 1) * sizeof(unsigned int));
+		c->nnz = total;
+		task.c = c;
+		parallel_for_weighted(rows, weight, add_fill_range, &task);
+	}
+	pool_free(row_ptr, (rows + 1) * sizeof(unsigned int));
+	return c;
+}
+
+/*
+ * PURPOSE: Add a sparse matrix into dense data of the same size
+ * INPUTS: sparse matrix, dense data
+ * RETURN: none.  The data is modified.
+ */
+void sparse_add_dense (const Matrix_t* s, unsigned int* data) {
+	const Matrix_Sparse_t *sp = s->sparse;
+	for (size_t i = 0; i < s->rows; ++i) {
+		unsigned int *row = &data[i * s->cols];
+		for (size_t e = sp->row_ptr[i]; e < sp->row_ptr[i + 1]; ++e) {
+			row[sp->col_idx[e]] += sp->values[e];
+		}
+	}
+}
+
+/*
+ * PURPOSE: Shift the stored values of a sparse matrix and drop the ones
+ *          that became zero.  Shifting by the width of an unsigned int or
+ *          more gives 0.
+ * INPUTS: sparse matrix, direction 'l' or 'r', magnitude of the shift
+ * RETURN: none.  The matrix is modified.
+ */
+void sparse_shift (Matrix_t* m, char direction, unsigned int shift) {
+	Matrix_Sparse_t *s = m->sparse;
+	if (shift >= sizeof(unsigned int) * CHAR_BIT) {
+		memset(s->row_ptr, 0, ((size_t) m->rows + 1) * sizeof(unsigned int));
+		s->nnz = 0;
+		return;
+	}
+	if (direction == 'l') {
+		matrix_kernels()->shift_left(s->values, shift, s->nnz);
+	}
+	else {
+		matrix_kernels()->shift_right(s->values, shift, s->nnz);
+	}
+
+	size_t kept = 0;
+	size_t e = 0;
+	for (size_t i = 0; i < m->rows; ++i) {
+		const size_t row_end = s->row_ptr[i + 1];
+		for (; e < row_end; ++e) {
+			if (s->values[e]) {
+				s->col_idx[kept] = s->col_idx[e];
+				s->values[kept] = s->values[e];
+				++kept;
+			}
+		}
+		s->row_ptr[i + 1] = kept;
+	}
+	s->nnz = kept;
+}
+
+/*
+ * PURPOSE: Compare two matrices of the same size, at least one of them
+ *          sparse.  Two sparse ones are compared entry by entry, a sparse
+ *          one against a dense one row by row on the thread pool.
+ * INPUTS: two matrices
+ * RETURN: True if they hold the same values, false if not.
+ */
+bool sparse_equal (const Matrix_t* a, const Matrix_t* b) {
+	if (a->sparse && b->sparse) {
+		const Matrix_Sparse_t *x = a->sparse;
+		const Matrix_Sparse_t *y = b->sparse;
+		return x->nnz == y->nnz
+			&& memcmp(x->row_ptr, y->row_ptr, ((size_t) a->rows + 1) * sizeof(unsigned int)) == 0
+			&& memcmp(x->col_idx, y->col_idx, (size_t) x->nnz * sizeof(unsigned int)) == 0
+			&& matrix_kernels()->equal(x->values, y->values, x->nnz);
+	}
+
+	Sparse_Equal_Task_t task = { a->sparse ? a : b, a->sparse ? b : a, 0 };
+	parallel_for_weighted(a->rows, a->cols, equal_dense_range, &task);
+	return !task.differ;
+}
+
+/*
+ * PURPOSE: Sum every element of a sparse matrix
+ * INPUTS: sparse matrix
+ * RETURN: 64 bit sum of the stored values
+ */
+unsigned long long sparse_sum (const Matrix_t* m) {
+	return matrix_kernels()->sum(m->sparse->values, m->sparse->nnz);
+}
+
+/*
+ * PURPOSE: Sum each row of a sparse matrix in 64 bits
+ * INPUTS: sparse matrix, output of m->rows elements
+ * RETURN: none.  out is filled.
+ */
+void sparse_sum_rows (const Matrix_t* m, unsigned long long* out) {
+	const Matrix_Sparse_t *s = m->sparse;
+	for (size_t i = 0; i < m->rows; ++i) {
+		out[i] = matrix_kernels()->sum(&s->values[s->row_ptr[i]],
+			s->row_ptr[i + 1] - s->row_ptr[i]);
+	}
+}
+
+/*
+ * PURPOSE: Sum each column of a sparse matrix in 64 bits
+ * INPUTS: sparse matrix, output of m->cols elements
+ * RETURN: none.  out is filled.
+ */
+void sparse_sum_cols (const Matrix_t* m, unsigned long long* out) {
+	const Matrix_Sparse_t *s = m->sparse;
+	memset(out, 0, (size_t) m->cols * sizeof(unsigned long long));
+	for (size_t e = 0; e < s->nnz; ++e) {
+		out[s->col_idx[e]] += s->values[e];
+	}
+}
+
+/*
+ * PURPOSE: Multiply a (n x k) by b (k x m) into c when either of them is
+ *          sparse.  Each row of c is the sum of the rows of b picked by the
+ *          nonzeros of the matching row of a, so only nonzeros cost work.
+ *          Rows of c are spread over the thread pool.
+ * INPUTS: matrices a and b, at least one sparse, dense c of n x m set to 0
+ * RETURN: none.  Matrix c is modified.
+ */
+void sparse_multiply (const Matrix_t* a, const Matrix_t* b, Matrix_t* c) {
+	const size_t row_cost = b->sparse ? (size_t) b->sparse->nnz / (b->rows ? b->rows : 1) + 1 : b->cols;
+	const size_t terms = a->sparse ? (size_t) a->sparse->nnz / (a->rows ? a->rows : 1) + 1 : a->cols;
+	Sparse_Mult_Task_t task = { a, b, c };
+	parallel_for_weighted(a->rows, terms * row_cost, multiply_range, &task);
+}
+
+/*
+ * PURPOSE: Transpose a sparse matrix.  The entries of each column are
+ *          counted to place the rows of the result, then every entry is
+ *          dropped into place in row order, which keeps the columns of each
+ *          result row ascending.
+ * INPUTS: sparse matrix
+ * RETURN: storage of the transpose, NULL if it could not be allocated
+ */
+Matrix_Sparse_t* sparse_transpose (const Matrix_t* m) {
+	const Matrix_Sparse_t *s = m->sparse;
+	Matrix_Sparse_t *t = sparse_alloc(m->cols, s->nnz);
+	unsigned int *next = pool_alloc(((size_t) m->cols + 1) * sizeof(unsigned int));
+	if (!t || !next) {
+		sparse_free(&t, m->cols);
+		pool_free(next, ((size_t) m->cols + 1) * sizeof(unsigned int));
+		return NULL;
+	}
+	memset(t->row_ptr, 0, ((size_t) m->cols + 1) * sizeof(unsigned int));
+	for (size_t e = 0; e < s->nnz; ++e) {
+		t->row_ptr[s->col_idx[e] + 1]++;
+	}
+	for (size_t j = 0; j < m->cols; ++j) {
+		t->row_ptr[j + 1] += t->row_ptr[j];
+	}
+	memcpy(next, t->row_ptr, ((size_t) m->cols + 1) * sizeof(unsigned int));
+	for (size_t i = 0; i < m->rows; ++i) {
+		for (size_t e = s->row_ptr[i]; e < s->row_ptr[i + 1]; ++e) {
+			const unsigned int dst = next[s->col_idx[e]]++;
+			t->col_idx[dst] = i;
+			t->values[dst] = s->values[e];
+		}
+	}
+	t->nnz = s->nnz;
+	pool_free(next, ((size_t) m->cols + 1) * sizeof(unsigned int));
+	return t;
+}
+
+/*Protected Functions in C*/
+
+/*
+ * PURPOSE: Find the first entry of a row at or after a column
+ * INPUTS: storage, row, column
+ * RETURN: entry index, the end of the row if there is none
+ */
+size_t row_entry (const Matrix_Sparse_t* s, size_t row, unsigned int col) {
+	size_t lo = s->row_ptr[row];
+	size_t hi = s->row_ptr[row + 1];
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		if (s->col_idx[mid] < col) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * PURPOSE: Merge one row of two sparse matrices, adding the values that
+ *          share a column and skipping sums that are zero
+ * INPUTS: storages a and b, row, where to store the columns and values of
+ *         the result (both NULL to only count them)
+ * RETURN: number of entries in the result row
+ */
+unsigned int merge_row (const Matrix_Sparse_t* a, const Matrix_Sparse_t* b, size_t row,
+	unsigned int* cols, unsigned int* values) {
+	size_t i = a->row_ptr[row];
+	size_t j = b->row_ptr[row];
+	const size_t i_end = a->row_ptr[row + 1];
+	const size_t j_end = b->row_ptr[row + 1];
+	unsigned int n = 0;
+	while (i < i_end || j < j_end) {
+		unsigned int col;
+		unsigned int value;
+		if (j == j_end || (i < i_end && a->col_idx[i] < b->col_idx[j])) {
+			col = a->col_idx[i];
+			value = a->values[i++];
+		}
+		else if (i == i_end || b->col_idx[j] < a->col_idx[i]) {
+			col = b->col_idx[j];
+			value = b->values[j++];
+		}
+		else {
+			col = a->col_idx[i];
+			value = a->values[i++] + b->values[j++];
+		}
+		if (value) {
+			if (cols) {
+				cols[n] = col;
+				values[n] = value;
+			}
+			n++;
+		}
+	}
+	return n;
+}
+
+/*
+ * PURPOSE: Count the entries of a range of rows of a sparse sum, run by
+ *          parallel_for_weighted
+ * INPUTS: Sparse_Add_Task_t, first and one past the last row of the range
+ * RETURN: none.  row_ptr[i + 1] holds the count of row i.
+ */
+void add_count_range (void* ctx, size_t begin, size_t end) {
+	Sparse_Add_Task_t *task = ctx;
+	for (size_t i = begin; i < end; ++i) {
+		task->row_ptr[i + 1] = merge_row(task->a, task->b, i, NULL, NULL);
+	}
+}
+
+/*
+ * PURPOSE: Fill in a range of rows of a sparse sum, run by
+ *          parallel_for_weighted
+ * INPUTS: Sparse_Add_Task_t, first and one past the last row of the range
+ * RETURN: none.  The result entries are filled.
+ */
+void add_fill_range (void* ctx, size_t begin, size_t end) {
+	Sparse_Add_Task_t *task = ctx;
+	Matrix_Sparse_t *c = task->c;
+	for (size_t i = begin; i < end; ++i) {
+		merge_row(task->a, task->b, i, &c->col_idx[c->row_ptr[i]], &c->values[c->row_ptr[i]]);
+	}
+}
+
+/*
+ * PURPOSE: Compare a range of rows of a sparse matrix with a dense one,
+ *          run by parallel_for_weighted
+ * INPUTS: Sparse_Equal_Task_t, first and one past the last row of the range
+ * RETURN: none.  The differ flag is set on a mismatch.
+ */
+void equal_dense_range (void* ctx, size_t begin, size_t end) {
+	Sparse_Equal_Task_t *task = ctx;
+	const Matrix_Sparse_t *s = task->s->sparse;
+	const size_t cols = task->s->cols;
+	for (size_t i = begin; i < end; ++i) {
+		if (__atomic_load_n(&task->differ, __ATOMIC_RELAXED)) {
+			return;
+		}
+		const unsigned int *row = &task->d->data[i * cols];
+		size_t e = s->row_ptr[i];
+		const size_t row_end = s->row_ptr[i + 1];
+		for (size_t j = 0; j < cols; ++j) {
+			unsigned int expected = 0;
+			if (e < row_end && s->col_idx[e] == j) {
+				expected = s->values[e++];
+			}
+			if (row[j] != expected) {
+				__atomic_store_n(&task->differ, 1, __ATOMIC_RELAXED);
+				return;
+			}
+		}
+	}
+}
+
+/*
+ * PURPOSE: Add scale times row k of b into a row of c
+ * INPUTS: matrix b, row of b, scale, row of c
+ * RETURN: none.  The row of c is modified.
+ */
+void axpy_row (const Matrix_t* b, size_t k, unsigned int scale, unsigned int* crow) {
+	if (b->sparse) {
+		const Matrix_Sparse_t *s = b->sparse;
+		for (size_t f = s->row_ptr[k]; f < s->row_ptr[k + 1]; ++f) {
+			crow[s->col_idx[f]] += scale * s->values[f];
+		}
+		return;
+	}
+	const unsigned int * restrict brow = &b->data[k * b->cols];
+	unsigned int * restrict out = crow;
+	for (size_t j = 0; j < b->cols; ++j) {
+		out[j] += scale * brow[j];
+	}
+}
+
+/*
+ * PURPOSE: Compute a range of rows of a sparse product, run by
+ *          parallel_for_weighted
+ * INPUTS: Sparse_Mult_Task_t, first and one past the last row of the range
+ * RETURN: none.  Matrix c is modified.
+ */
+void multiply_range (void* ctx, size_t begin, size_t end) {
+	const Sparse_Mult_Task_t *task = ctx;
+	const Matrix_t *a = task->a;
+	for (size_t i = begin; i < end; ++i) {
+		unsigned int *crow = &task->c->data[i * task->c->cols];
+		if (a->sparse) {
+			const Matrix_Sparse_t *s = a->sparse;
+			for (size_t e = s->row_ptr[i]; e < s->row_ptr[i + 1]; ++e) {
+				axpy_row(task->b, s->col_idx[e], s->values[e], crow);
+			}
+		}
+		else {
+			const unsigned int *arow = &a->data[i * a->cols];
+			for (size_t k = 0; k < a->cols; ++k) {
+				if (arow[k]) {
+					axpy_row(task->b, k, arow[k], crow);
+				}
+			}
+		}
+	}
+}
@@ -0,0 +1,38 @@
+#ifndef _SPARSE_H_
+#define _SPARSE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "matrix.h"
+
+/* Storage is picked by density: a dense matrix with at most 1 in
+ * SPARSE_ENTER_RATIO elements nonzero is stored as CSR, a sparse one with
+ * more than 1 in SPARSE_LEAVE_RATIO goes back to dense.  The gap keeps a
+ * matrix from flipping back and forth. */
+#define SPARSE_ENTER_RATIO 10
+#define SPARSE_LEAVE_RATIO 4
+
+/* Returned by sparse_gather when a range holds more entries than fit */
+#define SPARSE_TOO_MANY ((size_t) -1)
+
+Matrix_Sparse_t* sparse_alloc (unsigned int rows, size_t capacity);
+void sparse_free (Matrix_Sparse_t** s, unsigned int rows);
+Matrix_Sparse_t* sparse_copy (const Matrix_Sparse_t* s, unsigned int rows);
+size_t sparse_bytes (const Matrix_Sparse_t* s, unsigned int rows);
+size_t sparse_count_nonzero (const unsigned int* data, size_t count, size_t limit);
+Matrix_Sparse_t* sparse_from_dense (const unsigned int* data, unsigned int rows, unsigned int cols, size_t nnz);
+void sparse_expand (const Matrix_t* m, size_t begin, size_t n, unsigned int* out);
+size_t sparse_gather (const Matrix_t* m, size_t begin, size_t n, unsigned int* pos,
+	unsigned int* values, size_t cap);
+Matrix_Sparse_t* sparse_add (const Matrix_t* a, const Matrix_t* b);
+void sparse_add_dense (const Matrix_t* s, unsigned int* data);
+void sparse_shift (Matrix_t* m, char direction, unsigned int shift);
+bool sparse_equal (const Matrix_t* a, const Matrix_t* b);
+unsigned long long sparse_sum (const Matrix_t* m);
+void sparse_sum_rows (const Matrix_t* m, unsigned long long* out);
+void sparse_sum_cols (const Matrix_t* m, unsigned long long* out);
+void sparse_multiply (const Matrix_t* a, const Matrix_t* b, Matrix_t* c);
+Matrix_Sparse_t* sparse_transpose (const Matrix_t* m);
+
+#endif
@@ -0,0 +1,391 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "stats.h"
+#include "command.h"
+#include "pool.h"
+#include "sparse.h"
+#include "types.h"
+
+/* Guards the totals and the trace, commands may finish on several threads */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static Stats_Command_t commands[STATS_MAX_COMMANDS];
+static size_t num_commands = 0;
+static FILE *trace = NULL;
+static bool trace_empty = true;
+static double clock_base_us = -1;	/* trace timestamps count from here */
+static long long sample_overhead = -1;	/* syscalls made by sampling them once */
+
+/* The command the calling thread is measuring, counters hold their value
+ * at stats_begin */
+static __thread struct {
+	bool active;
+	char name[STATS_NAME_LEN];
+	char line[STATS_LINE_LEN];
+	double start_us;
+	pid_t tid;
+	unsigned long long bytes;
+	unsigned long long allocs;
+	long long syscalls;
+	long long faults;
+}current;
+
+/*protected functions*/
+double now_us (void);
+unsigned long long count_allocs (void);
+long long count_syscalls (void);
+long long count_faults (void);
+Stats_Command_t* find_command (const char* name);
+unsigned int latency_bucket (double us);
+double bucket_percentile (const Stats_Command_t* c, unsigned int p);
+void trace_string (const char* str);
+void close_trace (void);
+
+/*
+ * PURPOSE: Start measuring a command.  Its wall time, the matrix bytes it
+ *          touches, and the allocations, read/write system calls and page
+ *          faults of the calling thread are counted until stats_end, so
+ *          commands running at the same time don't count each other's.
+ * INPUTS: command name, whole command line for the trace (may be NULL)
+ * RETURN: none
+ */
+void stats_begin (const char* name, const char* line) {
+	if (!name) {
+		return;
+	}
+	pthread_mutex_lock(&stats_lock);
+	if (clock_base_us < 0) {
+		clock_base_us = now_us();
+	}
+	if (sample_overhead < 0) {
+		const long long first = count_syscalls();
+		sample_overhead = (first < 0) ? 0 : count_syscalls() - first;
+	}
+	pthread_mutex_unlock(&stats_lock);
+	strncpy(current.name, name, STATS_NAME_LEN - 1);
+	current.name[STATS_NAME_LEN - 1] = '\0';
+	strncpy(current.line, line ? line : name, STATS_LINE_LEN - 1);
+	current.line[STATS_LINE_LEN - 1] = '\0';
+	current.bytes = 0;
+	current.tid = gettid();
+	current.allocs = count_allocs();
+	current.faults = count_faults();
+	current.syscalls = count_syscalls();
+	current.start_us = now_us();
+	current.active = true;
+}
+
+/*
+ * PURPOSE: Count the data of a matrix as touched by the current command
+ * INPUTS: matrix, may be NULL
+ * RETURN: none
+ */
+void stats_touch_matrix (const Matrix_t* m) {
+	if (!current.active || !m || m->pending) {
+		return;
+	}
+	if (m->sparse) {
+		current.bytes += sparse_bytes(m->sparse, m->rows);
+	}
+	else if (m->data) {
+		current.bytes += (size_t) m->rows * m->cols * type_size(m->type);
+	}
+}
+
+/*
+ * PURPOSE: Finish measuring the current command, add it to the totals of
+ *          its name and to the trace file if one is open
+ * INPUTS: none
+ * RETURN: none
+ */
+void stats_end (void) {
+	if (!current.active) {
+		return;
+	}
+	const double end_us = now_us();
+	const double us = end_us - current.start_us;
+	const unsigned long long allocs = count_allocs() - current.allocs;
+	const long long faults = count_faults() - current.faults;
+	long long syscalls = 0;
+	if (current.syscalls >= 0) {
+		syscalls = count_syscalls() - current.syscalls - sample_overhead;
+		syscalls = (syscalls < 0) ? 0 : syscalls;
+	}
+	current.active = false;
+
+	pthread_mutex_lock(&stats_lock);
+	Stats_Command_t *c = find_command(current.name);
+	if (c) {
+		if (c->count == 0 || us < c->min_us) {
+			c->min_us = us;
+		}
+		if (us > c->max_us) {
+			c->max_us = us;
+		}
+		c->count++;
+		c->total_us += us;
+		c->bytes += current.bytes;
+		c->allocs += allocs;
+		c->syscalls += syscalls;
+		c->faults += faults;
+		c->buckets[latency_bucket(us)]++;
+	}
+
+	if (trace) {
+		fprintf(trace, "%s{\"name\": ", trace_empty ? "" : ",\n");
+		trace_string(current.name);
+		fprintf(trace, ", \"cat\": \"command\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+			"\"pid\": %d, \"tid\": %d, \"args\": {\"line\": ",
+			current.start_us - clock_base_us, us, (int) getpid(), (int) current.tid);
+		trace_string(current.line);
+		fprintf(trace, ", \"bytes\": %llu, \"allocs\": %llu, \"syscalls\": %lld, \"faults\": %lld}}",
+			current.bytes, allocs, syscalls, faults);
+		trace_empty = false;
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+ * PURPOSE: Print the totals and a latency histogram of every command run
+ *          since the last reset
+ * INPUTS: none
+ * RETURN: none
+ */
+void stats_print (void) {
+	FILE *out = command_output();
+	pthread_mutex_lock(&stats_lock);
+	for (size_t i = 0; i < num_commands; ++i) {
+		const Stats_Command_t *c = &commands[i];
+		if (c->count == 0) {
+			continue;
+		}
+		fprintf(out, "%s: %lu runs, %.3f ms total, %.3f ms mean, %.3f ms min, %.3f ms max, "
+			"p50 < %.0f us, p99 < %.0f us\n", c->name, c->count, c->total_us / 1e3,
+			c->total_us / c->count / 1e3, c->min_us / 1e3, c->max_us / 1e3,
+			bucket_percentile(c, 50), bucket_percentile(c, 99));
+		fprintf(out, "\t%.3f MB touched (%.3f GB/s), per run %.1f allocs, %.1f syscalls, %.1f faults\n",
+			c->bytes / 1e6, c->total_us > 0 ? c->bytes / c->total_us / 1e3 : 0.0,
+			(double) c->allocs / c->count, (double) c->syscalls / c->count, (double) c->faults / c->count);
+
+		unsigned long most = 0;
+		for (unsigned int b = 0; b < STATS_BUCKETS; ++b) {
+			most = (c->buckets[b] > most) ? c->buckets[b] : most;
+		}
+		for (unsigned int b = 0; b < STATS_BUCKETS; ++b) {
+			if (!c->buckets[b]) {
+				continue;
+			}
+			const unsigned int width = (c->buckets[b] * 40 + most - 1) / most;
+			fprintf(out, "\t[%10llu, %10llu) us %-40.*s %lu\n", b ? 1ULL << b : 0ULL, 1ULL << (b + 1),
+				width, "########################################", c->buckets[b]);
+		}
+	}
+	const bool sampled = sample_overhead >= 0;
+	pthread_mutex_unlock(&stats_lock);
+	if (sampled && count_syscalls() < 0) {
+		fprintf(out, "System call counts are not available on this system\n");
+	}
+}
+
+/*
+ * PURPOSE: Forget the totals of every command
+ * INPUTS: none
+ * RETURN: none
+ */
+void stats_reset (void) {
+	pthread_mutex_lock(&stats_lock);
+	memset(commands, 0, sizeof(commands));
+	num_commands = 0;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+ * PURPOSE: Start writing every command as a complete event in the Chrome
+ *          trace event format, which chrome://tracing and Perfetto load
+ * INPUTS: file name, it is replaced
+ * RETURN: True if the file was opened, false if not.
+ */
+bool stats_trace_open (const char* filename) {
+	pthread_mutex_lock(&stats_lock);
+	close_trace();
+	if (filename) {
+		trace = fopen(filename, "w");
+		if (!trace) {
+			command_perror("FAILED TO OPEN TRACE FILE");
+		}
+		else {
+			fprintf(trace, "[\n");
+			trace_empty = true;
+		}
+	}
+	const bool opened = trace != NULL;
+	pthread_mutex_unlock(&stats_lock);
+	return opened;
+}
+
+/*
+ * PURPOSE: Finish and close the trace file, if one is open
+ * INPUTS: none
+ * RETURN: none
+ */
+void stats_trace_close (void) {
+	pthread_mutex_lock(&stats_lock);
+	close_trace();
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/*Protected Functions in C*/
+
+/*
+ * PURPOSE: Read the monotonic clock
+ * INPUTS: none
+ * RETURN: time in microseconds
+ */
+double now_us (void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ * PURPOSE: Count every allocation the calling thread has made, pooled or not
+ * INPUTS: none
+ * RETURN: allocation count
+ */
+unsigned long long count_allocs (void) {
+	return pool_thread_allocs();
+}
+
+/*
+ * PURPOSE: Count the read and write system calls the calling thread has
+ *          made, from /proc/thread-self/io.  Reading it is itself a few
+ *          system calls, which stats_end takes back out.
+ * INPUTS: none
+ * RETURN: system call count, -1 if the system does not report it
+ */
+long long count_syscalls (void) {
+	int fd = open("/proc/thread-self/io", O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	char buffer[512];
+	const ssize_t len = read(fd, buffer, sizeof(buffer) - 1);
+	close(fd);
+	if (len <= 0) {
+		return -1;
+	}
+	buffer[len] = '\0';
+	const char *reads = strstr(buffer, "syscr:");
+	const char *writes = strstr(buffer, "syscw:");
+	if (!reads || !writes) {
+		return -1;
+	}
+	return strtoll(reads + strlen("syscr:"), NULL, 10) + strtoll(writes + strlen("syscw:"), NULL, 10);
+}
+
+/*
+ * PURPOSE: Count the page faults the calling thread has taken
+ * INPUTS: none
+ * RETURN: minor plus major faults
+ */
+long long count_faults (void) {
+	struct rusage usage;
+	if (getrusage(RUSAGE_THREAD, &usage)) {
+		return 0;
+	}
+	return (long long) usage.ru_minflt + usage.ru_majflt;
+}
+
+/*
+ * PURPOSE: Find the totals of a command name, adding them if needed
+ * INPUTS: command name
+ * RETURN: totals, NULL once STATS_MAX_COMMANDS names are tracked
+ */
+Stats_Command_t* find_command (const char* name) {
+	for (size_t i = 0; i < num_commands; ++i) {
+		if (strcmp(commands[i].name, name) == 0) {
+			return &commands[i];
+		}
+	}
+	if (num_commands == STATS_MAX_COMMANDS) {
+		return NULL;
+	}
+	Stats_Command_t *c = &commands[num_commands++];
+	memset(c, 0, sizeof(*c));
+	memcpy(c->name, name, strlen(name) + 1);
+	return c;
+}
+
+/*
+ * PURPOSE: Pick the histogram bucket of a latency
+ * INPUTS: latency in microseconds
+ * RETURN: bucket index, latencies under 2 us go in bucket 0
+ */
+unsigned int latency_bucket (double us) {
+	unsigned int b = 0;
+	while (b + 1 < STATS_BUCKETS && (double) (1ULL << (b + 1)) <= us) {
+		b++;
+	}
+	return b;
+}
+
+/*
+ * PURPOSE: Upper bound of a latency percentile from the histogram
+ * INPUTS: command totals, percentile
+ * RETURN: upper end of the bucket holding that percentile, in microseconds
+ */
+double bucket_percentile (const Stats_Command_t* c, unsigned int p) {
+	const unsigned long rank = (p * c->count + 99) / 100;
+	unsigned long seen = 0;
+	for (unsigned int b = 0; b < STATS_BUCKETS; ++b) {
+		seen += c->buckets[b];
+		if (seen >= rank) {
+			return (double) (1ULL << (b + 1));
+		}
+	}
+	return (double) (1ULL << STATS_BUCKETS);
+}
+
+/*
+ * PURPOSE: Write a string to the trace file as a JSON string
+ * INPUTS: string
+ * RETURN: none
+ */
+void trace_string (const char* str) {
+	fputc('"', trace);
+	for (const unsigned char *p = (const unsigned char*) str; *p; ++p) {
+		if (*p == '"' || *p == '\\') {
+			fprintf(trace, "\\%c", *p);
+		}
+		else if (*p < 0x20) {
+			fprintf(trace, "\\u%04x", *p);
+		}
+		else {
+			fputc(*p, trace);
+		}
+	}
+	fputc('"', trace);
+}
+
+/*
+ * PURPOSE: Finish and close the trace file with stats_lock held
+ * INPUTS: none
+ * RETURN: none
+ */
+void close_trace (void) {
+	if (!trace) {
+		return;
+	}
+	fprintf(trace, "\n]\n");
+	fclose(trace);
+	trace = NULL;
+}
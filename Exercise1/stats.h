@@ -0,0 +1,36 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "matrix.h"
+
+#define STATS_MAX_COMMANDS 64		/* distinct command names tracked */
+#define STATS_NAME_LEN 16
+#define STATS_LINE_LEN 256		/* command line kept for the trace */
+#define STATS_BUCKETS 32		/* bucket i holds latencies of [2^i, 2^(i+1)) us */
+
+/* Totals of every run of one command */
+typedef struct {
+	char name[STATS_NAME_LEN];
+	unsigned long count;
+	double total_us;
+	double min_us;
+	double max_us;
+	unsigned long long bytes;	/* matrix data looked up or created */
+	unsigned long long allocs;	/* pool, arena and system allocations */
+	unsigned long long syscalls;	/* read and write system calls */
+	unsigned long long faults;	/* page faults */
+	unsigned long buckets[STATS_BUCKETS];
+}Stats_Command_t;
+
+void stats_begin (const char* name, const char* line);
+void stats_touch_matrix (const Matrix_t* m);
+void stats_end (void);
+void stats_print (void);
+void stats_reset (void);
+bool stats_trace_open (const char* filename);
+void stats_trace_close (void);
+
+#endif
@@ -0,0 +1,443 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include "text.h"
+#include "sparse.h"
+#include "types.h"
+#include "thread_pool.h"
+#include "command.h"
+
+/* Text waiting to be written.  The element loops run on the type format
+ * kernels, stdio only ever sees whole buffers. */
+typedef struct {
+	FILE *out;
+	char *buffer;
+	size_t len;
+	bool failed;
+	unsigned int scratch[TEXT_RUN];	/* sparse elements expanded for the u32 kernel */
+}Text_Writer_t;
+
+/* Lines of a text file handled by one parse task */
+typedef struct {
+	size_t begin;
+	size_t end;
+	size_t first_row;
+	size_t rows;
+	size_t error_row;	/* first row that did not parse, SIZE_MAX if none */
+	const char *error;
+}Text_Chunk_t;
+
+typedef struct {
+	const char *text;
+	size_t len;
+	Matrix_t *m;
+	Text_Chunk_t *chunks;
+}Text_Import_t;
+
+/* Sixteen characters compared at once when counting lines */
+typedef signed char Text_Vec_t __attribute__((vector_size(16)));
+
+/*protected functions*/
+void flush_text (Text_Writer_t* w);
+char* reserve_text (Text_Writer_t* w, size_t n);
+void put_text (Text_Writer_t* w, const char* str);
+void put_elements (Text_Writer_t* w, const Matrix_t* m, size_t row, size_t first, size_t last, char sep);
+void put_row (Text_Writer_t* w, const Matrix_t* m, size_t row, size_t left_end, size_t right_begin,
+	char sep, bool trailing);
+bool is_separator (char c);
+size_t line_start (const char* text, size_t len, size_t pos);
+size_t count_newlines (const char* text, size_t n);
+size_t count_fields (const char* p, const char* end);
+void store_element (Matrix_t* m, size_t i, unsigned long long value, double real);
+const char* parse_row (const char* p, const char* end, Matrix_t* m, size_t row, const char** error);
+void count_range (void* ctx, size_t begin, size_t end);
+void parse_range (void* ctx, size_t begin, size_t end);
+
+/*
+ * PURPOSE: Write the elements of a matrix as text, one row per line.
+ *          Elements are converted without printf into a large buffer that
+ *          is written out in bulk, so big matrices go out at memory speed
+ *          rather than one stdio call per element.
+ * INPUTS: stream, dense or sparse matrix, separator, whether the last
+ *         element of a row is followed by the separator too, corner size:
+ *         0 writes everything, otherwise only the first and last corner
+ *         rows and columns are written with "..." standing for the rest
+ * RETURN: True if all the text was written, false if not.
+ */
+bool text_write_matrix (FILE* out, const Matrix_t* m, char sep, bool trailing, unsigned int corner) {
+	if (!out || !m || (!m->elems && !m->sparse)) {
+		return false;
+	}
+	Text_Writer_t *w = malloc(sizeof(Text_Writer_t));
+	if (!w) {
+		return false;
+	}
+	w->buffer = malloc(TEXT_BUFFER_LEN);
+	if (!w->buffer) {
+		free(w);
+		return false;
+	}
+	w->out = out;
+	w->len = 0;
+	w->failed = false;
+
+	const bool cut_rows = corner && m->rows > 2 * (size_t) corner;
+	const bool cut_cols = corner && m->cols > 2 * (size_t) corner;
+	const size_t top_end = cut_rows ? corner : m->rows;
+	const size_t left_end = cut_cols ? corner : m->cols;
+	const size_t right_begin = cut_cols ? m->cols - corner : m->cols;
+
+	for (size_t i = 0; i < top_end && !w->failed; ++i) {
+		put_row(w, m, i, left_end, right_begin, sep, trailing);
+	}
+	if (cut_rows) {
+		put_text(w, "...\n");
+		for (size_t i = m->rows - corner; i < m->rows && !w->failed; ++i) {
+			put_row(w, m, i, left_end, right_begin, sep, trailing);
+		}
+	}
+	flush_text(w);
+
+	const bool ok = !w->failed;
+	free(w->buffer);
+	free(w);
+	return ok;
+}
+
+/*
+ * PURPOSE: Parse a text matrix, one row per line with the values split by
+ *          commas, tabs or spaces (runs of them count as one).  The text is
+ *          cut into TEXT_CHUNK pieces at line starts and the pieces are
+ *          spread over the thread pool twice: once to count their lines,
+ *          which places every piece at its first row, then to parse the
+ *          values straight into the new matrix.
+ * INPUTS: text and its length, matrix name, element type, where to put the
+ *         matrix
+ * RETURN: True if every row parsed with the same number of values, false
+ *         if not.
+ */
+bool text_read_matrix (const char* text, size_t len, const char* name, Matrix_Type_t type, Matrix_t** m) {
+	if (!text || !name || !m || !type_kernels(type)) {
+		return false;
+	}
+	/*trailing blank lines would read as empty rows*/
+	while (len && (is_separator(text[len - 1]) || text[len - 1] == '\n')) {
+		len--;
+	}
+	const size_t cols = count_fields(text, text + len);
+	if (cols == 0 || cols > UINT_MAX) {
+		fprintf(command_output(), "No values on the first line\n");
+		return false;
+	}
+
+	Text_Import_t import = { text, len, NULL, NULL };
+	const size_t num_chunks = (len + TEXT_CHUNK - 1) / TEXT_CHUNK;
+	import.chunks = calloc(num_chunks, sizeof(Text_Chunk_t));
+	if (!import.chunks) {
+		return false;
+	}
+	parallel_for_weighted(num_chunks, TEXT_CHUNK, count_range, &import);
+	size_t rows = 0;
+	for (size_t i = 0; i < num_chunks; ++i) {
+		import.chunks[i].first_row = rows;
+		import.chunks[i].error_row = SIZE_MAX;
+		rows += import.chunks[i].rows;
+	}
+	if (rows > UINT_MAX || !create_typed_matrix(m, name, rows, cols, type) || !reserve_matrix_storage(*m)) {
+		fprintf(command_output(), "Matrix (%s) of %zu x %zu is too large\n", name, rows, cols);
+		destroy_matrix(m);
+		free(import.chunks);
+		return false;
+	}
+
+	import.m = *m;
+	parallel_for_weighted(num_chunks, TEXT_CHUNK, parse_range, &import);
+	bool ok = true;
+	for (size_t i = 0; i < num_chunks && ok; ++i) {
+		if (import.chunks[i].error) {
+			fprintf(command_output(), "Line %zu: %s\n", import.chunks[i].error_row + 1, import.chunks[i].error);
+			ok = false;
+		}
+	}
+	free(import.chunks);
+	if (!ok) {
+		destroy_matrix(m);
+	}
+	return ok;
+}
+
+/*Protected Functions in C*/
+
+/*
+ * PURPOSE: Hand the buffered text to the stream
+ * INPUTS: writer
+ * RETURN: none, failed is set if the stream took less than all of it
+ */
+void flush_text (Text_Writer_t* w) {
+	if (w->len && fwrite(w->buffer, 1, w->len, w->out) != w->len) {
+		w->failed = true;
+	}
+	w->len = 0;
+}
+
+/*
+ * PURPOSE: Make room in the buffer, flushing it if needed
+ * INPUTS: writer, characters needed, at most TEXT_BUFFER_LEN
+ * RETURN: where the characters go
+ */
+char* reserve_text (Text_Writer_t* w, size_t n) {
+	if (w->len + n > TEXT_BUFFER_LEN) {
+		flush_text(w);
+	}
+	return &w->buffer[w->len];
+}
+
+/*
+ * PURPOSE: Add a short string to the buffer
+ * INPUTS: writer, string
+ * RETURN: none
+ */
+void put_text (Text_Writer_t* w, const char* str) {
+	const size_t len = strlen(str);
+	memcpy(reserve_text(w, len), str, len);
+	w->len += len;
+}
+
+/*
+ * PURPOSE: Add columns first to last of a row, each followed by sep
+ * INPUTS: writer, matrix, row, first column, end column, separator
+ * RETURN: none
+ */
+void put_elements (Text_Writer_t* w, const Matrix_t* m, size_t row, size_t first, size_t last, char sep) {
+	const Type_Kernels_t *kernels = type_kernels(m->sparse ? MATRIX_U32 : m->type);
+	for (size_t j = first; j < last; j += TEXT_RUN) {
+		const size_t n = (last - j < TEXT_RUN) ? last - j : TEXT_RUN;
+		const size_t index = row * m->cols + j;
+		const void *src;
+		if (m->sparse) {
+			sparse_expand(m, index, n, w->scratch);
+			src = w->scratch;
+		}
+		else {
+			src = (const char*) m->elems + index * kernels->size;
+		}
+		char *text = reserve_text(w, n * TYPE_TEXT_MAX);
+		w->len = kernels->format(text, src, n, sep) - w->buffer;
+	}
+}
+
+/*
+ * PURPOSE: Add one row and its newline, skipping the middle columns
+ *          left_end to right_begin
+ * INPUTS: writer, matrix, row, end of the left columns, start of the right
+ *         columns, separator, whether the row ends with the separator
+ * RETURN: none
+ */
+void put_row (Text_Writer_t* w, const Matrix_t* m, size_t row, size_t left_end, size_t right_begin,
+	char sep, bool trailing) {
+	put_elements(w, m, row, 0, left_end, sep);
+	if (right_begin > left_end) {
+		put_text(w, "...");
+		*reserve_text(w, 1) = sep;
+		w->len++;
+		put_elements(w, m, row, right_begin, m->cols, sep);
+	}
+	if (!trailing && m->cols) {
+		w->len--;
+	}
+	put_text(w, "\n");
+}
+
+/*
+ * PURPOSE: Tell the characters that split values on import
+ * INPUTS: character
+ * RETURN: True for commas, tabs, spaces and carriage returns
+ */
+bool is_separator (char c) {
+	return c == ',' || c == '\t' || c == ' ' || c == '\r';
+}
+
+/*
+ * PURPOSE: Find the first line that starts at or after a position
+ * INPUTS: text and its length, position
+ * RETURN: offset of that line, len if there is none
+ */
+size_t line_start (const char* text, size_t len, size_t pos) {
+	if (pos == 0 || pos >= len) {
+		return (pos == 0) ? 0 : len;
+	}
+	const char *newline = memchr(&text[pos - 1], '\n', len - pos + 1);
+	return newline ? (size_t) (newline - text) + 1 : len;
+}
+
+/*
+ * PURPOSE: Count the newlines in a piece of text, sixteen characters a step
+ * INPUTS: text, length
+ * RETURN: number of newlines
+ */
+size_t count_newlines (const char* text, size_t n) {
+	size_t count = 0;
+	size_t i = 0;
+	while (n - i >= sizeof(Text_Vec_t)) {
+		/*each lane counts to at most 255 before it is added up*/
+		const size_t steps = ((n - i) / sizeof(Text_Vec_t) < 255) ? (n - i) / sizeof(Text_Vec_t) : 255;
+		Text_Vec_t lanes = {0};
+		for (size_t s = 0; s < steps; ++s, i += sizeof(Text_Vec_t)) {
+			Text_Vec_t v;
+			memcpy(&v, &text[i], sizeof(v));
+			lanes -= (Text_Vec_t) (v == '\n');
+		}
+		for (size_t j = 0; j < sizeof(Text_Vec_t); ++j) {
+			count += (unsigned char) lanes[j];
+		}
+	}
+	for (; i < n; ++i) {
+		count += (text[i] == '\n');
+	}
+	return count;
+}
+
+/*
+ * PURPOSE: Count the values on a line
+ * INPUTS: start of the line, end of the text
+ * RETURN: number of values before the newline
+ */
+size_t count_fields (const char* p, const char* end) {
+	size_t fields = 0;
+	while (p < end && *p != '\n') {
+		while (p < end && is_separator(*p)) {
+			p++;
+		}
+		if (p == end || *p == '\n') {
+			break;
+		}
+		fields++;
+		while (p < end && *p != '\n' && !is_separator(*p)) {
+			p++;
+		}
+	}
+	return fields;
+}
+
+/*
+ * PURPOSE: Store a parsed value as the element type of a matrix
+ * INPUTS: matrix, element index, value as an integer and as a real
+ * RETURN: none
+ */
+void store_element (Matrix_t* m, size_t i, unsigned long long value, double real) {
+	switch (m->type) {
+		case MATRIX_U8: ((unsigned char*) m->elems)[i] = value; break;
+		case MATRIX_U16: ((unsigned short*) m->elems)[i] = value; break;
+		case MATRIX_U64: ((unsigned long long*) m->elems)[i] = value; break;
+		case MATRIX_F32: ((float*) m->elems)[i] = real; break;
+		case MATRIX_F64: ((double*) m->elems)[i] = real; break;
+		default: m->data[i] = value; break;
+	}
+}
+
+/*
+ * PURPOSE: Parse one line into a row of a matrix.  Integers are read digit
+ *          by digit and must fit the element type, reals go through strtod.
+ * INPUTS: start of the line, end of the text, matrix, row, where to put
+ *         the reason the line did not parse
+ * RETURN: start of the next line, NULL if the line did not parse
+ */
+const char* parse_row (const char* p, const char* end, Matrix_t* m, size_t row, const char** error) {
+	const Type_Kernels_t *kernels = type_kernels(m->type);
+	const size_t first = row * m->cols;
+	size_t col = 0;
+	while (true) {
+		while (p < end && is_separator(*p)) {
+			p++;
+		}
+		if (p == end || *p == '\n') {
+			break;
+		}
+		if (col == m->cols) {
+			*error = "more values than the first line";
+			return NULL;
+		}
+		if (kernels->is_real) {
+			char token[TEXT_TOKEN_MAX];
+			size_t n = 0;
+			while (p < end && *p != '\n' && !is_separator(*p) && n < TEXT_TOKEN_MAX - 1) {
+				token[n++] = *p++;
+			}
+			token[n] = '\0';
+			char *stop = NULL;
+			const double real = strtod(token, &stop);
+			if (*stop || (p < end && *p != '\n' && !is_separator(*p))) {
+				*error = "not a number";
+				return NULL;
+			}
+			store_element(m, first + col, 0, real);
+		}
+		else {
+			const char *digits = p;
+			unsigned long long value = 0;
+			while (p < end && *p >= '0' && *p <= '9') {
+				const unsigned int digit = *p++ - '0';
+				if (value > (kernels->max - digit) / 10) {
+					*error = "value too large for the element type";
+					return NULL;
+				}
+				value = value * 10 + digit;
+			}
+			if (p == digits || (p < end && *p != '\n' && !is_separator(*p))) {
+				*error = "not an unsigned integer";
+				return NULL;
+			}
+			store_element(m, first + col, value, 0);
+		}
+		col++;
+	}
+	if (col != m->cols) {
+		*error = "fewer values than the first line";
+		return NULL;
+	}
+	return (p < end) ? p + 1 : p;
+}
+
+/*
+ * PURPOSE: Find the lines of each chunk in a range and count them
+ * INPUTS: import, range of chunks
+ * RETURN: none
+ */
+void count_range (void* ctx, size_t begin, size_t end) {
+	Text_Import_t *import = ctx;
+	for (size_t i = begin; i < end; ++i) {
+		Text_Chunk_t *chunk = &import->chunks[i];
+		chunk->begin = line_start(import->text, import->len, i * TEXT_CHUNK);
+		chunk->end = line_start(import->text, import->len, (i + 1) * TEXT_CHUNK);
+		chunk->rows = count_newlines(&import->text[chunk->begin], chunk->end - chunk->begin);
+		/*the last line has no newline once the text is trimmed*/
+		if (chunk->end == import->len && chunk->begin < chunk->end) {
+			chunk->rows++;
+		}
+	}
+}
+
+/*
+ * PURPOSE: Parse the rows of each chunk in a range
+ * INPUTS: import, range of chunks
+ * RETURN: none
+ */
+void parse_range (void* ctx, size_t begin, size_t end) {
+	Text_Import_t *import = ctx;
+	for (size_t i = begin; i < end; ++i) {
+		Text_Chunk_t *chunk = &import->chunks[i];
+		const char *p = &import->text[chunk->begin];
+		const char *stop = &import->text[chunk->end];
+		for (size_t r = 0; r < chunk->rows; ++r) {
+			p = parse_row(p, stop, import->m, chunk->first_row + r, &chunk->error);
+			if (!p) {
+				chunk->error_row = chunk->first_row + r;
+				break;
+			}
+		}
+	}
+}
@@ -0,0 +1,24 @@
+#ifndef _TEXT_H_
+#define _TEXT_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "matrix.h"
+
+/* Text is built up in a buffer of TEXT_BUFFER_LEN characters and handed to
+ * stdio in one write each time it fills */
+#define TEXT_BUFFER_LEN (1 << 20)
+/* Elements formatted per kernel call */
+#define TEXT_RUN 4096
+/* Bytes of text per parse task, each task starts at the first line that
+ * begins inside its chunk */
+#define TEXT_CHUNK (4 << 20)
+/* Longest real value accepted on import */
+#define TEXT_TOKEN_MAX 64
+
+bool text_write_matrix (FILE* out, const Matrix_t* m, char sep, bool trailing, unsigned int corner);
+bool text_read_matrix (const char* text, size_t len, const char* name, Matrix_Type_t type, Matrix_t** m);
+
+#endif
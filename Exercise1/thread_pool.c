@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "thread_pool.h"
+
+/* ranges handed to each thread are rounded to this many elements so
+ * neighbouring threads never share a cache line of unsigned ints */
+#define PARALLEL_GRAIN 16
+
+typedef struct {
+	Parallel_Task_t task;
+	void* ctx;
+	size_t count;
+	size_t chunk;
+	unsigned int parts;
+	unsigned int next_part;
+	unsigned int done_parts;
+	unsigned int workers;
+}Parallel_Job_t;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+/* held by the thread currently dispatching a job */
+static pthread_mutex_t dispatch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t *workers = NULL;
+static unsigned int num_workers = 0;
+static unsigned int requested_threads = 0;
+static size_t threshold = THREAD_POOL_DEFAULT_THRESHOLD;
+static Parallel_Job_t *current_job = NULL;
+static unsigned long generation = 0;
+static bool shutting_down = false;
+
+/*protected functions*/
+void run_parts (Parallel_Job_t* job);
+void* worker_main (void* arg);
+bool start_workers (void);
+void stop_workers (void);
+
+/* 
+ * PURPOSE: Set the number of threads used by parallel_for, the calling
+ *          thread included.  The workers are (re)started on the next job.
+ * INPUTS: thread count, 0 for one per online cpu
+ * RETURN: True if the count was accepted, false if not.
+ */
+bool thread_pool_set_threads (unsigned int num_threads) {
+	if (num_threads > 1024) {
+		return false;
+	}
+	pthread_mutex_lock(&dispatch_lock);
+	stop_workers();
+	requested_threads = num_threads;
+	pthread_mutex_unlock(&dispatch_lock);
+	return true;
+}
+
+/* 
+ * PURPOSE: Report how many threads parallel_for will use
+ * INPUTS: none
+ * RETURN: thread count, the calling thread included
+ */
+unsigned int thread_pool_get_threads (void) {
+	if (requested_threads) {
+		return requested_threads;
+	}
+	const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return cpus > 0 ? (unsigned int) cpus : 1;
+}
+
+/* 
+ * PURPOSE: Set the element count below which parallel_for stays serial
+ * INPUTS: minimum element count for a parallel run
+ * RETURN: none
+ */
+void thread_pool_set_threshold (size_t min_elements) {
+	threshold = min_elements;
+}
+
+/* 
+ * PURPOSE: Report the serial threshold of parallel_for
+ * INPUTS: none
+ * RETURN: minimum element count for a parallel run
+ */
+size_t thread_pool_get_threshold (void) {
+	return threshold;
+}
+
+/* 
+ * PURPOSE: Split [0,count) into contiguous ranges and run task over them
+ *          on the persistent workers and the calling thread.  Small ranges,
+ *          single thread pools and nested calls run serially on the caller.
+ * INPUTS: element count, task to run on each range, context for the task
+ * RETURN: none.  Returns once every range has been processed.
+ */
+void parallel_for (size_t count, Parallel_Task_t task, void* ctx) {
+	parallel_for_weighted(count, 1, task, ctx);
+}
+
+/* 
+ * PURPOSE: parallel_for over items that each cover weight elements, such
+ *          as whole rows.  The serial threshold and the range rounding are
+ *          applied in elements rather than items.
+ * INPUTS: item count, elements per item, task to run on each range of
+ *         items, context for the task
+ * RETURN: none.  Returns once every range has been processed.
+ */
+void parallel_for_weighted (size_t count, size_t weight, Parallel_Task_t task, void* ctx) {
+	if (!task || count == 0) {
+		return;
+	}
+	if (weight == 0) {
+		weight = 1;
+	}
+
+	const unsigned int threads = thread_pool_get_threads();
+	if (count * weight < threshold || count < 2 || threads < 2
+		|| pthread_mutex_trylock(&dispatch_lock)) {
+		task(ctx, 0, count);
+		return;
+	}
+	if (num_workers + 1 != threads && (stop_workers(), !start_workers())) {
+		pthread_mutex_unlock(&dispatch_lock);
+		task(ctx, 0, count);
+		return;
+	}
+
+	Parallel_Job_t job = {0};
+	job.task = task;
+	job.ctx = ctx;
+	job.count = count;
+	const size_t grain = (weight < PARALLEL_GRAIN) ? PARALLEL_GRAIN / weight : 1;
+	job.chunk = (count + threads - 1) / threads;
+	job.chunk = (job.chunk + grain - 1) / grain * grain;
+	job.parts = (count + job.chunk - 1) / job.chunk;
+
+	pthread_mutex_lock(&pool_lock);
+	current_job = &job;
+	generation++;
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&pool_lock);
+
+	run_parts(&job);
+
+	pthread_mutex_lock(&pool_lock);
+	while (__atomic_load_n(&job.done_parts, __ATOMIC_ACQUIRE) < job.parts || job.workers > 0) {
+		pthread_cond_wait(&done_cond, &pool_lock);
+	}
+	current_job = NULL;
+	pthread_mutex_unlock(&pool_lock);
+	pthread_mutex_unlock(&dispatch_lock);
+}
+
+/* 
+ * PURPOSE: Join every worker thread.  Called at exit so nothing is leaked.
+ * INPUTS: none
+ * RETURN: none
+ */
+void thread_pool_destroy (void) {
+	pthread_mutex_lock(&dispatch_lock);
+	stop_workers();
+	pthread_mutex_unlock(&dispatch_lock);
+}
+
+/*Protected Functions in C*/
+
+/* 
+ * PURPOSE: Claim and run ranges of a job until none are left
+ * INPUTS: job to work on
+ * RETURN: none
+ */
+void run_parts (Parallel_Job_t* job) {
+	unsigned int part;
+	while ((part = __atomic_fetch_add(&job->next_part, 1, __ATOMIC_RELAXED)) < job->parts) {
+		const size_t begin = part * job->chunk;
+		const size_t end = (begin + job->chunk < job->count) ? begin + job->chunk : job->count;
+		job->task(job->ctx, begin, end);
+		__atomic_fetch_add(&job->done_parts, 1, __ATOMIC_RELEASE);
+	}
+}
+
+/* 
+ * PURPOSE: Worker loop, sleeps until a job is published then helps with it
+ * INPUTS: unused
+ * RETURN: NULL once the pool shuts down
+ */
+void* worker_main (void* arg) {
+	unsigned long seen = 0;
+	pthread_mutex_lock(&pool_lock);
+	seen = generation;
+	while (true) {
+		while (!shutting_down && generation == seen) {
+			pthread_cond_wait(&work_cond, &pool_lock);
+		}
+		if (shutting_down) {
+			break;
+		}
+		seen = generation;
+		Parallel_Job_t *job = current_job;
+		if (!job) {
+			continue;
+		}
+		job->workers++;
+		pthread_mutex_unlock(&pool_lock);
+
+		run_parts(job);
+
+		pthread_mutex_lock(&pool_lock);
+		job->workers--;
+		pthread_cond_broadcast(&done_cond);
+	}
+	pthread_mutex_unlock(&pool_lock);
+	return NULL;
+}
+
+/* 
+ * PURPOSE: Start the worker threads, caller must hold dispatch_lock
+ * INPUTS: none
+ * RETURN: True if every worker started, false if not.
+ */
+bool start_workers (void) {
+	const unsigned int count = thread_pool_get_threads() - 1;
+	workers = calloc(count, sizeof(pthread_t));
+	if (!workers) {
+		return false;
+	}
+	shutting_down = false;
+	for (num_workers = 0; num_workers < count; ++num_workers) {
+		if (pthread_create(&workers[num_workers], NULL, worker_main, NULL)) {
+			perror("FAILED TO START WORKER THREAD");
+			stop_workers();
+			return false;
+		}
+	}
+	return true;
+}
+
+/* 
+ * PURPOSE: Stop and join the worker threads, caller must hold dispatch_lock
+ * INPUTS: none
+ * RETURN: none
+ */
+void stop_workers (void) {
+	pthread_mutex_lock(&pool_lock);
+	shutting_down = true;
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&pool_lock);
+
+	for (unsigned int i = 0; i < num_workers; ++i) {
+		pthread_join(workers[i], NULL);
+	}
+	free(workers);
+	workers = NULL;
+	num_workers = 0;
+}
@@ -0,0 +1,20 @@
+#ifndef _THREAD_POOL_H_
+#define _THREAD_POOL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Element counts below this run serially on the calling thread */
+#define THREAD_POOL_DEFAULT_THRESHOLD (1 << 16)
+
+typedef void (*Parallel_Task_t)(void* ctx, size_t begin, size_t end);
+
+bool thread_pool_set_threads (unsigned int num_threads);
+unsigned int thread_pool_get_threads (void);
+void thread_pool_set_threshold (size_t min_elements);
+size_t thread_pool_get_threshold (void);
+void parallel_for (size_t count, Parallel_Task_t task, void* ctx);
+void parallel_for_weighted (size_t count, size_t weight, Parallel_Task_t task, void* ctx);
+void thread_pool_destroy (void);
+
+#endif
@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+
+#include "types.h"
+#include "rng.h"
+
+/* Elements drawn per step of a random fill */
+#define TYPE_RANDOM_BLOCK 256
+
+/* Two digit groups "00" to "99", integers are formatted two digits a step */
+static const char digit_pairs[201] =
+	"0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+	"5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+
+/*protected functions*/
+char* format_decimal (char* out, unsigned long long v);
+
+/*
+ * Conversion loops used by every <type>_convert.  Integers are converted
+ * with C casts, which wrap, reals go through <type>_from_real, which
+ * saturates into integer types.
+ */
+#define CONVERT_FROM_INT(T, S) { \
+	const S *s = src; \
+	for (size_t i = 0; i < n; ++i) { \
+		d[i] = (T) s[i]; \
+	} \
+}
+
+#define CONVERT_FROM_REAL(sfx, S) { \
+	const S *s = src; \
+	for (size_t i = 0; i < n; ++i) { \
+		d[i] = sfx##_from_real(s[i]); \
+	} \
+}
+
+/*
+ * Kernels every element type has.  The add is written once with vector
+ * extensions, so each type gets TYPE_VECTOR_BYTES / sizeof(T) lanes and
+ * narrow types move proportionally more elements per instruction.
+ */
+#define DEFINE_COMMON_KERNELS(sfx, T) \
+typedef T sfx##_vec_t __attribute__((vector_size(TYPE_VECTOR_BYTES))); \
+void sfx##_add (const void* a, const void* b, void* c, size_t n) { \
+	const T *x = a; \
+	const T *y = b; \
+	T *z = c; \
+	const size_t lanes = sizeof(sfx##_vec_t) / sizeof(T); \
+	size_t i = 0; \
+	for (; i + lanes <= n; i += lanes) { \
+		sfx##_vec_t vx, vy; \
+		memcpy(&vx, &x[i], sizeof(vx)); \
+		memcpy(&vy, &y[i], sizeof(vy)); \
+		vx += vy; \
+		memcpy(&z[i], &vx, sizeof(vx)); \
+	} \
+	for (; i < n; ++i) { \
+		z[i] = x[i] + y[i]; \
+	} \
+} \
+double sfx##_sum_real (const void* data, size_t n) { \
+	const T *x = data; \
+	double sum = 0; \
+	for (size_t i = 0; i < n; ++i) { \
+		sum += x[i]; \
+	} \
+	return sum; \
+} \
+void sfx##_convert (void* dst, const void* src, Matrix_Type_t src_type, size_t n) { \
+	T *d = dst; \
+	switch (src_type) { \
+		case MATRIX_U8: CONVERT_FROM_INT(T, unsigned char) break; \
+		case MATRIX_U16: CONVERT_FROM_INT(T, unsigned short) break; \
+		case MATRIX_U32: CONVERT_FROM_INT(T, unsigned int) break; \
+		case MATRIX_U64: CONVERT_FROM_INT(T, unsigned long long) break; \
+		case MATRIX_F32: CONVERT_FROM_REAL(sfx, float) break; \
+		case MATRIX_F64: CONVERT_FROM_REAL(sfx, double) break; \
+		default: break; \
+	} \
+}
+
+/*
+ * Integer types: wrapping add, vector shifts, 64 bit sums and fills drawn
+ * straight from the generator.
+ */
+#define DEFINE_INT_KERNELS(sfx, T, MAX) \
+T sfx##_from_real (double v) { \
+	if (!(v > 0)) { \
+		return 0; \
+	} \
+	return (v >= (double) MAX) ? MAX : (T) v; \
+} \
+DEFINE_COMMON_KERNELS(sfx, T) \
+void sfx##_shift_left (void* data, unsigned int shift, size_t n) { \
+	T *x = data; \
+	const size_t lanes = sizeof(sfx##_vec_t) / sizeof(T); \
+	size_t i = 0; \
+	for (; i + lanes <= n; i += lanes) { \
+		sfx##_vec_t v; \
+		memcpy(&v, &x[i], sizeof(v)); \
+		v <<= shift; \
+		memcpy(&x[i], &v, sizeof(v)); \
+	} \
+	for (; i < n; ++i) { \
+		x[i] <<= shift; \
+	} \
+} \
+void sfx##_shift_right (void* data, unsigned int shift, size_t n) { \
+	T *x = data; \
+	const size_t lanes = sizeof(sfx##_vec_t) / sizeof(T); \
+	size_t i = 0; \
+	for (; i + lanes <= n; i += lanes) { \
+		sfx##_vec_t v; \
+		memcpy(&v, &x[i], sizeof(v)); \
+		v >>= shift; \
+		memcpy(&x[i], &v, sizeof(v)); \
+	} \
+	for (; i < n; ++i) { \
+		x[i] >>= shift; \
+	} \
+} \
+unsigned long long sfx##_sum (const void* data, size_t n) { \
+	const T *x = data; \
+	unsigned long long sum = 0; \
+	for (size_t i = 0; i < n; ++i) { \
+		sum += x[i]; \
+	} \
+	return sum; \
+} \
+void sfx##_random (void* out, size_t begin, size_t end, unsigned long long seed, \
+	unsigned int low, unsigned int high) { \
+	T *x = out; \
+	unsigned int block[TYPE_RANDOM_BLOCK]; \
+	for (size_t i = begin; i < end; i += TYPE_RANDOM_BLOCK) { \
+		const size_t n = (end - i < TYPE_RANDOM_BLOCK) ? end - i : TYPE_RANDOM_BLOCK; \
+		rng_fill_block(block, i, i + n, seed, low, high); \
+		for (size_t j = 0; j < n; ++j) { \
+			x[i - begin + j] = block[j]; \
+		} \
+	} \
+} \
+char* sfx##_format (char* out, const void* data, size_t n, char sep) { \
+	const T *x = data; \
+	for (size_t i = 0; i < n; ++i) { \
+		out = format_decimal(out, x[i]); \
+		*out++ = sep; \
+	} \
+	return out; \
+}
+
+/*
+ * Real types: IEEE add and sums, fills scaled from full range draws.
+ */
+#define DEFINE_REAL_KERNELS(sfx, T) \
+T sfx##_from_real (double v) { \
+	return (T) v; \
+} \
+DEFINE_COMMON_KERNELS(sfx, T) \
+void sfx##_random (void* out, size_t begin, size_t end, unsigned long long seed, \
+	unsigned int low, unsigned int high) { \
+	T *x = out; \
+	unsigned int block[TYPE_RANDOM_BLOCK]; \
+	const double scale = ((double) high - low) / 4294967296.0; \
+	for (size_t i = begin; i < end; i += TYPE_RANDOM_BLOCK) { \
+		const size_t n = (end - i < TYPE_RANDOM_BLOCK) ? end - i : TYPE_RANDOM_BLOCK; \
+		rng_fill_block(block, i, i + n, seed, 0, UINT_MAX); \
+		for (size_t j = 0; j < n; ++j) { \
+			x[i - begin + j] = (T) (low + block[j] * scale); \
+		} \
+	} \
+} \
+char* sfx##_format (char* out, const void* data, size_t n, char sep) { \
+	const T *x = data; \
+	for (size_t i = 0; i < n; ++i) { \
+		out += snprintf(out, TYPE_TEXT_MAX, "%g", (double) x[i]); \
+		*out++ = sep; \
+	} \
+	return out; \
+}
+
+DEFINE_INT_KERNELS(u8, unsigned char, UCHAR_MAX)
+DEFINE_INT_KERNELS(u16, unsigned short, USHRT_MAX)
+DEFINE_INT_KERNELS(u32, unsigned int, UINT_MAX)
+DEFINE_INT_KERNELS(u64, unsigned long long, ULLONG_MAX)
+DEFINE_REAL_KERNELS(f32, float)
+DEFINE_REAL_KERNELS(f64, double)
+
+static const Type_Kernels_t type_table[MATRIX_NUM_TYPES] = {
+	[MATRIX_U32] = { "u32", sizeof(unsigned int), false, u32_add, u32_shift_left, u32_shift_right,
+		u32_sum, u32_sum_real, u32_random, u32_convert, u32_format, UINT_MAX },
+	[MATRIX_U8] = { "u8", sizeof(unsigned char), false, u8_add, u8_shift_left, u8_shift_right,
+		u8_sum, u8_sum_real, u8_random, u8_convert, u8_format, UCHAR_MAX },
+	[MATRIX_U16] = { "u16", sizeof(unsigned short), false, u16_add, u16_shift_left, u16_shift_right,
+		u16_sum, u16_sum_real, u16_random, u16_convert, u16_format, USHRT_MAX },
+	[MATRIX_U64] = { "u64", sizeof(unsigned long long), false, u64_add, u64_shift_left, u64_shift_right,
+		u64_sum, u64_sum_real, u64_random, u64_convert, u64_format, ULLONG_MAX },
+	[MATRIX_F32] = { "f32", sizeof(float), true, f32_add, NULL, NULL,
+		NULL, f32_sum_real, f32_random, f32_convert, f32_format, 0 },
+	[MATRIX_F64] = { "f64", sizeof(double), true, f64_add, NULL, NULL,
+		NULL, f64_sum_real, f64_random, f64_convert, f64_format, 0 }
+};
+
+/*
+ * PURPOSE: Look up the kernels of an element type
+ * INPUTS: element type
+ * RETURN: kernel table, NULL for an unknown type
+ */
+const Type_Kernels_t* type_kernels (Matrix_Type_t type) {
+	if ((unsigned int) type >= MATRIX_NUM_TYPES) {
+		return NULL;
+	}
+	return &type_table[type];
+}
+
+/*
+ * PURPOSE: Size of one element of a type
+ * INPUTS: element type
+ * RETURN: size in bytes, 0 for an unknown type
+ */
+size_t type_size (Matrix_Type_t type) {
+	const Type_Kernels_t *k = type_kernels(type);
+	return k ? k->size : 0;
+}
+
+/*
+ * PURPOSE: Name of an element type as the REPL spells it
+ * INPUTS: element type
+ * RETURN: name, "?" for an unknown type
+ */
+const char* type_name (Matrix_Type_t type) {
+	const Type_Kernels_t *k = type_kernels(type);
+	return k ? k->name : "?";
+}
+
+/*
+ * PURPOSE: Parse the name of an element type
+ * INPUTS: name (u8, u16, u32, u64, f32 or f64), where to store the type
+ * RETURN: True if the name is a type, false if not.
+ */
+bool type_parse (const char* name, Matrix_Type_t* type) {
+	if (!name || !type) {
+		return false;
+	}
+	for (unsigned int i = 0; i < MATRIX_NUM_TYPES; ++i) {
+		if (strcmp(name, type_table[i].name) == 0) {
+			*type = (Matrix_Type_t) i;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*Protected Functions in C*/
+
+/*
+ * PURPOSE: Write an integer in decimal without going through printf
+ * INPUTS: where to write, at least 20 characters, integer
+ * RETURN: end of the digits written
+ */
+char* format_decimal (char* out, unsigned long long v) {
+	char digits[20];
+	char *p = digits + sizeof(digits);
+	while (v >= 100) {
+		const unsigned int pair = v % 100;
+		v /= 100;
+		p -= 2;
+		memcpy(p, &digit_pairs[pair * 2], 2);
+	}
+	if (v >= 10) {
+		p -= 2;
+		memcpy(p, &digit_pairs[v * 2], 2);
+	}
+	else {
+		*--p = '0' + v;
+	}
+	const size_t len = digits + sizeof(digits) - p;
+	memcpy(out, p, len);
+	return out + len;
+}
@@ -0,0 +1,45 @@
+#ifndef _TYPES_H_
+#define _TYPES_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "matrix.h"
+
+/* Bytes handled per vector by the element type kernels */
+#define TYPE_VECTOR_BYTES 16
+
+/* Most characters one element takes as text, its separator included */
+#define TYPE_TEXT_MAX 32
+
+/* Flat element kernels over n elements of one type, generated for every
+ * type from one body (see types.c).  Integer arithmetic wraps around. */
+typedef struct {
+	const char* name;
+	size_t size;
+	bool is_real;			/* float or double */
+	void (*add) (const void* a, const void* b, void* c, size_t n);
+	/* integer types only, shift counts must be below the element width */
+	void (*shift_left) (void* data, unsigned int shift, size_t n);
+	void (*shift_right) (void* data, unsigned int shift, size_t n);
+	unsigned long long (*sum) (const void* data, size_t n);
+	/* every type */
+	double (*sum_real) (const void* data, size_t n);
+	/* elements begin to end of a fill, integers drawn from [low,high] and
+	 * reals from [low,high) */
+	void (*random) (void* out, size_t begin, size_t end, unsigned long long seed,
+		unsigned int low, unsigned int high);
+	/* dst = src converted, integers wrap and reals saturate into integers */
+	void (*convert) (void* dst, const void* src, Matrix_Type_t src_type, size_t n);
+	/* writes n elements as text, each followed by sep, out must have room
+	 * for n * TYPE_TEXT_MAX characters.  Returns the end of the text. */
+	char* (*format) (char* out, const void* data, size_t n, char sep);
+	unsigned long long max;		/* largest value, 0 for real types */
+}Type_Kernels_t;
+
+const Type_Kernels_t* type_kernels (Matrix_Type_t type);
+size_t type_size (Matrix_Type_t type);
+const char* type_name (Matrix_Type_t type);
+bool type_parse (const char* name, Matrix_Type_t* type);
+
+#endif